@@ -698,6 +698,8 @@ __SYSCALL(__NR_popcorn_test_ipi_latency, sys_popcorn_test_ipi_latency)
 __SYSCALL(__NR_popcorn_perf_start, sys_popcorn_perf_start)
 #define __NR_popcorn_perf_end       317
 __SYSCALL(__NR_popcorn_perf_end, sys_popcorn_perf_end)
+#define __NR_popcorn_migrate        318
+__SYSCALL(__NR_popcorn_migrate, sys_popcorn_migrate)
 
 #ifndef __NO_STUBS
 #define __ARCH_WANT_OLD_READDIR
@@ -63,6 +63,11 @@ unsigned long get_percpu_old_rsp(void)
 	return percpu_read(old_rsp);
 }
 
+void set_percpu_old_rsp(unsigned long rsp)
+{
+	percpu_write(old_rsp, rsp);
+}
+
 static ATOMIC_NOTIFIER_HEAD(idle_notifier);
 
 void idle_notifier_register(struct notifier_block *n)
@@ -20,6 +20,7 @@
 #include <linux/personality.h>
 #include <linux/uaccess.h>
 #include <linux/user-return-notifier.h>
+#include <linux/process_server.h>
 
 #include <asm/processor.h>
 #include <asm/ucontext.h>
@@ -830,6 +831,9 @@ do_notify_resume(struct pt_regs *regs, void *unused, __u32 thread_info_flags)
 		tracehook_notify_resume(regs);
 		if (current->replacement_session_keyring)
 			key_replace_session_keyring();
+		/* Multikernel: explicit migration requested for this thread */
+		if (current->migration_target_cpu != -1)
+			process_server_do_pending_migration(regs);
 	}
 	if (thread_info_flags & _TIF_USER_RETURN_NOTIFY)
 		fire_user_return_notifiers();
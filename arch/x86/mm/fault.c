@@ -1014,6 +1014,10 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 					(write ? FAULT_FLAG_WRITE : 0);
     int original_enable_do_mmap_pgoff_hook = current->enable_do_mmap_pgoff_hook;
     int original_enable_distributed_munmap = current->enable_distributed_munmap;
+    int fault_path;
+    int fault_lead = 0;
+    int fault_shared = 0;
+    int fault_miss = 0;
 
 	tsk =(current->surrogate == -1) ? current : pid_task(find_get_pid(current->surrogate),PIDTYPE_PID);
 	mm = tsk->mm;
@@ -1103,11 +1107,45 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 	}
 
     vma = find_vma(mm, address);
+    fault_path = process_server_fault_path(mm, vma, address, write);
+    if ((fault_path == PS_FAULT_PATH_LOCKED ||
+         fault_path == PS_FAULT_PATH_FAST_READ ||
+         fault_path == PS_FAULT_PATH_OPTIMISTIC) &&
+        (error_code & PF_USER) &&
+        process_server_fault_coalesce(mm, address, &fault_lead)) {
+        // Another thread resolved this page meanwhile, look again.
+        vma = find_vma(mm, address);
+        fault_path = process_server_fault_path(mm, vma, address, write);
+    }
+    if (fault_path == PS_FAULT_PATH_OPTIMISTIC) {
+        // A page pulled in is validated against concurrent vma changes.
+        // If no other kernel has the page, its first touch must not race
+        // with one on another kernel, so it is made under the lock.
+        switch (process_server_fault_optimistic(mm,vma,address,flags,&vma,error_code)) {
+        case PS_FAULT_OPTIMISTIC_HANDLED:
+            goto ret;
+        case PS_FAULT_OPTIMISTIC_MISS:
+            // The lock is held and the answer still holds.
+            fault_miss = 1;
+            break;
+        default:
+            break;
+        }
+        fault_path = PS_FAULT_PATH_LOCKED;
+    }
+    if (fault_path == PS_FAULT_PATH_LOCKED && !fault_miss) {
 #if defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-    process_server_acquire_distributed_mm_lock();
+        process_server_acquire_distributed_mm_page_lock(address);
 #else
-    process_server_acquire_page_lock(address);
+        // Read faults only need other kernels to keep the page as it
+        // is.  The lead of a coalesced fault is alone on this kernel.
+        fault_shared = !write && fault_lead;
+        if (fault_shared)
+            process_server_acquire_page_lock_shared(address);
+        else
+            process_server_acquire_page_lock(address);
 #endif
+    }
 	if (unlikely(!vma)) {
         // Multikernel - see if another member of the thread group has mapped
         // this vma
@@ -1118,7 +1156,8 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
             bad_area(regs, error_code, address);
 		    goto ret;
         }
-	} else if(process_server_pull_remote_mappings(mm,vma,address,flags,&vma,error_code)) {
+	} else if(!fault_miss &&
+              process_server_pull_remote_mappings(mm,vma,address,flags,&vma,error_code)) {
         goto ret;
     }
 
@@ -1249,10 +1288,17 @@ ret:
     current->enable_do_mmap_pgoff_hook = original_enable_do_mmap_pgoff_hook;
     current->enable_distributed_munmap = original_enable_distributed_munmap;
 
+    if (fault_path == PS_FAULT_PATH_LOCKED) {
 #if defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-    process_server_release_distributed_mm_lock();
+        process_server_release_distributed_mm_page_lock(address);
 #else
-    process_server_release_page_lock(address);
+        if (fault_shared)
+            process_server_release_page_lock_shared(address);
+        else
+            process_server_release_page_lock(address);
 #endif
+    }
+    if (fault_lead)
+        process_server_fault_coalesce_done(mm, address);
     return;
 }
@@ -62,6 +62,7 @@ enum pcn_kmsg_type {
 	PCN_KMSG_TYPE_MCAST,
 	PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_REQUEST,
 	PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_RESPONSE,
+	PCN_KMSG_TYPE_REMOTE_PROC_LOAD_UPDATE,
 	PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_REQUEST,
 	PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_RESPONSE,
 	PCN_KMSG_TYPE_REMOTE_PROC_STAT_REQUEST,
@@ -124,6 +125,17 @@ enum pcn_kmsg_type {
     PCN_KMSG_TYPE_PROC_SRV_STATS_CLEAR,
     PCN_KMSG_TYPE_PROC_SRV_STATS_QUERY,   
     PCN_KMSG_TYPE_PROC_SRV_STATS_RESPONSE, 
+    PCN_KMSG_TYPE_PROC_SRV_GANG_MIGRATION,
+    PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE,
+    PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE_RESPONSE,
+    PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH,
+    PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH_RESPONSE,
+    PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN,
+    PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN_RESPONSE,
+    PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_REQUEST,
+    PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_GRANT,
+    PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_RELEASE,
+    PCN_KMSG_TYPE_PROC_SRV_SHARED_LOCK_WAKE,
     PCN_KMSG_TYPE_PCN_PERF_START_MESSAGE,
 	PCN_KMSG_TYPE_PCN_PERF_END_MESSAGE,
 	PCN_KMSG_TYPE_PCN_PERF_CONTEXT_MESSAGE,
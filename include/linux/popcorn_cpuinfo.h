@@ -31,7 +31,16 @@ struct _remote_cpu_info_list
  {
          _remote_cpu_info_data_t _data;
          struct list_head cpu_list_member;
+         /* last load reported by the kernel, see popcorn_kernel_load() */
+         unsigned long _nr_running;
+         unsigned int _nr_cpus;
+         unsigned long _load_jiffies;
+         /* last time the kernel asked for our load, see send_load_update() */
+         unsigned long _want_jiffies;
 
   };
 typedef struct _remote_cpu_info_list _remote_cpu_info_list_t;
 
+
+int popcorn_kernel_load(int kernel, unsigned long *nr_running, unsigned int *nr_cpus);
+void popcorn_kernel_load_charge(int kernel, unsigned long nr);
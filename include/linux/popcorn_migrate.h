@@ -0,0 +1,55 @@
+#ifndef __LINUX_POPCORN_MIGRATE_H
+#define __LINUX_POPCORN_MIGRATE_H
+/*
+ * User interface for explicit inter-kernel thread migration.
+ *
+ * A migration is started with POPCORN_MIGRATE_START.  The call
+ * returns immediately with an eventfd that is signaled once for
+ * every listed thread that has resumed execution on the destination
+ * kernel.  Per-phase timing for a thread can then be collected with
+ * POPCORN_MIGRATE_QUERY.
+ */
+
+#include <linux/types.h>
+
+#define POPCORN_MIGRATE_MAX_THREADS 64
+#define POPCORN_MIGRATE_ANY_CPU -1
+
+enum popcorn_migrate_op {
+    POPCORN_MIGRATE_START,
+    POPCORN_MIGRATE_QUERY
+};
+
+/**
+ * Argument for POPCORN_MIGRATE_START.
+ *
+ * pids lists threads of the calling thread group.  A NULL pids
+ * (or nr_pids == 0) migrates the calling thread only.  Every listed
+ * thread migrates itself the next time it returns to user space.
+ * efd is an existing eventfd to signal, or -1 to have one created
+ * and returned.  cpu may be POPCORN_MIGRATE_ANY_CPU to let the kernel
+ * pick the destination, in which case the chosen cpu is written back.
+ */
+struct popcorn_migrate_args {
+    int cpu;
+    int efd;
+    unsigned int nr_pids;
+    pid_t __user *pids;
+};
+
+/**
+ * Argument for POPCORN_MIGRATE_QUERY.  pid is filled in by the caller,
+ * everything else by the kernel.  Timestamps are TSC values, which are
+ * shared between kernels on the same machine.
+ */
+struct popcorn_migrate_timing {
+    pid_t pid;
+    int cpu;
+    int done;
+    unsigned long long start;       // migration requested
+    unsigned long long request;     // clone (or back migration) request sent
+    unsigned long long import;      // destination started importing the task
+    unsigned long long resume;      // destination about to run first instruction
+};
+
+#endif /* __LINUX_POPCORN_MIGRATE_H */
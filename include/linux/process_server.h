@@ -32,8 +32,23 @@
 //#define PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK
 //#undef PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK
 
-#define PROCESS_SERVER_USE_HEAVY_LOCK
-//#undef PROCESS_SERVER_USE_HEAVY_LOCK
+// Without the heavy lock, vma changes lock only the range they change,
+// so that changes to disjoint ranges on different kernels go in parallel.
+//#define PROCESS_SERVER_USE_HEAVY_LOCK
+#undef PROCESS_SERVER_USE_HEAVY_LOCK
+
+// Page locks arbitrated by the thread group's home kernel rather than
+// by a lamport barrier among all kernels.
+#define PROCESS_SERVER_USE_HOME_PAGE_LOCK
+//#undef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+
+// Locks are kept in lock words in memory shared by all kernels, with a
+// message only to wake up kernels that gave up spinning.  With the home
+// page lock, faults take only the word of their page, and the range and
+// heavy locks the home kernel grants also take the words of their pages.
+// Otherwise the words hold the distributed mm lock.
+#define PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+//#undef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
 
 #if defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK) && defined(PROCESS_SERVER_USE_HEAVY_LOCK)
 #error cannot have both PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK and PROCESS_SERVER_USE_HEAVY_LOCK
@@ -44,6 +59,93 @@
  */
 int process_server_do_migration(struct task_struct* task, int cpu);
 void process_server_do_return_disposition(void);
+void process_server_do_pending_migration(struct pt_regs* regs);
+
+/*
+ * Placement policy, chooses where a migrating task goes.
+ * select() returns a cpu of another kernel within mask, or -1.
+ * It is called under rcu_read_lock() and must not sleep.
+ */
+struct process_server_placement_policy {
+    const char* name;
+    int (*select)(struct task_struct* task, const struct cpumask* mask);
+};
+void process_server_set_placement_policy(struct process_server_placement_policy* policy);
+void process_server_clear_placement_policy(struct process_server_placement_policy* policy);
+int process_server_select_migration_cpu(struct task_struct* task, const struct cpumask* mask);
+
+/*
+ * Sites that sleep waiting for other kernels, see
+ * process_server_track_wait.
+ */
+enum process_server_wait_site {
+    PS_WAIT_SHADOW_RETURN = 0,
+    PS_WAIT_THREAD_COUNT,
+    PS_WAIT_MAPPING,
+    PS_WAIT_MUNMAP,
+    PS_WAIT_MPROTECT,
+    PS_WAIT_COUNTER_PHYS,
+    PS_WAIT_STATS_QUERY,
+    PS_WAIT_LAMPORT_RESPONSES,
+    PS_WAIT_LAMPORT_LOCK,
+    PS_WAIT_LAMPORT_ALL,
+    PS_WAIT_VMA_UPDATE,
+    PS_WAIT_MM_JOIN,
+    PS_WAIT_FAULT_COALESCE,
+    PS_WAIT_PAGE_LOCK,
+    PS_WAIT_SHARED_LOCK,
+    PS_WAIT_GANG,
+    PS_WAIT_MAX
+};
+void process_server_track_wait(int site, unsigned long long start);
+
+/*
+ * Callers of the distributed page locks, see /proc/procsrv_page_lock.
+ */
+enum process_server_lock_site {
+    PS_LOCK_SITE_FAULT = 0,
+    PS_LOCK_SITE_MMAP,
+    PS_LOCK_SITE_MUNMAP,
+    PS_LOCK_SITE_MPROTECT,
+    PS_LOCK_SITE_MREMAP,
+    PS_LOCK_SITE_MAX
+};
+
+/*
+ * Phases of a migration, see the popcorn_migration_phase tracepoint.
+ */
+enum process_server_migration_phase {
+    PS_MIGRATION_REQUEST_BUILT = 0,
+    PS_MIGRATION_REQUEST_SENT,
+    PS_MIGRATION_PLACEHOLDER_PARKED,
+    PS_MIGRATION_REQUEST_RECEIVED,
+    PS_MIGRATION_IMPORT_STARTED,
+    PS_MIGRATION_MM_ATTACHED,
+    PS_MIGRATION_USER_RESUMED,
+    PS_MIGRATION_PHASE_MAX
+};
+
+/*
+ * Paths a page fault can take, see process_server_fault_path.
+ */
+enum process_server_fault_path {
+    PS_FAULT_PATH_LOCAL = 0,    // thread group not distributed
+    PS_FAULT_PATH_FAST_MAPPED,  // page mapped (writable for writes), no lock
+    PS_FAULT_PATH_FAST_READ,    // read fault in a local vma, no lock
+    PS_FAULT_PATH_LOCKED,       // distributed page lock taken
+    PS_FAULT_PATH_OPTIMISTIC,   // write fault in a local vma, validated
+    PS_FAULT_PATH_MAX
+};
+
+/*
+ * Outcomes of a fault on the optimistic path, see
+ * process_server_fault_optimistic.
+ */
+enum process_server_fault_optimistic {
+    PS_FAULT_OPTIMISTIC_HANDLED = 0, // page pulled in, no lock held
+    PS_FAULT_OPTIMISTIC_MISS,        // no kernel has the page, lock held
+    PS_FAULT_OPTIMISTIC_RETRY,       // look again under the lock, not held
+};
 
 /*
  * Utilities for other modules to hook
@@ -57,14 +159,22 @@ int process_server_import_address_space(unsigned long* ip, unsigned long *sp, st
 int process_server_notify_delegated_subprocess_starting(pid_t pid, pid_t remote_pid, int remote_cpu);
 int process_server_do_exit(void);
 int process_server_do_group_exit(void);
-int process_server_notify_mmap(struct file *file, unsigned long addr,
-                                unsigned long len, unsigned long prot,
-                                unsigned long flags, unsigned long pgoff);
+void process_server_thread_group_dead(struct task_struct* task);
+int process_server_notify_mmap(unsigned long addr, unsigned long len);
 int process_server_notify_munmap(struct mm_struct *mm, unsigned long start, size_t len);
+int process_server_fault_path(struct mm_struct* mm, struct vm_area_struct* vma,
+                              unsigned long address, int write);
+int process_server_fault_coalesce(struct mm_struct* mm, unsigned long address,
+                                  int* lead);
+void process_server_fault_coalesce_done(struct mm_struct* mm, unsigned long address);
 int process_server_pull_remote_mappings(struct mm_struct *mm, struct vm_area_struct *vma,
                                 unsigned long address, unsigned int flags,
                                 struct vm_area_struct **vma_out,
                                 unsigned long error_code);
+int process_server_fault_optimistic(struct mm_struct *mm, struct vm_area_struct *vma,
+                                unsigned long address, unsigned int flags,
+                                struct vm_area_struct **vma_out,
+                                unsigned long error_code);
 int process_server_do_munmap(struct mm_struct* mm, 
                                 unsigned long start, 
                                 unsigned long len);
@@ -77,11 +187,20 @@ unsigned long process_server_do_mmap_pgoff(struct file *file, unsigned long addr
                                            unsigned long len, unsigned long prot,
                                            unsigned long flags, unsigned long pgoff);
 int process_server_acquire_page_lock(unsigned long address);
-int process_server_acquire_page_lock_range(unsigned long address, size_t sz);
-int process_server_acquire_heavy_lock(void);
-int process_server_acquire_distributed_mm_lock(void);
+int process_server_acquire_page_lock_shared(unsigned long address);
+int process_server_acquire_page_lock_range(unsigned long address, size_t sz,
+                                           int site);
+int process_server_acquire_heavy_lock(int site);
+int process_server_acquire_distributed_mm_lock(int site);
+int process_server_acquire_distributed_mm_page_lock(unsigned long address);
 void process_server_release_page_lock(unsigned long address);
+void process_server_mapping_changed(struct mm_struct* mm,
+                                    unsigned long start, size_t len);
+void process_server_release_page_lock_shared(unsigned long address);
 void process_server_release_page_lock_range(unsigned long address, size_t sz);
 void process_server_release_heavy_lock(void);
 void process_server_release_distributed_mm_lock(void);
+void process_server_release_distributed_mm_page_lock(unsigned long address);
+atomic_t* process_server_futex_waiters(struct task_struct* task);
+int process_server_on_tgroup_home(struct task_struct* task);
 #endif // _PROCESS_SERVER_H
@@ -1578,6 +1578,8 @@ struct task_struct {
      */
     spinlock_t mig_lock;
     volatile int migration_state;
+    int migration_target_cpu;   /* Pending explicit migration, -1 if none */
+    int migration_gang_id;      /* Gang the pending migration belongs to, 0 if none */
     volatile int represents_remote;      /* Is this a placeholder process? */
     int executing_for_remote;   /* Is this executing on behalf of another cpu? */
     int next_pid;             /* What is the pid on the remote cpu? */
@@ -870,4 +870,6 @@ asmlinkage long sys_popcorn_test_kmsg(enum pcn_kmsg_test_op op,
 
 asmlinkage long sys_popcorn_test_ipi_latency(int cpu);
 
+asmlinkage long sys_popcorn_migrate(int op, void __user *arg);
+
 #endif
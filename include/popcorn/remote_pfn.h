@@ -18,5 +18,8 @@ struct _pfn_range_list
 };
 typedef struct _pfn_range_list _pfn_range_list_t;
 
+//kernel owning a page frame, from a sorted index of the list above
+extern int pfn_range_find_kernel(unsigned long pfn);
+
 
 #endif /* REMOTE_PFN_H_ */
@@ -0,0 +1,56 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM popcorn
+
+#if !defined(_TRACE_POPCORN_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_POPCORN_H
+
+#include <linux/process_server.h>
+#include <linux/tracepoint.h>
+
+#define show_migration_phase(phase)					\
+	__print_symbolic(phase,						\
+		{ PS_MIGRATION_REQUEST_BUILT,	"request_built" },	\
+		{ PS_MIGRATION_REQUEST_SENT,	"request_sent" },	\
+		{ PS_MIGRATION_PLACEHOLDER_PARKED, "placeholder_parked" }, \
+		{ PS_MIGRATION_REQUEST_RECEIVED, "request_received" },	\
+		{ PS_MIGRATION_IMPORT_STARTED,	"import_started" },	\
+		{ PS_MIGRATION_MM_ATTACHED,	"mm_attached" },	\
+		{ PS_MIGRATION_USER_RESUMED,	"user_resumed" })
+
+/*
+ * Tracepoint for a thread migration reaching one of its phases.
+ * start is the TSC value at which the migration was started on the
+ * source kernel, now the one at which the phase was reached.
+ */
+TRACE_EVENT(popcorn_migration_phase,
+
+	TP_PROTO(int phase, pid_t pid, int peer_cpu,
+		 unsigned long long start, unsigned long long now),
+
+	TP_ARGS(phase, pid, peer_cpu, start, now),
+
+	TP_STRUCT__entry(
+		__field(	int,			phase		)
+		__field(	pid_t,			pid		)
+		__field(	int,			peer_cpu	)
+		__field(	unsigned long long,	start		)
+		__field(	unsigned long long,	now		)
+	),
+
+	TP_fast_assign(
+		__entry->phase		= phase;
+		__entry->pid		= pid;
+		__entry->peer_cpu	= peer_cpu;
+		__entry->start		= start;
+		__entry->now		= now;
+	),
+
+	TP_printk("phase=%s pid=%d peer_cpu=%d elapsed=%llu",
+		  show_migration_phase(__entry->phase), __entry->pid,
+		  __entry->peer_cpu, __entry->now - __entry->start)
+);
+
+#endif /* _TRACE_POPCORN_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
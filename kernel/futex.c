@@ -71,6 +71,7 @@
 #include <asm/cacheflush.h>
 #include <linux/mmu_context.h>
 #include <linux/string.h>
+#include <linux/process_server.h>
 
 #define FUTEX_VERBOSE 0 
 #if FUTEX_VERBOSE
@@ -1144,6 +1145,8 @@ futex_wake(u32 __user *uaddr, unsigned int flags, int nr_wake, u32 bitset,unsign
 	unsigned long bp = stack_frame(current,NULL);
 	_spin_value *value =NULL;
 	_local_rq_t *l =NULL;
+	atomic_t *waiters;
+	int local;
 	struct spin_key sk;
 	__spin_key_init(&sk);
 
@@ -1166,6 +1169,30 @@ futex_wake(u32 __user *uaddr, unsigned int flags, int nr_wake, u32 bitset,unsign
 cont:
 	hb = hash_futex(&key);
 	if( !_tsk && !(flags & FLAGS_SHARED) && current->tgroup_distributed  && !(fn_flags & FLAGS_REMOTECALL) ){
+		/*
+		 * No thread of the group waits through the server on any
+		 * kernel, so there is nobody for it to wake.  Pairs with the
+		 * increment in futex_wait_setup(): either the waiter is
+		 * counted here, or it sees the new futex value and does not
+		 * block.  The count is per thread group, not per futex.
+		 * Threads that went to sleep before the group was distributed
+		 * were not counted, and are only queued on the home kernel.
+		 * So the server is skipped only on the home kernel, and only
+		 * if none is queued on this hash bucket.  Waiters check the
+		 * value and queue under its lock.
+		 */
+		waiters = process_server_futex_waiters(current);
+		smp_mb();
+		if (waiters && !atomic_read(waiters) &&
+		    process_server_on_tgroup_home(current)) {
+			spin_lock(&hb->lock);
+			local = !plist_head_empty(&hb->chain);
+			spin_unlock(&hb->lock);
+			if (!local) {
+				ret = 0;
+				goto out;
+			}
+		}
 		g_errno= global_queue_wake_lock(&key,uaddr, flags & FLAGS_SHARED, nr_wake, bitset,
 				0, fn_flags, 0,0,0);
 		FPRINTK(KERN_ALERT " %s: err {%d}\n",__func__,g_errno);
@@ -2435,6 +2462,8 @@ static int futex_wait_queue_me(struct futex_hash_bucket *hb, struct futex_q *q,
  * @flags:	futex flags (FLAGS_SHARED, etc.)
  * @q:		the associated futex_q
  * @hb:		storage for hash_bucket pointer to be returned to caller
+ * @waiters:	if not NULL, set to the waiter count of the thread group
+ *		once the caller is counted in it, see futex_wake()
  *
  * Setup the futex_q and locate the hash_bucket.  Get the futex value and
  * compare it with the expected value.  Handle atomic faults internally.
@@ -2446,7 +2475,8 @@ static int futex_wait_queue_me(struct futex_hash_bucket *hb, struct futex_q *q,
  * <1 - -EFAULT or -EWOULDBLOCK (uaddr does not contain val) and hb is unlocked
  */
 static int futex_wait_setup(u32 __user *uaddr, u32 val, unsigned int flags,
-		struct futex_q *q, struct futex_hash_bucket **hb, unsigned int fn_flag,u32 bitset)
+		struct futex_q *q, struct futex_hash_bucket **hb, unsigned int fn_flag,u32 bitset,
+		atomic_t **waiters)
 {
 	u32 uval;
 	int ret;
@@ -2483,6 +2513,28 @@ retry_private:
 #ifdef FUTEX_STAT
 		perf_bb = native_read_tsc();
 #endif
+		/*
+		 * Count ourselves as a waiter of the thread group before the
+		 * futex value is checked, so that futex_wake() on any kernel
+		 * can skip the server when there is nobody to wake.  Only
+		 * waits that go through the server are counted.
+		 */
+		if (waiters && !*waiters) {
+			*waiters = process_server_futex_waiters(current);
+			if (*waiters) {
+				atomic_inc(*waiters);
+				smp_mb__after_atomic_inc();
+			}
+		}
+		/*
+		 * The futex word is in memory shared by all kernels, so a
+		 * value that already changed needs no round trip to the
+		 * server.
+		 */
+		if (!get_user(uval, uaddr) && uval != val) {
+			ret = -EWOULDBLOCK;
+			goto out;
+		}
 		current->uaddr = (unsigned long) uaddr;
 		g_errno = global_queue_wait_lock(q, uaddr, *hb, fn_flag, val,
 				flags & FLAGS_SHARED, VERIFY_READ, bitset);
@@ -2630,6 +2682,7 @@ int futex_wait(u32 __user *uaddr, unsigned int flags, u32 val,
 	struct restart_block *restart;
 	struct futex_hash_bucket *hb;
 	struct futex_q q = futex_q_init;
+	atomic_t *waiters = NULL;
 	int ret,retf;
 	int sig;
 
@@ -2665,7 +2718,7 @@ retry:
 	 * Prepare to wait on uaddr. On success, holds hb lock and increments
 	 * q.key refs.
 	 */
-	ret = futex_wait_setup(uaddr, val, flags, &q, &hb,fn_flag,bitset);
+	ret = futex_wait_setup(uaddr, val, flags, &q, &hb,fn_flag,bitset,&waiters);
 
 	if (ret !=0 && ret != WAIT_MAIN)
 		goto out;
@@ -2713,6 +2766,8 @@ out:
 		hrtimer_cancel(&to->timer);
 		destroy_hrtimer_on_stack(&to->timer);
 	}
+	if (waiters)
+		atomic_dec(waiters);
 #ifdef FUTEX_STAT
 	if(current->tgroup_distributed){
 		wait_bb = native_read_tsc();
@@ -3106,6 +3161,7 @@ static int futex_wait_requeue_pi(u32 __user *uaddr, unsigned int flags,
 	struct futex_hash_bucket *hb;
 	union futex_key key2 = FUTEX_KEY_INIT;
 	struct futex_q q = futex_q_init;
+	atomic_t *waiters = NULL;
 	int res, ret;
 
 	if (!bitset)
@@ -3140,7 +3196,7 @@ static int futex_wait_requeue_pi(u32 __user *uaddr, unsigned int flags,
 	 * Prepare to wait on uaddr. On success, increments q.key (key1) ref
 	 * count.
 	 */
-	ret = futex_wait_setup(uaddr, val, flags, &q, &hb,FLAGS_SYSCALL,bitset);//temp modified
+	ret = futex_wait_setup(uaddr, val, flags, &q, &hb,FLAGS_SYSCALL,bitset,&waiters);//temp modified
 	if (ret)
 		goto out_key2;
 
@@ -3228,6 +3284,8 @@ out:
 		hrtimer_cancel(&to->timer);
 		destroy_hrtimer_on_stack(&to->timer);
 	}
+	if (waiters)
+		atomic_dec(waiters);
 	return ret;
 }
 
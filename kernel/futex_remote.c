@@ -52,7 +52,16 @@
 
 DEFINE_SPINLOCK(access_global_value_table);
 
-static struct workqueue_struct *grq;
+/*
+ * Remote futex requests are served by a fixed set of single threaded
+ * workqueues.  A request goes to the server picked by its thread group
+ * and futex address, so requests on one futex are served in the order
+ * they arrived, while unrelated futexes are served in parallel.
+ */
+#define FUTEX_SERVER_BITS 3
+#define FUTEX_SERVERS (1 << FUTEX_SERVER_BITS)
+static struct workqueue_struct *grq[FUTEX_SERVERS];
+static char grq_name[FUTEX_SERVERS][16];
 static pid_t worker_pid;
 static volatile unsigned int free_work = 0;
 static volatile unsigned int finish_work = 0;
@@ -84,6 +93,10 @@ static const _global_value gvp_init = {
 };
 
 
+static struct workqueue_struct *futex_server(pid_t tghid, unsigned long uaddr) {
+	return grq[hash_long(uaddr + (unsigned long)tghid, FUTEX_SERVER_BITS)];
+}
+
 //void _spin_key_init (struct spin_key *st);
 extern int getKey(unsigned long uaddr, _spin_key *sk, pid_t tgid);
 #define  NSIG 32
@@ -138,6 +151,9 @@ int find_kernel_for_pfn(unsigned long addr, struct list_head *head) {
 	struct list_head *iter;
 	_pfn_range_list_t *objPtr;
 
+	if (head == &pfn_list_head)
+		return pfn_range_find_kernel(addr);
+
 	list_for_each(iter, head)
 	{
 		objPtr = list_entry(iter, _pfn_range_list_t, pfn_list_member);
@@ -701,7 +717,7 @@ static int handle_remote_futex_wake_request(struct pcn_kmsg_message* inc_msg) {
 				gvp ->free =1;
 			}
 			FRPRINTK(KERN_ALERT"%s: wake gvp free \n", __func__);
-			gvp->global_wq = grq;// create_singlethread_workqueue(gvp->name);
+			gvp->global_wq = futex_server(msg->tghid, msg->uaddr);
 			gvp->thread_group_leader = tsk;
 			global_request_work_t* back_work = NULL;
 			// Spin up bottom half to process this event
@@ -898,7 +914,7 @@ static int handle_remote_futex_key_request(struct pcn_kmsg_message* inc_msg) {
 		FRPRINTK(KERN_ALERT"%s: wait gvp free \n", __func__);
 		//	scnprintf(gvp->name, sizeof(gvp->name), MODULE);
 
-		gvp->global_wq = grq;//create_singlethread_workqueue(gvp->name);
+		gvp->global_wq = futex_server(msg->tghid, msg->uaddr);
 		gvp->thread_group_leader = tsk;
 		global_request_work_t* back_work = NULL;
 
@@ -923,7 +939,7 @@ static int handle_remote_futex_key_request(struct pcn_kmsg_message* inc_msg) {
 			back_work->gq = trq;
 			FRPRINTK(KERN_ALERT"%s: wait token aqc trq->wait.ticket{%d} cnt{%d}\n", __func__,trq->wait.ticket,trq->cnt);
 
-			queue_work(grq, (struct work_struct*) back_work);
+			queue_work(gvp->global_wq, (struct work_struct*) back_work);
 		}
 		gvp->worker_task = back_work;//pid_task(find_vpid(worker_pid), PIDTYPE_PID);
 	}
@@ -998,6 +1014,7 @@ int futex_global_worker_cleanup(struct task_struct *tsk){
 
 static int __init futex_remote_init(void)
 {
+	int i;
 
 	pcn_kmsg_register_callback(PCN_KMSG_TYPE_REMOTE_IPC_FUTEX_KEY_REQUEST,
 			handle_remote_futex_key_request);
@@ -1011,7 +1028,10 @@ static int __init futex_remote_init(void)
 	pcn_kmsg_register_callback(PCN_KMSG_TYPE_REMOTE_IPC_FUTEX_WAKE_RESPONSE,
 			handle_remote_futex_wake_response);
 
-	grq   = create_singlethread_workqueue(MODULE);
+	for (i = 0; i < FUTEX_SERVERS; i++) {
+		scnprintf(grq_name[i], sizeof(grq_name[i]), MODULE "%d", i);
+		grq[i] = create_singlethread_workqueue(grq_name[i]);
+	}
 	worker_pid=-1;
 
 	INIT_LIST_HEAD(&vm_head);
@@ -10,6 +10,7 @@
 #include <linux/highmem.h>
 
 #include <linux/list.h>
+#include <linux/rculist.h>
 
 
 #include <linux/smp.h>
@@ -26,9 +27,14 @@
 #include <linux/string.h>
 #include <linux/jhash.h>
 #include <linux/cpufreq.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 
 #include <linux/popcorn_cpuinfo.h>
 #include <linux/bootmem.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/module.h> // EXPORT_SYMBOL
 #include <popcorn/remote_pfn.h>
 
 
@@ -119,6 +125,103 @@ int flush_pfn_var() {
 
 
 
+/*
+ * Sorted, non overlapping copy of pfn_list_head in page frame numbers,
+ * so that finding the kernel owning a page is a binary search rather
+ * than a list walk.  Rebuilt whenever a kernel's range is added or
+ * removed, which only happens as kernels come up or go away.
+ */
+struct pfn_range {
+	unsigned long start_pfn;
+	unsigned long end_pfn;
+	int kernel_number;
+};
+
+static struct pfn_range *pfn_range_index;
+static int pfn_range_count;
+static DEFINE_RWLOCK(pfn_range_lock);
+
+static int pfn_range_cmp(const void *a, const void *b)
+{
+	const struct pfn_range *ra = a, *rb = b;
+
+	if (ra->start_pfn < rb->start_pfn)
+		return -1;
+	return ra->start_pfn > rb->start_pfn;
+}
+
+/*
+ * The list is kept newest first, so when a kernel registered more than
+ * once only its latest range is indexed.
+ */
+static void pfn_range_rebuild(struct list_head *head)
+{
+	struct list_head *iter;
+	_pfn_range_list_t *objPtr;
+	struct pfn_range *index, *old;
+	unsigned long flags;
+	int count = 0, n = 0, i;
+
+	list_for_each(iter, head)
+		count++;
+
+	index = count ? kmalloc(sizeof(struct pfn_range) * count, GFP_ATOMIC) : NULL;
+	if (count && !index) {
+		printk(KERN_ALERT"%s: can not allocate pfn range index\n", __func__);
+		return;
+	}
+
+	list_for_each(iter, head) {
+		objPtr = list_entry(iter, _pfn_range_list_t, pfn_list_member);
+		for (i = 0; i < n; i++)
+			if (index[i].kernel_number == objPtr->kernel_number)
+				break;
+		if (i < n || objPtr->end_pfn_addr <= objPtr->start_pfn_addr)
+			continue;
+		index[n].start_pfn = objPtr->start_pfn_addr >> PAGE_SHIFT;
+		index[n].end_pfn = PFN_UP(objPtr->end_pfn_addr);
+		index[n].kernel_number = objPtr->kernel_number;
+		n++;
+	}
+	sort(index, n, sizeof(struct pfn_range), pfn_range_cmp, NULL);
+
+	write_lock_irqsave(&pfn_range_lock, flags);
+	old = pfn_range_index;
+	pfn_range_index = index;
+	pfn_range_count = n;
+	write_unlock_irqrestore(&pfn_range_lock, flags);
+
+	kfree(old);
+}
+
+/*
+ * Kernel whose memory holds page frame <pfn>, or -1 if none is known.
+ */
+int pfn_range_find_kernel(unsigned long pfn)
+{
+	unsigned long flags;
+	int lo = 0, hi, mid;
+	int kernel = -1;
+
+	read_lock_irqsave(&pfn_range_lock, flags);
+	hi = pfn_range_count - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pfn < pfn_range_index[mid].start_pfn) {
+			hi = mid - 1;
+		} else if (pfn >= pfn_range_index[mid].end_pfn) {
+			lo = mid + 1;
+		} else {
+			kernel = pfn_range_index[mid].kernel_number;
+			break;
+		}
+	}
+	read_unlock_irqrestore(&pfn_range_lock, flags);
+
+	return kernel;
+}
+EXPORT_SYMBOL(pfn_range_find_kernel);
+
 void add_pfn_node(int kernel_number, unsigned long start_pfn_addr,unsigned long end_pfn_addr, struct list_head *head)
 {
 	_pfn_range_list_t *Ptr = (_pfn_range_list_t *)kmalloc(sizeof(struct _pfn_range_list),GFP_KERNEL);
@@ -129,6 +232,9 @@ void add_pfn_node(int kernel_number, unsigned long start_pfn_addr,unsigned long
 	Ptr->kernel_number = kernel_number;
 	INIT_LIST_HEAD(&Ptr->pfn_list_member);
 	list_add(&Ptr->pfn_list_member, head);
+
+	if (head == &pfn_list_head)
+		pfn_range_rebuild(head);
 }
 
 
@@ -143,9 +249,12 @@ int delete_pfn(int kernel_number, struct list_head *head)
 		if(objPtr->kernel_number == kernel_number) {
 			list_del(&objPtr->pfn_list_member);
 			kfree(objPtr);
+			if (head == &pfn_list_head)
+				pfn_range_rebuild(head);
 			return 1;
 		}
 	}
+	return 0;
 }
 
 
@@ -382,8 +491,15 @@ void popcorn_init(void)
  * ****************************** Message structures for obtaining PID status ********************************
  */
 
+/*
+ * Protects insertions into rlist_head and the load fields of its nodes.
+ * Nodes are never removed, so walking the list needs no lock.
+ */
+static DEFINE_SPINLOCK(rlist_lock);
+
 void add_node(_remote_cpu_info_data_t *arg, struct list_head *head)
 {
+	unsigned long flags;
 	_remote_cpu_info_list_t *Ptr =
 		(_remote_cpu_info_list_t *)kmalloc(sizeof(_remote_cpu_info_list_t), GFP_KERNEL);
 	if (!Ptr) {
@@ -395,23 +511,13 @@ void add_node(_remote_cpu_info_data_t *arg, struct list_head *head)
 
 	INIT_LIST_HEAD(&(Ptr->cpu_list_member));
 	memcpy(&(Ptr->_data), arg, sizeof(_remote_cpu_info_data_t)); //Ptr->_data = *arg;
-	list_add(&Ptr->cpu_list_member, head);
-}
-
-int find_and_delete(int cpuno, struct list_head *head)
-{
-	struct list_head *iter;
-	_remote_cpu_info_list_t *objPtr;
-
-	list_for_each(iter, head) {
-		objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
-		if(objPtr->_data._processor == cpuno) {
-			list_del(&objPtr->cpu_list_member);
-			kfree(objPtr);
-			return 1;
-		}
-	}
-	return 0;
+	Ptr->_nr_running = 0;
+	Ptr->_nr_cpus = 0;
+	Ptr->_load_jiffies = 0;
+	Ptr->_want_jiffies = 0;
+	spin_lock_irqsave(&rlist_lock, flags);
+	list_add_rcu(&Ptr->cpu_list_member, head);
+	spin_unlock_irqrestore(&rlist_lock, flags);
 }
 
 #define DISPLAY_BUFFER 128
@@ -632,6 +738,154 @@ int send_cpu_info_request(int KernelId) {
 	return res;
 }
 
+/*
+ * ****************************** Kernel load exchange ***************************************************
+ */
+
+/*
+ * Kernels tell each other how many tasks they have runnable, so that
+ * the placement policy in the process server can pick migration
+ * destinations.  Updates are only sent while somebody uses them: a
+ * kernel that reads loads sends its own updates with _want set, and a
+ * kernel keeps reporting to another for LOAD_UPDATE_WANTED after the
+ * last such update.
+ */
+#define LOAD_UPDATE_INTERVAL (HZ / 4)
+#define LOAD_UPDATE_STALE (4 * HZ)
+#define LOAD_UPDATE_WANTED (10 * HZ)
+
+struct _remote_load_update {
+	struct pcn_kmsg_hdr header;
+	unsigned int _processor;
+	unsigned int _nr_cpus;
+	unsigned long _nr_running;
+	unsigned int _want;
+	char pad[32];
+}__attribute__((packed)) __attribute__((aligned(64)));
+
+typedef struct _remote_load_update _remote_load_update_t;
+
+static void send_load_update(struct work_struct *work);
+static DECLARE_DELAYED_WORK(load_update_work, send_load_update);
+static unsigned long load_wanted_jiffies;	/* last local popcorn_kernel_load() */
+static int load_wanted;
+
+/*
+ * Requires rlist_lock
+ */
+static _remote_cpu_info_list_t *find_node(int kernel, struct list_head *head)
+{
+	struct list_head *iter;
+	_remote_cpu_info_list_t *objPtr;
+
+	list_for_each(iter, head) {
+		objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+		if (objPtr->_data._processor == kernel)
+			return objPtr;
+	}
+	return NULL;
+}
+
+static int handle_remote_load_update(struct pcn_kmsg_message* inc_msg) {
+	_remote_load_update_t* msg = (_remote_load_update_t*) inc_msg;
+	_remote_cpu_info_list_t *objPtr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rlist_lock, flags);
+	objPtr = find_node(msg->_processor, &rlist_head);
+	if (objPtr) {
+		objPtr->_nr_running = msg->_nr_running;
+		objPtr->_nr_cpus = msg->_nr_cpus;
+		objPtr->_load_jiffies = jiffies;
+		if (msg->_want)
+			objPtr->_want_jiffies = jiffies;
+	}
+	spin_unlock_irqrestore(&rlist_lock, flags);
+
+	// Start reporting to it, if we were not already.
+	if (msg->_want)
+		schedule_delayed_work(&load_update_work, 0);
+
+	pcn_kmsg_free_msg(inc_msg);
+
+	return 0;
+}
+
+static void send_load_update(struct work_struct *work)
+{
+	struct list_head *iter;
+	_remote_cpu_info_list_t *objPtr;
+	_remote_load_update_t update;
+	int sent = 0;
+
+	update.header.type = PCN_KMSG_TYPE_REMOTE_PROC_LOAD_UPDATE;
+	update.header.prio = PCN_KMSG_PRIO_NORMAL;
+	update._processor = my_cpu;
+	update._nr_cpus = num_online_cpus();
+	update._nr_running = nr_running();
+	update._want = load_wanted &&
+		time_before(jiffies, load_wanted_jiffies + LOAD_UPDATE_WANTED);
+
+	// Everybody if we want loads ourselves, else those who asked.
+	list_for_each(iter, &rlist_head) {
+		objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+		if (!update._want && !(objPtr->_want_jiffies &&
+		    time_before(jiffies, objPtr->_want_jiffies + LOAD_UPDATE_WANTED)))
+			continue;
+		pcn_kmsg_send(objPtr->_data._processor, (struct pcn_kmsg_message*) (&update));
+		sent = 1;
+	}
+
+	if (sent)
+		schedule_delayed_work(&load_update_work, LOAD_UPDATE_INTERVAL);
+}
+
+/*
+ * Last load reported by <kernel>.  Returns -1 if the kernel is unknown
+ * or has not reported recently.
+ */
+int popcorn_kernel_load(int kernel, unsigned long *nr_running, unsigned int *nr_cpus)
+{
+	_remote_cpu_info_list_t *objPtr;
+	unsigned long flags;
+	int ret = -1;
+
+	// Keep the reports coming while loads are being used.
+	if (!load_wanted || time_after(jiffies, load_wanted_jiffies + HZ)) {
+		load_wanted_jiffies = jiffies;
+		load_wanted = 1;
+		schedule_delayed_work(&load_update_work, 0);
+	}
+
+	spin_lock_irqsave(&rlist_lock, flags);
+	objPtr = find_node(kernel, &rlist_head);
+	if (objPtr && objPtr->_nr_cpus &&
+	    !time_after(jiffies, objPtr->_load_jiffies + LOAD_UPDATE_STALE)) {
+		*nr_running = objPtr->_nr_running;
+		*nr_cpus = objPtr->_nr_cpus;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&rlist_lock, flags);
+
+	return ret;
+}
+
+/*
+ * Account <nr> tasks just sent to <kernel> until its next update
+ * arrives, so a burst of migrations does not all pick the same kernel.
+ */
+void popcorn_kernel_load_charge(int kernel, unsigned long nr)
+{
+	_remote_cpu_info_list_t *objPtr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rlist_lock, flags);
+	objPtr = find_node(kernel, &rlist_head);
+	if (objPtr)
+		objPtr->_nr_running += nr;
+	spin_unlock_irqrestore(&rlist_lock, flags);
+}
+
 /*
  * ************************************* Function (hook) to be called from other file ********************
  */
@@ -696,6 +950,8 @@ static int __init cpu_info_handler_init(void)
 			handle_remote_proc_cpu_info_request);
 	pcn_kmsg_register_callback(PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_RESPONSE,
 			handle_remote_proc_cpu_info_response);
+	pcn_kmsg_register_callback(PCN_KMSG_TYPE_REMOTE_PROC_LOAD_UPDATE,
+			handle_remote_load_update);
 
 	pcn_kmsg_register_callback(PCN_KMSG_TYPE_REMOTE_PFN_REQUEST,
 			handle_remote_pfn_request);
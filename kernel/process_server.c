@@ -20,6 +20,9 @@
 #include <linux/file.h>
 #include <linux/fdtable.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/prio_tree.h>
+#include <linux/jhash.h>
 #include <linux/process_server.h>
 #include <linux/mm.h>
 #include <linux/io.h> // ioremap
@@ -34,6 +37,10 @@
 #include <linux/syscalls.h>
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
+#include <linux/eventfd.h>
+#include <linux/tracehook.h> // set_notify_resume
+#include <linux/popcorn_migrate.h>
+#include <linux/mmu_context.h> // use_mm
 
 #include <asm/pgtable.h>
 #include <asm/atomic.h>
@@ -48,6 +55,7 @@
 #include <asm/i387.h>
 
 unsigned long get_percpu_old_rsp(void);
+void set_percpu_old_rsp(unsigned long rsp);
 
 #include <linux/futex.h>
 #define  NSIG 32
@@ -56,6 +64,9 @@ unsigned long get_percpu_old_rsp(void);
 #include <linux/fcntl.h>
 #include "futex_remote.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/popcorn.h>
+
 //#define FPU_ 1
 #undef FPU_
 /**
@@ -137,6 +148,18 @@ unsigned long get_percpu_old_rsp(void);
 #define PROCESS_SERVER_MPROTECT_DATA_TYPE 8
 #define PROCESS_SERVER_LAMPORT_BARRIER_DATA_TYPE 9
 #define PROCESS_SERVER_STATS_DATA_TYPE 10
+#define PROCESS_SERVER_MIGRATION_NOTIFY_DATA_TYPE 11
+#define PROCESS_SERVER_GANG_MIGRATION_DATA_TYPE 12
+#define PROCESS_SERVER_VMA_MISS_DATA_TYPE 13
+#define PROCESS_SERVER_VMA_UPDATE_DATA_TYPE 14
+#define PROCESS_SERVER_MPROTECT_BATCH_DATA_TYPE 15
+#define PROCESS_SERVER_TGROUP_MM_JOIN_DATA_TYPE 16
+#define PROCESS_SERVER_LAZY_COW_DATA_TYPE 17
+#define PROCESS_SERVER_FAULT_FLIGHT_DATA_TYPE 18
+#define PROCESS_SERVER_PAGE_LOCK_HOME_DATA_TYPE 19
+#define PROCESS_SERVER_PAGE_LOCK_DATA_TYPE 20
+#define PROCESS_SERVER_PAGE_LOCK_HOME_GROUP_DATA_TYPE 21
+#define PROCESS_SERVER_PAGE_LOCK_STATS_DATA_TYPE 22
 
 /**
  * Useful macros
@@ -332,6 +355,17 @@ typedef struct _contiguous_physical_mapping {
     size_t sz;
 } contiguous_physical_mapping_t;
 #define HAS_FPU_MASK 0x80
+
+/**
+ * Shared by every member of a gang migration on the receiving
+ * cpu.  The first member to import records itself here so the
+ * rest can adopt its mm without searching for it.
+ */
+typedef struct _gang_import_data {
+    atomic_t refs;
+    struct task_struct* task;
+} gang_import_data_t;
+
 /**
  *
  */
@@ -381,6 +415,7 @@ typedef struct _clone_data {
 	unsigned int rt_priority; //from sched.c
 	int sched_class; //from sched.c but here we are using SCHED_NORMAL, SCHED_FIFO, etc.
     unsigned long previous_cpus;
+    unsigned long known_cpu_with_tgroup_mm;
     vma_data_t* vma_list;
     vma_data_t* pending_vma_list;
     /*mklinux_akshay*/int origin_pid;
@@ -390,8 +425,21 @@ typedef struct _clone_data {
     unsigned long sas_ss_sp;
     size_t sas_ss_size;
     struct k_sigaction action[_NSIG];
+    gang_import_data_t* gang;
+    unsigned long long migration_start;
 } clone_data_t;
 
+/**
+ * Identifies the contents of a file, so that a kernel can tell whether
+ * its own copy is the one another kernel has mapped.
+ */
+typedef struct _file_identity {
+    unsigned long ino;
+    loff_t size;
+    struct timespec mtime;
+    __u32 generation;
+} file_identity_t;
+
 /**
  * 
  */
@@ -409,12 +457,14 @@ typedef struct _mapping_request_data {
     unsigned char present;
     unsigned char complete;
     unsigned char from_saved_mm;
+    unsigned char file_clean;
+    file_identity_t file_id;
     int responses;
     int expected_responses;
     unsigned long pgoff;
     spinlock_t lock;
     char path[512];
-    struct semaphore wait_sem;
+    wait_queue_head_t wait_queue;
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long wait_time_concluded;
 #endif
@@ -435,6 +485,19 @@ typedef struct _munmap_request_data {
     spinlock_t lock;
 } munmap_request_data_t;
 
+/**
+ *
+ */
+typedef struct _tgroup_mm_join_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int requester_pid;
+    unsigned long known_cpu_with_tgroup_mm; // Union of the responses
+    int responses;
+    int expected_responses;
+} tgroup_mm_join_data_t;
+
 /**
  *
  */
@@ -459,6 +522,20 @@ typedef struct _mm_data {
     struct mm_struct* mm;
 } mm_data_t;
 
+/**
+ * A vma announcement waiting for every kernel to install it.
+ */
+typedef struct _vma_update_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int requester_pid;
+    unsigned long vaddr_start;
+    int responses;
+    int expected_responses;
+    spinlock_t lock;
+} vma_update_data_t;
+
 typedef struct _mprotect_data {
     data_header_t header;
     int tgroup_home_cpu;
@@ -476,6 +553,264 @@ typedef struct _get_counter_phys_data {
     unsigned long resp;
 } get_counter_phys_data_t;
 
+/**
+ * Tracks an explicit migration requested through sys_popcorn_migrate.
+ * Lives on the kernel the thread migrated away from, and is keyed by
+ * the pid of the placeholder left behind.
+ */
+typedef struct _migration_notify_data {
+    data_header_t header;
+    pid_t pid;
+    pid_t tgid;
+    int cpu;
+    int done;                   // 0 pending, 1 resumed remotely, -1 failed
+    struct eventfd_ctx* efd;
+    unsigned long long start;
+    unsigned long long request;
+    unsigned long long import;
+    unsigned long long resume;
+} migration_notify_data_t;
+
+/**
+ * A gang migration being assembled on the sending cpu.  Members
+ * fill in their slot as they reach their migration point, and the
+ * last one to arrive sends the whole gang.  A member may never
+ * arrive, e.g. when it is blocked on a sibling that already parked,
+ * so the first one to arrive sends the members that did arrive after
+ * GANG_MIGRATION_TIMEOUT.  Stragglers then migrate on their own.
+ */
+#define GANG_MIGRATION_TIMEOUT (HZ/10)
+typedef struct _gang_migration_data {
+    data_header_t header;
+    int gang_id;
+    int cpu;
+    int expected;
+    int arrived;
+    struct _gang_migration* msg;    // Defined with the messages below
+} gang_migration_data_t;
+
+/**
+ * Negative vma lookup cache of a distributed thread group.  Each range
+ * is known to have had no vma on any kernel when it was recorded.  The
+ * generation is bumped by every invalidation, so that a lookup that
+ * raced with an mmap/munmap does not record a stale miss.  brk and
+ * stack growth are not announced to the other kernels, so a range may
+ * have gained a vma elsewhere; misses are only trusted for faults that
+ * grow a local stack, see process_server_pull_remote_mappings.
+ *
+ * The clean ranges are read only file mappings whose pages are known to
+ * match the local copy of the file, see file_clean_cache_insert.  They
+ * do not expire, but are dropped by any vma or protection change.
+ */
+#define VMA_MISS_CACHE_RANGES 8
+#define VMA_MISS_CACHE_TTL (HZ/50)
+#define FILE_CLEAN_CACHE_RANGES 16
+typedef struct _vma_miss_range {
+    unsigned long start;
+    unsigned long end;
+    unsigned long stamp;
+} vma_miss_range_t;
+
+typedef struct _vma_miss_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    unsigned long generation;
+    int next;
+    vma_miss_range_t ranges[VMA_MISS_CACHE_RANGES];
+    int next_clean;
+    vma_miss_range_t clean[FILE_CLEAN_CACHE_RANGES];
+} vma_miss_data_t;
+
+/**
+ * Processes forked off a distributed thread group that still share
+ * copy-on-write pages with it, see lazy_cow_fork.  <children> hold a
+ * reference on mm_count.  <served> are the cow vma ranges this kernel
+ * has handed pages out of to other kernels, whose writes to those
+ * pages cannot be caught here.
+ */
+#define LAZY_COW_CHILDREN 8
+#define LAZY_COW_SERVED_RANGES 16
+typedef struct _lazy_cow_range {
+    unsigned long start;
+    unsigned long end;
+} lazy_cow_range_t;
+
+typedef struct _lazy_cow_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int nr_children;
+    struct mm_struct* children[LAZY_COW_CHILDREN];
+    int nr_served;
+    int served_overflow;        // Too many ranges, forks break everything
+    lazy_cow_range_t served[LAZY_COW_SERVED_RANGES];
+} lazy_cow_data_t;
+
+/**
+ * A fault on <address> of <mm> that is being resolved on this kernel.
+ * Threads faulting on the same page meanwhile wait for it rather than
+ * taking the page lock and asking the other kernels themselves, see
+ * process_server_fault_coalesce.  Freed by whoever of the faulting
+ * thread and the waiters lets go of it last.
+ */
+typedef struct _fault_flight {
+    data_header_t header;
+    struct mm_struct* mm;
+    unsigned long address;      // Page aligned
+    int waiters;
+    int done;
+    wait_queue_head_t wait_queue;
+} fault_flight_t;
+
+/**
+ * A page lock request queued at the home kernel of its thread group,
+ * see page_lock_home_enqueue.  Light requests are also kept in the
+ * interval tree of their group by first and last page.  Of requests on
+ * the identical range only one is linked in the tree, and the others
+ * hang off its <same> list, as vmas do in the i_mmap prio tree.
+ * Shared requests, taken by read faults, do not conflict with each
+ * other.
+ */
+typedef struct _page_lock_home_entry {
+    data_header_t header;
+    struct list_head queue;     // In the group's queue, oldest first
+    struct prio_tree_node node;
+    struct list_head same;
+    int in_tree;
+    struct list_head notify;    // On _page_lock_home_notify once granted
+    unsigned long seq;          // Order of arrival in the group
+    unsigned long address;
+    size_t sz;
+    int is_heavy;
+    int shared;
+    int cpu;                    // Requesting kernel
+    unsigned long token;        // Unique per requesting kernel
+    int granted;
+    int contended;              // Not granted on arrival
+} page_lock_home_entry_t;
+
+/**
+ * The page lock requests of one thread group, at its home kernel.  A
+ * request is granted once no earlier request that it conflicts with
+ * is queued.  A heavy request conflicts with every other request of
+ * the group, so it is granted only at the head of the queue.
+ */
+typedef struct _page_lock_home_group {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    struct list_head queue;
+    struct prio_tree_root tree;
+    unsigned long next_seq;
+    int nr_heavy;
+} page_lock_home_group_t;
+
+/**
+ * A ticket lock in memory shared by all kernels.  A thread that does
+ * not get the lock after spinning for a while sets the bit of its
+ * kernel in <sleepers> and sleeps, and the holder wakes every such
+ * kernel up with a message when it gives the lock away.
+ */
+typedef struct _ps_shared_lock {
+    atomic_t next;              // Next ticket handed out
+    atomic_t owner;             // Ticket holding the lock
+    DECLARE_BITMAP(sleepers,NR_CPUS);
+} __attribute__((aligned(L1_CACHE_BYTES))) ps_shared_lock_t;
+
+/**
+ * Layout of the page shared by all kernels, see init_shared_counter.
+ * It is split into lock words per thread group hash and per page hash,
+ * and futex waiter counts per thread group hash, see
+ * process_server_futex_waiters.
+ */
+#define PS_SHARED_FUTEX_WAITERS 256
+#define PS_SHARED_LOCKS ((PAGE_SIZE - PS_SHARED_FUTEX_WAITERS * sizeof(atomic_t)) \
+                         / sizeof(ps_shared_lock_t))
+#define PS_SHARED_TGROUP_LOCKS (PS_SHARED_LOCKS / 4)
+#define PS_SHARED_PAGE_LOCKS (PS_SHARED_LOCKS - PS_SHARED_TGROUP_LOCKS)
+#define PS_SHARED_LOCK_SPINS 10000
+typedef struct _ps_shared_page {
+    ps_shared_lock_t tgroup_locks[PS_SHARED_TGROUP_LOCKS];
+    ps_shared_lock_t page_locks[PS_SHARED_PAGE_LOCKS];
+    atomic_t futex_waiters[PS_SHARED_FUTEX_WAITERS];
+} ps_shared_page_t;
+
+/**
+ * With home page locks, faults only take the lock word of their page,
+ * and range and heavy locks granted by the home kernel also take the
+ * page words of their range, see page_lock_take_words.
+ */
+#if defined(PROCESS_SERVER_USE_HOME_PAGE_LOCK) && \
+    defined(PROCESS_SERVER_USE_SHARED_LOCK_WORDS)
+#define PAGE_LOCK_USES_LOCK_WORDS
+#endif
+
+/**
+ * A page lock requested or held by a thread on this kernel.
+ */
+typedef struct _page_lock_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    unsigned long address;
+    size_t sz;
+    int is_heavy;
+    int shared;
+    pid_t pid;
+    unsigned long token;
+    int granted;
+    int retry;                  // The home kernel could not queue it
+    int contended;
+    int site;                   // enum process_server_lock_site
+    unsigned long long requested;
+    unsigned long long acquired;
+    struct _page_lock_stats* stats; // Accounted into when given up
+    wait_queue_head_t wait_queue;
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    DECLARE_BITMAP(words,PS_SHARED_PAGE_LOCKS); // Page lock words held
+#endif
+} page_lock_data_t;
+
+/**
+ * Protection changes of a distributed thread group that were made on
+ * this kernel and not yet pushed to the others.  Ranges are applied
+ * remotely in order.  The queue is flushed when full, after
+ * MPROTECT_BATCH_DELAY, and before anything that has to observe it:
+ * a local munmap, a migration, another kernel taking the heavy lock,
+ * or another kernel joining the thread group, which is added to it.
+ *
+ * The range lock each mprotect took at the home kernel is not given up
+ * when it returns, but <held> until the queue is flushed, so no kernel
+ * gets a conflicting page or range lock before the change is applied
+ * everywhere.  Local lockers flush the queue instead of waiting.
+ * Without home range locks there is nothing to hold, and mprotect
+ * waits for the other kernels.
+ */
+#if defined(PROCESS_SERVER_ENFORCE_VMA_MOD_ATOMICITY) && \
+    defined(PROCESS_SERVER_USE_HOME_PAGE_LOCK) && \
+    !defined(PROCESS_SERVER_USE_HEAVY_LOCK) && \
+    !defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
+#define MPROTECT_BATCH_HOLDS_RANGE_LOCK
+#endif
+#define MPROTECT_BATCH_RANGES 32
+#define MPROTECT_BATCH_DELAY (HZ/100)
+typedef struct _mprotect_batch_range {
+    unsigned long start;
+    size_t len;
+    unsigned long prot;
+} mprotect_batch_range_t;
+
+typedef struct _mprotect_batch_data {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    unsigned long known_cpu_with_tgroup_mm; // Kernels to push to
+    data_header_t* held;        // page_lock_data_t, released once flushed
+    int count;
+    mprotect_batch_range_t ranges[MPROTECT_BATCH_RANGES];
+} mprotect_batch_data_t;
+
 typedef struct _lamport_barrier_entry {
     data_header_t header;
     unsigned long long timestamp;
@@ -556,19 +891,90 @@ typedef struct _clone_request {
     size_t sas_ss_size;
     struct k_sigaction action[_NSIG];
     unsigned long previous_cpus;
+    unsigned long known_cpu_with_tgroup_mm;
+    unsigned long long migration_start;
 } clone_request_t;
 
+/**
+ * Per thread state carried by a gang migration.  This is the
+ * subset of clone_request_t that is not shared by the thread group.
+ */
+typedef struct _gang_thread {
+    int placeholder_pid;
+    int clone_request_id;
+    int t_home_cpu;
+    int t_home_id;
+    int origin_pid;
+    int prio, static_prio, normal_prio;
+    unsigned int rt_priority;
+    int sched_class;
+    unsigned long previous_cpus;
+    struct pt_regs regs;
+    unsigned long thread_fs;
+    unsigned long thread_gs;
+    unsigned long thread_sp0;
+    unsigned long thread_sp;
+    unsigned long thread_usersp;
+    unsigned short thread_es;
+    unsigned short thread_ds;
+    unsigned short thread_fsindex;
+    unsigned short thread_gsindex;
+    sigset_t remote_blocked, remote_real_blocked;
+    sigset_t remote_saved_sigmask;
+    unsigned long sas_ss_sp;
+    size_t sas_ss_size;
+    unsigned long long migration_start;
+} gang_thread_t;
+
+// Bounded by the long message payload size, see process_server_init.
+#define GANG_MIGRATION_MAX_THREADS 12
+
+/**
+ * Migrates up to GANG_MIGRATION_MAX_THREADS members of one thread
+ * group to a cpu none of them has executed on before.  Everything the
+ * thread group shares is sent once.
+ */
+typedef struct _gang_migration {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int placeholder_tgid;
+    int nr_threads;
+    unsigned long clone_flags;
+    unsigned long stack_start;
+    unsigned long env_start;
+    unsigned long env_end;
+    unsigned long arg_start;
+    unsigned long arg_end;
+    unsigned long heap_start;
+    unsigned long heap_end;
+    unsigned long data_start;
+    unsigned long data_end;
+    unsigned long def_flags;
+    unsigned long known_cpu_with_tgroup_mm;
+    unsigned int personality;
+    char exe_path[512];
+    struct k_sigaction action[_NSIG];
+    gang_thread_t threads[GANG_MIGRATION_MAX_THREADS];
+} gang_migration_t;
+
 /**
  * This message is sent in response to a clone request.
  * Its purpose is to notify the requesting cpu that
  * the specified pid is executing on behalf of the
  * requesting cpu.
  */
-typedef struct _create_process_pairing {
+struct _create_process_pairing {
     struct pcn_kmsg_hdr header;
-    int your_pid; // PID of cpu receiving this pairing request
-    int my_pid;   // PID of cpu transmitting this pairing request
-} create_process_pairing_t;
+    int your_pid;                     // 4 PID of cpu receiving this pairing request
+    int my_pid;                       // 4 PID of cpu transmitting this pairing request
+    unsigned long long import_start;  // 8 tsc when the import started
+    unsigned long long import_end;    // 8 tsc right before resuming user code
+                                      // ---
+                                      // 24 -> 28 bytes of padding needed
+    char pad[28];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _create_process_pairing create_process_pairing_t;
 
 /**
  * This message informs the remote cpu of delegated
@@ -615,6 +1021,85 @@ typedef struct _vma_transfer {
     char path[256];
 } vma_transfer_t;
 
+/**
+ * Announce a new vma to every kernel, so that their faults only
+ * ever have to resolve the physical page.  <version> is the vma
+ * layout version of the thread group on the sender, see
+ * vma_miss_data_t.
+ */
+typedef struct _vma_update {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int requester_pid;
+    unsigned long version;
+    unsigned long vaddr_start;
+    unsigned long vaddr_size;
+    unsigned long vm_flags;
+    unsigned long pgoff;
+    char path[512];
+} vma_update_t;
+
+/**
+ *
+ */
+struct _vma_update_response {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;        // 4
+    int tgroup_home_id;         // 4
+    int requester_pid;          // 4
+    unsigned long vaddr_start;  // 8
+                                // ---
+                                // 20 -> 32 bytes of padding needed
+    char pad[32];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _vma_update_response vma_update_response_t;
+
+/**
+ * A flushed mprotect queue, see mprotect_batch_data_t.
+ */
+typedef struct _mprotect_batch {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    unsigned long batch_id;
+    int count;
+    mprotect_batch_range_t ranges[MPROTECT_BATCH_RANGES];
+} mprotect_batch_t;
+
+/**
+ *
+ */
+struct _mprotect_batch_response {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;        // 4
+    int tgroup_home_id;         // 4
+    unsigned long batch_id;     // 8
+                                // ---
+                                // 16 -> 36 bytes of padding needed
+    char pad[36];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _mprotect_batch_response mprotect_batch_response_t;
+
+/**
+ * Sent by a kernel that just created an mm for a distributed thread
+ * group to every kernel it knows holds one, so that they start
+ * sending it mm traffic.  The response carries the responder's view
+ * of which kernels hold the mm.
+ */
+struct _tgroup_mm_join {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;        // 4
+    int tgroup_home_id;         // 4
+    int requester_pid;          // 4
+    unsigned long known_cpu_with_tgroup_mm; // 8
+                                // ---
+                                // 20 -> 32 bytes of padding needed
+    char pad[32];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _tgroup_mm_join tgroup_mm_join_t;
+typedef struct _tgroup_mm_join tgroup_mm_join_response_t;
+
 /**
  * Inform remote cpu of a pte to vma mapping.
  */
@@ -686,6 +1171,8 @@ struct _mapping_response {
     pgprot_t prot;              
     unsigned long vm_flags;     
     unsigned long pgoff;
+    unsigned char file_clean;   // vma pages all match file_id
+    file_identity_t file_id;
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long send_time;
 #endif
@@ -820,7 +1307,9 @@ typedef struct _back_migration {
     int tgroup_home_id;
     int t_home_cpu;
     int t_home_id;
+    int placeholder_pid;
     unsigned long previous_cpus;
+    unsigned long long migration_start;
     struct pt_regs regs;
     unsigned long thread_fs;
     unsigned long thread_gs;
@@ -936,6 +1425,66 @@ struct _lamport_barrier_release_range {
 } __attribute__((packed)) __attribute__((aligned(64)));
 typedef struct _lamport_barrier_release_range lamport_barrier_release_range_t;
 
+/**
+ * Page lock request, sent to the home kernel of the thread group.
+ */
+struct _page_lock_request {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;            // 4
+    int tgroup_home_id;             // 4
+    unsigned long address;          // 8
+    size_t sz;                      // 8
+    unsigned long token;            // 8
+    int is_heavy;                   // 4
+    int shared;                     // 4
+                                    // ---
+                                    // 40 -> 20 bytes of padding needed
+    char pad[20];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _page_lock_request page_lock_request_t;
+
+/**
+ * Page lock grant, sent by the home kernel to the requester.
+ */
+struct _page_lock_grant {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;            // 4
+    int tgroup_home_id;             // 4
+    unsigned long token;            // 8
+    int contended;                  // 4
+    int retry;                      // 4 Not queued, ask again
+                                    // ---
+                                    // 24 -> 36 bytes of padding needed
+    char pad[36];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _page_lock_grant page_lock_grant_t;
+
+/**
+ * Page lock release, sent by the holder to the home kernel.
+ */
+struct _page_lock_release {
+    struct pcn_kmsg_hdr header;
+    int tgroup_home_cpu;            // 4
+    int tgroup_home_id;             // 4
+    unsigned long address;          // 8
+    size_t sz;                      // 8
+    unsigned long token;            // 8
+    int is_heavy;                   // 4
+                                    // ---
+                                    // 36 -> 24 bytes of padding needed
+    char pad[24];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _page_lock_release page_lock_release_t;
+
+/**
+ * A shared lock word this kernel was sleeping on changed hands.
+ */
+struct _shared_lock_wake {
+    struct pcn_kmsg_hdr header;
+    char pad[60];
+} __attribute__((packed)) __attribute__((aligned(64)));
+typedef struct _shared_lock_wake shared_lock_wake_t;
+
 /**
  *
  */
@@ -1001,6 +1550,14 @@ typedef struct {
     clone_data_t* data;
 } import_task_work_t;
 
+/**
+ *
+ */
+typedef struct {
+    struct work_struct work;
+    gang_migration_t* msg;
+} gang_migration_work_t;
+
 /**
  *
  */
@@ -1080,6 +1637,34 @@ typedef struct {
     int from_cpu;
 } munmap_request_work_t;
 
+/**
+ *
+ */
+typedef struct {
+    struct work_struct work;
+    vma_update_t* msg;
+} vma_update_work_t;
+
+/**
+ *
+ */
+typedef struct {
+    struct work_struct work;
+    mprotect_batch_t* msg;
+} mprotect_batch_work_t;
+
+/**
+ *
+ */
+typedef struct {
+    struct work_struct work;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    int requester_pid;
+    unsigned long known_cpu_with_tgroup_mm;
+    int from_cpu;
+} tgroup_mm_join_work_t;
+
 /**
  *
  */
@@ -1126,7 +1711,10 @@ typedef struct {
     int tgroup_home_id;
     int t_home_cpu;
     int t_home_id;
+    int placeholder_pid;
+    int from_cpu;
     unsigned long previous_cpus;
+    unsigned long long migration_start;
     struct pt_regs regs;
     unsigned long thread_fs;
     unsigned long thread_gs;
@@ -1256,7 +1844,47 @@ extern int exec_mmap(struct mm_struct* mm);
 extern void start_remote_thread(struct pt_regs* regs);
 extern void flush_old_files(struct files_struct * files);
 #endif
-static unsigned long get_next_ts_value(void);
+static unsigned long long get_next_ts_value(void);
+static void lamport_clock_observe(unsigned long long timestamp);
+static int notify_process_pairing(pid_t pid, pid_t remote_pid, int remote_cpu,
+        unsigned long long import_start, unsigned long long import_end);
+static void migration_notify_finish(pid_t pid, unsigned long long import,
+        unsigned long long resume, int done);
+static void gang_migration_leave(int gang_id);
+static void gang_import_put(gang_import_data_t* gang);
+static void vma_miss_cache_invalidate(int tgroup_home_cpu, int tgroup_home_id,
+                                      unsigned long start, unsigned long len,
+                                      unsigned long version);
+static void vma_miss_cache_destroy(int tgroup_home_cpu, int tgroup_home_id);
+static void page_lock_stats_destroy(int tgroup_home_cpu, int tgroup_home_id);
+static unsigned long vma_miss_cache_generation(void);
+static int is_clean_file_vma(struct vm_area_struct* vma);
+static void get_file_identity(struct file* file, file_identity_t* id);
+static void file_clean_cache_invalidate(int tgroup_home_cpu, int tgroup_home_id,
+                                        unsigned long start, unsigned long len);
+static void lazy_cow_break(int tgroup_home_cpu, int tgroup_home_id,
+                           unsigned long start, unsigned long end);
+static void lazy_cow_note_served(int tgroup_home_cpu, int tgroup_home_id,
+                                 unsigned long start, unsigned long end);
+static void lazy_cow_destroy(int tgroup_home_cpu, int tgroup_home_id);
+static void break_cow_range(struct mm_struct* mm, struct mm_struct* orig,
+                            unsigned long start, unsigned long end);
+static int mprotect_batch_pending(int tgroup_home_cpu, int tgroup_home_id,
+                                  unsigned long start, size_t len);
+static void mprotect_batch_flush(int tgroup_home_cpu, int tgroup_home_id);
+static void mprotect_batch_kick(void);
+static void mprotect_batch_drop(int tgroup_home_cpu, int tgroup_home_id);
+#ifdef MPROTECT_BATCH_HOLDS_RANGE_LOCK
+static void page_lock_put(page_lock_data_t* data);
+#endif
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+static void page_lock_take_words(page_lock_data_t* data);
+static void page_lock_words_release(unsigned long* words);
+static page_lock_data_t* page_lock_other_held(pid_t pid,
+                                              page_lock_data_t* data);
+#endif
+static void send_lamport_barrier_response_range(struct work_struct* work);
+static void tgroup_mm_join(struct task_struct* task);
 
 /**
  * Module variables
@@ -1264,17 +1892,32 @@ static unsigned long get_next_ts_value(void);
 static int _vma_id = 0;
 static int _clone_request_id = 0;
 static int _cpu = -1;
-static unsigned long long perf_a, perf_b, perf_c, perf_d, perf_e;
 data_header_t* _saved_mm_head = NULL;             // Saved MM list
 DEFINE_SPINLOCK(_saved_mm_head_lock);             // Lock for _saved_mm_head
 data_header_t* _mapping_request_data_head = NULL; // Mapping request data head
 DEFINE_SPINLOCK(_mapping_request_data_head_lock);  // Lock for above
 data_header_t* _count_remote_tmembers_data_head = NULL;
 DEFINE_SPINLOCK(_count_remote_tmembers_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_count_remote_tmembers_wq);
 data_header_t* _munmap_data_head = NULL;
 DEFINE_SPINLOCK(_munmap_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_munmap_wq);
 data_header_t* _mprotect_data_head = NULL;
 DEFINE_SPINLOCK(_mprotect_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_mprotect_wq);
+data_header_t* _vma_update_data_head = NULL;
+DEFINE_SPINLOCK(_vma_update_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_vma_update_wq);
+data_header_t* _mprotect_batch_data_head = NULL;
+DEFINE_SPINLOCK(_mprotect_batch_data_head_lock);
+static DEFINE_MUTEX(_mprotect_batch_flush_mutex); // One batch in flight
+static unsigned long _mprotect_batch_id = 0;      // Id of that batch
+static int _mprotect_batch_responses = 0;
+static int _mprotect_batch_expected_responses = 0;
+DEFINE_SPINLOCK(_mprotect_batch_responses_lock);
+data_header_t* _tgroup_mm_join_data_head = NULL;
+DEFINE_SPINLOCK(_tgroup_mm_join_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_tgroup_mm_join_wq);
 data_header_t* _data_head = NULL;                 // General purpose data store
 DEFINE_SPINLOCK(_data_head_lock);                 // Lock for _data_head
 DEFINE_SPINLOCK(_vma_id_lock);                    // Lock for _vma_id
@@ -1283,12 +1926,38 @@ struct rw_semaphore _import_sem;
 DEFINE_SPINLOCK(_remap_lock);
 data_header_t* _lamport_barrier_queue_head = NULL;
 DEFINE_SPINLOCK(_lamport_barrier_queue_lock);
-unsigned long* ts_counter = NULL;
+DECLARE_WAIT_QUEUE_HEAD(_lamport_barrier_wq);     // Woken on any queue change
+ps_shared_page_t* _shared_page = NULL;            // Shared by all kernels
+static atomic64_t _lamport_clock = ATOMIC64_INIT(0); // See get_next_ts_value
+DECLARE_WAIT_QUEUE_HEAD(_shared_lock_wq);         // Woken on shared lock wake
 get_counter_phys_data_t* get_counter_phys_data = NULL;
+DECLARE_WAIT_QUEUE_HEAD(_get_counter_phys_wq);
+data_header_t* _migration_notify_data_head = NULL;
+DEFINE_SPINLOCK(_migration_notify_data_head_lock);
+data_header_t* _gang_migration_data_head = NULL;
+DEFINE_SPINLOCK(_gang_migration_data_head_lock);
+DECLARE_WAIT_QUEUE_HEAD(_gang_migration_wq);       // Woken when a gang is sent
+data_header_t* _vma_miss_data_head = NULL;
+DEFINE_SPINLOCK(_vma_miss_data_head_lock);
+data_header_t* _lazy_cow_data_head = NULL;
+DEFINE_SPINLOCK(_lazy_cow_data_head_lock);
+static atomic_t _lazy_cow_children = ATOMIC_INIT(0); // Across all groups
+data_header_t* _fault_flight_head = NULL;
+DEFINE_SPINLOCK(_fault_flight_head_lock);
+data_header_t* _page_lock_home_head = NULL;  // Groups
+DEFINE_SPINLOCK(_page_lock_home_lock);
+static LIST_HEAD(_page_lock_home_notify);       // Grants not yet sent
+data_header_t* _page_lock_data_head = NULL;
+DEFINE_SPINLOCK(_page_lock_data_head_lock);
+data_header_t* _page_lock_stats_head = NULL;
+DEFINE_SPINLOCK(_page_lock_stats_head_lock);
+static atomic_t _page_lock_token = ATOMIC_INIT(0);
+static int _gang_id = 1;
 
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
 struct proc_dir_entry *_proc_entry = NULL;
 struct proc_dir_entry *_lamport_proc_entry = NULL;
+DECLARE_WAIT_QUEUE_HEAD(_stats_query_wq);
 static void proc_track_data(int entry, unsigned long long time);//proto
 static void proc_data_init();
 typedef struct _proc_data {
@@ -1386,6 +2055,359 @@ typedef struct {
 static struct workqueue_struct *clone_wq;
 static struct workqueue_struct *exit_wq;
 static struct workqueue_struct *mapping_wq;
+static struct workqueue_struct *mprotect_batch_wq;
+static struct workqueue_struct *tgroup_mm_join_wq;
+
+/**
+ * Latency histograms.  Bucket n counts samples of [2^n,2^(n+1)) TSC
+ * cycles.
+ */
+#define PS_LATENCY_HIST_BUCKETS 40
+typedef struct _latency_hist {
+    const char* name;
+    atomic_t count;
+    atomic64_t total;
+    atomic_t hist[PS_LATENCY_HIST_BUCKETS];
+} latency_hist_t;
+
+static void latency_hist_add(latency_hist_t* h, unsigned long long cycles) {
+    int bucket = cycles ? fls64(cycles) - 1 : 0;
+
+    if(bucket >= PS_LATENCY_HIST_BUCKETS) bucket = PS_LATENCY_HIST_BUCKETS - 1;
+
+    atomic_inc(&h->count);
+    atomic64_add(cycles,&h->total);
+    atomic_inc(&h->hist[bucket]);
+}
+
+/**
+ * @brief Print <nr> histograms into [p,end), each on a line of its own
+ * that starts with <prefix>.  Returns the end of what was printed.
+ */
+static char* latency_hist_print(const char* prefix, latency_hist_t* h, int nr,
+                                char* p, char* end) {
+    int i,j,n;
+
+    for(i = 0; i < nr; i++) {
+        n = atomic_read(&h[i].count);
+        p += scnprintf(p,end - p,"%s%s count{%d} avg{%llu}",
+                       prefix, h[i].name, n,
+                       n ? (unsigned long long)atomic64_read(&h[i].total) / n : 0);
+        for(j = 0; j < PS_LATENCY_HIST_BUCKETS; j++) {
+            n = atomic_read(&h[i].hist[j]);
+            if(n) p += scnprintf(p,end - p," 2^%d{%d}",j,n);
+        }
+        p += scnprintf(p,end - p,"\n");
+    }
+    return p;
+}
+
+static int latency_hist_proc_read(latency_hist_t* h, int nr,
+                                  char* page, int* eof) {
+    char* p = latency_hist_print("",h,nr,page,page + PAGE_SIZE);
+
+    *eof = 1;
+    return p - page;
+}
+
+static void latency_hist_clear(latency_hist_t* h, int nr) {
+    int i,j;
+
+    for(i = 0; i < nr; i++) {
+        atomic_set(&h[i].count,0);
+        atomic64_set(&h[i].total,0);
+        for(j = 0; j < PS_LATENCY_HIST_BUCKETS; j++)
+            atomic_set(&h[i].hist[j],0);
+    }
+}
+
+/**
+ * Wait time histograms, one per site that sleeps waiting for other
+ * kernels.  Published in /proc/procsrv_wait, writing to it clears them.
+ */
+static latency_hist_t _wait_stats[PS_WAIT_MAX] = {
+    [PS_WAIT_SHADOW_RETURN]     = { .name = "shadow_return" },
+    [PS_WAIT_THREAD_COUNT]      = { .name = "thread_count" },
+    [PS_WAIT_MAPPING]           = { .name = "mapping" },
+    [PS_WAIT_MUNMAP]            = { .name = "munmap" },
+    [PS_WAIT_MPROTECT]          = { .name = "mprotect" },
+    [PS_WAIT_COUNTER_PHYS]      = { .name = "counter_phys" },
+    [PS_WAIT_STATS_QUERY]       = { .name = "stats_query" },
+    [PS_WAIT_LAMPORT_RESPONSES] = { .name = "lamport_responses" },
+    [PS_WAIT_LAMPORT_LOCK]      = { .name = "lamport_lock" },
+    [PS_WAIT_LAMPORT_ALL]       = { .name = "lamport_all" },
+    [PS_WAIT_VMA_UPDATE]        = { .name = "vma_update" },
+    [PS_WAIT_MM_JOIN]           = { .name = "mm_join" },
+    [PS_WAIT_FAULT_COALESCE]    = { .name = "fault_coalesce" },
+    [PS_WAIT_PAGE_LOCK]         = { .name = "page_lock" },
+    [PS_WAIT_SHARED_LOCK]       = { .name = "shared_lock" },
+    [PS_WAIT_GANG]              = { .name = "gang" },
+};
+
+/**
+ * @brief Account a wait at <site> that started at TSC value <start>.
+ */
+void process_server_track_wait(int site, unsigned long long start) {
+    if(site < 0 || site >= PS_WAIT_MAX) return;
+    latency_hist_add(&_wait_stats[site],native_read_tsc() - start);
+}
+
+static int wait_stats_proc_read(char* page, char** start, off_t off,
+                                int count, int* eof, void* d) {
+    return latency_hist_proc_read(_wait_stats,PS_WAIT_MAX,page,eof);
+}
+
+static int wait_stats_proc_write(struct file* file, const char* buffer,
+                                 unsigned long count, void* data) {
+    latency_hist_clear(_wait_stats,PS_WAIT_MAX);
+    return count;
+}
+
+/**
+ * Migration phase histograms.  Each phase reached on this kernel is
+ * accounted with the time elapsed since the migration started on the
+ * source kernel, which the TSC shared between kernels makes possible.
+ * Published in /proc/procsrv_migration, writing to it clears them.
+ */
+static latency_hist_t _migration_phase_stats[PS_MIGRATION_PHASE_MAX] = {
+    [PS_MIGRATION_REQUEST_BUILT]      = { .name = "request_built" },
+    [PS_MIGRATION_REQUEST_SENT]       = { .name = "request_sent" },
+    [PS_MIGRATION_PLACEHOLDER_PARKED] = { .name = "placeholder_parked" },
+    [PS_MIGRATION_REQUEST_RECEIVED]   = { .name = "request_received" },
+    [PS_MIGRATION_IMPORT_STARTED]     = { .name = "import_started" },
+    [PS_MIGRATION_MM_ATTACHED]        = { .name = "mm_attached" },
+    [PS_MIGRATION_USER_RESUMED]       = { .name = "user_resumed" },
+};
+
+/**
+ * @brief Record that the migration of <pid>, started at TSC value
+ * <start>, has reached <phase>.  <peer_cpu> is the other end.
+ */
+static void migration_phase(int phase, pid_t pid, int peer_cpu,
+                            unsigned long long start) {
+    unsigned long long now = native_read_tsc();
+
+    trace_popcorn_migration_phase(phase,pid,peer_cpu,start,now);
+    if(start && now > start)
+        latency_hist_add(&_migration_phase_stats[phase],now - start);
+}
+
+static int migration_stats_proc_read(char* page, char** start, off_t off,
+                                     int count, int* eof, void* d) {
+    return latency_hist_proc_read(_migration_phase_stats,
+                                  PS_MIGRATION_PHASE_MAX,page,eof);
+}
+
+static int migration_stats_proc_write(struct file* file, const char* buffer,
+                                      unsigned long count, void* data) {
+    latency_hist_clear(_migration_phase_stats,PS_MIGRATION_PHASE_MAX);
+    return count;
+}
+
+/**
+ * Number of faults that took each path through the fault handler.
+ * Published in /proc/procsrv_fault, writing to it clears them.
+ */
+static const char* const _fault_path_names[PS_FAULT_PATH_MAX] = {
+    [PS_FAULT_PATH_LOCAL]       = "local",
+    [PS_FAULT_PATH_FAST_MAPPED] = "fast_mapped",
+    [PS_FAULT_PATH_FAST_READ]   = "fast_read",
+    [PS_FAULT_PATH_LOCKED]      = "locked",
+    [PS_FAULT_PATH_OPTIMISTIC]  = "optimistic",
+};
+// Per cpu, every fault in the system is counted.
+typedef struct _fault_path_stats {
+    unsigned long count[PS_FAULT_PATH_MAX];
+} fault_path_stats_t;
+static DEFINE_PER_CPU(fault_path_stats_t, _fault_path_stats);
+
+static int fault_stats_proc_read(char* page, char** start, off_t off,
+                                 int count, int* eof, void* d) {
+    char* p = page;
+    unsigned long sum;
+    int i, cpu;
+
+    for(i = 0; i < PS_FAULT_PATH_MAX; i++) {
+        sum = 0;
+        for_each_possible_cpu(cpu)
+            sum += per_cpu(_fault_path_stats,cpu).count[i];
+        p += sprintf(p,"%s %lu\n",_fault_path_names[i],sum);
+    }
+    *eof = 1;
+    return p - page;
+}
+
+static int fault_stats_proc_write(struct file* file, const char* buffer,
+                                  unsigned long count, void* data) {
+    int i, cpu;
+    for_each_possible_cpu(cpu)
+        for(i = 0; i < PS_FAULT_PATH_MAX; i++)
+            per_cpu(_fault_path_stats,cpu).count[i] = 0;
+    return count;
+}
+
+/**
+ * Object caches for what is allocated per fault and per page lock
+ * request, so that these do not go through the generic kmalloc caches.
+ * A cache with a reserve is backed by a mempool.  Its objects are
+ * allocated under _lamport_barrier_queue_lock or are replies a remote
+ * kernel waits for, and the lock protocol cannot do without them.
+ * Usage is published in /proc/procsrv_cache, writing to it clears the
+ * counters.
+ */
+enum ps_cache_id {
+    PS_CACHE_MAPPING_REQUEST_DATA = 0,
+    PS_CACHE_MAPPING_REQUEST_WORK,
+    PS_CACHE_MAPPING_RESPONSE,
+    PS_CACHE_PATH,
+    PS_CACHE_FAULT_FLIGHT,
+    PS_CACHE_LAMPORT_ENTRY,
+    PS_CACHE_LAMPORT_QUEUE,
+    PS_CACHE_LAMPORT_REQUEST_RANGE,
+    PS_CACHE_LAMPORT_RESPONSE,
+    PS_CACHE_LAMPORT_RESPONSE_RANGE,
+    PS_CACHE_LAMPORT_RELEASE_RANGE,
+    PS_CACHE_LAMPORT_REQUEST_WORK,
+    PS_CACHE_LAMPORT_RESPONSE_WORK,
+    PS_CACHE_LAMPORT_RELEASE_WORK,
+    PS_CACHE_LAMPORT_REQUEST_RANGE_WORK,
+    PS_CACHE_LAMPORT_RESPONSE_RANGE_WORK,
+    PS_CACHE_LAMPORT_RELEASE_RANGE_WORK,
+    PS_CACHE_PAGE_LOCK_HOME,
+    PS_CACHE_PAGE_LOCK_DATA,
+    PS_CACHE_PAGE_LOCK_HOME_GROUP,
+    PS_CACHE_MAX
+};
+
+typedef struct _ps_cache {
+    const char* name;
+    size_t size;
+    int reserve;                // Objects kept back in a mempool
+    struct kmem_cache* cache;   // NULL falls back to kmalloc
+    mempool_t* pool;
+    atomic_t in_use;
+    atomic_t allocs;
+    atomic_t failures;
+} ps_cache_t;
+
+#define PS_CACHE(id,type,res) \
+    [id] = { .name = #type, .size = sizeof(type), .reserve = res }
+static ps_cache_t _ps_caches[PS_CACHE_MAX] = {
+    PS_CACHE(PS_CACHE_MAPPING_REQUEST_DATA,mapping_request_data_t,0),
+    PS_CACHE(PS_CACHE_MAPPING_REQUEST_WORK,mapping_request_work_t,0),
+    PS_CACHE(PS_CACHE_MAPPING_RESPONSE,mapping_response_t,0),
+    [PS_CACHE_PATH] = { .name = "ps_path", .size = POPCORN_MAX_PATH },
+    PS_CACHE(PS_CACHE_FAULT_FLIGHT,fault_flight_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_ENTRY,lamport_barrier_entry_t,256),
+    PS_CACHE(PS_CACHE_LAMPORT_QUEUE,lamport_barrier_queue_t,64),
+    PS_CACHE(PS_CACHE_LAMPORT_REQUEST_RANGE,lamport_barrier_request_range_t,16),
+    PS_CACHE(PS_CACHE_LAMPORT_RESPONSE,lamport_barrier_response_t,16),
+    PS_CACHE(PS_CACHE_LAMPORT_RESPONSE_RANGE,lamport_barrier_response_range_t,16),
+    PS_CACHE(PS_CACHE_LAMPORT_RELEASE_RANGE,lamport_barrier_release_range_t,16),
+    PS_CACHE(PS_CACHE_LAMPORT_REQUEST_WORK,lamport_barrier_request_work_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_RESPONSE_WORK,lamport_barrier_response_work_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_RELEASE_WORK,lamport_barrier_release_work_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_REQUEST_RANGE_WORK,lamport_barrier_request_range_work_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_RESPONSE_RANGE_WORK,lamport_barrier_response_range_work_t,0),
+    PS_CACHE(PS_CACHE_LAMPORT_RELEASE_RANGE_WORK,lamport_barrier_release_range_work_t,0),
+    PS_CACHE(PS_CACHE_PAGE_LOCK_HOME,page_lock_home_entry_t,64),
+    PS_CACHE(PS_CACHE_PAGE_LOCK_DATA,page_lock_data_t,16),
+    PS_CACHE(PS_CACHE_PAGE_LOCK_HOME_GROUP,page_lock_home_group_t,16),
+};
+#undef PS_CACHE
+
+/**
+ * @brief Allocate an object from cache <id>.
+ * @return The object, or NULL if none could be had.
+ */
+static void* ps_cache_alloc(int id, gfp_t gfp) {
+    ps_cache_t* c = &_ps_caches[id];
+    void* obj;
+
+    if(c->pool)
+        obj = mempool_alloc(c->pool,gfp);
+    else if(c->cache)
+        obj = kmem_cache_alloc(c->cache,gfp);
+    else
+        obj = kmalloc(c->size,gfp);
+
+    if(obj) {
+        atomic_inc(&c->in_use);
+        atomic_inc(&c->allocs);
+    } else {
+        atomic_inc(&c->failures);
+    }
+    return obj;
+}
+
+/**
+ * @brief Return <obj>, allocated by ps_cache_alloc, to cache <id>.
+ */
+static void ps_cache_free(int id, void* obj) {
+    ps_cache_t* c = &_ps_caches[id];
+
+    if(!obj) return;
+
+    if(c->pool)
+        mempool_free(obj,c->pool);
+    else if(c->cache)
+        kmem_cache_free(c->cache,obj);
+    else
+        kfree(obj);
+    atomic_dec(&c->in_use);
+}
+
+/**
+ * @brief Create the object caches.  A cache that cannot be created
+ * leaves its objects to kmalloc.
+ */
+static void __init ps_cache_init(void) {
+    int i;
+
+    for(i = 0; i < PS_CACHE_MAX; i++) {
+        ps_cache_t* c = &_ps_caches[i];
+        c->cache = kmem_cache_create(c->name,c->size,0,
+                                     SLAB_HWCACHE_ALIGN,NULL);
+        if(!c->cache) {
+            printk(KERN_ALERT"%s: no cache for %s\n",__func__,c->name);
+            continue;
+        }
+        if(c->reserve) {
+            c->pool = mempool_create_slab_pool(c->reserve,c->cache);
+            if(!c->pool)
+                printk(KERN_ALERT"%s: no reserve for %s\n",__func__,c->name);
+        }
+    }
+}
+
+static int cache_stats_proc_read(char* page, char** start, off_t off,
+                                 int count, int* eof, void* d) {
+    char* p = page;
+    int i;
+
+    p += sprintf(p,"name size reserve in_use allocs failures\n");
+    for(i = 0; i < PS_CACHE_MAX; i++) {
+        ps_cache_t* c = &_ps_caches[i];
+        p += sprintf(p,"%s %lu %d %d %d %d\n",c->name,
+                     (unsigned long)c->size,
+                     c->pool? c->reserve : 0,
+                     atomic_read(&c->in_use),
+                     atomic_read(&c->allocs),
+                     atomic_read(&c->failures));
+    }
+    *eof = 1;
+    return p - page;
+}
+
+static int cache_stats_proc_write(struct file* file, const char* buffer,
+                                  unsigned long count, void* data) {
+    int i;
+    for(i = 0; i < PS_CACHE_MAX; i++) {
+        atomic_set(&_ps_caches[i].allocs,0);
+        atomic_set(&_ps_caches[i].failures,0);
+    }
+    return count;
+}
 
 /**
  * General helper functions and debugging tools
@@ -1442,11 +2464,53 @@ extern struct list_head rlist_head;
 static void set_cpu_has_known_tgroup_mm(struct task_struct *task,int cpu) {
     struct task_struct *me = task;
     struct task_struct *t = me;
+    if(cpu < 0 || cpu >= BITS_PER_LONG)
+        return;
     do {
         set_bit(cpu,&t->known_cpu_with_tgroup_mm);
     } while_each_thread(me, t);
 }
 
+/**
+ * @brief Fold a mask of kernels known to hold the mm into every
+ * thread of task's group.  Bits are only ever added, so the mask is
+ * a superset of the kernels that have the mm.
+ */
+static void merge_known_tgroup_mm(struct task_struct *task,
+                                  unsigned long known) {
+    int cpu;
+    for(cpu = 0; cpu < BITS_PER_LONG; cpu++) {
+        if(test_bit(cpu,&known))
+            set_cpu_has_known_tgroup_mm(task,cpu);
+    }
+}
+
+/**
+ * @brief Whether kernel cpu (as walked by the broadcast loops) may hold
+ * an mm for the thread group whose known mask is known.  Kernels the
+ * mask cannot describe are always assumed to hold it.
+ */
+static int kernel_has_known_tgroup_mm(unsigned long known, int cpu) {
+#ifdef SUPPORT_FOR_CLUSTERING
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+    struct cpumask *pcpum;
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        pcpum = &(objPtr->_data._cpumask);
+        if(objPtr->_data._processor == cpu || cpumask_test_cpu(cpu, pcpum))
+            return bitmap_intersects(cpumask_bits(pcpum), &known,
+                                     (sizeof(unsigned long) *8));
+    }
+    return 1;
+#else
+    if(cpu < 0 || cpu >= BITS_PER_LONG)
+        return 1;
+    return test_bit(cpu,&known);
+#endif
+}
+
 /**
  * @brief find_vma does not always return the correct vm_area_struct*.
  * If it fails to find a vma for the specified address, it instead
@@ -1731,6 +2795,16 @@ static clone_data_t* get_current_clone_data(void) {
     return 0;
 }*/
 
+/**
+ * @brief Result of a single page lookup.  mapping_sz is the size of
+ * the page table leaf that maps the address, so that callers can skip
+ * over a whole huge page instead of resolving it 4K at a time.
+ */
+typedef struct _vm_search_result {
+    unsigned long resolved;
+    unsigned long mapping_sz;
+} vm_search_result_t;
+
 /**
  * @brief Callback used when walking a memory map.  It looks to see
  * if the page is present.  If present, it resolves the given
@@ -1739,10 +2813,10 @@ static clone_data_t* get_current_clone_data(void) {
  */
 static int vm_search_page_walk_pte_entry_callback(pte_t *pte, unsigned long start, unsigned long end, struct mm_walk *walk) {
  
-    unsigned long* resolved_addr = (unsigned long*)walk->private;
+    vm_search_result_t* result = (vm_search_result_t*)walk->private;
 
     if (pte == NULL || pte_none(*pte) || !pte_present(*pte)) {
-        *resolved_addr = 0;
+        result->resolved = 0;
         return 0;
     }
 
@@ -1750,57 +2824,125 @@ static int vm_search_page_walk_pte_entry_callback(pte_t *pte, unsigned long star
     // pointed to by the private field of the walk
     // structure.  This is checked by the caller
     // of the walk function when the walk is complete.
-    *resolved_addr = (pte_val(*pte) & PHYSICAL_PAGE_MASK) | (start & (PAGE_SIZE-1));
+    result->resolved = (pte_val(*pte) & PHYSICAL_PAGE_MASK) | (start & (PAGE_SIZE-1));
+    result->mapping_sz = PAGE_SIZE;
     return 0;
 }
 
 /**
- * @brief Retrieve the physical address of the specified virtual address.
+ * @brief pmd level callback used when walking a memory map.  Transparent
+ * huge pages are resolved here directly from the pmd.  Regular pmds are
+ * handed to the pte callback.  Registering only a pmd_entry keeps
+ * walk_page_range() from splitting the huge page being looked up.
+ * @return always returns 0
+ */
+static int vm_search_page_walk_pmd_entry_callback(pmd_t *pmd, unsigned long start, unsigned long end, struct mm_walk *walk) {
+
+    vm_search_result_t* result = (vm_search_result_t*)walk->private;
+    pte_t* pte;
+
+    if(pmd_trans_huge(*pmd)) {
+        result->resolved = (pmd_pfn(*pmd) << PAGE_SHIFT) | (start & ~HPAGE_PMD_MASK);
+        result->mapping_sz = HPAGE_PMD_SIZE;
+        return 0;
+    }
+
+    if(pmd_none(*pmd) || pmd_bad(*pmd)) {
+        result->resolved = 0;
+        return 0;
+    }
+
+    pte = pte_offset_map(pmd,start);
+    vm_search_page_walk_pte_entry_callback(pte,start,end,walk);
+    pte_unmap(pte);
+
+    return 0;
+}
+
+/**
+ * @brief Retrieve the physical address of the specified virtual address,
+ * along with the size of the page that maps it.
  * @return -1 indicates failure.  Otherwise, 0 is returned.
  */
-static int get_physical_address(struct mm_struct* mm, 
+static int get_physical_mapping(struct mm_struct* mm,
                                 unsigned long vaddr,
-                                unsigned long* paddr) {
-    unsigned long resolved = 0;
+                                unsigned long* paddr,
+                                unsigned long* mapping_sz) {
+    vm_search_result_t result = { 0, PAGE_SIZE };
     struct mm_walk walk = {
-        .pte_entry = vm_search_page_walk_pte_entry_callback,
-        .private = &(resolved),
+        .pmd_entry = vm_search_page_walk_pmd_entry_callback,
+        .private = &(result),
         .mm = mm
     };
 
     // Walk the page tables.  The walk handler modifies the
     // resolved variable if it finds the address.
     walk_page_range(vaddr & PAGE_MASK, (vaddr & PAGE_MASK) + PAGE_SIZE, &walk);
-    if(resolved == 0) {
+    if(result.resolved == 0) {
         return -1;
     }
 
     // Set the output
-    *paddr = resolved;
+    *paddr = result.resolved;
+    if(mapping_sz)
+        *mapping_sz = result.mapping_sz;
 
     return 0;
 }
 
+/**
+ * @brief Retrieve the physical address of the specified virtual address.
+ * @return -1 indicates failure.  Otherwise, 0 is returned.
+ */
+static int get_physical_address(struct mm_struct* mm, 
+                                unsigned long vaddr,
+                                unsigned long* paddr) {
+    return get_physical_mapping(mm,vaddr,paddr,NULL);
+}
+
 /**
  * Check to see if the specified virtual address has a 
  * corresponding physical address mapped to it.
  * @return 0 = no mapping, 1 = mapping present
  */
 static int is_vaddr_mapped(struct mm_struct* mm, unsigned long vaddr) {
-    unsigned long resolved = 0;
-    struct mm_walk walk = {
-        .pte_entry = vm_search_page_walk_pte_entry_callback,
-        .private = &(resolved),
-        .mm = mm
-    };
+    unsigned long paddr;
 
-    // Walk the page tables.  The walk handler will set the
-    // resolved variable if it finds the mapping.  
-    walk_page_range(vaddr & PAGE_MASK, ( vaddr & PAGE_MASK ) + PAGE_SIZE, &walk);
-    if(resolved != 0) {
-        return 1;
-    }
-    return 0;
+    return get_physical_address(mm,vaddr,&paddr) == 0;
+}
+
+/**
+ * Check to see if the specified virtual address is mapped by an entry
+ * that already allows writes, so that a write fault on it can neither
+ * break COW nor replace the zero page.
+ * @return 0 = no writable mapping, 1 = writable mapping present
+ * @prerequisite Caller must hold mm->mmap_sem
+ */
+static int is_vaddr_mapped_writable(struct mm_struct* mm, unsigned long vaddr) {
+    pgd_t* pgd;
+    pud_t* pud;
+    pmd_t* pmd;
+    pte_t* ptep;
+    pte_t pte;
+
+    pgd = pgd_offset(mm,vaddr);
+    if(pgd_none(*pgd) || pgd_bad(*pgd))
+        return 0;
+    pud = pud_offset(pgd,vaddr);
+    if(pud_none(*pud) || pud_bad(*pud))
+        return 0;
+    pmd = pmd_offset(pud,vaddr);
+    if(pmd_none(*pmd))
+        return 0;
+    if(pmd_trans_huge(*pmd))
+        return pmd_write(*pmd);
+    if(pmd_bad(*pmd))
+        return 0;
+    ptep = pte_offset_map(pmd,vaddr);
+    pte = *ptep;
+    pte_unmap(ptep);
+
+    return pte_present(pte) && pte_write(pte);
 }
 
 /**
@@ -1866,6 +3008,15 @@ static int break_cow(struct mm_struct *mm, struct vm_area_struct* vma, unsigned
         goto not_handled_unlock;
     }
 
+    // A writable huge page is not cow.  Otherwise the
+    // cow is broken on the 4K ptes below, so split it.
+    if(pmd_trans_huge(*pmd)) {
+        if(pmd_write(*pmd)) {
+            goto not_handled_unlock;
+        }
+        split_huge_page_pmd(mm,pmd);
+    }
+
     ptep = pte_offset_map(pmd,address);
     if(!ptep || !pte_present(*ptep) || pte_none(*ptep)) {
         pte_unmap(ptep);
@@ -1946,7 +3097,8 @@ int find_consecutive_physically_mapped_region(struct mm_struct* mm,
     unsigned long vaddr_curr = vaddr;
     unsigned long vaddr_next = vaddr;
     unsigned long paddr_next = NULL;
-    unsigned long paddr_start = NULL;
+    unsigned long vaddr_end;
+    unsigned long mapping_sz = PAGE_SIZE;
     size_t sz = 0;
 
     
@@ -1954,20 +3106,22 @@ int find_consecutive_physically_mapped_region(struct mm_struct* mm,
     if(br_cow) {
         break_cow(mm,vma,vaddr_curr);
     }
-    if(get_physical_address(mm,vaddr_curr,&paddr_curr) < 0) {
+    if(get_physical_mapping(mm,vaddr_curr,&paddr_curr,&mapping_sz) < 0) {
         return -1;
     }
-    paddr_start = paddr_curr;
-    *vaddr_mapping_start = vaddr_curr;
-    *paddr_mapping_start = paddr_curr;
-    
-    sz = PAGE_SIZE;
+
+    // Start with the whole page that maps vaddr, clipped
+    // to the vma.  For a huge page that is up to 2MB.
+    vaddr_curr = max(vaddr & ~(mapping_sz - 1), vma->vm_start);
+    vaddr_end = min((vaddr & ~(mapping_sz - 1)) + mapping_sz, vma->vm_end);
+    paddr_curr -= vaddr - vaddr_curr;
+    sz = vaddr_end - vaddr_curr;
 
     // seek up in memory
     // This stretches (sz) only while leaving
     // vaddr and paddr the samed
     while(1) {
-        vaddr_next += PAGE_SIZE;
+        vaddr_next = vaddr_curr + sz;
         
         // dont' go past the end of the vma
         if(vaddr_next >= vma->vm_end) {
@@ -1978,13 +3132,16 @@ int find_consecutive_physically_mapped_region(struct mm_struct* mm,
             break_cow(mm,vma,vaddr_next);
         }
 
-        if(get_physical_address(mm,vaddr_next,&paddr_next) < 0) {
+        if(get_physical_mapping(mm,vaddr_next,&paddr_next,&mapping_sz) < 0) {
             break;
         }
 
-        if(paddr_next == paddr_curr + PAGE_SIZE) {
-            sz += PAGE_SIZE;
-            paddr_curr = paddr_next;
+        if(paddr_next == paddr_curr + sz) {
+            // vaddr_next is always the first page of its
+            // mapping here, so take the rest of it in one step.
+            vaddr_end = min((vaddr_next & ~(mapping_sz - 1)) + mapping_sz,
+                            vma->vm_end);
+            sz = vaddr_end - vaddr_curr;
         } else {
             break;
         }
@@ -1992,29 +3149,29 @@ int find_consecutive_physically_mapped_region(struct mm_struct* mm,
 
     // seek down in memory
     // This stretches sz, and the paddr and vaddr's
-    vaddr_curr = vaddr;
-    paddr_curr = paddr_start; 
-    vaddr_next = vaddr_curr;
     while(1) {
-        vaddr_next -= PAGE_SIZE;
+        unsigned long vaddr_first;
 
         // don't go past the start of the vma
-        if(vaddr_next < vma->vm_start) {
+        if(vaddr_curr <= vma->vm_start) {
             break;
         }
+        vaddr_next = vaddr_curr - PAGE_SIZE;
 
         if(br_cow) {
             break_cow(mm,vma,vaddr_next);
         }
 
-        if(get_physical_address(mm,vaddr_next,&paddr_next) < 0) {
+        if(get_physical_mapping(mm,vaddr_next,&paddr_next,&mapping_sz) < 0) {
             break;
         }
 
         if(paddr_next == (paddr_curr - PAGE_SIZE)) {
-            vaddr_curr = vaddr_next;
-            paddr_curr = paddr_next;
-            sz += PAGE_SIZE;
+            // Take the whole mapping that ends at vaddr_curr.
+            vaddr_first = max(vaddr_next & ~(mapping_sz - 1), vma->vm_start);
+            paddr_curr = paddr_next - (vaddr_next - vaddr_first);
+            sz += vaddr_curr - vaddr_first;
+            vaddr_curr = vaddr_first;
         } else {
             break;
         }
@@ -2258,9 +3415,11 @@ int remap_pfn_range_remaining(struct mm_struct* mm,
                                   size_t sz,
                                   pgprot_t prot,
                                   int make_writable) {
-    unsigned long vaddr_curr;
-    unsigned long paddr_curr = paddr_start;
-    int ret = 0, val;
+    unsigned long vaddr_curr = vaddr_start;
+    unsigned long vaddr_end = vaddr_start + sz;
+    unsigned long run_start, run_end;
+    unsigned long paddr_run;
+    int ret = 0;
     int err;
 
     PSPRINTK("%s: entered vaddr_start{%lx}, paddr_start{%lx}, sz{%x}\n",
@@ -2269,36 +3428,48 @@ int remap_pfn_range_remaining(struct mm_struct* mm,
             paddr_start,
             sz);
 
-    for(vaddr_curr = vaddr_start; 
-        vaddr_curr < vaddr_start + sz; 
-        vaddr_curr += PAGE_SIZE) {
-        //if( !(val = is_vaddr_mapped(mm,vaddr_curr)) ) {
-        if(!is_vaddr_mapped(mm,vaddr_curr)) {
-            //PSPRINTK("%s: mapping vaddr{%lx} paddr{%lx}\n",__func__,vaddr_curr,paddr_curr);
-            // not mapped - map it
-            err = remap_pfn_range(vma,
-                                  vaddr_curr,
-                                  paddr_curr >> PAGE_SHIFT,
-                                  PAGE_SIZE,
-                                  prot);
-            if(err == 0) {
-                PSPRINTK("%s: succesfully mapped vaddr{%lx} to paddr{%lx}\n",
-                            __func__,vaddr_curr,paddr_curr);
-                if(make_writable && vma->vm_flags & VM_WRITE) {
+    while(vaddr_curr < vaddr_end) {
+        if(is_vaddr_mapped(mm,vaddr_curr)) {
+            vaddr_curr += PAGE_SIZE;
+            continue;
+        }
+
+        // Gather the run of unmapped pages starting here, so that
+        // it is installed with a single remap_pfn_range() call
+        // rather than one call per 4K page.
+        run_start = vaddr_curr;
+        run_end = vaddr_curr + PAGE_SIZE;
+        while(run_end < vaddr_end && !is_vaddr_mapped(mm,run_end)) {
+            run_end += PAGE_SIZE;
+        }
+
+        // remap_pfn_range() rewrites vm_pgoff when handed the whole
+        // vma, so never cover the whole of a multi page vma at once.
+        if(run_start == vma->vm_start && run_end == vma->vm_end &&
+           run_end - run_start > PAGE_SIZE) {
+            run_end -= PAGE_SIZE;
+        }
+
+        paddr_run = paddr_start + (run_start - vaddr_start);
+        err = remap_pfn_range(vma,
+                              run_start,
+                              paddr_run >> PAGE_SHIFT,
+                              run_end - run_start,
+                              prot);
+        if(err == 0) {
+            PSPRINTK("%s: succesfully mapped vaddr{%lx} to paddr{%lx} sz{%lx}\n",
+                        __func__,run_start,paddr_run,run_end - run_start);
+            if(make_writable && vma->vm_flags & VM_WRITE) {
+                for(vaddr_curr = run_start; vaddr_curr < run_end; vaddr_curr += PAGE_SIZE)
                     mk_page_writable(mm, vma, vaddr_curr);
-                }
-            } else {
-                printk(KERN_ALERT"%s: ERROR mapping %lx to %lx with err{%d}\n",
-                            __func__, vaddr_curr, paddr_curr, err);
             }
-
-            if( err != 0 ) ret = err;
         } else {
-  	        PSPRINTK("%s: is_vaddr_mapped %d, star:%lx end:%lx\n",
-	  	        __func__, val, vma->vm_start, vma->vm_end);
+            printk(KERN_ALERT"%s: ERROR mapping %lx to %lx with err{%d}\n",
+                        __func__, run_start, paddr_run, err);
+            ret = err;
         }
 
-        paddr_curr += PAGE_SIZE;
+        vaddr_curr = run_end;
     }
 
     PSPRINTK("%s: exiting\n",__func__);
@@ -3432,6 +4603,7 @@ static int count_remote_thread_members(int exclude_t_home_cpu,
     int ret = -1;
     int perf = -1;
     unsigned long lockflags;
+    unsigned long long wait_start;
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long end_time;
     unsigned long long total_time;
@@ -3477,6 +4649,8 @@ static int count_remote_thread_members(int exclude_t_home_cpu,
         objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
         i = objPtr->_data._processor;
 #endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i)) continue;
         // Send the request to this cpu.
         s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&request));
         if(!s) {
@@ -3489,9 +4663,10 @@ static int count_remote_thread_members(int exclude_t_home_cpu,
     PSPRINTK("%s: waiting on %d responses\n",__func__,data->expected_responses);
 
     // Wait for all cpus to respond.
-    while(data->expected_responses != data->responses) {
-        schedule();
-    }
+    wait_start = native_read_tsc();
+    wait_event(_count_remote_tmembers_wq,
+               data->expected_responses == data->responses);
+    process_server_track_wait(PS_WAIT_THREAD_COUNT,wait_start);
 
     // OK, all responses are in, we can proceed.
     ret = data->count;
@@ -3642,6 +4817,11 @@ found:
         goto loop;
     }
 
+    vma_miss_cache_destroy(w->tgroup_home_cpu,w->tgroup_home_id);
+    page_lock_stats_destroy(w->tgroup_home_cpu,w->tgroup_home_id);
+    mprotect_batch_drop(w->tgroup_home_cpu,w->tgroup_home_id);
+    lazy_cow_destroy(w->tgroup_home_cpu,w->tgroup_home_id);
+
     kfree(work);
 
     PERF_MEASURE_STOP(&perf_process_tgroup_closed_item," ",perf);
@@ -3671,10 +4851,6 @@ void process_mapping_request(struct work_struct* work) {
     struct mm_struct* mm = NULL;
     unsigned long address = w->address;
     unsigned long resolved = 0;
-    struct mm_walk walk = {
-        .pte_entry = vm_search_page_walk_pte_entry_callback,
-        .private = &(resolved)
-    };
     char *plpath = NULL, *lpath = NULL;
     int used_saved_mm = 0, found_vma = 1, found_pte = 1; 
     int i;
@@ -3738,18 +4914,19 @@ task_mm_search_exit:
 
         PS_SPIN_UNLOCK(&_saved_mm_head_lock);
     }
-     response = kmalloc(sizeof(mapping_response_t), GFP_ATOMIC); //TODO convert to alloc_cache
+    response = ps_cache_alloc(PS_CACHE_MAPPING_RESPONSE,GFP_ATOMIC);
     if (!response) {
       printk(KERN_ALERT"can not kmalloc mapping_response_t area from{%d} address{%lx} cpu{%d} id{%d}\n",
 	      w->from_cpu, w->address, w->tgroup_home_cpu, w->tgroup_home_id);
       goto err_work;
     }
-    lpath = kmalloc(POPCORN_MAX_PATH, GFP_ATOMIC); //TODO convert to alloc_cache
+    lpath = ps_cache_alloc(PS_CACHE_PATH,GFP_ATOMIC);
     if (!lpath) {
       printk(KERN_ALERT"can not kmalloc lpath area from{%d} address{%lx} cpu{%d} id{%d}\n",
 	      w->from_cpu, w->address, w->tgroup_home_cpu, w->tgroup_home_id);
       goto err_response;
     }
+    response->file_clean = 0;
     
     // OK, if mm was found, look up the mapping.
     if(mm) {
@@ -3778,13 +4955,20 @@ changed_can_be_cow:
             }
         }
 
-        walk.mm = mm;
-        walk_page_range(address & PAGE_MASK, 
-                (address & PAGE_MASK) + PAGE_SIZE, &walk);
+        if(get_physical_address(mm,address,&resolved) < 0) {
+            resolved = 0;
+        }
 
         if(vma && resolved != 0) {
             PSPRINTK("mapping found! %lx for vaddr %lx\n",resolved,
                     address & PAGE_MASK);
+            // The other kernel will write to these pages directly,
+            // so children still sharing them must copy them now.
+            if(can_be_cow) {
+                lazy_cow_note_served(w->tgroup_home_cpu,w->tgroup_home_id,
+                                     vma->vm_start,vma->vm_end);
+            }
+
             /*
              * Find regions of consecutive physical memory
              * in this vma, including the faulting address
@@ -3825,6 +5009,12 @@ changed_can_be_cow:
             response->vaddr_size = vma->vm_end - vma->vm_start;
             response->prot = vma->vm_page_prot;
             response->vm_flags = vma->vm_flags;
+            // Pages pulled from yet another kernel cannot be vouched for.
+            if(is_clean_file_vma(vma) && !(vma->vm_flags & VM_PFNMAP)) {
+                response->file_clean = 1;
+                response->pgoff = vma->vm_pgoff;
+                get_file_identity(vma->vm_file,&response->file_id);
+            }
             if(vma->vm_file == NULL || !w->need_vma) {
                  response->path[0] = '\0';
             } else {    
@@ -3931,9 +5121,9 @@ changed_can_be_cow:
 
     }
     
-    kfree(lpath);
+    ps_cache_free(PS_CACHE_PATH,lpath);
 err_response:
-    kfree(response);
+    ps_cache_free(PS_CACHE_MAPPING_RESPONSE,response);
 err_work:
     // proc
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
@@ -3941,7 +5131,7 @@ err_work:
             mapping_response_send_time_end - mapping_response_send_time_start);
 #endif
 
-    kfree(work);
+    ps_cache_free(PS_CACHE_MAPPING_REQUEST_WORK,work);
 
     // Perf stop
     if(used_saved_mm && found_vma && found_pte) {
@@ -3989,8 +5179,6 @@ err_work:
     return;
 }
 
-unsigned long long perf_aa, perf_bb, perf_cc, perf_dd, perf_ee;
-
 /**
  * @brief Process notification that a task has exited.  This function
  * sets the "return disposition" of the task, then wakes the task.
@@ -4294,6 +5482,8 @@ void process_mprotect_item(struct work_struct* work) {
 done:
     read_unlock(&tasklist_lock);
 
+    file_clean_cache_invalidate(tgroup_home_cpu,tgroup_home_id,start,len);
+
       if(mm_to_munmap) {
         do_mprotect(task,mm_to_munmap,start,len,prot,0);
         goto early_exit;
@@ -4401,6 +5591,7 @@ void process_back_migration(struct work_struct* work) {
     unsigned char found = 0;
     int perf = -1;
     struct pt_regs* regs = NULL;
+    unsigned long long import_start = native_read_tsc();
 
     perf = PERF_MEASURE_START(&perf_process_back_migration);
 
@@ -4469,6 +5660,15 @@ search_exit:
 
     // Release the task
     wake_up_process(task);
+    migration_phase(PS_MIGRATION_USER_RESUMED,w->placeholder_pid,
+                    w->from_cpu,w->migration_start);
+
+    // Pair back up with the placeholder we just left behind.
+    notify_process_pairing(task->pid,
+            w->placeholder_pid,
+            w->from_cpu,
+            import_start,
+            native_read_tsc());
     
 exit:
     kfree(work);
@@ -4481,9 +5681,10 @@ void register_lamport_barrier_request_light(int tgroup_home_cpu,
                                             unsigned long address,
                                             unsigned long long timestamp,
                                             int from_cpu) {
-    lamport_barrier_entry_t* entry = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+    lamport_barrier_entry_t* entry = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
     lamport_barrier_queue_t* queue = NULL;
     lamport_barrier_queue_t* heavy_queue = NULL;
+    BUG_ON(!entry);
     entry->timestamp = timestamp;
     entry->responses = 0;
     entry->is_heavy = 0;
@@ -4501,7 +5702,8 @@ void register_lamport_barrier_request_light(int tgroup_home_cpu,
     // If we cannot find one, make one
     if(!queue) {
         PSPRINTK("%s: Queue not found, creating one\n",__func__);
-        queue = kmalloc(sizeof(lamport_barrier_queue_t),GFP_ATOMIC);
+        queue = ps_cache_alloc(PS_CACHE_LAMPORT_QUEUE,GFP_ATOMIC);
+        BUG_ON(!queue);
         queue->tgroup_home_cpu = tgroup_home_cpu;
         queue->tgroup_home_id  = tgroup_home_id;
         queue->address = address;
@@ -4520,7 +5722,8 @@ void register_lamport_barrier_request_light(int tgroup_home_cpu,
             lamport_barrier_entry_t* curr = heavy_queue->queue;
             PSPRINTK("%s: found heavy queue\n",__func__);
             while(curr) {
-                lamport_barrier_entry_t* e = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+                lamport_barrier_entry_t* e = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+                BUG_ON(!e);
                 PSPRINTK("%s: adding entry from heavy queue to queue(addr{%lx}) ts{%llx}\n",
                         __func__,address,curr->timestamp);
                 e->timestamp = curr->timestamp;
@@ -4561,8 +5764,9 @@ void register_lamport_barrier_request_heavy(int tgroup_home_cpu,
     
     PSPRINTK("%s: ts{%llx},cpu{%d}\n",__func__,timestamp,from_cpu);
 
-    lamport_barrier_entry_t* entry = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+    lamport_barrier_entry_t* entry = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
     lamport_barrier_queue_t* queue = NULL;
+    BUG_ON(!entry);
     entry->timestamp = timestamp;
     entry->responses = 0;
     entry->is_heavy = 1;
@@ -4579,7 +5783,8 @@ void register_lamport_barrier_request_heavy(int tgroup_home_cpu,
     // If we cannot find one, make one
     if(!queue) {
         PSPRINTK("%s: Adding a heavy queue\n",__func__);
-        queue = kmalloc(sizeof(lamport_barrier_queue_t),GFP_ATOMIC);
+        queue = ps_cache_alloc(PS_CACHE_LAMPORT_QUEUE,GFP_ATOMIC);
+        BUG_ON(!queue);
         queue->tgroup_home_cpu = tgroup_home_cpu;
         queue->tgroup_home_id  = tgroup_home_id;
         queue->address = 0;
@@ -4604,7 +5809,8 @@ void register_lamport_barrier_request_heavy(int tgroup_home_cpu,
             PSPRINTK("%s: adding heavy entry to addr{%lx}\n",
                     __func__,queue_curr->address);
 
-            lamport_barrier_entry_t* e = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+            lamport_barrier_entry_t* e = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+            BUG_ON(!e);
             e->timestamp = entry->timestamp;
             e->responses = entry->responses;
             e->expected_responses = entry->expected_responses;
@@ -4678,7 +5884,8 @@ void process_lamport_barrier_request(struct work_struct* work) {
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
 
     // Reply
-    response = kmalloc(sizeof(lamport_barrier_response_t),GFP_KERNEL);
+    response = ps_cache_alloc(PS_CACHE_LAMPORT_RESPONSE,GFP_KERNEL);
+    BUG_ON(!response);
     response->header.type = PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_RESPONSE;
     response->header.prio = PCN_KMSG_PRIO_NORMAL;
     response->tgroup_home_cpu = w->tgroup_home_cpu;
@@ -4687,9 +5894,9 @@ void process_lamport_barrier_request(struct work_struct* work) {
     response->is_heavy = w->is_heavy;
     response->timestamp = w->timestamp;
     pcn_kmsg_send(w->from_cpu,(struct pcn_kmsg_message*)response);
-    kfree(response);
+    ps_cache_free(PS_CACHE_LAMPORT_RESPONSE,response);
     
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_REQUEST_WORK,work);
 }
 
 /**
@@ -4697,7 +5904,6 @@ void process_lamport_barrier_request(struct work_struct* work) {
  */
 void process_lamport_barrier_request_range(struct work_struct* work) {
     lamport_barrier_request_range_work_t* w = (lamport_barrier_request_range_work_t*)work;
-    lamport_barrier_response_range_t* response = NULL;
     int i;
 
     PSPRINTK("%s: timestamp{%llx},cpu{%d},is_heavy{%d}\n",__func__,
@@ -4723,8 +5929,39 @@ void process_lamport_barrier_request_range(struct work_struct* work) {
     }
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
 
+    // Whoever takes the heavy lock is about to change the vma layout,
+    // so it must not get it before our queued protection changes are
+    // applied everywhere.  Flushing blocks, so reply from the flush
+    // workqueue.  A fault only needs them soon.
+    if(w->is_heavy) {
+        if(mprotect_batch_pending(w->tgroup_home_cpu,w->tgroup_home_id,0,0)) {
+            INIT_WORK( (struct work_struct*)work,
+                       send_lamport_barrier_response_range);
+            queue_work(mprotect_batch_wq, (struct work_struct*)work);
+            return;
+        }
+    } else if(mprotect_batch_pending(w->tgroup_home_cpu,w->tgroup_home_id,
+                                     w->address,w->sz)) {
+        mprotect_batch_kick();
+    }
+
+    send_lamport_barrier_response_range(work);
+}
+
+/**
+ * @brief Reply to a lamport barrier range request, once any queued
+ * protection changes of its thread group are flushed.
+ */
+static void send_lamport_barrier_response_range(struct work_struct* work) {
+    lamport_barrier_request_range_work_t* w = (lamport_barrier_request_range_work_t*)work;
+    lamport_barrier_response_range_t* response = NULL;
+
+    if(w->is_heavy)
+        mprotect_batch_flush(w->tgroup_home_cpu,w->tgroup_home_id);
+
     // Reply
-    response = kmalloc(sizeof(lamport_barrier_response_range_t),GFP_KERNEL);
+    response = ps_cache_alloc(PS_CACHE_LAMPORT_RESPONSE_RANGE,GFP_KERNEL);
+    BUG_ON(!response);
     response->header.type = PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_RESPONSE_RANGE;
     response->header.prio = PCN_KMSG_PRIO_NORMAL;
     response->tgroup_home_cpu = w->tgroup_home_cpu;
@@ -4734,11 +5971,11 @@ void process_lamport_barrier_request_range(struct work_struct* work) {
     response->sz = w->sz;
     response->timestamp = w->timestamp;
     pcn_kmsg_send(w->from_cpu,(struct pcn_kmsg_message*)response);
-    kfree(response);
+    ps_cache_free(PS_CACHE_LAMPORT_RESPONSE_RANGE,response);
    
     PSPRINTK("%s: exiting\n",__func__);
 
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_REQUEST_RANGE_WORK,work);
 }
 /**
  * 
@@ -4844,9 +6081,10 @@ void process_lamport_barrier_response(struct work_struct* work) {
                                       w->timestamp,
                                       w->is_heavy);
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+    wake_up(&_lamport_barrier_wq);
 
 
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_RESPONSE_WORK,work);
 }
 
 /**
@@ -4876,10 +6114,11 @@ void process_lamport_barrier_response_range(struct work_struct* work) {
         }
     }
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+    wake_up(&_lamport_barrier_wq);
 
     PSPRINTK("%s: exiting\n",__func__);
     
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_RESPONSE_RANGE_WORK,work);
 }
 
 /**
@@ -4908,7 +6147,7 @@ void register_lamport_barrier_release_light(int tgroup_home_cpu,
                 PSPRINTK("%s: entry found, ts{%llx}\n",
                         __func__,curr->timestamp);
                 remove_data_entry_from(curr,(data_header_t**)&queue->queue);
-                kfree(curr);
+                ps_cache_free(PS_CACHE_LAMPORT_ENTRY,curr);
                 break;
             }
             curr = curr->header.next;
@@ -4916,7 +6155,7 @@ void register_lamport_barrier_release_light(int tgroup_home_cpu,
         if(!queue->queue) {
             PSPRINTK("%s: queue empty, removing\n",__func__);
             remove_data_entry_from(queue,&_lamport_barrier_queue_head);
-            kfree(queue);
+            ps_cache_free(PS_CACHE_LAMPORT_QUEUE,queue);
         }
     }
     PSPRINTK("%s: exiting\n",__func__);
@@ -4959,7 +6198,7 @@ void register_lamport_barrier_release_heavy(int tgroup_home_cpu,
                     PSPRINTK("%s: removing heavy entry ts{%llx}\n",
                             __func__,entry_curr->timestamp);
                     remove_data_entry_from(entry_curr,(data_header_t**)&queue->queue); 
-                    kfree(entry_curr);
+                    ps_cache_free(PS_CACHE_LAMPORT_ENTRY,entry_curr);
                 }
                 entry_curr = next_entry;
 
@@ -4968,7 +6207,7 @@ void register_lamport_barrier_release_heavy(int tgroup_home_cpu,
             if(!queue->queue) {
                 PSPRINTK("%s: queue is now empty, freeing it\n",__func__);
                 remove_data_entry_from(queue,&_lamport_barrier_queue_head);
-                kfree(queue);
+                ps_cache_free(PS_CACHE_LAMPORT_QUEUE,queue);
             }
 
         }
@@ -5014,8 +6253,9 @@ void process_lamport_barrier_release(struct work_struct* work) {
                                      w->from_cpu,
                                      w->is_heavy);
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+    wake_up(&_lamport_barrier_wq);
 
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_RELEASE_WORK,work);
 }
 
 /**
@@ -5048,10 +6288,11 @@ void process_lamport_barrier_release_range(struct work_struct* work) {
         }
     }
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+    wake_up(&_lamport_barrier_wq);
 
     PSPRINTK("%s: exiting\n",__func__);
 
-    kfree(work);
+    ps_cache_free(PS_CACHE_LAMPORT_RELEASE_RANGE_WORK,work);
 }
 
 /**
@@ -5119,6 +6360,8 @@ static int handle_remote_thread_count_response(struct pcn_kmsg_message* inc_msg)
     data->responses++;
     spin_unlock_irqrestore(&data->lock,lockflags);
 
+    wake_up(&_count_remote_tmembers_wq);
+
 error_exit:
     pcn_kmsg_free_msg(inc_msg);
 
@@ -5185,6 +6428,8 @@ static int handle_munmap_response(struct pcn_kmsg_message* inc_msg) {
     data->responses++;
     spin_unlock_irqrestore(&data->lock,lockflags);
 
+    wake_up(&_munmap_wq);
+
 exit_error:
 
     pcn_kmsg_free_msg(inc_msg);
@@ -5206,6 +6451,11 @@ static int handle_munmap_request(struct pcn_kmsg_message* inc_msg) {
     
     int perf = PERF_MEASURE_START(&perf_handle_munmap_request);
 
+    // The range is about to change on the sender, possibly to be
+    // mapped, so stop trusting misses there right away.
+    vma_miss_cache_invalidate(msg->tgroup_home_cpu,msg->tgroup_home_id,
+                              msg->vaddr_start,msg->vaddr_size,0);
+
     work = kmalloc(sizeof(munmap_request_work_t),GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_munmap_request  );
@@ -5255,6 +6505,8 @@ static int handle_mprotect_response(struct pcn_kmsg_message* inc_msg) {
     data->responses++;
     PS_SPIN_UNLOCK(&data->lock);
 
+    wake_up(&_mprotect_wq);
+
     pcn_kmsg_free_msg(inc_msg);
 
     PERF_MEASURE_STOP(&perf_handle_mprotect_response," ",perf);
@@ -5350,6 +6602,9 @@ static int handle_nonpresent_mapping_response(struct pcn_kmsg_message* inc_msg)
 
     data->responses++;
     spin_unlock_irqrestore(&data->lock,lockflags1);
+
+    // The requester cannot free data while we hold the list lock.
+    wake_up(&data->wait_queue);
 exit:
 
     spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags2);
@@ -5526,6 +6781,8 @@ static int handle_mapping_response(struct pcn_kmsg_message* inc_msg) {
         }
         strcpy(data->path,msg->path);
         data->pgoff = msg->pgoff;
+        data->file_clean = msg->file_clean;
+        data->file_id = msg->file_id;
 
     } else {
         PSPRINTK("received negative search result\n");
@@ -5550,6 +6807,9 @@ out:
 
     spin_unlock_irqrestore(&data->lock,lockflags);
 
+    // The requester cannot free data while we hold the list lock.
+    wake_up(&data->wait_queue);
+
 out_err:
 
     spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags2);
@@ -5575,7 +6835,7 @@ static int handle_mapping_request(struct pcn_kmsg_message* inc_msg) {
 
     int perf = PERF_MEASURE_START(&perf_handle_mapping_request);
 
-    work = kmalloc(sizeof(mapping_request_work_t),GFP_ATOMIC);
+    work = ps_cache_alloc(PS_CACHE_MAPPING_REQUEST_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_mapping_request );
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -5846,6 +7106,9 @@ static int handle_process_pairing_request(struct pcn_kmsg_message* inc_msg) {
 done:
     read_unlock(&tasklist_lock);
 
+    // The delegate is about to run, tell whoever asked for this migration.
+    migration_notify_finish(msg->your_pid,msg->import_start,msg->import_end,1);
+
     pcn_kmsg_free_msg(inc_msg);
 
     PERF_MEASURE_STOP(&perf_handle_process_pairing_request," ",perf);
@@ -5868,7 +7131,8 @@ static int handle_clone_request(struct pcn_kmsg_message* inc_msg) {
 
     int perf = PERF_MEASURE_START(&perf_handle_clone_request);
 
-    perf_cc = native_read_tsc();
+    migration_phase(PS_MIGRATION_REQUEST_RECEIVED,request->placeholder_pid,
+                    source_cpu,request->migration_start);
 
     printk("%s: entered\n",__func__);
     
@@ -5917,11 +7181,14 @@ static int handle_clone_request(struct pcn_kmsg_message* inc_msg) {
     clone_data->def_flags = request->def_flags;
     clone_data->personality = request->personality;
     clone_data->vma_list = NULL;
+    clone_data->gang = NULL;
     clone_data->tgroup_home_cpu = request->tgroup_home_cpu;
     clone_data->tgroup_home_id = request->tgroup_home_id;
     clone_data->t_home_cpu = request->t_home_cpu;
     clone_data->t_home_id = request->t_home_id;
     clone_data->previous_cpus = request->previous_cpus;
+    clone_data->known_cpu_with_tgroup_mm = request->known_cpu_with_tgroup_mm;
+    clone_data->migration_start = request->migration_start;
     clone_data->prio = request->prio;
     clone_data->static_prio = request->static_prio;
     clone_data->normal_prio = request->normal_prio;
@@ -5977,8 +7244,6 @@ static int handle_clone_request(struct pcn_kmsg_message* inc_msg) {
     spin_unlock_irqrestore(&_data_head_lock,lockflags);
 #endif
 
-perf_dd = native_read_tsc();
-
     {
 #ifdef PROCESS_SERVER_USE_KMOD
     struct subprocess_info* sub_info;
@@ -5991,7 +7256,6 @@ perf_dd = native_read_tsc();
     
     add_data_entry(clone_data);
     
-    perf_aa = native_read_tsc();
     sub_info = call_usermodehelper_setup( clone_data->exe_path /*argv[0]*/, 
             argv, envp, 
             GFP_ATOMIC );
@@ -6018,7 +7282,6 @@ perf_dd = native_read_tsc();
      * Spin up the new process.
      */
     call_usermodehelper_exec(sub_info, UMH_NO_WAIT);
-    perf_bb = native_read_tsc();
 #else
     import_task_work_t* work;
     work = kmalloc(sizeof(import_task_work_t),GFP_ATOMIC);
@@ -6033,8 +7296,6 @@ perf_dd = native_read_tsc();
 
     pcn_kmsg_free_msg(inc_msg);
 
-    perf_ee = native_read_tsc();
-
     PERF_MEASURE_STOP(&perf_handle_clone_request," ",perf);
     return 0;
 }
@@ -6046,6 +7307,9 @@ static int handle_back_migration(struct pcn_kmsg_message* inc_msg) {
     back_migration_t* msg = (back_migration_t*)inc_msg;
     back_migration_work_t* work;
 
+    migration_phase(PS_MIGRATION_REQUEST_RECEIVED,msg->placeholder_pid,
+                    msg->header.from_cpu,msg->migration_start);
+
     work = kmalloc(sizeof(back_migration_work_t),GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_back_migration);
@@ -6053,7 +7317,10 @@ static int handle_back_migration(struct pcn_kmsg_message* inc_msg) {
         work->tgroup_home_id  = msg->tgroup_home_id;
         work->t_home_cpu      = msg->t_home_cpu;
         work->t_home_id       = msg->t_home_id;
+        work->placeholder_pid = msg->placeholder_pid;
+        work->from_cpu        = msg->header.from_cpu;
         work->previous_cpus   = msg->previous_cpus;
+        work->migration_start = msg->migration_start;
         work->thread_fs       = msg->thread_fs;
         work->thread_gs       = msg->thread_gs;
         work->thread_usersp   = msg->thread_usersp;
@@ -6083,7 +7350,9 @@ static int handle_lamport_barrier_request(struct pcn_kmsg_message* inc_msg) {
     lamport_barrier_request_t* msg = (lamport_barrier_request_t*)inc_msg;
     lamport_barrier_request_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_request_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_REQUEST_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_request);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6104,7 +7373,9 @@ static int handle_lamport_barrier_response(struct pcn_kmsg_message* inc_msg) {
     lamport_barrier_response_t* msg = (lamport_barrier_response_t*)inc_msg;
     lamport_barrier_response_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_response_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_RESPONSE_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_response);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6125,7 +7396,9 @@ static int handle_lamport_barrier_release(struct pcn_kmsg_message* inc_msg) {
     lamport_barrier_release_t* msg = (lamport_barrier_release_t*)inc_msg;
     lamport_barrier_release_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_release_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_RELEASE_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_release);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6146,7 +7419,9 @@ static int handle_lamport_barrier_request_range(struct pcn_kmsg_message* inc_msg
     lamport_barrier_request_range_t* msg = (lamport_barrier_request_range_t*)inc_msg;
     lamport_barrier_request_range_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_request_range_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_REQUEST_RANGE_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_request_range);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6168,7 +7443,9 @@ static int handle_lamport_barrier_response_range(struct pcn_kmsg_message* inc_ms
     lamport_barrier_response_range_t* msg = (lamport_barrier_response_range_t*)inc_msg;
     lamport_barrier_response_range_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_response_range_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_RESPONSE_RANGE_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_response_range);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6190,7 +7467,9 @@ static int handle_lamport_barrier_release_range(struct pcn_kmsg_message* inc_msg
     lamport_barrier_release_range_t* msg = (lamport_barrier_release_range_t*)inc_msg;
     lamport_barrier_release_range_work_t* work;
 
-    work = kmalloc(sizeof(lamport_barrier_release_range_work_t),GFP_ATOMIC);
+    lamport_clock_observe(msg->timestamp);
+
+    work = ps_cache_alloc(PS_CACHE_LAMPORT_RELEASE_RANGE_WORK,GFP_ATOMIC);
     if(work) {
         INIT_WORK( (struct work_struct*)work, process_lamport_barrier_release_range);
         work->tgroup_home_cpu = msg->tgroup_home_cpu;
@@ -6215,7 +7494,7 @@ static int handle_get_counter_phys_request(struct pcn_kmsg_message* inc_msg) {
     get_counter_phys_response_t resp;
     resp.header.type = PCN_KMSG_TYPE_PROC_SRV_GET_COUNTER_PHYS_RESPONSE;
     resp.header.prio = PCN_KMSG_PRIO_NORMAL;
-    resp.resp = virt_to_phys(ts_counter);
+    resp.resp = virt_to_phys(_shared_page);
     pcn_kmsg_send(inc_msg->hdr.from_cpu,(struct pcn_kmsg_message*)&resp);
     pcn_kmsg_free_msg(inc_msg);
     return 0;
@@ -6230,6 +7509,7 @@ static int handle_get_counter_phys_response(struct pcn_kmsg_message* inc_msg) {
     if(get_counter_phys_data) {
         get_counter_phys_data->resp = msg->resp;
         get_counter_phys_data->response_received = 1;
+        wake_up(&_get_counter_phys_wq);
     }
 
     pcn_kmsg_free_msg(inc_msg);
@@ -6266,6 +7546,7 @@ int process_server_import_address_space(unsigned long* ip,
 #ifndef PROCESS_SERVER_USE_KMOD
     struct cred* new_cred = NULL;
 #endif
+    unsigned long long import_start = native_read_tsc();
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long end_time;
     unsigned long long total_time;
@@ -6273,8 +7554,6 @@ int process_server_import_address_space(unsigned long* ip,
     unsigned long long start_time = native_read_tsc();
 #endif
 
-    perf_a = native_read_tsc();
-    
     printk("import address space\n");
     
     // Verify that we're a delegated task // deadlock.
@@ -6299,7 +7578,8 @@ int process_server_import_address_space(unsigned long* ip,
     do_time_measurement = 1;
 #endif
 
-    perf_b = native_read_tsc();    
+    migration_phase(PS_MIGRATION_IMPORT_STARTED,clone_data->placeholder_pid,
+                    clone_data->placeholder_cpu,clone_data->migration_start);
     
     // Search for existing thread members to share an mm with.
     // Immediately set tgroup_home_<foo> under lock to keep 
@@ -6308,10 +7588,19 @@ int process_server_import_address_space(unsigned long* ip,
     // the same thread group.
     PS_DOWN_WRITE(&_import_sem);
 
-    thread_mm = find_thread_mm(clone_data->tgroup_home_cpu,
-                               clone_data->tgroup_home_id,
-                               &used_saved_mm,
-                               &thread_task);
+    if(clone_data->gang && clone_data->gang->task &&
+       clone_data->gang->task->mm &&
+       !(clone_data->gang->task->flags & PF_EXITING)) {
+        // Another member of this gang already imported the mm,
+        // no need to look for it.
+        thread_task = clone_data->gang->task;
+        thread_mm = thread_task->mm;
+    } else {
+        thread_mm = find_thread_mm(clone_data->tgroup_home_cpu,
+                                   clone_data->tgroup_home_id,
+                                   &used_saved_mm,
+                                   &thread_task);
+    }
 
 
     current->prev_cpu = clone_data->placeholder_cpu;
@@ -6404,8 +7693,6 @@ int process_server_import_address_space(unsigned long* ip,
         }
 #endif
 
-        perf_c = native_read_tsc();    
-
         // Import address space
 #if !(COPY_WHOLE_VM_WITH_MIGRATION)
         {
@@ -6622,7 +7909,8 @@ int process_server_import_address_space(unsigned long* ip,
     }
 
 
-    perf_d = native_read_tsc();
+    migration_phase(PS_MIGRATION_MM_ATTACHED,clone_data->placeholder_pid,
+                    clone_data->placeholder_cpu,clone_data->migration_start);
 
     // install memory information
     current->mm->start_stack = clone_data->stack_start;
@@ -6778,30 +8066,51 @@ int process_server_import_address_space(unsigned long* ip,
     current->clone_data = clone_data;
 #endif
 
+    // The sender holds the mm, and so does every kernel it knew of.
+    // Fold in what the local thread group, if any, already learned.
+    set_cpu_has_known_tgroup_mm(current,clone_data->placeholder_cpu);
+    merge_known_tgroup_mm(current,clone_data->known_cpu_with_tgroup_mm);
+    if(thread_task)
+        merge_known_tgroup_mm(current,thread_task->known_cpu_with_tgroup_mm);
+
+    // Let the rest of the gang adopt this mm.
+    if(clone_data->gang) {
+        gang_import_data_t* gang = clone_data->gang;
+        if(!gang->task) {
+            get_task_struct(current);
+            gang->task = current;
+        }
+        clone_data->gang = NULL;
+        gang_import_put(gang);
+    }
+
     PS_UP_WRITE(&_import_sem);
 
-    process_server_notify_delegated_subprocess_starting(current->pid,
+    // No live thread of this group was here, so nobody has been
+    // sending this kernel mm traffic.  Announce the mm before running.
+    if(!thread_task)
+        tgroup_mm_join(current);
+
+    migration_phase(PS_MIGRATION_USER_RESUMED,clone_data->placeholder_pid,
+                    clone_data->placeholder_cpu,clone_data->migration_start);
+
+    notify_process_pairing(current->pid,
             clone_data->placeholder_pid,
-            clone_data->requesting_cpu);
+            clone_data->requesting_cpu,
+            import_start,
+            native_read_tsc());
 
     //dump_task(current,NULL,0);
 
     PERF_MEASURE_STOP(&perf_process_server_import_address_space, " ",perf);
 
 
-    perf_e = native_read_tsc();
-
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     end_time = native_read_tsc();
     total_time = end_time - start_time;
     PS_PROC_DATA_TRACK(PS_PROC_DATA_IMPORT_TASK_TIME,total_time);
 #endif
 
-    printk("%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu (%d)\n",
-            __func__,
-            perf_aa, perf_bb, perf_cc, perf_dd, perf_ee,
-            perf_a, perf_b, perf_c, perf_d, perf_e, current->t_home_id);
-
     return 0;
 }
 
@@ -6817,12 +8126,149 @@ static void process_import_task(struct work_struct* work) {
     kernel_thread(call_import_task, data, SIGCHLD);
 }
 
-long sys_process_server_import_task(void *info /*name*/,
-        const char* argv,
-        const char* envp,
-        struct pt_regs* regs) {
-    clone_data_t* clone_data = (clone_data_t*)info;
-    unsigned long ip, sp;
+/**
+ * @brief Drop a gang member's reference to the shared import data.
+ */
+static void gang_import_put(gang_import_data_t* gang) {
+    if(atomic_dec_and_test(&gang->refs)) {
+        if(gang->task)
+            put_task_struct(gang->task);
+        kfree(gang);
+    }
+}
+
+/**
+ * @brief Bottom half of a gang migration.  Builds clone data for each
+ * member and starts its import, all sharing one gang_import_data_t.
+ */
+static void process_gang_migration(struct work_struct* work) {
+    gang_migration_work_t* w = (gang_migration_work_t*)work;
+    gang_migration_t* msg = w->msg;
+    unsigned int source_cpu = msg->header.from_cpu;
+    gang_import_data_t* gang = NULL;
+    clone_data_t* clone_data = NULL;
+    gang_thread_t* t = NULL;
+    int i, cnt;
+
+    gang = kmalloc(sizeof(gang_import_data_t),GFP_KERNEL);
+    if(!gang) {
+        printk("%s: ERROR kmalloc gang import data\n",__func__);
+        goto exit;
+    }
+    atomic_set(&gang->refs,msg->nr_threads);
+    gang->task = NULL;
+
+    for(i = 0; i < msg->nr_threads; i++) {
+        t = &msg->threads[i];
+
+        clone_data = kmalloc(sizeof(clone_data_t),GFP_KERNEL);
+        if(!clone_data) {
+            printk("%s: ERROR kmalloc clone data for pid{%d}\n",
+                    __func__,t->placeholder_pid);
+            gang_import_put(gang);
+            continue;
+        }
+
+        clone_data->header.data_type = PROCESS_SERVER_CLONE_DATA_TYPE;
+        clone_data->lock = __SPIN_LOCK_UNLOCKED(&clone_data->lock);
+        clone_data->requesting_cpu = source_cpu;
+        clone_data->placeholder_cpu = source_cpu;
+        clone_data->placeholder_tgid = msg->placeholder_tgid;
+        clone_data->tgroup_home_cpu = msg->tgroup_home_cpu;
+        clone_data->tgroup_home_id = msg->tgroup_home_id;
+        clone_data->clone_flags = msg->clone_flags;
+        clone_data->stack_start = msg->stack_start;
+        clone_data->stack_ptr = msg->stack_start;
+        clone_data->arg_start = msg->arg_start;
+        clone_data->arg_end = msg->arg_end;
+        clone_data->env_start = msg->env_start;
+        clone_data->env_end = msg->env_end;
+        clone_data->heap_start = msg->heap_start;
+        clone_data->heap_end = msg->heap_end;
+        clone_data->data_start = msg->data_start;
+        clone_data->data_end = msg->data_end;
+        clone_data->def_flags = msg->def_flags;
+        clone_data->personality = msg->personality;
+        clone_data->known_cpu_with_tgroup_mm = msg->known_cpu_with_tgroup_mm;
+        memcpy(&clone_data->exe_path, &msg->exe_path, sizeof(msg->exe_path));
+        for(cnt = 0; cnt < _NSIG; cnt++)
+            clone_data->action[cnt] = msg->action[cnt];
+
+        clone_data->clone_request_id = t->clone_request_id;
+        clone_data->placeholder_pid = t->placeholder_pid;
+        clone_data->t_home_cpu = t->t_home_cpu;
+        clone_data->t_home_id = t->t_home_id;
+        clone_data->origin_pid = t->origin_pid;
+        clone_data->prio = t->prio;
+        clone_data->static_prio = t->static_prio;
+        clone_data->normal_prio = t->normal_prio;
+        clone_data->rt_priority = t->rt_priority;
+        clone_data->sched_class = t->sched_class;
+        clone_data->previous_cpus = t->previous_cpus;
+        clone_data->migration_start = t->migration_start;
+        memcpy(&clone_data->regs, &t->regs, sizeof(struct pt_regs));
+        clone_data->thread_fs = t->thread_fs;
+        clone_data->thread_gs = t->thread_gs;
+        clone_data->thread_sp0 = t->thread_sp0;
+        clone_data->thread_sp = t->thread_sp;
+        clone_data->thread_usersp = t->thread_usersp;
+        clone_data->thread_es = t->thread_es;
+        clone_data->thread_ds = t->thread_ds;
+        clone_data->thread_fsindex = t->thread_fsindex;
+        clone_data->thread_gsindex = t->thread_gsindex;
+        clone_data->remote_blocked = t->remote_blocked;
+        clone_data->remote_real_blocked = t->remote_real_blocked;
+        clone_data->remote_saved_sigmask = t->remote_saved_sigmask;
+        clone_data->sas_ss_sp = t->sas_ss_sp;
+        clone_data->sas_ss_size = t->sas_ss_size;
+        clone_data->vma_list = NULL;
+        clone_data->pending_vma_list = NULL;
+        clone_data->gang = gang;
+
+        kernel_thread(call_import_task, clone_data, SIGCHLD);
+    }
+
+exit:
+    pcn_kmsg_free_msg(msg);
+    kfree(work);
+}
+
+/**
+ * @brief Message handler for gang migration messages.
+ */
+static int handle_gang_migration(struct pcn_kmsg_message* inc_msg) {
+    gang_migration_t* msg = (gang_migration_t*)inc_msg;
+    gang_migration_work_t* work;
+
+    int i;
+
+    PSPRINTK("%s: gang of %d threads from cpu{%d}\n",
+            __func__,msg->nr_threads,msg->header.from_cpu);
+
+    for(i = 0; i < msg->nr_threads; i++)
+        migration_phase(PS_MIGRATION_REQUEST_RECEIVED,
+                        msg->threads[i].placeholder_pid,
+                        msg->header.from_cpu,msg->threads[i].migration_start);
+
+    work = kmalloc(sizeof(gang_migration_work_t),GFP_ATOMIC);
+    if(work) {
+        INIT_WORK( (struct work_struct*)work, process_gang_migration);
+        // The message is big, hand it to the bottom half which frees it.
+        work->msg = msg;
+        queue_work(clone_wq, (struct work_struct*)work);
+    } else {
+        pcn_kmsg_free_msg(inc_msg);
+    }
+
+    return 0;
+}
+
+long sys_process_server_import_task(void *info /*name*/,
+        const char* argv,
+        const char* envp,
+        struct pt_regs* regs) {
+    clone_data_t* clone_data = (clone_data_t*)info;
+    unsigned long ip, sp;
     current->clone_data = clone_data;
     //printk("in sys_process_server_import_task pid{%d}, clone_data{%lx}\n",current->pid,(unsigned long)clone_data);
     process_server_import_address_space(&ip,&sp,regs);
@@ -6875,6 +8321,8 @@ int process_server_do_group_exit(void) {
         objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
         i = objPtr->_data._processor;
 #endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i)) continue;
 	// Send
         pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&msg));
     }
@@ -6916,6 +8364,16 @@ int process_server_do_exit(void) {
     unsigned long long start_time = native_read_tsc();
 #endif
 
+    // Nobody should keep waiting on a migration that will never happen.
+    if(current->migration_target_cpu != -1) {
+        current->migration_target_cpu = -1;
+        migration_notify_finish(current->pid,0,0,-1);
+    }
+    if(current->migration_gang_id) {
+        gang_migration_leave(current->migration_gang_id);
+        current->migration_gang_id = 0;
+    }
+
     // Select only relevant tasks to operate on
     if(!(current->t_distributed || current->tgroup_distributed)/* || 
             !current->enable_distributed_exit*/) {
@@ -7054,6 +8512,15 @@ finished_membership_search:
 
             PSPRINTK("%s: This is the last thread member!\n",__func__);
 
+            vma_miss_cache_destroy(current->tgroup_home_cpu,
+                                   current->tgroup_home_id);
+            page_lock_stats_destroy(current->tgroup_home_cpu,
+                                    current->tgroup_home_id);
+            mprotect_batch_drop(current->tgroup_home_cpu,
+                                current->tgroup_home_id);
+            lazy_cow_destroy(current->tgroup_home_cpu,
+                             current->tgroup_home_id);
+
             // Notify all cpus
             exit_notification.header.type = PCN_KMSG_TYPE_PROC_SRV_THREAD_GROUP_EXITED_NOTIFICATION;
             exit_notification.header.prio = PCN_KMSG_PRIO_NORMAL;
@@ -7073,6 +8540,9 @@ finished_membership_search:
               objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
               i = objPtr->_data._processor;
 #endif
+              // Only kernels that have an mm for this thread group.
+              if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i))
+                  continue;
               pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&exit_notification));
             }
 
@@ -7137,10 +8607,11 @@ finished_membership_search:
  * @brief Create a pairing between a newly created delegate process and the
  * remote placeholder process.  This function creates the local
  * pairing first, then sends a message to the originating cpu
- * so that it can do the same.
+ * so that it can do the same.  The import timestamps are reported
+ * back to the originating cpu for migration notification.
  */
-int process_server_notify_delegated_subprocess_starting(pid_t pid, 
-        pid_t remote_pid, int remote_cpu) {
+static int notify_process_pairing(pid_t pid, pid_t remote_pid, int remote_cpu,
+        unsigned long long import_start, unsigned long long import_end) {
 
     create_process_pairing_t msg;
     int perf = PERF_MEASURE_START(&perf_process_server_notify_delegated_subprocess_starting);
@@ -7154,6 +8625,8 @@ int process_server_notify_delegated_subprocess_starting(pid_t pid,
     msg.header.prio = PCN_KMSG_PRIO_NORMAL;
     msg.your_pid = remote_pid; 
     msg.my_pid = pid;
+    msg.import_start = import_start;
+    msg.import_end = import_end;
     
     if(0 != pcn_kmsg_send(remote_cpu, (struct pcn_kmsg_message*)(&msg))) {
         printk("%s: ERROR sending message pairing message to cpu %d\n",
@@ -7169,6 +8642,14 @@ int process_server_notify_delegated_subprocess_starting(pid_t pid,
 
 }
 
+/**
+ * @brief Public version of notify_process_pairing, without import timing.
+ */
+int process_server_notify_delegated_subprocess_starting(pid_t pid, 
+        pid_t remote_pid, int remote_cpu) {
+    return notify_process_pairing(pid,remote_pid,remote_cpu,0,0);
+}
+
 /**
  * @brief If the current process is distributed, we want to make sure that all members
  * of this distributed thread group carry out the same munmap operation.  Furthermore,
@@ -7187,6 +8668,7 @@ int process_server_do_munmap(struct mm_struct* mm,
     int s;
     int perf = -1;
     unsigned long lockflags;
+    unsigned long long wait_start;
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long end_time = 0;
     unsigned long long total_time = 0;
@@ -7195,7 +8677,15 @@ int process_server_do_munmap(struct mm_struct* mm,
 #endif
 
      // Nothing to do for a thread group that's not distributed.
-    if(!current->tgroup_distributed || !current->enable_distributed_munmap) {
+    if(!current->tgroup_distributed) {
+        goto exit;
+    }
+
+    vma_miss_cache_invalidate(current->tgroup_home_cpu,
+                              current->tgroup_home_id,
+                              start,len,0);
+
+    if(!current->enable_distributed_munmap) {
         goto exit;
     } 
 
@@ -7238,6 +8728,9 @@ int process_server_do_munmap(struct mm_struct* mm,
     // ensues.
     up_write(&mm->mmap_sem);
 
+    // Queued protection changes must land before the unmap.
+    mprotect_batch_flush(current->tgroup_home_cpu,current->tgroup_home_id);
+
 #ifndef SUPPORT_FOR_CLUSTERING
     for(i = 0; i < NR_CPUS; i++) {
         // Skip the current cpu
@@ -7251,6 +8744,8 @@ extern struct list_head rlist_head;
         objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
         i = objPtr->_data._processor;
 #endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i)) continue;
         // Send the request to this cpu.
         s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&request));
         if(!s) {
@@ -7261,9 +8756,9 @@ extern struct list_head rlist_head;
     }
 
     // Wait for all cpus to respond.
-    while(data->expected_responses != data->responses) {
-        schedule();
-    }
+    wait_start = native_read_tsc();
+    wait_event(_munmap_wq, data->expected_responses == data->responses);
+    process_server_track_wait(PS_WAIT_MUNMAP,wait_start);
 
     down_write(&mm->mmap_sem);
 
@@ -7292,20 +8787,20 @@ exit:
 }
 
 /**
- * @brief Hooks do_mprotect.  Local protection changes must invalidate
- * the corresponding remote page mappings to force other CPUs to re-acquire
- * the modified mappings.
+ * @brief Synchronously push a single protection change to every other
+ * kernel.  Used when the change cannot be queued.
  */
-void process_server_do_mprotect(struct task_struct* task,
-                                unsigned long start,
-                                size_t len,
-                                unsigned long prot) {
+static void mprotect_broadcast(struct task_struct* task,
+                               unsigned long start,
+                               size_t len,
+                               unsigned long prot) {
     mprotect_data_t* data;
     mprotect_request_t request;
     int i;
     int s;
     int perf = -1;
     unsigned lockflags;
+    unsigned long long wait_start;
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
     unsigned long long end_time;
     unsigned long long total_time;
@@ -7365,6 +8860,8 @@ extern struct list_head rlist_head;
         objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
         i = objPtr->_data._processor;
 #endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(task->known_cpu_with_tgroup_mm,i)) continue;
         // Send the request to this cpu.
         s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&request));
         if(!s) {
@@ -7377,9 +8874,9 @@ extern struct list_head rlist_head;
     PSPRINTK("done\nWaiting for responses... ");
 
     // Wait for all cpus to respond.
-    while(data->expected_responses != data->responses) {
-        schedule();
-    }
+    wait_start = native_read_tsc();
+    wait_event(_mprotect_wq, data->expected_responses == data->responses);
+    process_server_track_wait(PS_WAIT_MPROTECT,wait_start);
 
     PSPRINTK("done\n");
 
@@ -7407,222 +8904,168 @@ exit:
 }
 
 /**
- * @brief Hooks do_mmap_pgoff.  This is necessary in order to maintain
- * address space coherency, since do_mmap_pgoff can modify existing
- * mappings.  If do_mmap_pgoff were allowed to modify existing mappings
- * without first unmapping those mappings remotely, multiple different
- * mappings for the same address would then exist between CPUs.  This
- * function forces remote munmap prior to doing the local do_mmap_pgoff.
+ * @brief Finds the mprotect queue of a thread group.
+ * @prerequisite Requires user to hold _mprotect_batch_data_head_lock
  */
-unsigned long process_server_do_mmap_pgoff(struct file *file, unsigned long addr,
-                                           unsigned long len, unsigned long prot,
-                                           unsigned long flags, unsigned long pgoff) {
+static mprotect_batch_data_t* find_mprotect_batch_data(int tgroup_home_cpu,
+                                                       int tgroup_home_id) {
+    data_header_t* curr = _mprotect_batch_data_head;
+    mprotect_batch_data_t* data = NULL;
 
-    // Nothing to do for a thread group that's not distributed.
-    // Also, skip if the mmap hook is turned off.  This should
-    // only happen when memory mapping within process_server
-    // fault handler and import address space.
-    if(!current->tgroup_distributed || !current->enable_do_mmap_pgoff_hook) {
-        goto not_handled_no_perf;
+    while(curr) {
+        data = (mprotect_batch_data_t*)curr;
+        if(data->tgroup_home_cpu == tgroup_home_cpu &&
+           data->tgroup_home_id  == tgroup_home_id) {
+            return data;
+        }
+        curr = curr->next;
     }
 
-    // Do a distributed munmap on the entire range of addresses that
-    // are about to be remapped.  This will ensure that the range
-    // is cleared out remotely, as well as locally (handled by the
-    // do_mmap_pgoff implementation) to keep from having differing
-    // vm address spaces on different cpus.
-    process_server_do_munmap(current->mm,
-                             addr,
-                             len);
-
-not_handled_no_perf:
-    return 0;
+    return NULL;
 }
 
 /**
- * @brief Implements on-demand page migration.  As this CPU faults,
- * this fault handler is invoked.  Its job is to pull in any mappings
- * that may exist for the faulting address from other CPUs.
- * @return 0 = not handled, 1 = handled.
- *
- * <MEASURED perf_process_server_try_handle_mm_fault>
+ * @brief Whether a thread group has queued protection changes that
+ * overlap [start,start+len).  A len of 0 matches any queued change.
  */
-int process_server_pull_remote_mappings(struct mm_struct *mm, 
-                                       struct vm_area_struct *vma,
-                                       unsigned long address, 
-                                       unsigned int flags, 
-                                       struct vm_area_struct **vma_out,
-                                       unsigned long error_code) {
-
-    mapping_request_data_t *data = NULL;
-    unsigned long err = 0;
-    int ret = 0;
-    mapping_request_t request;
+static int mprotect_batch_pending(int tgroup_home_cpu, int tgroup_home_id,
+                                  unsigned long start, size_t len) {
+    mprotect_batch_data_t* data = NULL;
+    unsigned long lockflags;
+    int pending = 0;
     int i;
-    int s;
-    int j;
-    struct file* f = NULL;
-    unsigned long prot = 0;
-    unsigned char started_outside_vma = 0;
-    unsigned char did_early_removal = 0;
-    char path[512];
-    char* ppath;
-    // for perf
-    unsigned char pte_provided = 0;
-    unsigned char is_anonymous = 0;
-    unsigned char vma_not_found = 1;
-    unsigned char adjusted_permissions = 0;
-    unsigned char is_new_vma = 0;
-    unsigned char paddr_present = 0;
-    int perf = -1;
-    int original_enable_distributed_munmap = current->enable_distributed_munmap;
-    int original_enable_do_mmap_pgoff_hook = current->enable_do_mmap_pgoff_hook;
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    unsigned long long mapping_wait_start = 0;
-    unsigned long long mapping_wait_end = 0;
-    unsigned long long mapping_request_send_start = 0;
-    unsigned long long mapping_request_send_end = 0;
-    unsigned long long fault_processing_time_start = 0;
-    unsigned long long fault_processing_time_end = 0;
-    unsigned long long fault_processing_time = 0;
-#endif
 
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    data = find_mprotect_batch_data(tgroup_home_cpu,tgroup_home_id);
+    if(data) {
+        for(i = 0; i < data->count && !pending; i++) {
+            mprotect_batch_range_t* r = &data->ranges[i];
+            if(!len || (r->start < start + len && start < r->start + r->len))
+                pending = 1;
+        }
+    }
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
 
-    // Nothing to do for a thread group that's not distributed.
-    if(!current->tgroup_distributed) {
-        goto not_handled_no_perf;
+    return pending;
+}
+
+/**
+ * @brief Add a protection change to a queue.  Queued ranges that the
+ * new one covers are dropped, and the new range is merged into the
+ * last one when they touch and agree on the protection.  Only the last
+ * one, since ranges are applied in order.
+ * @return 1 if the queue is now full.
+ * @prerequisite Requires user to hold _mprotect_batch_data_head_lock
+ */
+static int mprotect_batch_add(mprotect_batch_data_t* data,
+                              unsigned long start,
+                              size_t len,
+                              unsigned long prot) {
+    unsigned long end = start + len;
+    mprotect_batch_range_t* r;
+    int i, j;
+
+    for(i = 0, j = 0; i < data->count; i++) {
+        r = &data->ranges[i];
+        if(start <= r->start && r->start + r->len <= end)
+            continue;
+        data->ranges[j++] = *r;
     }
+    data->count = j;
 
-    current->enable_distributed_munmap = 0;
-    current->enable_do_mmap_pgoff_hook = 0;
-    
-    perf = PERF_MEASURE_START(&perf_process_server_try_handle_mm_fault);
+    if(data->count) {
+        r = &data->ranges[data->count - 1];
+        if(r->prot == prot && start <= r->start + r->len && r->start <= end) {
+            unsigned long r_end = max(end, r->start + r->len);
+            r->start = min(start, r->start);
+            r->len = r_end - r->start;
+            return 0;
+        }
+    }
 
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    fault_processing_time_start = native_read_tsc();
-#endif
+    r = &data->ranges[data->count++];
+    r->start = start;
+    r->len = len;
+    r->prot = prot;
 
-    PSPRINTK("Fault caught on address{%lx}, cpu{%d}, id{%d}, pid{%d}, tgid{%d}, error_code{%lx}\n",
-            address,
-            current->tgroup_home_cpu,
-            current->tgroup_home_id,
-            current->pid,
-            current->tgid,
-            error_code);
+    return data->count == MPROTECT_BATCH_RANGES;
+}
 
-    if(is_vaddr_mapped(mm,address)) {
-        PSPRINTK("exiting mk fault handler because vaddr %lx is already mapped- cpu{%d}, id{%d}\n",
-                address,current->tgroup_home_cpu,current->tgroup_home_id);
+static int mprotect_batch_done(void) {
+    unsigned long lockflags;
+    int done;
 
-        // should this thing be writable?  if so, set it and exit
-        // This is a security hole, and is VERY bad.
-        // It will also probably cause problems for genuine COW mappings..
-        if(!vma) {
-            vma = find_vma_checked(mm, address & PAGE_MASK);
-            if(!vma)
-                PSPRINTK("VMA failed to resolve\n");
-        }
-        if(vma && 
-                vma->vm_flags & VM_WRITE /*&& 
-                0 == is_page_writable(mm, vma, address & PAGE_MASK)*/) {
-            PSPRINTK("Touching up write setting\n");
-            mk_page_writable(mm,vma,address & PAGE_MASK);
-            adjusted_permissions = 1;
-            ret = 1;
-        } else {
-            PSPRINTK("Did not touch up write settings\n");
-        }
+    spin_lock_irqsave(&_mprotect_batch_responses_lock,lockflags);
+    done = (_mprotect_batch_expected_responses == _mprotect_batch_responses);
+    spin_unlock_irqrestore(&_mprotect_batch_responses_lock,lockflags);
 
-        goto not_handled;
-    }
+    return done;
+}
 
-    // Is this an optimization?  Will it work?
-    // The idea is to not bother pulling in physical pages
-    // for mappings that are executable and file backed, since
-    // those pages will never change.  Might as well map
-    // them locally.
-#if !(MIGRATE_EXECUTABLE_PAGES_ON_DEMAND)
-    if(vma && 
-            (vma->vm_start <= address) &&
-            (vma->vm_end > address) &&
-            (vma->vm_flags & VM_EXEC) && 
-            vma->vm_file) {
-        ret = 0;
-        PSPRINTK("Skipping distributed mapping pull because page is executable\n");
+/**
+ * @brief Give up the range locks a queue held, see
+ * mprotect_batch_data_t.
+ */
+static void mprotect_batch_unhold(data_header_t* held) {
+#ifdef MPROTECT_BATCH_HOLDS_RANGE_LOCK
+    data_header_t* next;
 
-        goto not_handled;
+    while(held) {
+        next = held->next;
+        page_lock_put((page_lock_data_t*)held);
+        held = next;
     }
 #endif
-    
-    // The vma that's passed in might not always be correct.  find_vma fails by returning the wrong
-    // vma when the vma is not present.  How ugly...
-    if(vma && (vma->vm_start > address || vma->vm_end <= address)) {
-        started_outside_vma = 1;
-        PSPRINTK("set vma = NULL, since the vma does not hold the faulting address, for whatever reason...\n");
-        vma = NULL;
-    } else if (vma) {
-        //PSPRINTK("vma found and valid\n");
-    } else {
-        //PSPRINTK("no vma present\n");
-    }
+}
 
-    data = kmalloc(sizeof(mapping_request_data_t),GFP_KERNEL); 
-   
-    // Set up data entry to share with response handler.
-    // This data entry will be modified by the response handler,
-    // and we will check it periodically to see if our request
-    // has been responded to by all active cpus.
-    data->header.data_type = PROCESS_SERVER_MAPPING_REQUEST_DATA_TYPE;
-    data->address = address;
-    data->present = 0;
-    data->complete = 0;
-    spin_lock_init(&data->lock);
-    data->responses = 0;
-    data->expected_responses = 0;
-    data->tgroup_home_cpu = current->tgroup_home_cpu;
-    data->tgroup_home_id = current->tgroup_home_id;
-    data->requester_pid = current->pid;
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    data->wait_time_concluded = 0;
-#endif
-    for(j = 0; j < MAX_MAPPINGS; j++) {
-        data->mappings[j].present = 0;
-        data->mappings[j].vaddr = 0;
-        data->mappings[j].paddr = 0;
-        data->mappings[j].sz = 0;
-    }
+/**
+ * @brief Push the queued protection changes of a thread group to every
+ * other kernel, and wait until they are applied.  Flushes are
+ * serialized, so once this returns every change queued before the call
+ * has been applied everywhere.
+ * NOTE: must not be called with the thread group's mmap_sem held, the
+ *       remote side needs it.
+ */
+static void mprotect_batch_flush(int tgroup_home_cpu, int tgroup_home_id) {
+    mprotect_batch_data_t* data = NULL;
+    mprotect_batch_t* msg = NULL;
+    data_header_t* held;
+    unsigned long known;
+    unsigned long lockflags;
+    unsigned long long wait_start;
+    int i;
+    int s;
 
+    msg = kmalloc(sizeof(mprotect_batch_t),GFP_KERNEL);
+    if(!msg) return;
 
-    // Make data entry visible to handler.
-    add_data_entry_to(data,
-                      &_mapping_request_data_head_lock,
-                      &_mapping_request_data_head);
+    mutex_lock(&_mprotect_batch_flush_mutex);
 
-    // Send out requests, tracking the number of successful
-    // send operations.  That number is the number of requests
-    // we will expect back.
-    request.header.type = PCN_KMSG_TYPE_PROC_SRV_MAPPING_REQUEST;
-    request.header.prio = PCN_KMSG_PRIO_NORMAL;
-    request.address = address;
-    request.tgroup_home_cpu = current->tgroup_home_cpu;
-    request.tgroup_home_id  = current->tgroup_home_id;
-    request.requester_pid = current->pid;
-    request.need_vma = vma? 0 : 1; // Optimization, do not bother
-                                    // sending the vma path if a local
-                                    // vma is already installed, since
-                                    // we know that a do_mmap_pgoff will
-                                    // not be needed in this case.
-    // Part of need_vma optimization.  Just record the path in the
-    // data structure since we know it in advance, and since the
-    // resolving kernel instance is no longer responsible for providing
-    // it in this case.
-    if(!request.need_vma && vma->vm_file) {
-        d_path(&vma->vm_file->f_path,data->path,sizeof(data->path));
-    }
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    data = find_mprotect_batch_data(tgroup_home_cpu,tgroup_home_id);
+    if(data)
+        remove_data_entry_from(data,&_mprotect_batch_data_head);
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
 
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    mapping_request_send_start = native_read_tsc();
-#endif
+    if(!data)
+        goto out;
+
+    msg->header.type = PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH;
+    msg->header.prio = PCN_KMSG_PRIO_NORMAL;
+    msg->tgroup_home_cpu = tgroup_home_cpu;
+    msg->tgroup_home_id = tgroup_home_id;
+    msg->count = data->count;
+    memcpy(msg->ranges,data->ranges,
+           data->count * sizeof(mprotect_batch_range_t));
+    known = data->known_cpu_with_tgroup_mm;
+    held = data->held;
+    kfree(data);
+
+    spin_lock_irqsave(&_mprotect_batch_responses_lock,lockflags);
+    msg->batch_id = ++_mprotect_batch_id;
+    _mprotect_batch_responses = 0;
+    _mprotect_batch_expected_responses = 0;
+    spin_unlock_irqrestore(&_mprotect_batch_responses_lock,lockflags);
 
 #ifndef SUPPORT_FOR_CLUSTERING
     for(i = 0; i < NR_CPUS; i++) {
@@ -7632,1159 +9075,5191 @@ int process_server_pull_remote_mappings(struct mm_struct *mm,
     // the list does not include the current processor group descirptor (TODO)
     struct list_head *iter;
     _remote_cpu_info_list_t *objPtr;
-    extern struct list_head rlist_head;
-    list_for_each(iter, &rlist_head) { 
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
         objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
         i = objPtr->_data._processor;
 #endif
-        // Send the request to this cpu.
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        request.send_time = native_read_tsc();
-#endif
-        s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&request));
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(known,i)) continue;
+        s = pcn_kmsg_send_long(i,(struct pcn_kmsg_long_message*)msg,
+                               sizeof(mprotect_batch_t) - sizeof(msg->header));
         if(!s) {
-            // A successful send operation, increase the number
-            // of expected responses.
-            data->expected_responses++;
+            spin_lock_irqsave(&_mprotect_batch_responses_lock,lockflags);
+            _mprotect_batch_expected_responses++;
+            spin_unlock_irqrestore(&_mprotect_batch_responses_lock,lockflags);
         }
     }
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    mapping_request_send_end = native_read_tsc();
-    PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_REQUEST_SEND_TIME,
-                        mapping_request_send_end - mapping_request_send_start);
-#endif
 
-    // Wait for all cpus to respond, or a mapping that is complete
-    // with a physical mapping.  Mapping results that do not include
-    // a physical mapping cause this to wait until all mapping responses
-    // have arrived from remote cpus.
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    mapping_wait_start = native_read_tsc();
-#endif
+    wait_start = native_read_tsc();
+    wait_event(_mprotect_wq, mprotect_batch_done());
+    process_server_track_wait(PS_WAIT_MPROTECT,wait_start);
+
+    mprotect_batch_unhold(held);
+
+out:
+    mutex_unlock(&_mprotect_batch_flush_mutex);
+    kfree(msg);
+}
+
+/**
+ * @brief Flush every queued protection change.
+ */
+static void mprotect_batch_flush_all(struct work_struct* work) {
+    mprotect_batch_data_t* data = NULL;
+    unsigned long lockflags;
+    int cpu, id;
+
     while(1) {
-        unsigned char done = 0;
-        unsigned long lockflags;
-        spin_lock_irqsave(&data->lock,lockflags);
-        if(data->expected_responses == data->responses || data->complete)
-            done = 1;
-        spin_unlock_irqrestore(&data->lock,lockflags);
-        if (done) {
-            unsigned long lockflags;
-            spin_lock_irqsave(&_mapping_request_data_head_lock,lockflags);
-            remove_data_entry_from(data,
-                                  &_mapping_request_data_head);
-            spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags);
-            did_early_removal = 1;
-            break;
+        spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+        data = (mprotect_batch_data_t*)_mprotect_batch_data_head;
+        if(data) {
+            cpu = data->tgroup_home_cpu;
+            id = data->tgroup_home_id;
         }
-        schedule();
+        spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
+
+        if(!data) break;
+
+        mprotect_batch_flush(cpu,id);
     }
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    mapping_wait_end = native_read_tsc();
-    PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_WAIT_TIME,
-                        mapping_wait_end - mapping_wait_start);
-    if(data->wait_time_concluded) {
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_POST_WAIT_TIME_RESUME,
-                            mapping_wait_end - data->wait_time_concluded);
+}
+
+static DECLARE_DELAYED_WORK(_mprotect_batch_timer, mprotect_batch_flush_all);
+static DECLARE_WORK(_mprotect_batch_kick_work, mprotect_batch_flush_all);
+
+/**
+ * @brief Flush every queued protection change soon, without waiting.
+ */
+static void mprotect_batch_kick(void) {
+    queue_work(mprotect_batch_wq,&_mprotect_batch_kick_work);
+}
+
+/**
+ * @brief Forget the queued protection changes of a thread group that
+ * has exited.
+ */
+static void mprotect_batch_drop(int tgroup_home_cpu, int tgroup_home_id) {
+    mprotect_batch_data_t* data = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    data = find_mprotect_batch_data(tgroup_home_cpu,tgroup_home_id);
+    if(data)
+        remove_data_entry_from(data,&_mprotect_batch_data_head);
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
+
+    if(data) {
+        mprotect_batch_unhold(data->held);
+        kfree(data);
     }
-#endif
-    
-    // Handle successful response.
-    if(data->present) {
-        PSPRINTK(/*KERN_ALERT*/"Mapping(%d): %lx v:%lx p:%lx vaddr{%lx-%lx} prot{%lx} vm_flags{%lx} pgoff{%lx} \"%s\"\n",
-		smp_processor_id(), (unsigned long)vma, data->address, data->mappings[0].paddr,
-                data->vaddr_start, (data->vaddr_start + data->vaddr_size),
-                data->prot, data->vm_flags, data->pgoff, data->path);
-        vma_not_found = 0;
+}
 
-        // Figure out how to protect this region.
-        prot |= (data->vm_flags & VM_READ)?  PROT_READ  : 0;
-        prot |= (data->vm_flags & VM_WRITE)? PROT_WRITE : 0;
-        prot |= (data->vm_flags & VM_EXEC)?  PROT_EXEC  : 0;
+/**
+ * @brief Hooks do_mprotect.  Local protection changes must invalidate
+ * the corresponding remote page mappings to force other CPUs to re-acquire
+ * the modified mappings.  Rather than waiting for every kernel on each
+ * call, the change is queued and pushed in a batch with its neighbours,
+ * and the caller's range lock is held until then, see
+ * mprotect_batch_data_t.
+ */
+void process_server_do_mprotect(struct task_struct* task,
+                                unsigned long start,
+                                size_t len,
+                                unsigned long prot) {
+    mprotect_batch_data_t* data = NULL;
+    mprotect_batch_data_t* new_data = NULL;
+    unsigned long lockflags;
+    int full;
 
-        //PS_DOWN_WRITE(&current->mm->mmap_sem);
+     // Nothing to do for a thread group that's not distributed.
+    if(!current->tgroup_distributed) {
+        return;
+    }
 
-        // If there was not previously a vma, create one.
-        if(!vma || vma->vm_start != data->vaddr_start || vma->vm_end != (data->vaddr_start + data->vaddr_size)) {
-            PSPRINTK("vma not present\n");
-            is_new_vma = 1;
-            if(data->path[0] == '\0') {       
-                PSPRINTK("mapping anonymous\n");
-                is_anonymous = 1;
-                // mmap parts that are missing, while leaving the existing
-                // parts untouched.
-                PS_DOWN_WRITE(&current->mm->mmap_sem);
-                err = do_mmap_remaining(NULL,
-                        data->vaddr_start,
-                        data->vaddr_size,
-                        prot,
-                        MAP_FIXED|
-                        MAP_ANONYMOUS|
-                        ((data->vm_flags & VM_SHARED)?MAP_SHARED:MAP_PRIVATE),
-                        0, (data->vm_flags & VM_NORESERVE) ?1:0);
-                PS_UP_WRITE(&current->mm->mmap_sem);
+    file_clean_cache_invalidate(task->tgroup_home_cpu,task->tgroup_home_id,
+                                start,len);
+
+    new_data = kmalloc(sizeof(mprotect_batch_data_t),GFP_KERNEL);
+
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    data = find_mprotect_batch_data(task->tgroup_home_cpu,
+                                    task->tgroup_home_id);
+    if(!data && new_data) {
+        data = new_data;
+        new_data = NULL;
+        data->header.data_type = PROCESS_SERVER_MPROTECT_BATCH_DATA_TYPE;
+        data->tgroup_home_cpu = task->tgroup_home_cpu;
+        data->tgroup_home_id = task->tgroup_home_id;
+        data->known_cpu_with_tgroup_mm = 0;
+        data->held = NULL;
+        data->count = 0;
+        add_data_entry_to(data,NULL,&_mprotect_batch_data_head);
+    }
+    if(data)
+        data->known_cpu_with_tgroup_mm |= task->known_cpu_with_tgroup_mm;
+    full = data? mprotect_batch_add(data,start,PAGE_ALIGN(len),prot) : 0;
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
+
+    if(new_data) kfree(new_data);
+
+    if(!data) {
+        // Out of memory, keep the order and do it the slow way.
+        mprotect_batch_flush(task->tgroup_home_cpu,task->tgroup_home_id);
+        mprotect_broadcast(task,start,len,prot);
+    } else if(full) {
+        mprotect_batch_flush(task->tgroup_home_cpu,task->tgroup_home_id);
+    } else {
+#ifdef MPROTECT_BATCH_HOLDS_RANGE_LOCK
+        queue_delayed_work(mprotect_batch_wq,&_mprotect_batch_timer,
+                           MPROTECT_BATCH_DELAY);
+#else
+        // Nothing keeps other kernels off the range until the queue
+        // is flushed, so flush it now.
+        mprotect_batch_flush(task->tgroup_home_cpu,task->tgroup_home_id);
+#endif
+    }
+}
 
-/*		// NOTE we use the following to catch the megabug
-		if ( data->vm_flags & VM_NORESERVE )
-			printk(KERN_ALERT"MAPPING ANONYMOUS %p %p data: %lx vma: %lx {%lx-%lx} ret%lx\n",
-				__func__, data->mappings[i].vaddr, data->mappings[i].paddr, 
-				data->vm_flags, vma?vma->vm_flags:0, vma?vma->vm_start:0, vma?vma->vm_end:0, err);*/
-            } else {
-                //unsigned char used_existing;
-                PSPRINTK("opening file to map\n");
-                is_anonymous = 0;
-
-                // Temporary, check to see if the path is /dev/null (deleted), it should just
-                // be /dev/null in that case.  TODO: Add logic to detect and remove the 
-                // " (deleted)" from any path here.  This is important, because anonymous mappings
-                // are sometimes, depending on how glibc is compiled, mapped instead to the /dev/zero
-                // file, and without this check, the filp_open call will fail because the "(deleted)"
-                // string at the end of the path results in the file not being found.
-                if( !strncmp( "/dev/zero (deleted)", data->path, strlen("/dev/zero (deleted)")+1 )) {
-                    data->path[9] = '\0';
-                }
-               
-                //if(vma && vma->vm_file) {
-                //    used_existing = 0;
-                //    f = fget(fileno(vma->vm_file));
-                //} else {
-                //    used_existing = 1;
-                    f = filp_open(data->path, (data->vm_flags & VM_SHARED)? O_RDWR:O_RDONLY, 0);
-                //}
+/**
+ * @brief Apply a batch of protection changes to this kernel's copy of
+ * the thread group's mm, if there is one, and acknowledge it.
+ */
+static void process_mprotect_batch(struct work_struct* work) {
+    mprotect_batch_work_t* w = (mprotect_batch_work_t*)work;
+    mprotect_batch_t* msg = w->msg;
+    mprotect_batch_response_t response;
+    struct mm_struct* mm = NULL;
+    struct task_struct* task = NULL;
+    mm_data_t* saved_mm = NULL;
+    int i;
 
-                if(!IS_ERR(f)) {
-                    PSPRINTK("mapping file %s, %lx, %lx, %lx\n",data->path,
-                            data->vaddr_start, 
-                            data->vaddr_size,
-                            (unsigned long)f);
-                    // mmap parts that are missing, while leaving the existing
-                    // parts untouched.
-                    PS_DOWN_WRITE(&current->mm->mmap_sem);
-                    err = do_mmap_remaining(f,
-                            data->vaddr_start,
-                            data->vaddr_size,
-                            prot,
-                            MAP_FIXED |
-                            ((data->vm_flags & VM_DENYWRITE)?MAP_DENYWRITE:0) |
-                            ((data->vm_flags & VM_EXECUTABLE)?MAP_EXECUTABLE:0) |
-                            ((data->vm_flags & VM_SHARED)?MAP_SHARED:MAP_PRIVATE),
-                            data->pgoff << PAGE_SHIFT, (data->vm_flags & VM_NORESERVE) ?1:0);
-                    PS_UP_WRITE(&current->mm->mmap_sem);
+    for(i = 0; i < msg->count; i++) {
+        file_clean_cache_invalidate(msg->tgroup_home_cpu,msg->tgroup_home_id,
+                                    msg->ranges[i].start,msg->ranges[i].len);
+    }
 
-                    //if(used_existing) {
-                    //    fput(f);
-                    //} else {
-                        filp_close(f,NULL);
-                    //}
-                } else {
-                    printk("Error opening file %s\n",data->path);
-                }
-            }
-            if(err != data->vaddr_start) {
-                PSPRINTK("ERROR: Failed to do_mmap %lx\n",err);
-                //PS_UP_WRITE(&current->mm->mmap_sem);
-                goto exit_remove_data;
-            }
-            PS_DOWN_READ(&current->mm->mmap_sem); 
-            vma = find_vma_checked(current->mm, data->address); //data->vaddr_start);
-            PS_UP_READ(&current->mm->mmap_sem);
-            if (data->address < vma->vm_start || vma->vm_end <= data->address)
-		printk(KERN_ALERT"%s: ERROR %lx is not mapped in current vma {%lx-%lx} remote vma {%lx-%lx}\n",
-			__func__, data->address, vma->vm_start, vma->vm_end,
-			data->vaddr_start, (data->vaddr_start + data->vaddr_size));
-        } else {
-            PSPRINTK("vma is present, using existing\n");
-        }
+    mm = find_thread_mm(msg->tgroup_home_cpu,msg->tgroup_home_id,
+                        &saved_mm,&task);
+    if(mm && !atomic_inc_not_zero(&mm->mm_users))
+        mm = NULL;
 
-        if(vma) {
-            vma->vm_flags |= VM_MIXEDMAP;
-        }
+    if(mm) {
+        if(task)
+            set_cpu_has_known_tgroup_mm(task,msg->header.from_cpu);
 
-        // We should have a vma now, so map physical memory into it.
-        // Check to see if we have mappings
-        for(i = 0; i < MAX_MAPPINGS; i++) {
-            if(data->mappings[i].present) {
-                paddr_present = 1;
-                break;
-            }
+        current->enable_distributed_munmap = 0;
+        current->enable_do_mmap_pgoff_hook = 0;
+        for(i = 0; i < msg->count; i++) {
+            do_mprotect(NULL,mm,msg->ranges[i].start,msg->ranges[i].len,
+                        msg->ranges[i].prot,0);
         }
-        if(vma && paddr_present) { 
-            int remap_pfn_range_err = 0;
-            pte_provided = 1;
-            unsigned long cow_addr;
+        current->enable_distributed_munmap = 1;
+        current->enable_do_mmap_pgoff_hook = 1;
+        mmput(mm);
+    }
 
+    response.header.type = PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH_RESPONSE;
+    response.header.prio = PCN_KMSG_PRIO_NORMAL;
+    response.tgroup_home_cpu = msg->tgroup_home_cpu;
+    response.tgroup_home_id = msg->tgroup_home_id;
+    response.batch_id = msg->batch_id;
+    DO_UNTIL_SUCCESS(pcn_kmsg_send(msg->header.from_cpu,
+                        (struct pcn_kmsg_message*)&response));
 
-            for(i = 0; i < MAX_MAPPINGS; i++) {
-                if(data->mappings[i].present) {
-                    int tmp_err;
-                    PS_DOWN_WRITE(&current->mm->mmap_sem);
-                    tmp_err = remap_pfn_range_remaining(current->mm,
-                                                       vma,
-                                                       data->mappings[i].vaddr,
-                                                       data->mappings[i].paddr,
-                                                       data->mappings[i].sz,
-                                                       vm_get_page_prot(vma->vm_flags),
-                                                       1);
-                    PS_UP_WRITE(&current->mm->mmap_sem);
-                    if(tmp_err) remap_pfn_range_err = tmp_err;
-                }
-            }
+    pcn_kmsg_free_msg(msg);
+    kfree(work);
+}
 
-            // Check remap_pfn_range success
-            if(remap_pfn_range_err) {
-                printk(KERN_ALERT"ERROR: Failed to remap_pfn_range %d\n",err);
-            } else {
-                PSPRINTK("remap_pfn_range succeeded\n");
-                ret = 1;
-            }
-        } 
+/**
+ * @brief Message handler for batched protection changes.
+ */
+static int handle_mprotect_batch(struct pcn_kmsg_message* inc_msg) {
+    mprotect_batch_t* msg = (mprotect_batch_t*)inc_msg;
+    mprotect_batch_work_t* work;
 
-        //PS_UP_WRITE(&current->mm->mmap_sem);
+    work = kmalloc(sizeof(mprotect_batch_work_t),GFP_ATOMIC);
+    if(work) {
+        INIT_WORK( (struct work_struct*)work, process_mprotect_batch);
+        // The message is big, hand it to the bottom half which frees it.
+        work->msg = msg;
+        queue_work(mapping_wq, (struct work_struct*)work);
+    } else {
+        pcn_kmsg_free_msg(inc_msg);
+    }
 
-        if(vma) {
-            *vma_out = vma;
+    return 0;
+}
+
+/**
+ * @brief Message handler for batched protection change acknowledgements.
+ */
+static int handle_mprotect_batch_response(struct pcn_kmsg_message* inc_msg) {
+    mprotect_batch_response_t* msg = (mprotect_batch_response_t*)inc_msg;
+    unsigned long lockflags;
+    int counted = 0;
+
+    spin_lock_irqsave(&_mprotect_batch_responses_lock,lockflags);
+    if(msg->batch_id == _mprotect_batch_id) {
+        _mprotect_batch_responses++;
+        counted = 1;
+    }
+    spin_unlock_irqrestore(&_mprotect_batch_responses_lock,lockflags);
+
+    if(counted)
+        wake_up(&_mprotect_wq);
+
+    pcn_kmsg_free_msg(inc_msg);
+
+    return 0;
+}
+
+/**
+ * @brief Finds a thread group mm join data entry.
+ * @prerequisite Requires user to hold _tgroup_mm_join_data_head_lock.
+ */
+static tgroup_mm_join_data_t* find_tgroup_mm_join_data(int cpu, int id,
+        int requester_pid) {
+    data_header_t* curr = _tgroup_mm_join_data_head;
+    tgroup_mm_join_data_t* data;
+
+    while(curr) {
+        data = (tgroup_mm_join_data_t*)curr;
+        if(data->tgroup_home_cpu == cpu &&
+           data->tgroup_home_id == id &&
+           data->requester_pid == requester_pid) {
+            return data;
         }
+        curr = curr->next;
     }
 
-exit_remove_data:
+    return NULL;
+}
 
-    if(!did_early_removal) {
-        unsigned long lockflags;
-        spin_lock_irqsave(&_mapping_request_data_head_lock,lockflags);
-        remove_data_entry_from(data,
-                              &_mapping_request_data_head);
-        spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags);
+/**
+ * @brief Latest timestamp of the lamport entries this kernel has queued
+ * for a thread group.
+ * @return 0 if there are none.
+ */
+static unsigned long long lamport_own_latest_timestamp(int cpu, int id) {
+    data_header_t* curr;
+    lamport_barrier_queue_t* queue;
+    lamport_barrier_entry_t* entry;
+    unsigned long long ts = 0;
+
+    PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
+    curr = _lamport_barrier_queue_head;
+    while(curr) {
+        queue = (lamport_barrier_queue_t*)curr;
+        if(queue->tgroup_home_cpu == cpu && queue->tgroup_home_id == id) {
+            entry = queue->queue;
+            while(entry) {
+                if(entry->cpu == _cpu && entry->timestamp > ts)
+                    ts = entry->timestamp;
+                entry = (lamport_barrier_entry_t*)entry->header.next;
+            }
+        }
+        curr = curr->next;
     }
-    kfree(data);
+    PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
 
-    PSPRINTK("exiting fault handler\n");
+    return ts;
+}
 
-not_handled:
+/**
+ * @brief Whether every lamport entry this kernel queued for a thread
+ * group at or before ts has been released.
+ */
+static int lamport_own_entries_released(int cpu, int id,
+                                        unsigned long long ts) {
+    data_header_t* curr;
+    lamport_barrier_queue_t* queue;
+    lamport_barrier_entry_t* entry;
+    int done = 1;
 
-    if (adjusted_permissions) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_ADJUSTED_PERMISSIONS,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,"Adjusted Permissions",perf);
-    } else if (is_new_vma && is_anonymous && pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_ANONYMOUS_PTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "New Anonymous VMA + PTE",
-                perf);
-    } else if (is_new_vma && is_anonymous && !pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_ANONYMOUS_NOPTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "New Anonymous VMA + No PTE",
-                perf);
-    } else if (is_new_vma && !is_anonymous && pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_FILEBACKED_PTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "New File Backed VMA + PTE",
-                perf);
-    } else if (is_new_vma && !is_anonymous && !pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_FILEBACKED_NOPTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "New File Backed VMA + No PTE",
-                perf);
-    } else if (!is_new_vma && is_anonymous && pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_ANONYMOUS_PTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "Existing Anonymous VMA + PTE",
-                perf);
-    } else if (!is_new_vma && is_anonymous && !pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_ANONYMOUS_NOPTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "Existing Anonymous VMA + No PTE",
-                perf);
-    } else if (!is_new_vma && !is_anonymous && pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_FILEBACKED_PTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "Existing File Backed VMA + PTE",
-                perf);
-    } else if (!is_new_vma && !is_anonymous && !pte_provided) {
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_FILEBACKED_NOPTE,0);
-#endif
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
-                "Existing File Backed VMA + No PTE",
-                perf);
-    } else {
-        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,"test",perf);
-    }
-
-    current->enable_distributed_munmap = original_enable_distributed_munmap;
-    current->enable_do_mmap_pgoff_hook = original_enable_do_mmap_pgoff_hook;
-
-#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
-    fault_processing_time_end = native_read_tsc();
-    fault_processing_time = fault_processing_time_end - fault_processing_time_start;
-    PS_PROC_DATA_TRACK(PS_PROC_DATA_FAULT_PROCESSING_TIME,
-                        fault_processing_time);
-#endif
-
-    return ret;
-
-not_handled_no_perf:
-    
-    return 0;
-}
-
-/**
- *  
- */
-void break_all_cow_pages(struct task_struct* task, struct task_struct* orig) {
-    struct mm_struct* mm = task->mm;
-    struct vm_area_struct* curr = mm->mmap;
-    unsigned long i,start, end;
-    while(curr) {
-        if(is_maybe_cow(curr)) {
-            start = curr->vm_start;
-            end = curr->vm_end;
-            for(i = start; i < end; i += PAGE_SIZE) {
-                if(break_cow(mm,curr,i)) {
-                    mk_page_writable_lookupvma(orig->mm,i);
+    PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
+    curr = _lamport_barrier_queue_head;
+    while(curr && done) {
+        queue = (lamport_barrier_queue_t*)curr;
+        if(queue->tgroup_home_cpu == cpu && queue->tgroup_home_id == id) {
+            entry = queue->queue;
+            while(entry) {
+                if(entry->cpu == _cpu && entry->timestamp <= ts) {
+                    done = 0;
+                    break;
                 }
+                entry = (lamport_barrier_entry_t*)entry->header.next;
             }
         }
-        curr = curr->vm_next;
+        curr = curr->next;
     }
+    PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+
+    return done;
 }
 
 /**
- * @brief Propagate origin thread group to children, and initialize other 
- * task members.  If the parent was member of a remote thread group,
- * store the thread group info.
+ * @brief Announce a newly created mm for task's thread group to every
+ * kernel known to hold one, and learn which kernels they know of in
+ * turn.  Repeats until no new kernel is discovered.
  *
- * Note: In addition to in this function, distribution information is
- * maintained when a thread or process is migrated.  That ensures
- * that all members of a thread group are kept up-to-date when
- * one member migrates.
- */
-int process_server_dup_task(struct task_struct* orig, struct task_struct* task)
-{
-    // TODO more work to support kernel clustering is still required
-    int home_kernel =
+ * Once this returns, every kernel that holds the mm sends this kernel
+ * its mm traffic, and every lamport lock it took without asking this
+ * kernel has been released.
+ */
+static void tgroup_mm_join(struct task_struct* task) {
+    tgroup_mm_join_data_t* data;
+    tgroup_mm_join_t msg;
+    unsigned long announced = 0;
+    unsigned long long wait_start;
+    int round = 0;
+    int sent;
+    int i;
+#ifdef SUPPORT_FOR_CLUSTERING
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+extern struct list_head rlist_head;
+#endif
+
+    do {
+        data = kmalloc(sizeof(tgroup_mm_join_data_t),GFP_KERNEL);
+        if(!data) {
+            // Fall back to the whole mask we were told about.
+            printk(KERN_ERR"%s: out of memory, mm join incomplete\n",
+                   __func__);
+            return;
+        }
+        data->header.data_type = PROCESS_SERVER_TGROUP_MM_JOIN_DATA_TYPE;
+        data->tgroup_home_cpu = task->tgroup_home_cpu;
+        data->tgroup_home_id = task->tgroup_home_id;
+        data->requester_pid = task->pid;
+        data->known_cpu_with_tgroup_mm = 0;
+        data->responses = 0;
+        data->expected_responses = 0;
+        add_data_entry_to(data,
+                          &_tgroup_mm_join_data_head_lock,
+                          &_tgroup_mm_join_data_head);
+
+        msg.header.type = PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN;
+        msg.header.prio = PCN_KMSG_PRIO_NORMAL;
+        msg.tgroup_home_cpu = task->tgroup_home_cpu;
+        msg.tgroup_home_id = task->tgroup_home_id;
+        msg.requester_pid = task->pid;
+        msg.known_cpu_with_tgroup_mm = task->known_cpu_with_tgroup_mm;
+
+        sent = 0;
 #ifndef SUPPORT_FOR_CLUSTERING
-    _cpu;
+        for(i = 0; i < NR_CPUS; i++) {
+            // Skip the current cpu
+            if(i == _cpu) continue;
 #else
-    cpumask_first(cpu_present_mask);
+        // the list does not include the current processor group descirptor (TODO)
+        list_for_each(iter, &rlist_head) {
+            objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+            i = objPtr->_data._processor;
 #endif
-
-    task->executing_for_remote = 0;
-    task->represents_remote = 0;
-    task->enable_do_mmap_pgoff_hook = 1;
-    task->prev_cpu = -1;
-    task->next_cpu = -1;
-    task->prev_pid = -1;
-    task->next_pid = -1;
-    task->clone_data = NULL;
-    task->t_home_cpu = home_kernel;
-    task->t_home_id  = task->pid;
-    task->t_distributed = 0;
-    task->previous_cpus = 0;
-    task->known_cpu_with_tgroup_mm = 0;
-    task->return_disposition = RETURN_DISPOSITION_NONE;
-    task->surrogate = -1;
-    task->uaddr = 0;
-    task->futex_state = 0;
-    task->migration_state = 0;
-    spin_lock_init(&(task->mig_lock));
-    // If this is pid 1 or 2, the parent cannot have been migrated
-    // so it is safe to take on all local thread info.
-    if(unlikely(orig->pid == 1 || orig->pid == 2)) {
-        task->tgroup_home_cpu = home_kernel;
-        task->tgroup_home_id = orig->tgid;
-        task->tgroup_distributed = 0;
-        return 1;
-    }
-    // If the new task is not in the same thread group as the parent,
-    // then we do not need to propagate the old thread info.
-    if(orig->tgid != task->tgid) {
-        task->tgroup_home_cpu = home_kernel;
-        task->tgroup_home_id = task->tgid;
-        task->tgroup_distributed = 0;
-
-        // COW problem fix, necessary for coherency.
-        if(orig->tgroup_distributed) {
-            break_all_cow_pages(task,orig);
+            if(!kernel_has_known_tgroup_mm(task->known_cpu_with_tgroup_mm,i))
+                continue;
+            // Each kernel is asked once.  Those the mask cannot describe
+            // are only asked in the first round.
+            if(i < BITS_PER_LONG ? test_bit(i,&announced) : round)
+                continue;
+            if(i < BITS_PER_LONG)
+                set_bit(i,&announced);
+
+            if(!pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&msg))) {
+                PS_SPIN_LOCK(&_tgroup_mm_join_data_head_lock);
+                data->expected_responses++;
+                PS_SPIN_UNLOCK(&_tgroup_mm_join_data_head_lock);
+                sent++;
+            }
         }
 
-        return 1;
-    }
+        wait_start = native_read_tsc();
+        wait_event(_tgroup_mm_join_wq,
+                   data->responses >= data->expected_responses);
+        process_server_track_wait(PS_WAIT_MM_JOIN,wait_start);
 
-    // Inherit the list of known cpus with mms for this thread group 
-    // once we know that the task is int he same tgid.
-    task->known_cpu_with_tgroup_mm = orig->known_cpu_with_tgroup_mm;
+        PS_SPIN_LOCK(&_tgroup_mm_join_data_head_lock);
+        remove_data_entry_from(data,&_tgroup_mm_join_data_head);
+        PS_SPIN_UNLOCK(&_tgroup_mm_join_data_head_lock);
 
-    // This is important.  We want to make sure to keep an accurate record
-    // of which cpu and thread group the new thread is a part of.
-    if(orig->executing_for_remote == 1 || orig->tgroup_home_cpu != home_kernel) {
-        task->tgroup_home_cpu = orig->tgroup_home_cpu;
-        task->tgroup_home_id = orig->tgroup_home_id;
-        task->tgroup_distributed = 1;
-       // task->origin_pid = orig->origin_pid;
-    } else {
-        task->tgroup_home_cpu = home_kernel;
-        task->tgroup_home_id = orig->tgid;
-        task->tgroup_distributed = 0;
-    }
-//printk(KERN_ALERT"TGID {%d} \n",task->tgid);
-    return 1;
+        merge_known_tgroup_mm(task,data->known_cpu_with_tgroup_mm);
+        kfree(data);
+        round++;
+    } while(sent);
 }
+
 /**
- * @brief Migrate the specified task <task> to a CPU on which
- * it has not yet executed.
- *
- * <MEASURE perf_process_server_do_migration>
+ * @brief Record a kernel that joined a thread group's mm, wait until
+ * this kernel's lamport locks it could not have seen are released,
+ * then reply with the kernels known to hold the mm.
  */
-int do_migration_to_new_cpu(struct task_struct* task, int cpu) {
-    struct pt_regs *regs = task_pt_regs(task);
-    // TODO: THIS IS WRONG, task flags is not what I want here.
-    unsigned long clone_flags = task->clone_flags;
-    unsigned long stack_start = task->mm->start_stack;
-    clone_request_t* request = kmalloc(sizeof(clone_request_t),GFP_KERNEL);
-    struct task_struct* tgroup_iterator = NULL;
-    struct task_struct* g;
-    int dst_cpu = cpu;
-    char path[256] = {0};
-    char* rpath = d_path(&task->mm->exe_file->f_path,path,256);
-    int lclone_request_id;
-    int perf = -1;
+static void process_tgroup_mm_join(struct work_struct* work) {
+    tgroup_mm_join_work_t* w = (tgroup_mm_join_work_t*)work;
+    tgroup_mm_join_response_t response;
+    struct task_struct* task = NULL;
+    mm_data_t* saved_mm = NULL;
+    mprotect_batch_data_t* batch = NULL;
+    unsigned long lockflags;
+    unsigned long long ts;
+    unsigned long long wait_start;
+
+    response.known_cpu_with_tgroup_mm = 0;
+    find_thread_mm(w->tgroup_home_cpu,w->tgroup_home_id,&saved_mm,&task);
+    if(task) {
+        set_cpu_has_known_tgroup_mm(task,w->from_cpu);
+        merge_known_tgroup_mm(task,w->known_cpu_with_tgroup_mm);
+        response.known_cpu_with_tgroup_mm = task->known_cpu_with_tgroup_mm;
+    }
+
+    // Lamport requests queued from here on include the new kernel,
+    // earlier ones did not and must drain before it may fault.
+    ts = lamport_own_latest_timestamp(w->tgroup_home_cpu,w->tgroup_home_id);
+    if(ts) {
+        wait_start = native_read_tsc();
+        wait_event(_lamport_barrier_wq,
+                   lamport_own_entries_released(w->tgroup_home_cpu,
+                                                w->tgroup_home_id,ts));
+        process_server_track_wait(PS_WAIT_MM_JOIN,wait_start);
+    }
+
+    // Protection changes queued before the new kernel was known would
+    // not be pushed to it.  Push them, to it as well, before it may
+    // fault.
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    batch = find_mprotect_batch_data(w->tgroup_home_cpu,w->tgroup_home_id);
+    if(batch && w->from_cpu >= 0 && w->from_cpu < BITS_PER_LONG)
+        set_bit(w->from_cpu,&batch->known_cpu_with_tgroup_mm);
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
+    if(batch)
+        mprotect_batch_flush(w->tgroup_home_cpu,w->tgroup_home_id);
+
+    response.header.type = PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN_RESPONSE;
+    response.header.prio = PCN_KMSG_PRIO_NORMAL;
+    response.tgroup_home_cpu = w->tgroup_home_cpu;
+    response.tgroup_home_id = w->tgroup_home_id;
+    response.requester_pid = w->requester_pid;
+    DO_UNTIL_SUCCESS(pcn_kmsg_send(w->from_cpu,
+                        (struct pcn_kmsg_message*)(&response)));
 
-    printk("process_server_do_migration pid{%d} cpu {%d}\n",task->pid,cpu);
+    kfree(work);
+}
 
-    // Nothing to do if we're migrating to the current cpu
-    if(dst_cpu == _cpu) {
-        return PROCESS_SERVER_CLONE_FAIL;
+/**
+ * @brief Message handler for thread group mm join requests.
+ */
+static int handle_tgroup_mm_join(struct pcn_kmsg_message* inc_msg) {
+    tgroup_mm_join_t* msg = (tgroup_mm_join_t*)inc_msg;
+    tgroup_mm_join_work_t* work;
+
+    work = kmalloc(sizeof(tgroup_mm_join_work_t),GFP_ATOMIC);
+    if(work) {
+        INIT_WORK((struct work_struct*)work,process_tgroup_mm_join);
+        work->tgroup_home_cpu = msg->tgroup_home_cpu;
+        work->tgroup_home_id = msg->tgroup_home_id;
+        work->requester_pid = msg->requester_pid;
+        work->known_cpu_with_tgroup_mm = msg->known_cpu_with_tgroup_mm;
+        work->from_cpu = msg->header.from_cpu;
+        queue_work(tgroup_mm_join_wq,(struct work_struct*)work);
     }
 
-    perf = PERF_MEASURE_START(&perf_process_server_do_migration);
+    pcn_kmsg_free_msg(inc_msg);
 
-    // This will be a placeholder process for the remote
-    // process that is subsequently going to be started.
-    // Block its execution.
-    __set_task_state(task,TASK_UNINTERRUPTIBLE);
+    return 0;
+}
 
+/**
+ * @brief Message handler for thread group mm join responses.
+ */
+static int handle_tgroup_mm_join_response(struct pcn_kmsg_message* inc_msg) {
+    tgroup_mm_join_response_t* msg = (tgroup_mm_join_response_t*)inc_msg;
+    tgroup_mm_join_data_t* data;
 
-    int sig;
-    struct task_struct *t=current;
-    // Book keeping for previous cpu bitmask.
-    set_bit(smp_processor_id(),&task->previous_cpus);
+    PS_SPIN_LOCK(&_tgroup_mm_join_data_head_lock);
+    data = find_tgroup_mm_join_data(msg->tgroup_home_cpu,
+                                    msg->tgroup_home_id,
+                                    msg->requester_pid);
+    if(data) {
+        data->known_cpu_with_tgroup_mm |= msg->known_cpu_with_tgroup_mm;
+        data->responses++;
+    }
+    PS_SPIN_UNLOCK(&_tgroup_mm_join_data_head_lock);
 
-    // Book keeping for placeholder process.
-    spin_lock_irq(&(task->mig_lock));
-    task->represents_remote = 1;
-    task->tgroup_distributed = 1;
-    task->t_distributed = 1;
-    spin_unlock_irq(&(task->mig_lock));
+    wake_up(&_tgroup_mm_join_wq);
 
+    pcn_kmsg_free_msg(inc_msg);
 
-    /*mklinux_akshay*/
-    if(task->prev_pid==-1)
-    	task->origin_pid=task->pid;
-    else
-    	task->origin_pid=task->origin_pid;
+    return 0;
+}
 
-   struct task_struct *par = task->parent;
+/**
+ * @brief Hooks do_mmap_pgoff.  This is necessary in order to maintain
+ * address space coherency, since do_mmap_pgoff can modify existing
+ * mappings.  If do_mmap_pgoff were allowed to modify existing mappings
+ * without first unmapping those mappings remotely, multiple different
+ * mappings for the same address would then exist between CPUs.  This
+ * function forces remote munmap prior to doing the local do_mmap_pgoff.
+ */
+unsigned long process_server_do_mmap_pgoff(struct file *file, unsigned long addr,
+                                           unsigned long len, unsigned long prot,
+                                           unsigned long flags, unsigned long pgoff) {
 
+    // Nothing to do for a thread group that's not distributed.
+    // Also, skip if the mmap hook is turned off.  This should
+    // only happen when memory mapping within process_server
+    // fault handler and import address space.
+    if(!current->tgroup_distributed || !current->enable_do_mmap_pgoff_hook) {
+        goto not_handled_no_perf;
+    }
 
-    // Book keeping for distributed threads.
+    vma_miss_cache_invalidate(current->tgroup_home_cpu,
+                              current->tgroup_home_id,
+                              addr,len,0);
 
-    read_lock(&tasklist_lock);
-    do_each_thread(g,tgroup_iterator) {
-        if(tgroup_iterator != task) {
-            if(tgroup_iterator->tgid == task->tgid) {
-                tgroup_iterator->tgroup_distributed = 1;
-                tgroup_iterator->tgroup_home_id = task->tgroup_home_id;
-                tgroup_iterator->tgroup_home_cpu = task->tgroup_home_cpu;
+    // Do a distributed munmap on the entire range of addresses that
+    // are about to be remapped.  This will ensure that the range
+    // is cleared out remotely, as well as locally (handled by the
+    // do_mmap_pgoff implementation) to keep from having differing
+    // vm address spaces on different cpus.
+    process_server_do_munmap(current->mm,
+                             addr,
+                             len);
+
+not_handled_no_perf:
+    return 0;
+}
+
+/**
+ * @brief Map the remote vma [start,start+size) into the current mm,
+ * leaving any part that is already mapped untouched.  <path> is
+ * empty for anonymous memory and may be modified.
+ * NOTE: current->enable_do_mmap_pgoff_hook must be disabled
+ *       by client code before calling this.
+ * @return start on success.
+ */
+static unsigned long install_remote_vma(char* path,
+                                        unsigned long start,
+                                        unsigned long size,
+                                        unsigned long vm_flags,
+                                        unsigned long pgoff) {
+    struct file* f = NULL;
+    unsigned long prot = 0;
+    unsigned long err = 0;
+
+    // Figure out how to protect this region.
+    prot |= (vm_flags & VM_READ)?  PROT_READ  : 0;
+    prot |= (vm_flags & VM_WRITE)? PROT_WRITE : 0;
+    prot |= (vm_flags & VM_EXEC)?  PROT_EXEC  : 0;
+
+    if(path[0] == '\0') {       
+        PSPRINTK("mapping anonymous\n");
+        // mmap parts that are missing, while leaving the existing
+        // parts untouched.
+        PS_DOWN_WRITE(&current->mm->mmap_sem);
+        err = do_mmap_remaining(NULL,
+                start,
+                size,
+                prot,
+                MAP_FIXED|
+                MAP_ANONYMOUS|
+                ((vm_flags & VM_SHARED)?MAP_SHARED:MAP_PRIVATE),
+                0, (vm_flags & VM_NORESERVE) ?1:0);
+        PS_UP_WRITE(&current->mm->mmap_sem);
+        return err;
+    }
+
+    PSPRINTK("opening file to map\n");
+
+    // Temporary, check to see if the path is /dev/null (deleted), it should just
+    // be /dev/null in that case.  TODO: Add logic to detect and remove the 
+    // " (deleted)" from any path here.  This is important, because anonymous mappings
+    // are sometimes, depending on how glibc is compiled, mapped instead to the /dev/zero
+    // file, and without this check, the filp_open call will fail because the "(deleted)"
+    // string at the end of the path results in the file not being found.
+    if( !strncmp( "/dev/zero (deleted)", path, strlen("/dev/zero (deleted)")+1 )) {
+        path[9] = '\0';
+    }
+
+    f = filp_open(path, (vm_flags & VM_SHARED)? O_RDWR:O_RDONLY, 0);
+    if(IS_ERR(f)) {
+        printk("Error opening file %s\n",path);
+        return 0;
+    }
+
+    PSPRINTK("mapping file %s, %lx, %lx, %lx\n",path,
+            start, 
+            size,
+            (unsigned long)f);
+    // mmap parts that are missing, while leaving the existing
+    // parts untouched.
+    PS_DOWN_WRITE(&current->mm->mmap_sem);
+    err = do_mmap_remaining(f,
+            start,
+            size,
+            prot,
+            MAP_FIXED |
+            ((vm_flags & VM_DENYWRITE)?MAP_DENYWRITE:0) |
+            ((vm_flags & VM_EXECUTABLE)?MAP_EXECUTABLE:0) |
+            ((vm_flags & VM_SHARED)?MAP_SHARED:MAP_PRIVATE),
+            pgoff << PAGE_SHIFT, (vm_flags & VM_NORESERVE) ?1:0);
+    PS_UP_WRITE(&current->mm->mmap_sem);
+
+    filp_close(f,NULL);
+
+    return err;
+}
+
+/**
+ * @brief Finds a vma announcement waiting for responses.
+ * @prerequisite Requires user to hold _vma_update_data_head_lock
+ */
+static vma_update_data_t* find_vma_update_data(int cpu, int id,
+        int requester_pid, unsigned long address) {
+    data_header_t* curr = _vma_update_data_head;
+    vma_update_data_t* data = NULL;
+
+    while(curr) {
+        data = (vma_update_data_t*)curr;
+        if(data->tgroup_home_cpu == cpu &&
+           data->tgroup_home_id == id &&
+           data->requester_pid == requester_pid &&
+           data->vaddr_start == address) {
+            return data;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Install an announced vma in this kernel's copy of the
+ * thread group's mm, if there is one, and acknowledge it.
+ */
+static void process_vma_update(struct work_struct* work) {
+    vma_update_work_t* w = (vma_update_work_t*)work;
+    vma_update_t* msg = w->msg;
+    vma_update_response_t response;
+    struct mm_struct* mm = NULL;
+    struct task_struct* task = NULL;
+    mm_data_t* saved_mm = NULL;
+    unsigned long err;
+
+    vma_miss_cache_invalidate(msg->tgroup_home_cpu,msg->tgroup_home_id,
+                              msg->vaddr_start,msg->vaddr_size,
+                              msg->version);
+
+    mm = find_thread_mm(msg->tgroup_home_cpu,msg->tgroup_home_id,
+                        &saved_mm,&task);
+    if(mm && !atomic_inc_not_zero(&mm->mm_users))
+        mm = NULL;
+
+    if(mm) {
+        if(task)
+            set_cpu_has_known_tgroup_mm(task,msg->header.from_cpu);
+
+        current->enable_distributed_munmap = 0;
+        current->enable_do_mmap_pgoff_hook = 0;
+        use_mm(mm);
+        err = install_remote_vma(msg->path,
+                                 msg->vaddr_start,
+                                 msg->vaddr_size,
+                                 msg->vm_flags,
+                                 msg->pgoff);
+        unuse_mm(mm);
+        current->enable_distributed_munmap = 1;
+        current->enable_do_mmap_pgoff_hook = 1;
+        mmput(mm);
+
+        if(err != msg->vaddr_start)
+            printk(KERN_ALERT"%s: ERROR installing vma {%lx-%lx} \"%s\" %lx\n",
+                    __func__,msg->vaddr_start,
+                    msg->vaddr_start + msg->vaddr_size,msg->path,err);
+    }
+
+    response.header.type = PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE_RESPONSE;
+    response.header.prio = PCN_KMSG_PRIO_NORMAL;
+    response.tgroup_home_cpu = msg->tgroup_home_cpu;
+    response.tgroup_home_id = msg->tgroup_home_id;
+    response.requester_pid = msg->requester_pid;
+    response.vaddr_start = msg->vaddr_start;
+    DO_UNTIL_SUCCESS(pcn_kmsg_send(msg->header.from_cpu,
+                        (struct pcn_kmsg_message*)&response));
+
+    pcn_kmsg_free_msg(msg);
+    kfree(work);
+}
+
+/**
+ * @brief Message handler for vma announcements.
+ */
+static int handle_vma_update(struct pcn_kmsg_message* inc_msg) {
+    vma_update_t* msg = (vma_update_t*)inc_msg;
+    vma_update_work_t* work;
+
+    work = kmalloc(sizeof(vma_update_work_t),GFP_ATOMIC);
+    if(work) {
+        INIT_WORK( (struct work_struct*)work, process_vma_update);
+        // The message is big, hand it to the bottom half which frees it.
+        work->msg = msg;
+        queue_work(mapping_wq, (struct work_struct*)work);
+    } else {
+        pcn_kmsg_free_msg(inc_msg);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Message handler for vma announcement acknowledgements.
+ */
+static int handle_vma_update_response(struct pcn_kmsg_message* inc_msg) {
+    vma_update_response_t* msg = (vma_update_response_t*)inc_msg;
+    vma_update_data_t* data = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_vma_update_data_head_lock,lockflags);
+    data = find_vma_update_data(msg->tgroup_home_cpu,
+                                msg->tgroup_home_id,
+                                msg->requester_pid,
+                                msg->vaddr_start);
+    if(data) {
+        spin_lock(&data->lock);
+        data->responses++;
+        spin_unlock(&data->lock);
+    }
+    spin_unlock_irqrestore(&_vma_update_data_head_lock,lockflags);
+
+    if(data)
+        wake_up(&_vma_update_wq);
+
+    pcn_kmsg_free_msg(inc_msg);
+
+    return 0;
+}
+
+static int vma_update_done(vma_update_data_t* data) {
+    unsigned long lockflags;
+    int done;
+
+    spin_lock_irqsave(&data->lock,lockflags);
+    done = (data->expected_responses == data->responses);
+    spin_unlock_irqrestore(&data->lock,lockflags);
+
+    return done;
+}
+
+/**
+ * @brief Called by the mmap syscall once mmap_sem has been released.
+ * Pushes the vma that was just created at [addr,addr+len) to every
+ * other kernel and waits until they have installed it, so that their
+ * faults in it never have to look up the vma remotely.  munmap is
+ * already propagated eagerly by process_server_do_munmap, and mprotect
+ * in batches by process_server_do_mprotect.
+ * NOTE: mm->mmap_sem must not be held, the other kernels may need
+ *       their copy of it, held by a thread waiting on us.
+ */
+int process_server_notify_mmap(unsigned long addr, unsigned long len) {
+    vma_update_t* msg = NULL;
+    vma_update_data_t* data = NULL;
+    struct mm_struct* mm = current->mm;
+    struct vm_area_struct* vma;
+    struct file* file = NULL;
+    unsigned long vm_flags;
+    unsigned long pgoff;
+    char* ppath;
+    unsigned long lockflags;
+    unsigned long long wait_start;
+    int i;
+    int s;
+
+    // Faults and vma announcements install vmas with the hook
+    // turned off, those are not new.
+    if(!current->tgroup_distributed || !current->enable_do_mmap_pgoff_hook)
+        return 0;
+
+    len = PAGE_ALIGN(len);
+
+    msg = kmalloc(sizeof(vma_update_t),GFP_KERNEL);
+    data = kmalloc(sizeof(vma_update_data_t),GFP_KERNEL);
+    if(!msg || !data)
+        goto exit;
+
+    // Another thread may have changed the range since, in which case
+    // that change is announced instead.
+    down_read(&mm->mmap_sem);
+    vma = find_vma(mm,addr);
+    if(!vma || vma->vm_start > addr || vma->vm_end < addr + len) {
+        up_read(&mm->mmap_sem);
+        goto exit;
+    }
+    vm_flags = vma->vm_flags;
+    pgoff = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    if(vma->vm_file) {
+        file = vma->vm_file;
+        get_file(file);
+    }
+    up_read(&mm->mmap_sem);
+
+    if(file) {
+        ppath = d_path(&file->f_path,msg->path,sizeof(msg->path));
+        fput(file);
+        // Without a path, leave it to the other kernels' faults.
+        if(IS_ERR(ppath))
+            goto exit;
+        memmove(msg->path,ppath,strlen(ppath)+1);
+    } else {
+        msg->path[0] = '\0';
+    }
+
+    msg->header.type = PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE;
+    msg->header.prio = PCN_KMSG_PRIO_NORMAL;
+    msg->tgroup_home_cpu = current->tgroup_home_cpu;
+    msg->tgroup_home_id = current->tgroup_home_id;
+    msg->requester_pid = current->pid;
+    msg->version = vma_miss_cache_generation();
+    msg->vaddr_start = addr;
+    msg->vaddr_size = len;
+    msg->vm_flags = vm_flags;
+    msg->pgoff = pgoff;
+
+    data->header.data_type = PROCESS_SERVER_VMA_UPDATE_DATA_TYPE;
+    data->tgroup_home_cpu = current->tgroup_home_cpu;
+    data->tgroup_home_id = current->tgroup_home_id;
+    data->requester_pid = current->pid;
+    data->vaddr_start = addr;
+    data->responses = 0;
+    data->expected_responses = 0;
+    spin_lock_init(&data->lock);
+
+    add_data_entry_to(data,
+                      &_vma_update_data_head_lock,
+                      &_vma_update_data_head);
+
+#ifndef SUPPORT_FOR_CLUSTERING
+    for(i = 0; i < NR_CPUS; i++) {
+        // Skip the current cpu
+        if(i == _cpu) continue;
+#else
+    // the list does not include the current processor group descirptor (TODO)
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        i = objPtr->_data._processor;
+#endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i)) continue;
+        s = pcn_kmsg_send_long(i,(struct pcn_kmsg_long_message*)msg,
+                               sizeof(vma_update_t) - sizeof(msg->header));
+        if(!s) {
+            spin_lock_irqsave(&data->lock,lockflags);
+            data->expected_responses++;
+            spin_unlock_irqrestore(&data->lock,lockflags);
+        }
+    }
+
+    wait_start = native_read_tsc();
+    wait_event(_vma_update_wq, vma_update_done(data));
+    process_server_track_wait(PS_WAIT_VMA_UPDATE,wait_start);
+
+    spin_lock_irqsave(&_vma_update_data_head_lock,lockflags);
+    remove_data_entry_from(data,&_vma_update_data_head);
+    spin_unlock_irqrestore(&_vma_update_data_head_lock,lockflags);
+
+exit:
+    kfree(data);
+    kfree(msg);
+
+    return 0;
+}
+
+/**
+ * @brief Whether every cpu has answered the mapping request <data>,
+ * or one of them answered with a complete physical mapping.
+ */
+static int mapping_request_done(mapping_request_data_t* data) {
+    unsigned long lockflags;
+    int done;
+
+    spin_lock_irqsave(&data->lock,lockflags);
+    done = (data->expected_responses == data->responses || data->complete);
+    spin_unlock_irqrestore(&data->lock,lockflags);
+
+    return done;
+}
+
+/**
+ * @brief Finds the negative vma lookup cache of a thread group.
+ * @prerequisite Requires user to hold _vma_miss_data_head_lock
+ */
+static vma_miss_data_t* find_vma_miss_data(int tgroup_home_cpu,
+                                           int tgroup_home_id) {
+    data_header_t* curr = _vma_miss_data_head;
+    vma_miss_data_t* data = NULL;
+
+    while(curr) {
+        data = (vma_miss_data_t*)curr;
+        if(data->tgroup_home_cpu == tgroup_home_cpu &&
+           data->tgroup_home_id  == tgroup_home_id) {
+            return data;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Whether <address> recently had no vma on any kernel.
+ */
+static int vma_miss_cache_lookup(unsigned long address) {
+    vma_miss_data_t* data = NULL;
+    unsigned long lockflags;
+    int hit = 0;
+    int i;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(current->tgroup_home_cpu,
+                              current->tgroup_home_id);
+    if(data) {
+        for(i = 0; i < VMA_MISS_CACHE_RANGES; i++) {
+            vma_miss_range_t* r = &data->ranges[i];
+            if(r->start <= address && address < r->end &&
+               time_before(jiffies,r->stamp + VMA_MISS_CACHE_TTL)) {
+                hit = 1;
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+
+    return hit;
+}
+
+/**
+ * @brief Current generation of the calling thread group's cache,
+ * creating the cache if needed.  Taken before the mapping requests
+ * are sent, and handed back to vma_miss_cache_insert.
+ */
+static unsigned long vma_miss_cache_generation(void) {
+    vma_miss_data_t* data = NULL;
+    vma_miss_data_t* new_data = NULL;
+    unsigned long lockflags;
+    unsigned long generation;
+
+    new_data = kmalloc(sizeof(vma_miss_data_t),GFP_KERNEL);
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(current->tgroup_home_cpu,
+                              current->tgroup_home_id);
+    if(!data && new_data) {
+        data = new_data;
+        new_data = NULL;
+        memset(data,0,sizeof(vma_miss_data_t));
+        data->header.data_type = PROCESS_SERVER_VMA_MISS_DATA_TYPE;
+        data->tgroup_home_cpu = current->tgroup_home_cpu;
+        data->tgroup_home_id = current->tgroup_home_id;
+        data->generation = 1;
+        add_data_entry_to(data,NULL,&_vma_miss_data_head);
+    }
+    // Generation 0 is never current, so a miss will not be recorded.
+    generation = data? data->generation : 0;
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+
+    if(new_data) kfree(new_data);
+
+    return generation;
+}
+
+/**
+ * @brief Record that no kernel has a vma at <address>, provided nothing
+ * was invalidated since <generation> was taken.  Adjacent misses are
+ * merged into one range.
+ */
+static void vma_miss_cache_insert(unsigned long address,
+                                  unsigned long generation) {
+    vma_miss_data_t* data = NULL;
+    vma_miss_range_t* r = NULL;
+    unsigned long start = address & PAGE_MASK;
+    unsigned long end = start + PAGE_SIZE;
+    unsigned long lockflags;
+    int i;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(current->tgroup_home_cpu,
+                              current->tgroup_home_id);
+    if(!data || data->generation != generation)
+        goto out;
+
+    for(i = 0; i < VMA_MISS_CACHE_RANGES; i++) {
+        vma_miss_range_t* curr = &data->ranges[i];
+        if(curr->start < curr->end &&
+           time_before(jiffies,curr->stamp + VMA_MISS_CACHE_TTL) &&
+           (curr->end == start || curr->start == end)) {
+            r = curr;
+            break;
+        }
+    }
+    if(r) {
+        if(r->end == start) r->end = end;
+        else r->start = start;
+    } else {
+        r = &data->ranges[data->next];
+        data->next = (data->next + 1) % VMA_MISS_CACHE_RANGES;
+        r->start = start;
+        r->end = end;
+    }
+    r->stamp = jiffies;
+
+out:
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+}
+
+/**
+ * @brief Forget the misses of a thread group that overlap
+ * [start,start+len), and start a new generation.  Called for every
+ * mmap/munmap/mremap, both locally and when a remote one is announced.
+ * The generation doubles as the version of the thread group's vma
+ * layout: <version> is the one a remote change was announced with, 0
+ * for local changes, and the new generation is ordered after both.
+ */
+static void vma_miss_cache_invalidate(int tgroup_home_cpu, int tgroup_home_id,
+                                      unsigned long start, unsigned long len,
+                                      unsigned long version) {
+    vma_miss_data_t* data = NULL;
+    unsigned long lockflags;
+    int i;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(tgroup_home_cpu,tgroup_home_id);
+    if(data) {
+        if(version > data->generation)
+            data->generation = version;
+        data->generation++;
+        if(!data->generation) data->generation = 1;
+        for(i = 0; i < VMA_MISS_CACHE_RANGES; i++) {
+            vma_miss_range_t* r = &data->ranges[i];
+            if(r->start < start + len && start < r->end)
+                r->start = r->end = 0;
+        }
+        for(i = 0; i < FILE_CLEAN_CACHE_RANGES; i++) {
+            vma_miss_range_t* r = &data->clean[i];
+            if(r->start < start + len && start < r->end)
+                r->start = r->end = 0;
+        }
+    }
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+}
+
+/**
+ * @brief Drop the cache of a thread group that has exited.
+ */
+static void vma_miss_cache_destroy(int tgroup_home_cpu, int tgroup_home_id) {
+    vma_miss_data_t* data = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(tgroup_home_cpu,tgroup_home_id);
+    if(data)
+        remove_data_entry_from(data,&_vma_miss_data_head);
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+
+    if(data) kfree(data);
+}
+
+/**
+ * @brief Whether every page of <vma> can only ever come from its backing
+ * file: a private, read only file mapping that never had anonymous
+ * pages.  Such pages are the same on every kernel that has the same file.
+ */
+static int is_clean_file_vma(struct vm_area_struct* vma) {
+    return vma->vm_file &&
+           !(vma->vm_flags & (VM_WRITE | VM_MAYSHARE)) &&
+           !vma->anon_vma;
+}
+
+/**
+ * @brief Describe the contents of <file>, see file_identity_t.
+ */
+static void get_file_identity(struct file* file, file_identity_t* id) {
+    struct inode* inode = file->f_path.dentry->d_inode;
+
+    id->ino = inode->i_ino;
+    id->size = i_size_read(inode);
+    id->mtime = inode->i_mtime;
+    id->generation = inode->i_generation;
+}
+
+/**
+ * @brief Whether <file> is the same file that <id> was taken from.
+ */
+static int file_identity_matches(struct file* file, file_identity_t* id) {
+    file_identity_t local;
+
+    get_file_identity(file,&local);
+
+    return local.ino == id->ino &&
+           local.size == id->size &&
+           timespec_equal(&local.mtime,&id->mtime) &&
+           local.generation == id->generation;
+}
+
+/**
+ * @brief Whether <address> is in a range that is known to be served
+ * correctly from the local page cache.
+ */
+static int file_clean_cache_lookup(unsigned long address) {
+    vma_miss_data_t* data = NULL;
+    unsigned long lockflags;
+    int hit = 0;
+    int i;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(current->tgroup_home_cpu,
+                              current->tgroup_home_id);
+    if(data) {
+        for(i = 0; i < FILE_CLEAN_CACHE_RANGES; i++) {
+            vma_miss_range_t* r = &data->clean[i];
+            if(r->start <= address && address < r->end) {
+                hit = 1;
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+
+    return hit;
+}
+
+/**
+ * @brief Record that [start,end) of the calling thread group is a clean
+ * read only file range, see is_clean_file_vma.  Only ever called once a
+ * kernel that holds pages of it vouched for them and the local file
+ * turned out to be the same.
+ */
+static void file_clean_cache_insert(unsigned long start, unsigned long end) {
+    vma_miss_data_t* data = NULL;
+    vma_miss_data_t* new_data = NULL;
+    vma_miss_range_t* r = NULL;
+    unsigned long lockflags;
+    int i;
+
+    new_data = kmalloc(sizeof(vma_miss_data_t),GFP_KERNEL);
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(current->tgroup_home_cpu,
+                              current->tgroup_home_id);
+    if(!data && new_data) {
+        data = new_data;
+        new_data = NULL;
+        memset(data,0,sizeof(vma_miss_data_t));
+        data->header.data_type = PROCESS_SERVER_VMA_MISS_DATA_TYPE;
+        data->tgroup_home_cpu = current->tgroup_home_cpu;
+        data->tgroup_home_id = current->tgroup_home_id;
+        data->generation = 1;
+        add_data_entry_to(data,NULL,&_vma_miss_data_head);
+    }
+    if(!data)
+        goto out;
+
+    for(i = 0; i < FILE_CLEAN_CACHE_RANGES; i++) {
+        vma_miss_range_t* curr = &data->clean[i];
+        if(curr->start < curr->end &&
+           curr->start <= end && start <= curr->end) {
+            r = curr;
+            break;
+        }
+    }
+    if(r) {
+        r->start = min(r->start,start);
+        r->end = max(r->end,end);
+    } else {
+        r = &data->clean[data->next_clean];
+        data->next_clean = (data->next_clean + 1) % FILE_CLEAN_CACHE_RANGES;
+        r->start = start;
+        r->end = end;
+    }
+    r->stamp = jiffies;
+
+out:
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+
+    if(new_data) kfree(new_data);
+}
+
+/**
+ * @brief Forget the clean file ranges of a thread group that overlap
+ * [start,start+len).  Called for protection changes, which can make a
+ * range writable somewhere; vma changes go through
+ * vma_miss_cache_invalidate.
+ */
+static void file_clean_cache_invalidate(int tgroup_home_cpu, int tgroup_home_id,
+                                        unsigned long start, unsigned long len) {
+    vma_miss_data_t* data = NULL;
+    unsigned long lockflags;
+    int i;
+
+    spin_lock_irqsave(&_vma_miss_data_head_lock,lockflags);
+    data = find_vma_miss_data(tgroup_home_cpu,tgroup_home_id);
+    if(data) {
+        for(i = 0; i < FILE_CLEAN_CACHE_RANGES; i++) {
+            vma_miss_range_t* r = &data->clean[i];
+            if(r->start < start + len && start < r->end)
+                r->start = r->end = 0;
+        }
+    }
+    spin_unlock_irqrestore(&_vma_miss_data_head_lock,lockflags);
+}
+
+/**
+ * Versions of the pages of the mms on this kernel, hashed by mm and
+ * page, and one version for all of them.  A version is bumped with
+ * mmap_sem held for writing whenever its pages may be unmapped or have
+ * their protection changed, see process_server_mapping_changed.  A
+ * page pulled in without the distributed page lock is installed only
+ * if the versions read before asking for it still hold.
+ */
+#define FAULT_VERSIONS 1024
+static atomic_t _fault_version[FAULT_VERSIONS];
+static atomic_t _fault_version_all = ATOMIC_INIT(0);
+
+static atomic_t* fault_version(struct mm_struct* mm, unsigned long address) {
+    u32 hash = jhash_2words((u32)(unsigned long)mm,address >> PAGE_SHIFT,0);
+    return &_fault_version[hash % FAULT_VERSIONS];
+}
+
+static unsigned long fault_version_read(struct mm_struct* mm,
+                                        unsigned long address) {
+    return ((unsigned long)atomic_read(&_fault_version_all) << 32) |
+           (u32)atomic_read(fault_version(mm,address));
+}
+
+/**
+ * @brief Pages [start,start+len) of <mm> are about to be unmapped or
+ * change protection.  Called with mmap_sem held for writing, by every
+ * munmap and mprotect of a distributed mm, whether it started here or
+ * on another kernel.  A thread group is marked distributed before any
+ * kernel is asked to join it, so no page of it can be pulled in from
+ * another kernel before its changes start to be counted.
+ */
+void process_server_mapping_changed(struct mm_struct* mm,
+                                    unsigned long start, size_t len) {
+    unsigned long addr;
+
+    if((len >> PAGE_SHIFT) >= FAULT_VERSIONS) {
+        atomic_inc(&_fault_version_all);
+        return;
+    }
+    for(addr = start & PAGE_MASK; addr < start + len; addr += PAGE_SIZE)
+        atomic_inc(fault_version(mm,addr));
+}
+
+/**
+ * @brief Decide whether the fault at <address> needs the distributed
+ * page lock.  Faults on pages that are already mapped locally, with
+ * write access for write faults, only need their permissions or
+ * accessed bits touched up, and read faults inside a local
+ * vma can at worst pull in a copy of a page, so both are resolved
+ * without it.  Write faults inside a local vma try without it too,
+ * and the page they pull in is validated against vma changes, see
+ * fault_version.  If no kernel has the page, they take the lock for
+ * its first touch.  Writes to read only pages, which break COW or
+ * replace the zero page, and faults that may change a vma (no local
+ * vma, stack growth) always take the lock.  The chosen path is accounted in
+ * /proc/procsrv_fault.
+ * @return The path taken, see enum process_server_fault_path.
+ */
+int process_server_fault_path(struct mm_struct* mm,
+                              struct vm_area_struct* vma,
+                              unsigned long address,
+                              int write) {
+    int path;
+
+    if(!current->tgroup_distributed) {
+        path = PS_FAULT_PATH_LOCAL;
+    } else if(!vma || vma->vm_start > address || vma->vm_end <= address) {
+        path = PS_FAULT_PATH_LOCKED;
+    } else if(write? is_vaddr_mapped_writable(mm,address) :
+                     is_vaddr_mapped(mm,address)) {
+        path = PS_FAULT_PATH_FAST_MAPPED;
+    } else if(!write) {
+        path = PS_FAULT_PATH_FAST_READ;
+    } else if(is_vaddr_mapped(mm,address)) {
+        // Write to a read only COW or zero page, which allocates.
+        path = PS_FAULT_PATH_LOCKED;
+    } else {
+        path = PS_FAULT_PATH_OPTIMISTIC;
+    }
+
+    this_cpu_inc(_fault_path_stats.count[path]);
+    return path;
+}
+
+/**
+ * @brief Finds the fault in flight on page <address> of <mm>.
+ * @prerequisite Requires user to hold _fault_flight_head_lock
+ */
+static fault_flight_t* find_fault_flight(struct mm_struct* mm,
+                                         unsigned long address) {
+    data_header_t* curr = _fault_flight_head;
+    fault_flight_t* flight = NULL;
+
+    while(curr) {
+        flight = (fault_flight_t*)curr;
+        if(flight->mm == mm && flight->address == address) {
+            return flight;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Coalesce a fault with the other faults on the same page of
+ * <mm>.  If another thread is already resolving the page, wait for it
+ * to finish, so that a storm of faults on one page costs a single
+ * round trip to the other kernels.  Otherwise register this fault, and
+ * set <lead>; the caller must then call
+ * process_server_fault_coalesce_done once the fault is resolved.
+ * @return 1 if the fault waited and must be looked at again, else 0.
+ */
+int process_server_fault_coalesce(struct mm_struct* mm,
+                                  unsigned long address,
+                                  int* lead) {
+    fault_flight_t* flight = NULL;
+    fault_flight_t* new_flight = NULL;
+    unsigned long lockflags;
+    unsigned long long wait_start;
+    int free_flight = 0;
+
+    *lead = 0;
+
+    if(!current->tgroup_distributed) {
+        return 0;
+    }
+
+    address &= PAGE_MASK;
+
+    new_flight = ps_cache_alloc(PS_CACHE_FAULT_FLIGHT,GFP_KERNEL);
+
+    spin_lock_irqsave(&_fault_flight_head_lock,lockflags);
+    flight = find_fault_flight(mm,address);
+    if(flight) {
+        flight->waiters++;
+    } else if(new_flight) {
+        new_flight->header.data_type = PROCESS_SERVER_FAULT_FLIGHT_DATA_TYPE;
+        new_flight->mm = mm;
+        new_flight->address = address;
+        new_flight->waiters = 0;
+        new_flight->done = 0;
+        init_waitqueue_head(&new_flight->wait_queue);
+        add_data_entry_to(new_flight,NULL,&_fault_flight_head);
+        *lead = 1;
+        new_flight = NULL;
+    }
+    spin_unlock_irqrestore(&_fault_flight_head_lock,lockflags);
+
+    if(new_flight) ps_cache_free(PS_CACHE_FAULT_FLIGHT,new_flight);
+
+    // Without memory to track it, the fault is just not coalesced.
+    if(!flight) {
+        return 0;
+    }
+
+    PSPRINTK("%s: waiting on fault in flight at %lx\n",__func__,address);
+    wait_start = native_read_tsc();
+    wait_event(flight->wait_queue, flight->done);
+    process_server_track_wait(PS_WAIT_FAULT_COALESCE,wait_start);
+
+    spin_lock_irqsave(&_fault_flight_head_lock,lockflags);
+    flight->waiters--;
+    free_flight = (flight->waiters == 0);
+    spin_unlock_irqrestore(&_fault_flight_head_lock,lockflags);
+
+    if(free_flight) ps_cache_free(PS_CACHE_FAULT_FLIGHT,flight);
+
+    return 1;
+}
+
+/**
+ * @brief Mark the fault this thread leads on page <address> of <mm> as
+ * resolved, and let the threads waiting on it retry.
+ */
+void process_server_fault_coalesce_done(struct mm_struct* mm,
+                                        unsigned long address) {
+    fault_flight_t* flight = NULL;
+    unsigned long lockflags;
+    int free_flight = 0;
+
+    address &= PAGE_MASK;
+
+    spin_lock_irqsave(&_fault_flight_head_lock,lockflags);
+    flight = find_fault_flight(mm,address);
+    if(flight) {
+        remove_data_entry_from(flight,&_fault_flight_head);
+        flight->done = 1;
+        free_flight = (flight->waiters == 0);
+        if(!free_flight)
+            wake_up_all(&flight->wait_queue);
+    }
+    spin_unlock_irqrestore(&_fault_flight_head_lock,lockflags);
+
+    if(free_flight) ps_cache_free(PS_CACHE_FAULT_FLIGHT,flight);
+}
+
+/**
+ * @brief Implements on-demand page migration.  As this CPU faults,
+ * this fault handler is invoked.  Its job is to pull in any mappings
+ * that may exist for the faulting address from other CPUs.  If
+ * <no_page> is given, it is set when every kernel with the mm was
+ * asked and none had the page.
+ * @return 0 = not handled, 1 = handled.
+ *
+ * <MEASURED perf_process_server_try_handle_mm_fault>
+ */
+static int pull_remote_mappings(struct mm_struct *mm, 
+                                struct vm_area_struct *vma,
+                                unsigned long address, 
+                                unsigned int flags, 
+                                struct vm_area_struct **vma_out,
+                                unsigned long error_code,
+                                int* no_page) {
+
+    mapping_request_data_t *data = NULL;
+    unsigned long err = 0;
+    int ret = 0;
+    mapping_request_t request;
+    int i;
+    int s;
+    int j;
+    unsigned char started_outside_vma = 0;
+    unsigned char below_stack = 0;
+    unsigned char did_early_removal = 0;
+    char path[512];
+    char* ppath;
+    // for perf
+    unsigned char pte_provided = 0;
+    unsigned char is_anonymous = 0;
+    unsigned char vma_not_found = 1;
+    unsigned char adjusted_permissions = 0;
+    unsigned char is_new_vma = 0;
+    unsigned char paddr_present = 0;
+    int perf = -1;
+    int original_enable_distributed_munmap = current->enable_distributed_munmap;
+    int original_enable_do_mmap_pgoff_hook = current->enable_do_mmap_pgoff_hook;
+    unsigned long long wait_start;
+    unsigned long miss_generation = 0;
+    unsigned long version = 0;
+    unsigned char version_conflict = 0;
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    unsigned long long mapping_wait_start = 0;
+    unsigned long long mapping_wait_end = 0;
+    unsigned long long mapping_request_send_start = 0;
+    unsigned long long mapping_request_send_end = 0;
+    unsigned long long fault_processing_time_start = 0;
+    unsigned long long fault_processing_time_end = 0;
+    unsigned long long fault_processing_time = 0;
+#endif
+
+
+    // Nothing to do for a thread group that's not distributed.
+    if(!current->tgroup_distributed) {
+        goto not_handled_no_perf;
+    }
+
+    current->enable_distributed_munmap = 0;
+    current->enable_do_mmap_pgoff_hook = 0;
+    
+    perf = PERF_MEASURE_START(&perf_process_server_try_handle_mm_fault);
+
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    fault_processing_time_start = native_read_tsc();
+#endif
+
+    PSPRINTK("Fault caught on address{%lx}, cpu{%d}, id{%d}, pid{%d}, tgid{%d}, error_code{%lx}\n",
+            address,
+            current->tgroup_home_cpu,
+            current->tgroup_home_id,
+            current->pid,
+            current->tgid,
+            error_code);
+
+    if(is_vaddr_mapped(mm,address)) {
+        PSPRINTK("exiting mk fault handler because vaddr %lx is already mapped- cpu{%d}, id{%d}\n",
+                address,current->tgroup_home_cpu,current->tgroup_home_id);
+
+        // should this thing be writable?  if so, set it and exit
+        // This is a security hole, and is VERY bad.
+        // It will also probably cause problems for genuine COW mappings..
+        if(!vma) {
+            vma = find_vma_checked(mm, address & PAGE_MASK);
+            if(!vma)
+                PSPRINTK("VMA failed to resolve\n");
+        }
+        if(vma && 
+                vma->vm_flags & VM_WRITE /*&& 
+                0 == is_page_writable(mm, vma, address & PAGE_MASK)*/) {
+            PSPRINTK("Touching up write setting\n");
+            // Children forked off this thread group get their own copy
+            // of the page before it becomes writable, see lazy_cow_fork.
+            lazy_cow_break(current->tgroup_home_cpu,current->tgroup_home_id,
+                           address & PAGE_MASK,(address & PAGE_MASK) + PAGE_SIZE);
+            mk_page_writable(mm,vma,address & PAGE_MASK);
+            adjusted_permissions = 1;
+            ret = 1;
+        } else {
+            PSPRINTK("Did not touch up write settings\n");
+        }
+
+        goto not_handled;
+    }
+
+    // Is this an optimization?  Will it work?
+    // The idea is to not bother pulling in physical pages
+    // for mappings that are executable and file backed, since
+    // those pages will never change.  Might as well map
+    // them locally.
+#if !(MIGRATE_EXECUTABLE_PAGES_ON_DEMAND)
+    if(vma && 
+            (vma->vm_start <= address) &&
+            (vma->vm_end > address) &&
+            (vma->vm_flags & VM_EXEC) && 
+            vma->vm_file) {
+        ret = 0;
+        PSPRINTK("Skipping distributed mapping pull because page is executable\n");
+
+        goto not_handled;
+    }
+#endif
+
+    // Even when they are migrated, read only file pages that are known
+    // to match the local file are mapped from the local page cache.
+    if(vma &&
+            (vma->vm_start <= address) &&
+            (vma->vm_end > address) &&
+            is_clean_file_vma(vma) &&
+            file_clean_cache_lookup(address)) {
+        ret = 0;
+        PSPRINTK("Skipping distributed mapping pull because page is clean file data\n");
+
+        goto not_handled;
+    }
+    
+    // The vma that's passed in might not always be correct.  find_vma fails by returning the wrong
+    // vma when the vma is not present.  How ugly...
+    if(vma && (vma->vm_start > address || vma->vm_end <= address)) {
+        started_outside_vma = 1;
+        below_stack = vma->vm_start > address &&
+                      (vma->vm_flags & VM_GROWSDOWN);
+        PSPRINTK("set vma = NULL, since the vma does not hold the faulting address, for whatever reason...\n");
+        vma = NULL;
+    } else if (vma) {
+        //PSPRINTK("vma found and valid\n");
+    } else {
+        //PSPRINTK("no vma present\n");
+    }
+
+    // Misses are only cached while no local vma covers the address,
+    // see vma_miss_data_t.  Another kernel may have grown its heap or a
+    // stack over the address since, without announcing it, so a cached
+    // miss only saves the broadcast when the fault is going to grow the
+    // local stack anyway.  It never turns a fault into a SIGSEGV.
+    if(!vma) {
+        if(below_stack && vma_miss_cache_lookup(address)) {
+            PSPRINTK("Skipping distributed mapping pull, no kernel has a vma at %lx\n",address);
+            goto not_handled;
+        }
+        miss_generation = vma_miss_cache_generation();
+    }
+
+    version = fault_version_read(mm,address);
+
+    data = ps_cache_alloc(PS_CACHE_MAPPING_REQUEST_DATA,GFP_KERNEL);
+    if(!data) {
+        PSPRINTK("%s: no memory for mapping request data\n",__func__);
+        goto not_handled;
+    }
+   
+    // Set up data entry to share with response handler.
+    // This data entry will be modified by the response handler,
+    // and we will check it periodically to see if our request
+    // has been responded to by all active cpus.
+    data->header.data_type = PROCESS_SERVER_MAPPING_REQUEST_DATA_TYPE;
+    data->address = address;
+    data->present = 0;
+    data->complete = 0;
+    spin_lock_init(&data->lock);
+    data->responses = 0;
+    data->expected_responses = 0;
+    data->tgroup_home_cpu = current->tgroup_home_cpu;
+    data->tgroup_home_id = current->tgroup_home_id;
+    data->requester_pid = current->pid;
+    data->path[0] = '\0';
+    data->file_clean = 0;
+    init_waitqueue_head(&data->wait_queue);
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    data->wait_time_concluded = 0;
+#endif
+    for(j = 0; j < MAX_MAPPINGS; j++) {
+        data->mappings[j].present = 0;
+        data->mappings[j].vaddr = 0;
+        data->mappings[j].paddr = 0;
+        data->mappings[j].sz = 0;
+    }
+
+
+    // Make data entry visible to handler.
+    add_data_entry_to(data,
+                      &_mapping_request_data_head_lock,
+                      &_mapping_request_data_head);
+
+    // Send out requests, tracking the number of successful
+    // send operations.  That number is the number of requests
+    // we will expect back.
+    request.header.type = PCN_KMSG_TYPE_PROC_SRV_MAPPING_REQUEST;
+    request.header.prio = PCN_KMSG_PRIO_NORMAL;
+    request.address = address;
+    request.tgroup_home_cpu = current->tgroup_home_cpu;
+    request.tgroup_home_id  = current->tgroup_home_id;
+    request.requester_pid = current->pid;
+    request.need_vma = vma? 0 : 1; // A local vma is never replaced,
+                                    // so the remote one is only needed
+                                    // when there is none.
+
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    mapping_request_send_start = native_read_tsc();
+#endif
+
+#ifndef SUPPORT_FOR_CLUSTERING
+    for(i = 0; i < NR_CPUS; i++) {
+        // Skip the current cpu
+        if(i == _cpu) continue;
+#else
+    // the list does not include the current processor group descirptor (TODO)
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+    extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) { 
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        i = objPtr->_data._processor;
+#endif
+        // Only kernels that have an mm for this thread group.
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i)) continue;
+        // Send the request to this cpu.
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        request.send_time = native_read_tsc();
+#endif
+        s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)(&request));
+        if(!s) {
+            // A successful send operation, increase the number
+            // of expected responses.
+            data->expected_responses++;
+        }
+    }
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    mapping_request_send_end = native_read_tsc();
+    PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_REQUEST_SEND_TIME,
+                        mapping_request_send_end - mapping_request_send_start);
+#endif
+
+    // Wait for all cpus to respond, or a mapping that is complete
+    // with a physical mapping.  Mapping results that do not include
+    // a physical mapping cause this to wait until all mapping responses
+    // have arrived from remote cpus.
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    mapping_wait_start = native_read_tsc();
+#endif
+    wait_start = native_read_tsc();
+    wait_event(data->wait_queue, mapping_request_done(data));
+    process_server_track_wait(PS_WAIT_MAPPING,wait_start);
+    {
+        unsigned long lockflags;
+        spin_lock_irqsave(&_mapping_request_data_head_lock,lockflags);
+        remove_data_entry_from(data,
+                              &_mapping_request_data_head);
+        spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags);
+        did_early_removal = 1;
+    }
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    mapping_wait_end = native_read_tsc();
+    PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_WAIT_TIME,
+                        mapping_wait_end - mapping_wait_start);
+    if(data->wait_time_concluded) {
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_MAPPING_POST_WAIT_TIME_RESUME,
+                            mapping_wait_end - data->wait_time_concluded);
+    }
+#endif
+    
+    // Handle successful response.
+    if(data->present) {
+        PSPRINTK(/*KERN_ALERT*/"Mapping(%d): %lx v:%lx p:%lx vaddr{%lx-%lx} prot{%lx} vm_flags{%lx} pgoff{%lx} \"%s\"\n",
+		smp_processor_id(), (unsigned long)vma, data->address, data->mappings[0].paddr,
+                data->vaddr_start, (data->vaddr_start + data->vaddr_size),
+                data->prot, data->vm_flags, data->pgoff, data->path);
+        vma_not_found = 0;
+
+        // The vma layout is pushed eagerly by process_server_notify_mmap,
+        // so a local vma covering the address is trusted as is.  Only
+        // vmas that were never announced (brk, stack growth, mmaps made
+        // from inside the kernel, or created before this kernel joined)
+        // are installed here.
+        if(!vma) {
+            PSPRINTK("vma not present\n");
+            is_new_vma = 1;
+            is_anonymous = (data->path[0] == '\0');
+            err = install_remote_vma(data->path,
+                                     data->vaddr_start,
+                                     data->vaddr_size,
+                                     data->vm_flags,
+                                     data->pgoff);
+            if(err != data->vaddr_start) {
+                PSPRINTK("ERROR: Failed to do_mmap %lx\n",err);
+                goto exit_remove_data;
+            }
+            PS_DOWN_READ(&current->mm->mmap_sem); 
+            vma = find_vma_checked(current->mm, data->address); //data->vaddr_start);
+            PS_UP_READ(&current->mm->mmap_sem);
+            if (data->address < vma->vm_start || vma->vm_end <= data->address)
+		printk(KERN_ALERT"%s: ERROR %lx is not mapped in current vma {%lx-%lx} remote vma {%lx-%lx}\n",
+			__func__, data->address, vma->vm_start, vma->vm_end,
+			data->vaddr_start, (data->vaddr_start + data->vaddr_size));
+        } else {
+            PSPRINTK("vma is present, using existing\n");
+        }
+
+        if(vma) {
+            vma->vm_flags |= VM_MIXEDMAP;
+        }
+
+        // We should have a vma now, so map physical memory into it.
+        // Check to see if we have mappings
+        for(i = 0; i < MAX_MAPPINGS; i++) {
+            if(data->mappings[i].present) {
+                paddr_present = 1;
+                break;
+            }
+        }
+        if(vma && paddr_present) { 
+            int remap_pfn_range_err = 0;
+            pte_provided = 1;
+            unsigned long cow_addr;
+
+
+            for(i = 0; i < MAX_MAPPINGS; i++) {
+                if(data->mappings[i].present) {
+                    int tmp_err;
+                    unsigned long vaddr = data->mappings[i].vaddr;
+                    unsigned long paddr = data->mappings[i].paddr;
+                    unsigned long sz = data->mappings[i].sz;
+                    // The remote vma may be larger than the local one,
+                    // only map what the local vma covers.
+                    if(vaddr < vma->vm_start) {
+                        if(vaddr + sz <= vma->vm_start) continue;
+                        paddr += vma->vm_start - vaddr;
+                        sz -= vma->vm_start - vaddr;
+                        vaddr = vma->vm_start;
+                    }
+                    if(vaddr >= vma->vm_end) continue;
+                    if(vaddr + sz > vma->vm_end)
+                        sz = vma->vm_end - vaddr;
+                    PS_DOWN_WRITE(&current->mm->mmap_sem);
+                    // A local vma may have been unmapped or changed
+                    // since the page was asked for.  Install nothing,
+                    // and let the fault happen again.
+                    if(!is_new_vma &&
+                       (fault_version_read(mm,address) != version ||
+                        find_vma(current->mm,address) != vma)) {
+                        PS_UP_WRITE(&current->mm->mmap_sem);
+                        version_conflict = 1;
+                        break;
+                    }
+                    tmp_err = remap_pfn_range_remaining(current->mm,
+                                                       vma,
+                                                       vaddr,
+                                                       paddr,
+                                                       sz,
+                                                       vm_get_page_prot(vma->vm_flags),
+                                                       1);
+                    PS_UP_WRITE(&current->mm->mmap_sem);
+                    if(tmp_err) remap_pfn_range_err = tmp_err;
+                }
+            }
+
+            // Check remap_pfn_range success
+            if(version_conflict) {
+                PSPRINTK("%s: vma changed under fault at %lx, retrying\n",
+                        __func__,address);
+                ret = 1;
+                goto exit_remove_data;
+            } else if(remap_pfn_range_err) {
+                printk(KERN_ALERT"ERROR: Failed to remap_pfn_range %d\n",err);
+            } else {
+                PSPRINTK("remap_pfn_range succeeded\n");
+                ret = 1;
+            }
+        } 
+
+        // The kernel that had the page vouched for its whole vma.  If
+        // the local vma maps the same file at the same offset, fault the
+        // rest of it in from the local page cache.
+        if(vma && data->file_clean && is_clean_file_vma(vma) &&
+           vma->vm_pgoff - (vma->vm_start >> PAGE_SHIFT) ==
+               data->pgoff - (data->vaddr_start >> PAGE_SHIFT) &&
+           file_identity_matches(vma->vm_file,&data->file_id)) {
+            file_clean_cache_insert(max(vma->vm_start,data->vaddr_start),
+                                    min(vma->vm_end,
+                                        data->vaddr_start + data->vaddr_size));
+        }
+
+        //PS_UP_WRITE(&current->mm->mmap_sem);
+
+        if(vma) {
+            *vma_out = vma;
+        }
+    } else if(!vma) {
+        vma_miss_cache_insert(address,miss_generation);
+    }
+
+    if(no_page && !pte_provided)
+        *no_page = 1;
+
+exit_remove_data:
+
+    if(!did_early_removal) {
+        unsigned long lockflags;
+        spin_lock_irqsave(&_mapping_request_data_head_lock,lockflags);
+        remove_data_entry_from(data,
+                              &_mapping_request_data_head);
+        spin_unlock_irqrestore(&_mapping_request_data_head_lock,lockflags);
+    }
+    ps_cache_free(PS_CACHE_MAPPING_REQUEST_DATA,data);
+
+    PSPRINTK("exiting fault handler\n");
+
+not_handled:
+
+    if (adjusted_permissions) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_ADJUSTED_PERMISSIONS,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,"Adjusted Permissions",perf);
+    } else if (is_new_vma && is_anonymous && pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_ANONYMOUS_PTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "New Anonymous VMA + PTE",
+                perf);
+    } else if (is_new_vma && is_anonymous && !pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_ANONYMOUS_NOPTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "New Anonymous VMA + No PTE",
+                perf);
+    } else if (is_new_vma && !is_anonymous && pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_FILEBACKED_PTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "New File Backed VMA + PTE",
+                perf);
+    } else if (is_new_vma && !is_anonymous && !pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_NEWVMA_FILEBACKED_NOPTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "New File Backed VMA + No PTE",
+                perf);
+    } else if (!is_new_vma && is_anonymous && pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_ANONYMOUS_PTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "Existing Anonymous VMA + PTE",
+                perf);
+    } else if (!is_new_vma && is_anonymous && !pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_ANONYMOUS_NOPTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "Existing Anonymous VMA + No PTE",
+                perf);
+    } else if (!is_new_vma && !is_anonymous && pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_FILEBACKED_PTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "Existing File Backed VMA + PTE",
+                perf);
+    } else if (!is_new_vma && !is_anonymous && !pte_provided) {
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+        PS_PROC_DATA_TRACK(PS_PROC_DATA_OLDVMA_FILEBACKED_NOPTE,0);
+#endif
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,
+                "Existing File Backed VMA + No PTE",
+                perf);
+    } else {
+        PERF_MEASURE_STOP(&perf_process_server_try_handle_mm_fault,"test",perf);
+    }
+
+    current->enable_distributed_munmap = original_enable_distributed_munmap;
+    current->enable_do_mmap_pgoff_hook = original_enable_do_mmap_pgoff_hook;
+
+#ifdef PROCESS_SERVER_HOST_PROC_ENTRY
+    fault_processing_time_end = native_read_tsc();
+    fault_processing_time = fault_processing_time_end - fault_processing_time_start;
+    PS_PROC_DATA_TRACK(PS_PROC_DATA_FAULT_PROCESSING_TIME,
+                        fault_processing_time);
+#endif
+
+    return ret;
+
+not_handled_no_perf:
+    
+    return 0;
+}
+
+/**
+ * @brief See pull_remote_mappings.
+ */
+int process_server_pull_remote_mappings(struct mm_struct *mm, 
+                                       struct vm_area_struct *vma,
+                                       unsigned long address, 
+                                       unsigned int flags, 
+                                       struct vm_area_struct **vma_out,
+                                       unsigned long error_code) {
+    return pull_remote_mappings(mm,vma,address,flags,vma_out,error_code,NULL);
+}
+
+/**
+ * @brief Give <task> its own copy of every cow page.  When <orig> is
+ * given, the pages it keeps are made writable again.
+ */
+void break_all_cow_pages(struct task_struct* task, struct task_struct* orig) {
+    break_cow_range(task->mm,orig? orig->mm : NULL,0,TASK_SIZE);
+}
+
+/**
+ * @brief Finds the lazy cow data of a thread group.
+ * @prerequisite Requires user to hold _lazy_cow_data_head_lock
+ */
+static lazy_cow_data_t* find_lazy_cow_data(int tgroup_home_cpu,
+                                           int tgroup_home_id) {
+    data_header_t* curr = _lazy_cow_data_head;
+    lazy_cow_data_t* data = NULL;
+
+    while(curr) {
+        data = (lazy_cow_data_t*)curr;
+        if(data->tgroup_home_cpu == tgroup_home_cpu &&
+           data->tgroup_home_id  == tgroup_home_id) {
+            return data;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find or create the lazy cow data of a thread group.  <new_data>
+ * is used for the creation, and set to NULL if it was.
+ * @prerequisite Requires user to hold _lazy_cow_data_head_lock
+ */
+static lazy_cow_data_t* get_lazy_cow_data(int tgroup_home_cpu,
+                                          int tgroup_home_id,
+                                          lazy_cow_data_t** new_data) {
+    lazy_cow_data_t* data = find_lazy_cow_data(tgroup_home_cpu,
+                                               tgroup_home_id);
+    if(!data && *new_data) {
+        data = *new_data;
+        *new_data = NULL;
+        memset(data,0,sizeof(lazy_cow_data_t));
+        data->header.data_type = PROCESS_SERVER_LAZY_COW_DATA_TYPE;
+        data->tgroup_home_cpu = tgroup_home_cpu;
+        data->tgroup_home_id = tgroup_home_id;
+        add_data_entry_to(data,NULL,&_lazy_cow_data_head);
+    }
+
+    return data;
+}
+
+/**
+ * @brief Break the cow pages of <mm> in [start,end), so that it gets
+ * its own copy of every page it still shares.  When <orig> is given,
+ * the page it keeps is made writable again.
+ */
+static void break_cow_range(struct mm_struct* mm, struct mm_struct* orig,
+                            unsigned long start, unsigned long end) {
+    struct vm_area_struct* curr = mm->mmap;
+    unsigned long i;
+
+    while(curr) {
+        if(is_maybe_cow(curr) &&
+           curr->vm_start < end && start < curr->vm_end) {
+            for(i = max(start,curr->vm_start);
+                i < min(end,curr->vm_end);
+                i += PAGE_SIZE) {
+                if(break_cow(mm,curr,i) && orig) {
+                    mk_page_writable_lookupvma(orig,i);
+                }
+            }
+        }
+        curr = curr->vm_next;
+    }
+}
+
+/**
+ * @brief Give every child of a thread group that still shares its cow
+ * pages in [start,end) its own copy of them.  Children that have exited
+ * or exec()ed are dropped along the way.  The pages the thread group
+ * keeps are left alone, the caller makes them writable.
+ */
+static void lazy_cow_break(int tgroup_home_cpu, int tgroup_home_id,
+                           unsigned long start, unsigned long end) {
+    lazy_cow_data_t* data = NULL;
+    struct mm_struct* live[LAZY_COW_CHILDREN];
+    struct mm_struct* dead[LAZY_COW_CHILDREN];
+    int nr_live = 0, nr_dead = 0;
+    int i;
+
+    if(!atomic_read(&_lazy_cow_children))
+        return;
+
+    PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+    data = find_lazy_cow_data(tgroup_home_cpu,tgroup_home_id);
+    for(i = 0; data && i < data->nr_children; ) {
+        struct mm_struct* mm = data->children[i];
+        if(atomic_inc_not_zero(&mm->mm_users)) {
+            live[nr_live++] = mm;
+            i++;
+        } else {
+            dead[nr_dead++] = mm;
+            data->children[i] = data->children[--data->nr_children];
+        }
+    }
+    PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+
+    for(i = 0; i < nr_live; i++) {
+        PS_DOWN_READ(&live[i]->mmap_sem);
+        break_cow_range(live[i],NULL,start,end);
+        PS_UP_READ(&live[i]->mmap_sem);
+        mmput(live[i]);
+    }
+
+    for(i = 0; i < nr_dead; i++) {
+        atomic_dec(&_lazy_cow_children);
+        mmdrop(dead[i]);
+    }
+}
+
+/**
+ * @brief Record that pages of the cow vma [start,end) of a thread group
+ * are about to be mapped by another kernel.  Writes there cannot be
+ * caught anymore, so children sharing them get their own copy now, and
+ * later forks copy the range right away.
+ * @prerequisite Caller must hold the served mm's mmap_sem.
+ */
+static void lazy_cow_note_served(int tgroup_home_cpu, int tgroup_home_id,
+                                 unsigned long start, unsigned long end) {
+    lazy_cow_data_t* data = NULL;
+    lazy_cow_data_t* new_data = NULL;
+    lazy_cow_range_t* r = NULL;
+    int need_break = 0;
+    int i;
+
+    PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+    data = find_lazy_cow_data(tgroup_home_cpu,tgroup_home_id);
+    if(!data) {
+        // Only the first range served for a thread group allocates.
+        PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+        new_data = kmalloc(sizeof(lazy_cow_data_t),GFP_KERNEL);
+        PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+        data = get_lazy_cow_data(tgroup_home_cpu,tgroup_home_id,&new_data);
+    }
+    if(!data) {
+        // Cannot remember it, so children cannot rely on it either.
+        need_break = 1;
+        goto out;
+    }
+
+    for(i = 0; i < data->nr_served; i++) {
+        if(data->served[i].start <= start && end <= data->served[i].end)
+            goto out;
+    }
+
+    need_break = data->nr_children > 0;
+    for(i = 0; i < data->nr_served; i++) {
+        if(data->served[i].start <= end && start <= data->served[i].end) {
+            r = &data->served[i];
+            break;
+        }
+    }
+    if(r) {
+        r->start = min(r->start,start);
+        r->end = max(r->end,end);
+    } else if(data->nr_served < LAZY_COW_SERVED_RANGES) {
+        r = &data->served[data->nr_served++];
+        r->start = start;
+        r->end = end;
+    } else {
+        data->served_overflow = 1;
+    }
+
+out:
+    PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+
+    if(new_data) kfree(new_data);
+
+    if(need_break)
+        lazy_cow_break(tgroup_home_cpu,tgroup_home_id,start,end);
+}
+
+/**
+ * @brief Let <task>, just forked off the distributed thread group of
+ * <orig>, keep sharing cow pages with it.  Only the ranges other kernels
+ * map or write to are copied now; everything else is copied page by page,
+ * when the thread group writes to it (see process_server_try_handle_mm_fault)
+ * or hands it to another kernel (see lazy_cow_note_served).
+ * @return 0 on success, -1 if the caller has to break every cow page.
+ */
+static int lazy_cow_fork(struct task_struct* task, struct task_struct* orig) {
+    lazy_cow_data_t* data = NULL;
+    lazy_cow_data_t* new_data = NULL;
+    lazy_cow_range_t served[LAZY_COW_SERVED_RANGES];
+    struct vm_area_struct* curr;
+    int nr_served = 0;
+    int i;
+
+    if(!task->mm || task->mm == orig->mm)
+        return 0;
+
+    new_data = kmalloc(sizeof(lazy_cow_data_t),GFP_KERNEL);
+
+    PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+    data = get_lazy_cow_data(orig->tgroup_home_cpu,orig->tgroup_home_id,
+                             &new_data);
+    if(!data || data->served_overflow ||
+       data->nr_children == LAZY_COW_CHILDREN) {
+        PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+        if(new_data) kfree(new_data);
+        return -1;
+    }
+    atomic_inc(&task->mm->mm_count);
+    data->children[data->nr_children++] = task->mm;
+    atomic_inc(&_lazy_cow_children);
+    nr_served = data->nr_served;
+    memcpy(served,data->served,nr_served * sizeof(lazy_cow_range_t));
+    PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+
+    if(new_data) kfree(new_data);
+
+    for(i = 0; i < nr_served; i++) {
+        break_cow_range(task->mm,orig->mm,served[i].start,served[i].end);
+    }
+
+    // Pages mapped from other kernels are written to there directly.
+    for(curr = task->mm->mmap; curr; curr = curr->vm_next) {
+        if(curr->vm_flags & VM_PFNMAP)
+            break_cow_range(task->mm,orig->mm,curr->vm_start,curr->vm_end);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief <orig> is not distributed, but may itself be a child that still
+ * shares cow pages with a distributed thread group.  Its own children
+ * then share those pages too, so they are tracked along with it.
+ */
+static void lazy_cow_fork_inherit(struct task_struct* task,
+                                  struct task_struct* orig) {
+    data_header_t* curr = NULL;
+    lazy_cow_data_t* data = NULL;
+    int tracked = 0, i;
+
+    if(!atomic_read(&_lazy_cow_children))
+        return;
+    if(!task->mm || !orig->mm || task->mm == orig->mm)
+        return;
+
+    PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+    curr = _lazy_cow_data_head;
+    while(curr && !tracked) {
+        data = (lazy_cow_data_t*)curr;
+        for(i = 0; i < data->nr_children; i++) {
+            if(data->children[i] == orig->mm) {
+                tracked = 1;
+                break;
+            }
+        }
+        curr = curr->next;
+    }
+    if(tracked && data->nr_children < LAZY_COW_CHILDREN) {
+        atomic_inc(&task->mm->mm_count);
+        data->children[data->nr_children++] = task->mm;
+        atomic_inc(&_lazy_cow_children);
+        tracked = 0;
+    }
+    PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+
+    // No room left, copy everything it shares.  Whatever <orig> keeps
+    // is still shared with the thread group and must stay read only.
+    if(tracked)
+        break_all_cow_pages(task,NULL);
+}
+
+/**
+ * @brief Drop the children of a thread group that has exited.
+ */
+static void lazy_cow_destroy(int tgroup_home_cpu, int tgroup_home_id) {
+    lazy_cow_data_t* data = NULL;
+    int i;
+
+    PS_SPIN_LOCK(&_lazy_cow_data_head_lock);
+    data = find_lazy_cow_data(tgroup_home_cpu,tgroup_home_id);
+    if(data)
+        remove_data_entry_from(data,&_lazy_cow_data_head);
+    PS_SPIN_UNLOCK(&_lazy_cow_data_head_lock);
+
+    if(data) {
+        for(i = 0; i < data->nr_children; i++) {
+            atomic_dec(&_lazy_cow_children);
+            mmdrop(data->children[i]);
+        }
+        kfree(data);
+    }
+}
+
+/**
+ * @brief Propagate origin thread group to children, and initialize other 
+ * task members.  If the parent was member of a remote thread group,
+ * store the thread group info.
+ *
+ * Note: In addition to in this function, distribution information is
+ * maintained when a thread or process is migrated.  That ensures
+ * that all members of a thread group are kept up-to-date when
+ * one member migrates.
+ */
+int process_server_dup_task(struct task_struct* orig, struct task_struct* task)
+{
+    // TODO more work to support kernel clustering is still required
+    int home_kernel =
+#ifndef SUPPORT_FOR_CLUSTERING
+    _cpu;
+#else
+    cpumask_first(cpu_present_mask);
+#endif
+
+    task->executing_for_remote = 0;
+    task->represents_remote = 0;
+    task->enable_do_mmap_pgoff_hook = 1;
+    task->prev_cpu = -1;
+    task->next_cpu = -1;
+    task->prev_pid = -1;
+    task->next_pid = -1;
+    task->clone_data = NULL;
+    task->t_home_cpu = home_kernel;
+    task->t_home_id  = task->pid;
+    task->t_distributed = 0;
+    task->previous_cpus = 0;
+    task->known_cpu_with_tgroup_mm = 0;
+    task->return_disposition = RETURN_DISPOSITION_NONE;
+    task->surrogate = -1;
+    task->uaddr = 0;
+    task->futex_state = 0;
+    task->migration_state = 0;
+    task->migration_target_cpu = -1;
+    task->migration_gang_id = 0;
+    spin_lock_init(&(task->mig_lock));
+    // If this is pid 1 or 2, the parent cannot have been migrated
+    // so it is safe to take on all local thread info.
+    if(unlikely(orig->pid == 1 || orig->pid == 2)) {
+        task->tgroup_home_cpu = home_kernel;
+        task->tgroup_home_id = orig->tgid;
+        task->tgroup_distributed = 0;
+        return 1;
+    }
+    // If the new task is not in the same thread group as the parent,
+    // then we do not need to propagate the old thread info.
+    if(orig->tgid != task->tgid) {
+        task->tgroup_home_cpu = home_kernel;
+        task->tgroup_home_id = task->tgid;
+        task->tgroup_distributed = 0;
+
+        // COW problem fix, necessary for coherency.
+        if(orig->tgroup_distributed) {
+            if(lazy_cow_fork(task,orig))
+                break_all_cow_pages(task,orig);
+        } else {
+            lazy_cow_fork_inherit(task,orig);
+        }
+
+        return 1;
+    }
+
+    // Inherit the list of known cpus with mms for this thread group 
+    // once we know that the task is int he same tgid.
+    task->known_cpu_with_tgroup_mm = orig->known_cpu_with_tgroup_mm;
+
+    // This is important.  We want to make sure to keep an accurate record
+    // of which cpu and thread group the new thread is a part of.
+    if(orig->executing_for_remote == 1 || orig->tgroup_home_cpu != home_kernel) {
+        task->tgroup_home_cpu = orig->tgroup_home_cpu;
+        task->tgroup_home_id = orig->tgroup_home_id;
+        task->tgroup_distributed = 1;
+       // task->origin_pid = orig->origin_pid;
+    } else {
+        task->tgroup_home_cpu = home_kernel;
+        task->tgroup_home_id = orig->tgid;
+        task->tgroup_distributed = 0;
+    }
+//printk(KERN_ALERT"TGID {%d} \n",task->tgid);
+    return 1;
+}
+/**
+ * @brief Migrate the specified task <task> to a CPU on which
+ * it has not yet executed.
+ *
+ * <MEASURE perf_process_server_do_migration>
+ */
+int do_migration_to_new_cpu(struct task_struct* task, int cpu) {
+    struct pt_regs *regs = task_pt_regs(task);
+    // TODO: THIS IS WRONG, task flags is not what I want here.
+    unsigned long clone_flags = task->clone_flags;
+    unsigned long stack_start = task->mm->start_stack;
+    clone_request_t* request = kmalloc(sizeof(clone_request_t),GFP_KERNEL);
+    struct task_struct* tgroup_iterator = NULL;
+    struct task_struct* g;
+    int dst_cpu = cpu;
+    char path[256] = {0};
+    char* rpath = d_path(&task->mm->exe_file->f_path,path,256);
+    int lclone_request_id;
+    int perf = -1;
+    unsigned long long migration_start = native_read_tsc();
+
+    printk("process_server_do_migration pid{%d} cpu {%d}\n",task->pid,cpu);
+
+    // Nothing to do if we're migrating to the current cpu
+    if(dst_cpu == _cpu) {
+        return PROCESS_SERVER_CLONE_FAIL;
+    }
+
+    perf = PERF_MEASURE_START(&perf_process_server_do_migration);
+
+    // This will be a placeholder process for the remote
+    // process that is subsequently going to be started.
+    // Block its execution.
+    __set_task_state(task,TASK_UNINTERRUPTIBLE);
+
+
+    int sig;
+    struct task_struct *t=current;
+    // Book keeping for previous cpu bitmask.
+    set_bit(smp_processor_id(),&task->previous_cpus);
+
+    // Book keeping for placeholder process.
+    spin_lock_irq(&(task->mig_lock));
+    task->represents_remote = 1;
+    task->tgroup_distributed = 1;
+    task->t_distributed = 1;
+    spin_unlock_irq(&(task->mig_lock));
+
+
+    /*mklinux_akshay*/
+    if(task->prev_pid==-1)
+    	task->origin_pid=task->pid;
+    else
+    	task->origin_pid=task->origin_pid;
+
+   struct task_struct *par = task->parent;
+
+
+    // Book keeping for distributed threads.
+
+    read_lock(&tasklist_lock);
+    do_each_thread(g,tgroup_iterator) {
+        if(tgroup_iterator != task) {
+            if(tgroup_iterator->tgid == task->tgid) {
+                tgroup_iterator->tgroup_distributed = 1;
+                tgroup_iterator->tgroup_home_id = task->tgroup_home_id;
+                tgroup_iterator->tgroup_home_cpu = task->tgroup_home_cpu;
+            }
+        }
+    } while_each_thread(g,tgroup_iterator);
+    read_unlock(&tasklist_lock);
+
+    // Pick an id for this remote process request
+    PS_SPIN_LOCK(&_clone_request_id_lock);
+    lclone_request_id = _clone_request_id++;
+    PS_SPIN_UNLOCK(&_clone_request_id_lock);
+
+#if COPY_WHOLE_VM_WITH_MIGRATION
+    {
+    int dst_has_mm = cpu_has_known_tgroup_mm(dst_cpu);
+    if(!dst_has_mm) {
+        struct vm_area_struct* curr = NULL;
+        // We have to break every cow page before migrating if we're
+        // about to move the whole thing.
+    restart_break_cow_all:
+        curr = task->mm->mmap;
+        while(curr) {
+            unsigned long addr;
+            //unsigned char broken = 0;
+            if(is_maybe_cow(curr)) {
+                PS_DOWN_WRITE(&task->mm->mmap_sem);
+                for(addr = curr->vm_start; addr < curr->vm_end; addr += PAGE_SIZE) {
+                    if(break_cow(task->mm,curr,addr)) {
+                        //broken = 1;
+                    }
+                }
+                PS_UP_WRITE(&task->mm->mmap_sem);
+            }
+            //if(broken) 
+            //    goto restart_break_cow_all;
+            curr = curr->vm_next;
+        }
+        
+        PS_DOWN_READ(&task->mm->mmap_sem);
+        curr = task->mm->mmap;
+
+        while(curr) {
+            // Only send the vma is either we don't think the 
+            // remote cpu has a mm already set up, or if this
+            // vma represents the task's stack.
+            //if(!dst_has_mm ) {
+                send_vma(task->mm,
+                         curr,
+                         dst_cpu,
+                        lclone_request_id);
+            //} 
+            curr = curr->vm_next;
+        }
+
+
+        PS_UP_READ(&task->mm->mmap_sem);
+    }
+    }
+#endif
+
+    // Build request
+    request->header.type = PCN_KMSG_TYPE_PROC_SRV_CLONE_REQUEST;
+    request->header.prio = PCN_KMSG_PRIO_NORMAL;
+    request->clone_flags = clone_flags;
+    request->clone_request_id = lclone_request_id;
+    memcpy( &request->regs, regs, sizeof(struct pt_regs) );
+    strncpy( request->exe_path, rpath, 512 );
+    
+    // struct mm_struct -----------------------------------------------------------
+    request->stack_start = task->mm->start_stack;
+    request->heap_start = task->mm->start_brk;
+    request->heap_end = task->mm->brk;
+    request->env_start = task->mm->env_start;
+    request->env_end = task->mm->env_end;
+    request->arg_start = task->mm->arg_start;
+    request->arg_end = task->mm->arg_end;
+    request->data_start = task->mm->start_data;
+    request->data_end = task->mm->end_data;
+    request->def_flags = task->mm->def_flags;
+    
+    // struct task_struct ---------------------------------------------------------    
+    request->stack_ptr = stack_start;
+    request->placeholder_pid = task->pid;
+    request->placeholder_tgid = task->tgid;
+    request->tgroup_home_cpu = task->tgroup_home_cpu;
+    request->tgroup_home_id = task->tgroup_home_id;
+    request->t_home_cpu = task->t_home_cpu;
+    request->t_home_id = task->t_home_id;
+    request->previous_cpus = task->previous_cpus;
+    request->prio = task->prio;
+    request->static_prio = task->static_prio;
+    request->normal_prio = task->normal_prio;
+    request->rt_priority = task->rt_priority;
+    request->sched_class = task->policy;
+    request->personality = task->personality;
+    
+
+    /*mklinux_akshay*/
+    if (task->prev_pid == -1)
+    	request->origin_pid = task->pid;
+    else
+    	request->origin_pid = task->origin_pid;
+    request->remote_blocked = task->blocked;
+    request->remote_real_blocked = task->real_blocked;
+    request->remote_saved_sigmask = task->saved_sigmask;
+   // request->remote_pending = task->pending;
+    request->sas_ss_sp = task->sas_ss_sp;
+    request->sas_ss_size = task->sas_ss_size;
+    int cnt = 0;
+    for (cnt = 0; cnt < _NSIG; cnt++)
+    	request->action[cnt] = task->sighand->action[cnt];
+
+    // struct thread_struct -------------------------------------------------------
+    // have a look at: copy_thread() arch/x86/kernel/process_64.c 
+    // have a look at: struct thread_struct arch/x86/include/asm/processor.h
+    {
+      	unsigned long fs, gs;
+	unsigned int fsindex, gsindex;
+	unsigned int ds, es;
+    unsigned long _usersp;
+
+	if (current != task)
+	    PSPRINTK("DAVEK current is different from task!\n");
+
+    request->thread_sp0 = task->thread.sp0;
+    request->thread_sp = task->thread.sp;
+    //printk("%s: usersp percpu %lx thread %lx fs where it migrated {%lx}\n", __func__, get_percpu_old_rsp(), task->thread.usersp,task->thread.fs);
+    // if (percpu_read(old_rsp), task->thread.usersp) set to 0 otherwise copy
+    _usersp = get_percpu_old_rsp();
+    if (task->thread.usersp != _usersp) {
+       // printk("%s: USERSP %lx %lx\n",
+         //       __func__, task->thread.usersp, _usersp);
+        request->thread_usersp = _usersp;
+    } else {
+        request->thread_usersp = task->thread.usersp;
+    }
+    
+    request->thread_es = task->thread.es;
+    savesegment(es, es);          
+    if ((current == task) && (es != request->thread_es))
+      PSPRINTK("%s: DAVEK: es %x thread %x\n", __func__, es, request->thread_es);
+    request->thread_ds = task->thread.ds;
+    savesegment(ds, ds);
+    if (ds != request->thread_ds)
+      PSPRINTK("%s: DAVEK: ds %x thread %x\n", __func__, ds, request->thread_ds);
+    
+    // fs register (TLS in user space)    
+    request->thread_fsindex = task->thread.fsindex;
+    savesegment(fs, fsindex);
+    if (fsindex != request->thread_fsindex)
+        //printk(KERN_ALERT"%s: fsindex %x (TLS_SEL:%x) thread %x\n", __func__, fsindex, FS_TLS_SEL, request->thread_fsindex);
+    request->thread_fs = task->thread.fs;
+    rdmsrl(MSR_FS_BASE, fs);
+    if (fs != request->thread_fs) {
+        request->thread_fs = fs;
+        PSPRINTK("%s: DAVEK: fs %lx thread %lx\n", __func__, fs, request->thread_fs);
+    }
+    
+    // gs register (percpu in kernel space)
+    request->thread_gsindex = task->thread.gsindex;
+    savesegment(gs, gsindex);
+    if (gsindex != request->thread_gsindex)
+        printk(KERN_WARNING"%s: gsindex %x (TLS_SEL:%x) thread %x\n", __func__, gsindex, GS_TLS_SEL, request->thread_gsindex);
+    request->thread_gs = task->thread.gs;
+    rdmsrl(MSR_KERNEL_GS_BASE, gs); //NOTE there are two gs base registers in Kernel the used one is MSR_GS_BASE, so MSR_KERNEL_GS_BASE is user space in kernel
+    if (gs != request->thread_gs) {
+        request->thread_gs = gs;
+        PSPRINTK("%s: DAVEK: gs %lx thread %lx\n", __func__, fs, request->thread_gs);
+    }
+
+#ifdef FPU_   
+ //FPU migration code --- initiator
+PSPRINTK(KERN_ERR"%s: task flags %x fpu_counter %x has_fpu %x [%d:%d] %d:%d %x\n",
+		        __func__, task->flags, (int)task->fpu_counter, (int)task->thread.has_fpu,
+		         (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu),
+		         (int)use_xsave(), (int)use_fxsr(), (int) PF_USED_MATH);
+     request->task_flags = task->flags;
+     request->task_fpu_counter = task->fpu_counter;
+    request->thread_has_fpu = task->thread.has_fpu;
+     if (!fpu_allocated(&task->thread.fpu)) {  
+	         printk("%s: !fpu_allocated\n", __func__);
+	         request->thread_has_fpu &= (unsigned char)~HAS_FPU_MASK;
+	     }
+	     else {
+		         struct fpu temp; temp.state = &request->fpu_state;      
+		         fpu_save_init(&task->thread.fpu);
+		         fpu_copy(&temp, &task->thread.fpu);
+		         request->thread_has_fpu |= HAS_FPU_MASK;
+		     }
+		 printk(KERN_ALERT"%s: flags %x fpu_counter %x has_fpu %x [%d:%d]\n",
+				         __func__, request->task_flags, (int)request->task_fpu_counter,
+				         (int)request->thread_has_fpu, (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu));
+#endif
+    
+	// ptrace, debug, dr7: struct perf_event *ptrace_bps[HBP_NUM]; unsigned long debugreg6; unsigned long ptrace_dr7;
+    // Fault info: unsigned long cr2; unsigned long trap_no; unsigned long error_code;
+    // floating point: struct fpu fpu; THIS IS NEEDED
+    // IO permissions: unsigned long *io_bitmap_ptr; unsigned long iopl; unsigned io_bitmap_max;
+    }
+
+    // Remember that now, that cpu has a mm for this tgroup
+    set_cpu_has_known_tgroup_mm(task,dst_cpu);
+    request->known_cpu_with_tgroup_mm = task->known_cpu_with_tgroup_mm;
+
+    request->migration_start = migration_start;
+    migration_phase(PS_MIGRATION_REQUEST_BUILT,task->pid,dst_cpu,migration_start);
+
+    // Send request
+    DO_UNTIL_SUCCESS(pcn_kmsg_send_long(dst_cpu, 
+                        (struct pcn_kmsg_long_message*)request, 
+                        sizeof(clone_request_t) - sizeof(request->header)));
+
+    migration_phase(PS_MIGRATION_REQUEST_SENT,task->pid,dst_cpu,migration_start);
+
+    kfree(request);
+
+    printk(KERN_ALERT"Migration done\n");
+    //dump_task(task,regs,request->stack_ptr);
+    
+    PERF_MEASURE_STOP(&perf_process_server_do_migration,"migration to new cpu",perf);
+
+    
+    __set_task_state(task,TASK_UNINTERRUPTIBLE);
+    migration_phase(PS_MIGRATION_PLACEHOLDER_PARKED,task->pid,dst_cpu,migration_start);
+    return PROCESS_SERVER_CLONE_SUCCESS;
+
+}
+
+/**
+ * @brief Migrate the specified task to a CPU on which it has previously
+ * executed.
+ *
+ * <MEASURE perf_process_server_do_migration>
+ */
+int do_migration_back_to_previous_cpu(struct task_struct* task, int cpu) {
+    back_migration_t *mig =NULL;
+    struct pt_regs* regs = task_pt_regs(task);
+
+    unsigned long _usersp;
+    int perf = -1;
+    unsigned long long migration_start = native_read_tsc();
+
+    perf = PERF_MEASURE_START(&perf_process_server_do_migration);
+
+    mig = kmalloc(sizeof(back_migration_t), GFP_ATOMIC);
+    if (!mig) {
+         printk("%s: ERROR kmalloc ret %p\n", __func__, mig);
+         return -1;
+     }
+    // Set up response header
+
+    mig->header.type = PCN_KMSG_TYPE_PROC_SRV_BACK_MIGRATION;
+    mig->header.prio = PCN_KMSG_PRIO_NORMAL;
+
+    // Make mark on the list of previous cpus
+    set_bit(smp_processor_id(),&task->previous_cpus);
+
+    // Knock this task out.
+    __set_task_state(task,TASK_UNINTERRUPTIBLE);
+    
+    // Update local state
+    task->executing_for_remote = 0;
+    task->represents_remote = 1;
+    task->t_distributed = 1; // This should already be the case
+    
+    // Build message
+    mig->tgroup_home_cpu = task->tgroup_home_cpu;
+    mig->tgroup_home_id  = task->tgroup_home_id;
+    mig->t_home_cpu      = task->t_home_cpu;
+    mig->t_home_id       = task->t_home_id;
+    mig->placeholder_pid = task->pid;
+    mig->previous_cpus   = task->previous_cpus;
+    mig->thread_fs       = task->thread.fs;
+    mig->thread_gs       = task->thread.gs;
+
+    _usersp = get_percpu_old_rsp();
+if (task->thread.usersp != _usersp) { 
+  printk("%s: USERSP %lx %lx\n",
+    __func__, task->thread.usersp, _usersp);
+  mig->thread_usersp = _usersp;
+}else
+  mig->thread_usersp = task->thread.usersp;
+
+
+    mig->thread_es       = task->thread.es;
+    mig->thread_ds       = task->thread.ds;
+    mig->thread_fsindex  = task->thread.fsindex;
+    mig->thread_gsindex  = task->thread.gsindex;
+
+    //FPU support --- initiator (back migration?)
+
+#ifdef FPU_   
+  mig->task_flags      = task->flags;
+       mig->task_fpu_counter = task->fpu_counter;
+       mig->thread_has_fpu   = task->thread.has_fpu;
+       if (!fpu_allocated(&task->thread.fpu)) {  
+	           printk("%s: !fpu_allocated\n", __func__);
+	           mig->thread_has_fpu &= (unsigned char)~HAS_FPU_MASK;
+	       }
+	       else {
+	           struct fpu temp; temp.state = &mig->fpu_state;      
+		          fpu_save_init(&task->thread.fpu);
+		         fpu_copy(&temp, &task->thread.fpu);
+		          mig->thread_has_fpu |= HAS_FPU_MASK;
+		      }
+		   printk(KERN_ALERT"%s: flags %x fpu_counter %x has_fpu %x [%d:%d]\n",
+				           __func__, mig->task_flags, (int)mig->task_fpu_counter,
+				           (int)mig->thread_has_fpu, (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu));
+
+#endif
+
+    memcpy(&mig->regs, regs, sizeof(struct pt_regs));
+    mig->migration_start = migration_start;
+    migration_phase(PS_MIGRATION_REQUEST_BUILT,task->pid,cpu,migration_start);
+
+    // Send migration request to destination.
+    pcn_kmsg_send_long(cpu,
+                       (struct pcn_kmsg_long_message*)mig,
+                       sizeof(back_migration_t) - sizeof(struct pcn_kmsg_hdr));
+
+    migration_phase(PS_MIGRATION_REQUEST_SENT,task->pid,cpu,migration_start);
+
+    pcn_kmsg_free_msg(mig);
+    PERF_MEASURE_STOP(&perf_process_server_do_migration,"back migration",perf);
+ 
+    migration_phase(PS_MIGRATION_PLACEHOLDER_PARKED,task->pid,cpu,migration_start);
+
+    return PROCESS_SERVER_CLONE_SUCCESS;
+}
+
+/**
+ * @brief Migrate the specified task <task> to cpu <cpu>
+ * This function will put the specified task to 
+ * sleep, and push its info over to the remote cpu.  The
+ * remote cpu will then create a new process and import that
+ * info into its new context.  
+ *
+ * Note: There are now two different migration implementations.
+ *       One is for the case where we are migrating to a cpu that
+ *       has never before hosted this thread.  The other is where
+ *       we are migrating to a cpu that has hosted this thread
+ *       before.  There's a lot of stuff that we do not need
+ *       to do when the thread has been there before, and the
+ *       messaging data requirements are much less for that case.
+ *
+ */
+int process_server_do_migration(struct task_struct* task, int cpu) {
+   
+    int ret = 0;
+
+    // The destination has to see this thread's protection changes.
+    if(task->tgroup_distributed)
+        mprotect_batch_flush(task->tgroup_home_cpu,task->tgroup_home_id);
+
+#ifndef SUPPORT_FOR_CLUSTERING
+    printk(KERN_ALERT"%s: normal migration {%d}\n",__func__,cpu);
+    if(test_bit(cpu,&task->previous_cpus)) {
+        ret = do_migration_back_to_previous_cpu(task,cpu);
+    } else {
+        ret = do_migration_to_new_cpu(task,cpu);
+    }
+#else
+    if (cpumask_test_cpu(cpu, cpu_present_mask)) {
+        printk(KERN_ERR"%s: called but task %p does not require inter-kernel migration"
+		       "(cpu: %d present_mask)\n", __func__, task, cpu);
+        return -EBUSY;
+    }
+    //printk(KERN_ALERT"%s: clustering activated\n",__func__);
+    // TODO seems like that David is using previous_cpus as a bitmask.. 
+    // TODO well this must be upgraded to a cpumask, declared as usigned long in task_struct
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+    struct cpumask *pcpum =0;
+    int cpuid=-1;
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        cpuid = objPtr->_data._processor;
+        pcpum = &(objPtr->_data._cpumask);
+	if (cpumask_test_cpu(cpu, pcpum)) {
+		if ( bitmap_intersects(cpumask_bits(pcpum),
+				       &(task->previous_cpus),
+				       (sizeof(unsigned long)*8)) )
+	            ret = do_migration_back_to_previous_cpu(task,cpuid);
+		else
+		    ret = do_migration_to_new_cpu(task,cpuid);
+	}
+    }
+#endif
+    return ret;
+}
+
+/**
+ * @brief Whether <task> has executed on the kernel owning <cpu> before,
+ * in which case a migration there is a back migration.
+ */
+static int task_has_run_on_kernel(struct task_struct* task, int cpu) {
+#ifndef SUPPORT_FOR_CLUSTERING
+    return test_bit(cpu,&task->previous_cpus);
+#else
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+    struct cpumask *pcpum =0;
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        pcpum = &(objPtr->_data._cpumask);
+        if (cpumask_test_cpu(cpu, pcpum))
+            return bitmap_intersects(cpumask_bits(pcpum),
+                                     &(task->previous_cpus),
+                                     (sizeof(unsigned long)*8));
+    }
+    return 0;
+#endif
+}
+
+/**
+ * @brief Kernel id of the kernel owning <cpu>, or -1.
+ */
+static int kernel_for_cpu(int cpu) {
+#ifndef SUPPORT_FOR_CLUSTERING
+    return cpu;
+#else
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+extern struct list_head rlist_head;
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        if (cpumask_test_cpu(cpu, &(objPtr->_data._cpumask)))
+            return objPtr->_data._processor;
+    }
+    return -1;
+#endif
+}
+
+/**
+ * @brief Finds a gang migration being assembled.
+ * @prerequisite Requires user to hold _gang_migration_data_head_lock
+ */
+static gang_migration_data_t* find_gang_migration_data(int gang_id) {
+    data_header_t* curr = _gang_migration_data_head;
+    gang_migration_data_t* data = NULL;
+
+    while(curr) {
+        data = (gang_migration_data_t*)curr;
+        if(data->gang_id == gang_id) {
+            return data;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Group the tasks that are about to migrate to <cpu> for the
+ * first time into gangs.  Tasks that have been there before take the
+ * back migration path, which is already cheap, and so do gangs of one.
+ * Returns the number of tasks assigned to a gang.
+ */
+static int gang_migration_setup(struct task_struct** tasks, int nr_tasks, int cpu) {
+    struct task_struct* members[GANG_MIGRATION_MAX_THREADS];
+    gang_migration_data_t* data = NULL;
+    int kernel = kernel_for_cpu(cpu);
+    int nr_members = 0;
+    int assigned = 0;
+    int i, j;
+
+    if(kernel < 0) return 0;
+
+    for(i = 0; i <= nr_tasks; i++) {
+        if(i < nr_tasks && !task_has_run_on_kernel(tasks[i],cpu)) {
+            members[nr_members++] = tasks[i];
+            if(nr_members < GANG_MIGRATION_MAX_THREADS)
+                continue;
+        }
+
+        // Flush the gang collected so far.
+        if(nr_members < 2) {
+            nr_members = 0;
+            continue;
+        }
+
+        data = kmalloc(sizeof(gang_migration_data_t),GFP_KERNEL);
+        if(!data) break;
+        data->msg = kmalloc(sizeof(gang_migration_t),GFP_KERNEL);
+        if(!data->msg) {
+            kfree(data);
+            break;
+        }
+        data->header.data_type = PROCESS_SERVER_GANG_MIGRATION_DATA_TYPE;
+        data->cpu = kernel;
+        data->expected = nr_members;
+        data->arrived = 0;
+
+        PS_SPIN_LOCK(&_gang_migration_data_head_lock);
+        data->gang_id = _gang_id++;
+        if(!_gang_id) _gang_id = 1;
+        add_data_entry_to(data,NULL,&_gang_migration_data_head);
+        PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+
+        for(j = 0; j < nr_members; j++)
+            members[j]->migration_gang_id = data->gang_id;
+
+        assigned += nr_members;
+        nr_members = 0;
+    }
+
+    return assigned;
+}
+
+/**
+ * @brief Fill in the state shared by the thread group and send
+ * the gang.  The gang must already be off the list.
+ */
+static void gang_migration_send(gang_migration_data_t* data) {
+    gang_migration_t* msg = data->msg;
+    struct task_struct* task = current;
+    struct task_struct* tgroup_iterator = NULL;
+    struct task_struct* g;
+    char path[256] = {0};
+    char* rpath = d_path(&task->mm->exe_file->f_path,path,256);
+    int i;
+
+    msg->header.type = PCN_KMSG_TYPE_PROC_SRV_GANG_MIGRATION;
+    msg->header.prio = PCN_KMSG_PRIO_NORMAL;
+    msg->nr_threads = data->arrived;
+    msg->tgroup_home_cpu = task->tgroup_home_cpu;
+    msg->tgroup_home_id = task->tgroup_home_id;
+    msg->placeholder_tgid = task->tgid;
+    msg->known_cpu_with_tgroup_mm = task->known_cpu_with_tgroup_mm;
+    msg->clone_flags = task->clone_flags;
+    msg->stack_start = task->mm->start_stack;
+    msg->heap_start = task->mm->start_brk;
+    msg->heap_end = task->mm->brk;
+    msg->env_start = task->mm->env_start;
+    msg->env_end = task->mm->env_end;
+    msg->arg_start = task->mm->arg_start;
+    msg->arg_end = task->mm->arg_end;
+    msg->data_start = task->mm->start_data;
+    msg->data_end = task->mm->end_data;
+    msg->def_flags = task->mm->def_flags;
+    msg->personality = task->personality;
+    strlcpy(msg->exe_path, rpath, sizeof(msg->exe_path));
+    for(i = 0; i < _NSIG; i++)
+        msg->action[i] = task->sighand->action[i];
+
+    // Book keeping for distributed threads, once for the whole gang.
+    read_lock(&tasklist_lock);
+    do_each_thread(g,tgroup_iterator) {
+        if(tgroup_iterator->tgid == task->tgid) {
+            tgroup_iterator->tgroup_distributed = 1;
+            tgroup_iterator->tgroup_home_id = task->tgroup_home_id;
+            tgroup_iterator->tgroup_home_cpu = task->tgroup_home_cpu;
+        }
+    } while_each_thread(g,tgroup_iterator);
+    read_unlock(&tasklist_lock);
+
+    DO_UNTIL_SUCCESS(pcn_kmsg_send_long(data->cpu,
+                        (struct pcn_kmsg_long_message*)msg,
+                        sizeof(gang_migration_t) - sizeof(msg->header)));
+
+    PSPRINTK("%s: gang{%d} of %d threads sent to cpu{%d}\n",
+            __func__,data->gang_id,data->arrived,data->cpu);
+
+    for(i = 0; i < data->arrived; i++)
+        migration_phase(PS_MIGRATION_REQUEST_SENT,msg->threads[i].placeholder_pid,
+                        data->cpu,msg->threads[i].migration_start);
+
+    kfree(msg);
+    kfree(data);
+}
+
+/**
+ * @brief Whether gang <gang_id> has left the list, i.e. was sent or
+ * dropped.
+ */
+static int gang_migration_gone(int gang_id) {
+    int gone;
+
+    PS_SPIN_LOCK(&_gang_migration_data_head_lock);
+    gone = find_gang_migration_data(gang_id) == NULL;
+    PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+
+    return gone;
+}
+
+/**
+ * @brief Add the current thread to its gang and turn it into a
+ * placeholder.  The last member to arrive sends the gang, or the
+ * first one does once GANG_MIGRATION_TIMEOUT has passed.
+ * Must be called from the thread's own return to user space path.
+ */
+static int gang_migration_join(int gang_id) {
+    struct task_struct* task = current;
+    struct pt_regs* regs = task_pt_regs(task);
+    gang_migration_data_t* data = NULL;
+    gang_thread_t* t = NULL;
+    unsigned long fs, gs;
+    int lclone_request_id;
+    int send = 0;
+    int first = 0;
+    int cpu;
+    unsigned long long migration_start = native_read_tsc();
+    unsigned long long wait_start;
+
+    PS_SPIN_LOCK(&_clone_request_id_lock);
+    lclone_request_id = _clone_request_id++;
+    PS_SPIN_UNLOCK(&_clone_request_id_lock);
+
+    PS_SPIN_LOCK(&_gang_migration_data_head_lock);
+    data = find_gang_migration_data(gang_id);
+    if(!data || data->arrived >= data->expected) {
+        PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+        return PROCESS_SERVER_CLONE_FAIL;
+    }
+
+    // Same book keeping as do_migration_to_new_cpu for a placeholder.
+    __set_task_state(task,TASK_UNINTERRUPTIBLE);
+    set_bit(smp_processor_id(),&task->previous_cpus);
+    set_cpu_has_known_tgroup_mm(task,data->cpu);
+    spin_lock_irq(&(task->mig_lock));
+    task->represents_remote = 1;
+    task->tgroup_distributed = 1;
+    task->t_distributed = 1;
+    spin_unlock_irq(&(task->mig_lock));
+    if(task->prev_pid == -1)
+        task->origin_pid = task->pid;
+
+    t = &data->msg->threads[data->arrived];
+    t->placeholder_pid = task->pid;
+    t->clone_request_id = lclone_request_id;
+    t->t_home_cpu = task->t_home_cpu;
+    t->t_home_id = task->t_home_id;
+    t->origin_pid = task->origin_pid;
+    t->prio = task->prio;
+    t->static_prio = task->static_prio;
+    t->normal_prio = task->normal_prio;
+    t->rt_priority = task->rt_priority;
+    t->sched_class = task->policy;
+    t->previous_cpus = task->previous_cpus;
+    memcpy(&t->regs, regs, sizeof(struct pt_regs));
+    t->thread_sp0 = task->thread.sp0;
+    t->thread_sp = task->thread.sp;
+    t->thread_usersp = get_percpu_old_rsp();
+    t->thread_es = task->thread.es;
+    t->thread_ds = task->thread.ds;
+    t->thread_fsindex = task->thread.fsindex;
+    t->thread_gsindex = task->thread.gsindex;
+    rdmsrl(MSR_FS_BASE, fs);
+    t->thread_fs = fs;
+    rdmsrl(MSR_KERNEL_GS_BASE, gs);
+    t->thread_gs = gs;
+    t->remote_blocked = task->blocked;
+    t->remote_real_blocked = task->real_blocked;
+    t->remote_saved_sigmask = task->saved_sigmask;
+    t->sas_ss_sp = task->sas_ss_sp;
+    t->sas_ss_size = task->sas_ss_size;
+    t->migration_start = migration_start;
+    migration_phase(PS_MIGRATION_REQUEST_BUILT,task->pid,data->cpu,
+                    migration_start);
+
+    cpu = data->cpu;
+    data->arrived++;
+    if(data->arrived == data->expected) {
+        remove_data_entry_from(data,&_gang_migration_data_head);
+        send = 1;
+    } else if(data->arrived == 1) {
+        first = 1;
+    }
+    PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+
+    if(first) {
+        // Give the rest of the gang a while to arrive, then go with
+        // whoever made it.
+        wait_start = native_read_tsc();
+        wait_event_timeout(_gang_migration_wq,gang_migration_gone(gang_id),
+                           GANG_MIGRATION_TIMEOUT);
+        process_server_track_wait(PS_WAIT_GANG,wait_start);
+
+        PS_SPIN_LOCK(&_gang_migration_data_head_lock);
+        data = find_gang_migration_data(gang_id);
+        if(data) {
+            remove_data_entry_from(data,&_gang_migration_data_head);
+            send = 1;
+        }
+        PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+
+        // Park again.  The gang may already have been sent by the last
+        // member and this thread woken up by its return, in which case
+        // the placeholder must not go to sleep.
+        __set_task_state(task,TASK_UNINTERRUPTIBLE);
+        if(task->return_disposition != RETURN_DISPOSITION_NONE)
+            __set_task_state(task,TASK_RUNNING);
+    }
+
+    if(send) {
+        wake_up(&_gang_migration_wq);
+        gang_migration_send(data);
+    }
+
+    migration_phase(PS_MIGRATION_PLACEHOLDER_PARKED,task->pid,cpu,
+                    migration_start);
+
+    return PROCESS_SERVER_CLONE_SUCCESS;
+}
+
+/**
+ * @brief Withdraw a member that will never arrive, e.g. because it
+ * is exiting, so the rest of its gang is not held back.
+ */
+static void gang_migration_leave(int gang_id) {
+    gang_migration_data_t* data = NULL;
+    int send = 0;
+    int destroy = 0;
+
+    PS_SPIN_LOCK(&_gang_migration_data_head_lock);
+    data = find_gang_migration_data(gang_id);
+    if(data) {
+        data->expected--;
+        if(data->expected == 0) {
+            remove_data_entry_from(data,&_gang_migration_data_head);
+            destroy = 1;
+        } else if(data->arrived == data->expected) {
+            remove_data_entry_from(data,&_gang_migration_data_head);
+            send = 1;
+        }
+    }
+    PS_SPIN_UNLOCK(&_gang_migration_data_head_lock);
+
+    if(send) {
+        wake_up(&_gang_migration_wq);
+        gang_migration_send(data);
+    } else if(destroy) {
+        kfree(data->msg);
+        kfree(data);
+    }
+}
+
+/**
+ * @brief Handles a task's return disposition.  When a task is re-awoken
+ * when it either migrates back to this CPU, or exits, this function
+ * implements the actions that must be made immediately after
+ * the newly awoken task resumes execution.
+ */
+void process_server_do_return_disposition(void) {
+
+    int return_disposition = current->return_disposition;
+
+    //printk("%s disp{%d} \n",__func__,return_disposition);
+    // Reset the return disposition
+    current->return_disposition = RETURN_DISPOSITION_NONE;
+
+    switch(return_disposition) {
+    case RETURN_DISPOSITION_NONE:
+        printk("%s: ERROR, return disposition is none!\n",__func__);
+        break;   
+    case RETURN_DISPOSITION_MIGRATE:
+        // Nothing to do, already back-imported the
+        // state in process_back_migration.  This will
+        // remain a stub until something needs to occur
+        // here.
+        PSPRINTK("%s: return disposition migrate\n",__func__);
+        break;
+    case RETURN_DISPOSITION_EXIT:
+        PSPRINTK("%s: return disposition exit\n",__func__);
+    default:
+        do_exit(0);
+        break;
+    }
+
+    return;
+}
+
+/**
+ * @brief Finds the migration notification entry for a placeholder pid.
+ * @prerequisite Requires user to hold _migration_notify_data_head_lock
+ */
+static migration_notify_data_t* find_migration_notify_data(pid_t pid) {
+    data_header_t* curr = _migration_notify_data_head;
+    migration_notify_data_t* data = NULL;
+
+    while(curr) {
+        data = (migration_notify_data_t*)curr;
+        if(data->pid == pid) {
+            return data;
+        }
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Arm a migration notification for task <task>.  Any previous
+ * entry for the same task is recycled.
+ */
+static int migration_notify_arm(struct task_struct* task, int cpu,
+        struct eventfd_ctx* efd) {
+    migration_notify_data_t* data = NULL;
+    migration_notify_data_t* new_data = NULL;
+    struct eventfd_ctx* old_efd = NULL;
+    unsigned long lockflags;
+
+    new_data = kmalloc(sizeof(migration_notify_data_t),GFP_KERNEL);
+    if(!new_data) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&_migration_notify_data_head_lock,lockflags);
+    data = find_migration_notify_data(task->pid);
+    if(!data) {
+        data = new_data;
+        new_data = NULL;
+        data->header.data_type = PROCESS_SERVER_MIGRATION_NOTIFY_DATA_TYPE;
+        data->pid = task->pid;
+        add_data_entry_to(data,NULL,&_migration_notify_data_head);
+    } else if(!data->done) {
+        // Still in flight, don't lose its notification.
+        spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+        kfree(new_data);
+        return -EBUSY;
+    } else {
+        old_efd = data->efd;
+    }
+    data->tgid = task->tgid;
+    data->cpu = cpu;
+    data->done = 0;
+    data->efd = eventfd_ctx_get(efd);
+    data->start = native_read_tsc();
+    data->request = 0;
+    data->import = 0;
+    data->resume = 0;
+    spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+
+    if(old_efd) eventfd_ctx_put(old_efd);
+    if(new_data) kfree(new_data);
+
+    return 0;
+}
+
+/**
+ * @brief Record that the migration request for <pid> has been sent.
+ */
+static void migration_notify_request_sent(pid_t pid) {
+    migration_notify_data_t* data = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_migration_notify_data_head_lock,lockflags);
+    data = find_migration_notify_data(pid);
+    if(data && !data->done) {
+        data->request = native_read_tsc();
+    }
+    spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+}
+
+/**
+ * @brief Complete a pending migration notification, if there is one,
+ * and signal its eventfd.  Safe to call from message handlers.
+ */
+static void migration_notify_finish(pid_t pid, unsigned long long import,
+        unsigned long long resume, int done) {
+    migration_notify_data_t* data = NULL;
+    struct eventfd_ctx* efd = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_migration_notify_data_head_lock,lockflags);
+    data = find_migration_notify_data(pid);
+    if(data && !data->done) {
+        data->import = import;
+        data->resume = resume;
+        data->done = done;
+        efd = data->efd;
+    }
+    // Signal under the lock, the entry may be released by a query as
+    // soon as it is dropped.
+    if(efd) eventfd_signal(efd,1);
+    spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+}
+
+/**
+ * @brief Carry out an explicit migration requested through
+ * sys_popcorn_migrate.  Called by the migrating thread itself on
+ * its way back to user space, so its user register state is complete
+ * in <regs>.
+ */
+void process_server_do_pending_migration(struct pt_regs* regs) {
+    int cpu = current->migration_target_cpu;
+    int ret;
+
+    current->migration_target_cpu = -1;
+    if(cpu == -1) return;
+
+    // On this path the user stack pointer is always in regs, not in
+    // the per-cpu syscall scratch slot the migration code reads.
+    set_percpu_old_rsp(regs->sp);
+
+    spin_lock_irq(&(current->mig_lock));
+    current->migration_state = 1;
+    spin_unlock_irq(&(current->mig_lock));
+
+    if(current->migration_gang_id) {
+        int gang_id = current->migration_gang_id;
+        current->migration_gang_id = 0;
+        ret = gang_migration_join(gang_id);
+        if(ret == PROCESS_SERVER_CLONE_FAIL)
+            ret = process_server_do_migration(current,cpu);
+    } else {
+        ret = process_server_do_migration(current,cpu);
+    }
+
+    spin_lock_irq(&(current->mig_lock));
+    current->migration_state = 0;
+    spin_unlock_irq(&(current->mig_lock));
+
+    if(ret == PROCESS_SERVER_CLONE_FAIL) {
+        __set_current_state(TASK_RUNNING);
+        migration_notify_finish(current->pid,0,0,-1);
+        return;
+    }
+
+    migration_notify_request_sent(current->pid);
+
+    // Sleep as a placeholder until we either migrate back or exit.
+    shadow_return_check(current);
+}
+
+/**
+ * @brief Whether <cpu> names a cpu owned by another kernel.
+ */
+static int is_remote_kernel_cpu(int cpu) {
+    if(cpu < 0 || cpu >= NR_CPUS) return 0;
+#ifndef SUPPORT_FOR_CLUSTERING
+    return cpu != _cpu;
+#else
+    return !cpumask_test_cpu(cpu, cpu_present_mask);
+#endif
+}
+
+/**
+ * Placement policy.
+ *
+ * Picks the destination of a migration among the cpus a task is
+ * allowed on.  The default policy estimates, for every kernel owning
+ * an allowed cpu, how many remote faults the task will take once there
+ * and how long it will wait for a cpu, and goes for the cheapest one.
+ * Both are expressed in remote faults.
+ */
+#define PLACEMENT_MM_SETUP_COST 64  // first clone of the tgroup on a kernel
+#define PLACEMENT_LOAD_WEIGHT 256   // one runnable task per cpu
+
+/**
+ * @brief Expected remote faults for <task> on the kernel owning <kcpus>.
+ * The working set is approximated by the resident set of the mm.
+ */
+static unsigned long placement_fault_cost(struct task_struct* task,
+        const struct cpumask* kcpus) {
+    unsigned long rss = task->mm ? get_mm_rss(task->mm) : 0;
+
+    // Back migration, only what has been written since we left is gone.
+    if(bitmap_intersects(cpumask_bits(kcpus), &(task->previous_cpus),
+                         (sizeof(unsigned long)*8)))
+        return rss >> 3;
+
+    // The tgroup mm is there, and so are the pages its threads touched.
+    if(bitmap_intersects(cpumask_bits(kcpus), &(task->known_cpu_with_tgroup_mm),
+                         (sizeof(unsigned long)*8)))
+        return rss >> 1;
+
+    return rss + PLACEMENT_MM_SETUP_COST;
+}
+
+/**
+ * @brief Cost of queueing behind the runnable tasks of <kernel>.
+ */
+static unsigned long placement_load_cost(int kernel) {
+    unsigned long nr_running;
+    unsigned int nr_cpus;
+
+    // Nothing heard from it lately, assume it is fully busy.
+    if(popcorn_kernel_load(kernel,&nr_running,&nr_cpus))
+        return PLACEMENT_LOAD_WEIGHT;
+
+    return (nr_running * PLACEMENT_LOAD_WEIGHT) / nr_cpus;
+}
+
+static int placement_cost_select(struct task_struct* task,
+        const struct cpumask* mask) {
+    struct list_head *iter;
+    _remote_cpu_info_list_t *objPtr;
+    struct cpumask *pcpum;
+    unsigned long cost, best_cost = ULONG_MAX;
+    int cpu, best = -1;
+extern struct list_head rlist_head;
+
+    list_for_each(iter, &rlist_head) {
+        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
+        pcpum = &(objPtr->_data._cpumask);
+        cpu = cpumask_first_and(mask, pcpum);
+        if(cpu >= nr_cpu_ids || !is_remote_kernel_cpu(cpu))
+            continue;
+
+        cost = placement_fault_cost(task,pcpum) +
+               placement_load_cost(objPtr->_data._processor);
+        PSPRINTK("%s: kernel{%d} cpu{%d} cost{%lu}\n",
+                __func__,objPtr->_data._processor,cpu,cost);
+        if(cost < best_cost) {
+            best_cost = cost;
+            best = cpu;
+        }
+    }
+
+    return best;
+}
+
+static struct process_server_placement_policy placement_cost = {
+    .name = "cost",
+    .select = placement_cost_select,
+};
+
+static struct process_server_placement_policy* _placement_policy = &placement_cost;
+static DEFINE_MUTEX(_placement_policy_mutex);
+
+/**
+ * @brief Replace the placement policy.  NULL restores the default.
+ * Returns once no cpu can still be using the previous policy, so a
+ * module can go away after replacing or clearing its own.
+ */
+void process_server_set_placement_policy(struct process_server_placement_policy* policy) {
+    mutex_lock(&_placement_policy_mutex);
+    rcu_assign_pointer(_placement_policy, policy ? policy : &placement_cost);
+    synchronize_rcu();
+    printk("%s: using placement policy %s\n",__func__,_placement_policy->name);
+    mutex_unlock(&_placement_policy_mutex);
+}
+EXPORT_SYMBOL(process_server_set_placement_policy);
+
+/**
+ * @brief Restore the default placement policy if <policy> is the one
+ * in use.  For modules to call on unload.
+ */
+void process_server_clear_placement_policy(struct process_server_placement_policy* policy) {
+    mutex_lock(&_placement_policy_mutex);
+    if(_placement_policy == policy) {
+        rcu_assign_pointer(_placement_policy, &placement_cost);
+        synchronize_rcu();
+        printk("%s: using placement policy %s\n",__func__,placement_cost.name);
+    }
+    mutex_unlock(&_placement_policy_mutex);
+}
+EXPORT_SYMBOL(process_server_clear_placement_policy);
+
+/**
+ * @brief Destination cpu for migrating <task> within <mask>, or -1 if
+ * no cpu of another kernel is allowed.  The choice is charged to the
+ * destination's load until that kernel reports again.
+ */
+int process_server_select_migration_cpu(struct task_struct* task,
+        const struct cpumask* mask) {
+    struct process_server_placement_policy* policy;
+    int cpu;
+
+    // select() must not sleep.
+    rcu_read_lock();
+    policy = rcu_dereference(_placement_policy);
+    cpu = policy->select(task,mask);
+    rcu_read_unlock();
+
+    // The policy has no opinion, e.g. no load reports yet, fall back
+    // to the first cpu of another kernel.
+    if(!is_remote_kernel_cpu(cpu)) {
+        for_each_cpu(cpu, mask) {
+            if(is_remote_kernel_cpu(cpu))
+                break;
+        }
+        if(cpu >= nr_cpu_ids)
+            return -1;
+    }
+
+    popcorn_kernel_load_charge(kernel_for_cpu(cpu),1);
+
+    return cpu;
+}
+
+/**
+ * @brief POPCORN_MIGRATE_START.  Arms every listed thread for migration
+ * and returns the eventfd that will be signaled as they resume remotely.
+ */
+static long popcorn_migrate_start(struct popcorn_migrate_args __user* uargs) {
+    struct popcorn_migrate_args args;
+    pid_t pids[POPCORN_MIGRATE_MAX_THREADS];
+    struct task_struct* tasks[POPCORN_MIGRATE_MAX_THREADS];
+    struct eventfd_ctx* efd_ctx = NULL;
+    int efd;
+    int created = 0;
+    long ret = 0;
+    int i;
+    int nr_tasks = 0;
+
+    if(copy_from_user(&args,uargs,sizeof(args)))
+        return -EFAULT;
+
+    if(args.cpu != POPCORN_MIGRATE_ANY_CPU && !is_remote_kernel_cpu(args.cpu))
+        return -EINVAL;
+
+    if(args.nr_pids > POPCORN_MIGRATE_MAX_THREADS)
+        return -E2BIG;
+
+    if(!args.pids || !args.nr_pids) {
+        pids[0] = current->pid;
+        args.nr_pids = 1;
+    } else if(copy_from_user(pids,args.pids,sizeof(pid_t)*args.nr_pids)) {
+        return -EFAULT;
+    }
+
+    // Collect the tasks first, so that we either arm all of them or none.
+    rcu_read_lock();
+    for(i = 0; i < args.nr_pids; i++) {
+        struct task_struct* p = find_task_by_vpid(pids[i]);
+        if(!p || !same_thread_group(p,current) || !p->mm ||
+           p->represents_remote || p->migration_target_cpu != -1) {
+            ret = -ESRCH;
+            break;
+        }
+        get_task_struct(p);
+        tasks[nr_tasks++] = p;
+    }
+    rcu_read_unlock();
+    if(ret)
+        goto out_put;
+
+    if(args.cpu == POPCORN_MIGRATE_ANY_CPU) {
+        // The threads of a call travel together, place them by the first.
+        args.cpu = process_server_select_migration_cpu(tasks[0],cpu_all_mask);
+        if(args.cpu == -1) {
+            ret = -EINVAL;
+            goto out_put;
+        }
+        if(nr_tasks > 1)
+            popcorn_kernel_load_charge(kernel_for_cpu(args.cpu),nr_tasks - 1);
+        if(put_user(args.cpu,&uargs->cpu)) {
+            ret = -EFAULT;
+            goto out_put;
+        }
+    }
+
+    efd = args.efd;
+    if(efd < 0) {
+        efd = sys_eventfd2(0,EFD_CLOEXEC);
+        if(efd < 0) {
+            ret = efd;
+            goto out_put;
+        }
+        created = 1;
+    }
+
+    efd_ctx = eventfd_ctx_fdget(efd);
+    if(IS_ERR(efd_ctx)) {
+        ret = PTR_ERR(efd_ctx);
+        if(created) sys_close(efd);
+        goto out_put;
+    }
+
+    for(i = 0; i < nr_tasks; i++) {
+        ret = migration_notify_arm(tasks[i],args.cpu,efd_ctx);
+        if(ret) break;
+    }
+    if(ret) {
+        // Nothing has been armed for migration yet, just fail the
+        // notifications that were set up.
+        while(i--)
+            migration_notify_finish(tasks[i]->pid,0,0,-1);
+        eventfd_ctx_put(efd_ctx);
+        if(created) sys_close(efd);
+        goto out_put;
+    }
+
+    // Threads that go to a new kernel together travel as gangs.
+    gang_migration_setup(tasks,nr_tasks,args.cpu);
+
+    for(i = 0; i < nr_tasks; i++) {
+        tasks[i]->migration_target_cpu = args.cpu;
+        smp_mb();
+        set_notify_resume(tasks[i]);
+        if(tasks[i] != current)
+            kick_process(tasks[i]);
+    }
+
+    eventfd_ctx_put(efd_ctx);
+    ret = efd;
+
+out_put:
+    for(i = 0; i < nr_tasks; i++)
+        put_task_struct(tasks[i]);
+
+    return ret;
+}
+
+/**
+ * @brief Release the migration notifications of the threads of a
+ * thread group whose last local thread is exiting.  Entries that were
+ * never queried would otherwise be kept forever, and could be matched
+ * by a later thread group that reuses the pids.
+ */
+void process_server_thread_group_dead(struct task_struct* task) {
+    data_header_t* curr = NULL;
+    migration_notify_data_t* data = NULL;
+    migration_notify_data_t* dead = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_migration_notify_data_head_lock,lockflags);
+    curr = _migration_notify_data_head;
+    while(curr) {
+        data = (migration_notify_data_t*)curr;
+        curr = curr->next;
+        if(data->tgid == task->tgid) {
+            remove_data_entry_from(data,&_migration_notify_data_head);
+            // Chain them up through the header to free them unlocked.
+            data->header.next = (data_header_t*)dead;
+            dead = data;
+        }
+    }
+    spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+
+    while(dead) {
+        data = dead;
+        dead = (migration_notify_data_t*)data->header.next;
+        // Pending ones are failed, anyone still waiting must not hang.
+        if(!data->done) eventfd_signal(data->efd,1);
+        eventfd_ctx_put(data->efd);
+        kfree(data);
+    }
+}
+
+/**
+ * @brief POPCORN_MIGRATE_QUERY.  Reports the timing of the last explicit
+ * migration of a thread.  Completed entries are released once read.
+ */
+static long popcorn_migrate_query(struct popcorn_migrate_timing __user* utiming) {
+    struct popcorn_migrate_timing timing;
+    migration_notify_data_t* data = NULL;
+    struct eventfd_ctx* efd = NULL;
+    unsigned long lockflags;
+
+    if(copy_from_user(&timing,utiming,sizeof(timing)))
+        return -EFAULT;
+
+    spin_lock_irqsave(&_migration_notify_data_head_lock,lockflags);
+    data = find_migration_notify_data(timing.pid);
+    if(!data || data->tgid != current->tgid) {
+        spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+        return -ENOENT;
+    }
+    timing.cpu     = data->cpu;
+    timing.done    = data->done;
+    timing.start   = data->start;
+    timing.request = data->request;
+    timing.import  = data->import;
+    timing.resume  = data->resume;
+    if(data->done) {
+        remove_data_entry_from(data,&_migration_notify_data_head);
+        efd = data->efd;
+    } else {
+        data = NULL;
+    }
+    spin_unlock_irqrestore(&_migration_notify_data_head_lock,lockflags);
+
+    if(efd) eventfd_ctx_put(efd);
+    if(data) kfree(data);
+
+    if(copy_to_user(utiming,&timing,sizeof(timing)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/**
+ * @brief Explicit migration interface, see linux/popcorn_migrate.h
+ */
+SYSCALL_DEFINE2(popcorn_migrate, int, op, void __user*, arg) {
+    switch(op) {
+    case POPCORN_MIGRATE_START:
+        return popcorn_migrate_start((struct popcorn_migrate_args __user*)arg);
+    case POPCORN_MIGRATE_QUERY:
+        return popcorn_migrate_query((struct popcorn_migrate_timing __user*)arg);
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * @brief Whether <entry> is at the front of every queue of its
+ * thread group.
+ * _lamport_barrier_queue_lock must NOT already be held.
+ */
+static int lamport_lock_all_acquired(lamport_barrier_queue_t* queue,
+                                     lamport_barrier_entry_t* entry) {
+    data_header_t* curr = NULL;
+    lamport_barrier_queue_t* queue_curr = NULL;
+    int done = 1;
+
+    PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
+    // look through every queue for this thread group
+    curr = (data_header_t*)_lamport_barrier_queue_head;
+    while(curr) {
+        queue_curr = (lamport_barrier_queue_t*) curr;
+        if(queue_curr->tgroup_home_cpu == queue->tgroup_home_cpu &&
+           queue_curr->tgroup_home_id  == queue->tgroup_home_id) {
+            
+            // if we don't have the lock, wait again.
+            if(queue_curr->queue) {
+                if(queue_curr->queue->timestamp != entry->timestamp) {
+                    done = 0;
+                    break;
+                }
+            }
+
+        }
+        curr = curr->next;
+    }
+    PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+
+    return done;
+}
+
+/**
+ *
+ */
+void wait_for_all_lamport_lock_acquisition(lamport_barrier_queue_t* queue,
+                                           lamport_barrier_entry_t* entry) {
+    unsigned long long wait_start = native_read_tsc();
+    PSPRINTK("%s: ts{%lx}\n",__func__,entry->timestamp);
+    PSPRINTK("%s: Starting queues-\n",__func__);
+    dump_all_lamport_queues();
+    wait_event(_lamport_barrier_wq, lamport_lock_all_acquired(queue,entry));
+    process_server_track_wait(PS_WAIT_LAMPORT_ALL,wait_start);
+    PSPRINTK("%s: Ending queues-\n",__func__);
+    dump_all_lamport_queues();
+    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
+}
+
+/**
+ * @brief Whether <entry> is at the front of <queue>, in which case
+ * it becomes the active entry.
+ * _lamport_barrier_queue_lock must NOT already be held.
+ */
+static int lamport_lock_acquired(lamport_barrier_queue_t* queue,
+                                 lamport_barrier_entry_t* entry) {
+    int acquired = 0;
+
+    PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
+    if(entry == queue->queue) {
+        queue->active_timestamp = entry->timestamp;
+        acquired = 1;
+    }
+    PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+
+    return acquired;
+}
+
+/**
+ * _lamport_barrier_queue_lock must NOT already be held.
+ */
+void wait_for_lamport_lock_acquisition(lamport_barrier_queue_t* queue,
+                                       lamport_barrier_entry_t* entry) {
+    unsigned long long wait_start = native_read_tsc();
+
+    // Wait until "entry" is at the front of the queue
+    PSPRINTK("%s: ts{%llx}\n",__func__,entry->timestamp);
+    wait_event(_lamport_barrier_wq, lamport_lock_acquired(queue,entry));
+    process_server_track_wait(PS_WAIT_LAMPORT_LOCK,wait_start);
+
+    if(queue->is_heavy) {
+        wait_for_all_lamport_lock_acquisition(queue,entry);
+    }
+
+    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
+    return;
+}
+
+/**
+ * @brief Whether every cpu has answered the request for <entry>.
+ * _lamport_barrier_queue_lock must NOT already be held.
+ */
+static int lamport_request_responses_received(lamport_barrier_entry_t* entry) {
+    int done;
+
+    PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
+    done = (entry->expected_responses == entry->responses);
+    PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+
+    return done;
+}
+
+/**
+ * _lamport_barrier_queue_lock must NOT already be held.
+ */
+void wait_for_all_lamport_request_responses(lamport_barrier_entry_t* entry) {
+    unsigned long long wait_start = native_read_tsc();
+
+    PSPRINTK("%s: ts{%llx}\n",__func__,entry->timestamp);
+    wait_event(_lamport_barrier_wq, lamport_request_responses_received(entry));
+    process_server_track_wait(PS_WAIT_LAMPORT_RESPONSES,wait_start);
+    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
+    return;
+}
+
+/**
+ * 
+ */
+void add_entry_to_lamport_queue_light(unsigned long address, 
+                                      unsigned long long ts,
+                                      lamport_barrier_entry_t** entry,
+                                      lamport_barrier_queue_t** queue) {
+    lamport_barrier_queue_t* heavy_queue = NULL;
+
+    PSPRINTK("%s: addr{%lx},ts{%llx}\n",__func__,address,ts);
+
+    *entry = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+    BUG_ON(!*entry);
+
+    // form record and place in queue
+    (*entry)->timestamp = ts;
+    (*entry)->responses = 0;
+    (*entry)->expected_responses = 0;
+    (*entry)->allow_responses = 0;
+    (*entry)->is_heavy = 0;
+    (*entry)->cpu = _cpu;
+
+    // find queue if it exists
+    *queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
+                                     current->tgroup_home_id,
+                                     address,
+                                     0);
+    // If no queue exists, create one
+    if(!*queue) {
+        *queue = ps_cache_alloc(PS_CACHE_LAMPORT_QUEUE,GFP_ATOMIC);
+        BUG_ON(!*queue);
+        (*queue)->tgroup_home_cpu = current->tgroup_home_cpu;
+        (*queue)->tgroup_home_id  = current->tgroup_home_id;
+        (*queue)->address = address;
+        (*queue)->is_heavy = 0;
+        PSPRINTK("%s: Setting active_timestamp to 0\n",__func__);
+        (*queue)->active_timestamp = 0;
+        (*queue)->queue = NULL;
+        add_data_entry_to(*queue,NULL,&_lamport_barrier_queue_head);
+
+        // Add all heavy entries to this queue
+        heavy_queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
+                                                 current->tgroup_home_id,
+                                                 0,
+                                                 1);
+        if(heavy_queue) {
+            lamport_barrier_entry_t* curr = heavy_queue->queue;
+            PSPRINTK("%s: found heavy queue\n",__func__);
+            while(curr) {
+                lamport_barrier_entry_t* e = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+                BUG_ON(!e);
+                PSPRINTK("%s: adding entry from heavy queue to queue(addr{%lx}) ts{%llx}\n",
+                        __func__,address,curr->timestamp);
+                e->timestamp = curr->timestamp;
+                e->responses = 0;
+                e->expected_responses = 0;
+                e->allow_responses = 0;
+                e->is_heavy = 1;
+                e->cpu = curr->cpu;
+                
+                add_fault_entry_to_queue(e,*queue);
+
+                if((*queue)->queue == e) {
+                    PSPRINTK("%s: new entry is not at the front of the queue\n",
+                            __func__);
+                    PSPRINTK("%s: setting active timestamp to %llx\n",
+                            __func__,e->timestamp);
+                    (*queue)->active_timestamp = e->timestamp;
+                }
+               
+
+                curr = (lamport_barrier_entry_t*)curr->header.next;
             }
         }
-    } while_each_thread(g,tgroup_iterator);
-    read_unlock(&tasklist_lock);
+    } 
 
-    // Pick an id for this remote process request
-    PS_SPIN_LOCK(&_clone_request_id_lock);
-    lclone_request_id = _clone_request_id++;
-    PS_SPIN_UNLOCK(&_clone_request_id_lock);
+    // Add entry to queue
+    add_fault_entry_to_queue(*entry,*queue);
 
-#if COPY_WHOLE_VM_WITH_MIGRATION
-    {
-    int dst_has_mm = cpu_has_known_tgroup_mm(dst_cpu);
-    if(!dst_has_mm) {
-        struct vm_area_struct* curr = NULL;
-        // We have to break every cow page before migrating if we're
-        // about to move the whole thing.
-    restart_break_cow_all:
-        curr = task->mm->mmap;
-        while(curr) {
-            unsigned long addr;
-            //unsigned char broken = 0;
-            if(is_maybe_cow(curr)) {
-                PS_DOWN_WRITE(&task->mm->mmap_sem);
-                for(addr = curr->vm_start; addr < curr->vm_end; addr += PAGE_SIZE) {
-                    if(break_cow(task->mm,curr,addr)) {
-                        //broken = 1;
-                    }
+    dump_lamport_queue(*queue);
+
+}
+
+static void add_entry_to_lamport_queue_heavy(unsigned long long ts,
+                                      lamport_barrier_entry_t** entry,
+                                      lamport_barrier_queue_t** queue) {
+
+    data_header_t* curr = NULL;
+    lamport_barrier_queue_t* queue_curr = NULL;
+
+    PSPRINTK("%s: ts{%llx}\n",__func__,ts);
+
+    *entry = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+    BUG_ON(!*entry);
+
+    // form record and place in queue
+    (*entry)->timestamp = ts;
+    (*entry)->responses = 0;
+    (*entry)->expected_responses = 0;
+    (*entry)->allow_responses = 0;
+    (*entry)->is_heavy = 1;
+    (*entry)->cpu = _cpu;
+
+    // find queue if it exists
+    *queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
+                                        current->tgroup_home_id,
+                                        0,
+                                        1);
+    // If no queue exists, create one
+    if(!*queue) {
+        PSPRINTK("%s: adding heavy queue\n",__func__);
+        *queue = ps_cache_alloc(PS_CACHE_LAMPORT_QUEUE,GFP_ATOMIC);
+        BUG_ON(!*queue);
+        (*queue)->tgroup_home_cpu = current->tgroup_home_cpu;
+        (*queue)->tgroup_home_id  = current->tgroup_home_id;
+        (*queue)->address = 0;
+        (*queue)->is_heavy = 1;
+        PSPRINTK("%s: Setting active_timestamp to 0\n",__func__);
+        (*queue)->active_timestamp = 0;
+        (*queue)->queue = NULL;
+        add_data_entry_to(*queue,NULL,&_lamport_barrier_queue_head);
+    } 
+
+    // Add entry to queue
+    add_fault_entry_to_queue(*entry,*queue);
+
+    // Add entry to all existing non-heavy queues for this thread group
+    curr = (data_header_t*)_lamport_barrier_queue_head; 
+    while(curr) {
+        queue_curr = (lamport_barrier_queue_t*) curr;
+        if(queue_curr->tgroup_home_cpu == current->tgroup_home_cpu &&
+           queue_curr->tgroup_home_id  == current->tgroup_home_id) {
+
+            if(!queue_curr->is_heavy) {
+                lamport_barrier_entry_t* e = ps_cache_alloc(PS_CACHE_LAMPORT_ENTRY,GFP_ATOMIC);
+                BUG_ON(!e);
+                PSPRINTK("%s: adding entry to non heavy queue addr{%lx}\n",
+                        __func__,queue_curr->address);
+                e->timestamp = ts;
+                e->responses = 0;
+                e->expected_responses = 0;
+                e->allow_responses = 0;
+                e->is_heavy = 1;
+                e->cpu = _cpu;
+
+                add_fault_entry_to_queue(e,queue_curr);
+
+                if(queue_curr->queue == e) {
+                    PSPRINTK("%s: new entry is not at the front of the queue\n",
+                            __func__);
+                    PSPRINTK("%s: setting active timestamp to %llx\n",
+                            __func__,e->timestamp);
+                    queue_curr->active_timestamp = e->timestamp;
                 }
-                PS_UP_WRITE(&task->mm->mmap_sem);
+
+                PSPRINTK("Modified non heavy queue-\n");
+                dump_lamport_queue(queue_curr);
             }
-            //if(broken) 
-            //    goto restart_break_cow_all;
-            curr = curr->vm_next;
+            
         }
-        
-        PS_DOWN_READ(&task->mm->mmap_sem);
-        curr = task->mm->mmap;
+        curr = curr->next;
+    }
+    PSPRINTK("%s: exiting\n",__func__);
+}
 
-        while(curr) {
-            // Only send the vma is either we don't think the 
-            // remote cpu has a mm already set up, or if this
-            // vma represents the task's stack.
-            //if(!dst_has_mm ) {
-                send_vma(task->mm,
-                         curr,
-                         dst_cpu,
-                        lclone_request_id);
-            //} 
-            curr = curr->vm_next;
+/**
+ * _lamport_barrier_queue_lock must already be held.
+ */
+static void add_entry_to_lamport_queue(unsigned long address, 
+                                unsigned long long ts,
+                                lamport_barrier_entry_t** entry,
+                                lamport_barrier_queue_t** queue,
+                                int is_heavy) {
+    if(is_heavy) {
+        add_entry_to_lamport_queue_heavy(ts,entry,queue);
+    } else {
+        add_entry_to_lamport_queue_light(address,ts,entry,queue);
+    }
+}
+
+
+/**
+ * Page lock statistics of a thread group on this kernel, published in
+ * /proc/procsrv_page_lock, writing to it clears them.  Wait and hold
+ * times, and how many requests had to queue behind a conflicting one,
+ * are accounted per call site by the kernel that took the lock.  The
+ * home kernel also keeps the pages with the most queued requests, and
+ * which kernels those came from, to point at pages that are falsely
+ * shared between kernels.  It does so with the space saving algorithm:
+ * a page not tracked yet takes over the slot with the lowest count,
+ * and that count plus one.  Counts are therefore an upper bound, but
+ * no hot page is missed, for the price of a fixed size table.
+ *
+ * A lock looks up the statistics of its group once, when it is
+ * requested, and keeps a reference to them, so that giving it up only
+ * adds to atomic counters.  They are allocated when a group is first
+ * seen, and freed with the last reference once the group exits or
+ * they are cleared.
+ */
+#define PAGE_LOCK_HOT_PAGES 16
+typedef struct _page_lock_hot_page {
+    unsigned long address;
+    unsigned long count;
+    struct cpumask kernels;
+} page_lock_hot_page_t;
+
+typedef struct _page_lock_stats {
+    data_header_t header;
+    int tgroup_home_cpu;
+    int tgroup_home_id;
+    atomic_t refs;
+    latency_hist_t wait[PS_LOCK_SITE_MAX];
+    latency_hist_t hold[PS_LOCK_SITE_MAX];
+    atomic_long_t contended[PS_LOCK_SITE_MAX];
+    page_lock_hot_page_t hot[PAGE_LOCK_HOT_PAGES];
+} page_lock_stats_t;
+
+static const char* const _lock_site_names[PS_LOCK_SITE_MAX] = {
+    [PS_LOCK_SITE_FAULT]    = "fault",
+    [PS_LOCK_SITE_MMAP]     = "mmap",
+    [PS_LOCK_SITE_MUNMAP]   = "munmap",
+    [PS_LOCK_SITE_MPROTECT] = "mprotect",
+    [PS_LOCK_SITE_MREMAP]   = "mremap",
+};
+
+/**
+ * @brief Finds the page lock statistics of a thread group.
+ * @prerequisite Requires user to hold _page_lock_stats_head_lock
+ */
+static page_lock_stats_t* find_page_lock_stats(int tgroup_home_cpu,
+                                               int tgroup_home_id) {
+    data_header_t* curr;
+    page_lock_stats_t* stats;
+
+    for(curr = _page_lock_stats_head; curr; curr = curr->next) {
+        stats = (page_lock_stats_t*)curr;
+        if(stats->tgroup_home_cpu == tgroup_home_cpu &&
+           stats->tgroup_home_id  == tgroup_home_id) {
+            return stats;
         }
+    }
+
+    return NULL;
+}
 
+/**
+ * @brief Find or create the page lock statistics of a thread group.
+ * <new_stats> is used for the creation, and set to NULL if it was.
+ * @prerequisite Requires user to hold _page_lock_stats_head_lock
+ */
+static page_lock_stats_t* get_page_lock_stats(int tgroup_home_cpu,
+                                              int tgroup_home_id,
+                                              page_lock_stats_t** new_stats) {
+    page_lock_stats_t* stats = find_page_lock_stats(tgroup_home_cpu,
+                                                    tgroup_home_id);
+    int i;
 
-        PS_UP_READ(&task->mm->mmap_sem);
+    if(!stats && *new_stats) {
+        stats = *new_stats;
+        *new_stats = NULL;
+        stats->header.data_type = PROCESS_SERVER_PAGE_LOCK_STATS_DATA_TYPE;
+        stats->tgroup_home_cpu = tgroup_home_cpu;
+        stats->tgroup_home_id  = tgroup_home_id;
+        atomic_set(&stats->refs,1); // The list's
+        for(i = 0; i < PS_LOCK_SITE_MAX; i++)
+            stats->wait[i].name = stats->hold[i].name = _lock_site_names[i];
+        add_data_entry_to(stats,NULL,&_page_lock_stats_head);
     }
+
+    return stats;
+}
+
+/**
+ * @brief Look up the page lock statistics of a thread group, creating
+ * them if it is the first time it is seen, and take a reference to
+ * them.  Only the first lookup of a group allocates, with <gfp>.
+ * @return NULL if out of memory.
+ */
+static page_lock_stats_t* page_lock_stats_get(int tgroup_home_cpu,
+                                              int tgroup_home_id,
+                                              gfp_t gfp) {
+    page_lock_stats_t* stats;
+    page_lock_stats_t* new_stats = NULL;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+    stats = find_page_lock_stats(tgroup_home_cpu,tgroup_home_id);
+    if(!stats) {
+        spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
+        new_stats = kzalloc(sizeof(page_lock_stats_t),gfp);
+        spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+        stats = get_page_lock_stats(tgroup_home_cpu,tgroup_home_id,&new_stats);
     }
-#endif
+    if(stats)
+        atomic_inc(&stats->refs);
+    spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
 
-    // Build request
-    request->header.type = PCN_KMSG_TYPE_PROC_SRV_CLONE_REQUEST;
-    request->header.prio = PCN_KMSG_PRIO_NORMAL;
-    request->clone_flags = clone_flags;
-    request->clone_request_id = lclone_request_id;
-    memcpy( &request->regs, regs, sizeof(struct pt_regs) );
-    strncpy( request->exe_path, rpath, 512 );
-    
-    // struct mm_struct -----------------------------------------------------------
-    request->stack_start = task->mm->start_stack;
-    request->heap_start = task->mm->start_brk;
-    request->heap_end = task->mm->brk;
-    request->env_start = task->mm->env_start;
-    request->env_end = task->mm->env_end;
-    request->arg_start = task->mm->arg_start;
-    request->arg_end = task->mm->arg_end;
-    request->data_start = task->mm->start_data;
-    request->data_end = task->mm->end_data;
-    request->def_flags = task->mm->def_flags;
-    
-    // struct task_struct ---------------------------------------------------------    
-    request->stack_ptr = stack_start;
-    request->placeholder_pid = task->pid;
-    request->placeholder_tgid = task->tgid;
-    request->tgroup_home_cpu = task->tgroup_home_cpu;
-    request->tgroup_home_id = task->tgroup_home_id;
-    request->t_home_cpu = task->t_home_cpu;
-    request->t_home_id = task->t_home_id;
-    request->previous_cpus = task->previous_cpus;
-    request->prio = task->prio;
-    request->static_prio = task->static_prio;
-    request->normal_prio = task->normal_prio;
-    request->rt_priority = task->rt_priority;
-    request->sched_class = task->policy;
-    request->personality = task->personality;
-    
+    if(new_stats) kfree(new_stats);
 
-    /*mklinux_akshay*/
-    if (task->prev_pid == -1)
-    	request->origin_pid = task->pid;
-    else
-    	request->origin_pid = task->origin_pid;
-    request->remote_blocked = task->blocked;
-    request->remote_real_blocked = task->real_blocked;
-    request->remote_saved_sigmask = task->saved_sigmask;
-   // request->remote_pending = task->pending;
-    request->sas_ss_sp = task->sas_ss_sp;
-    request->sas_ss_size = task->sas_ss_size;
-    int cnt = 0;
-    for (cnt = 0; cnt < _NSIG; cnt++)
-    	request->action[cnt] = task->sighand->action[cnt];
+    return stats;
+}
 
-    // struct thread_struct -------------------------------------------------------
-    // have a look at: copy_thread() arch/x86/kernel/process_64.c 
-    // have a look at: struct thread_struct arch/x86/include/asm/processor.h
-    {
-      	unsigned long fs, gs;
-	unsigned int fsindex, gsindex;
-	unsigned int ds, es;
-    unsigned long _usersp;
+/**
+ * @brief Drop a reference taken with page_lock_stats_get.
+ */
+static void page_lock_stats_put(page_lock_stats_t* stats) {
+    if(stats && atomic_dec_and_test(&stats->refs))
+        kfree(stats);
+}
 
-	if (current != task)
-	    PSPRINTK("DAVEK current is different from task!\n");
+/**
+ * @brief Account a page lock taken at <site> once it is given up.
+ * Takes no lock.
+ */
+static void page_lock_stats_account(page_lock_stats_t* stats,
+                                    int site,
+                                    unsigned long long wait,
+                                    unsigned long long hold,
+                                    int contended) {
+    if(!stats || site < 0 || site >= PS_LOCK_SITE_MAX) return;
 
-    request->thread_sp0 = task->thread.sp0;
-    request->thread_sp = task->thread.sp;
-    //printk("%s: usersp percpu %lx thread %lx fs where it migrated {%lx}\n", __func__, get_percpu_old_rsp(), task->thread.usersp,task->thread.fs);
-    // if (percpu_read(old_rsp), task->thread.usersp) set to 0 otherwise copy
-    _usersp = get_percpu_old_rsp();
-    if (task->thread.usersp != _usersp) {
-       // printk("%s: USERSP %lx %lx\n",
-         //       __func__, task->thread.usersp, _usersp);
-        request->thread_usersp = _usersp;
-    } else {
-        request->thread_usersp = task->thread.usersp;
+    latency_hist_add(&stats->wait[site],wait);
+    latency_hist_add(&stats->hold[site],hold);
+    if(contended)
+        atomic_long_inc(&stats->contended[site]);
+}
+
+/**
+ * @brief At the home kernel, account a request from kernel <cpu> for
+ * the page at <address> that had to queue.
+ */
+static void page_lock_stats_hot(int tgroup_home_cpu,
+                                int tgroup_home_id,
+                                unsigned long address,
+                                int cpu) {
+    page_lock_stats_t* stats;
+    page_lock_hot_page_t* hot;
+    unsigned long lockflags;
+    int i;
+
+    stats = page_lock_stats_get(tgroup_home_cpu,tgroup_home_id,GFP_ATOMIC);
+    if(stats) {
+        spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+        hot = &stats->hot[0];
+        for(i = 0; i < PAGE_LOCK_HOT_PAGES; i++) {
+            if(stats->hot[i].count && stats->hot[i].address == address) {
+                hot = &stats->hot[i];
+                break;
+            }
+            if(stats->hot[i].count < hot->count)
+                hot = &stats->hot[i];
+        }
+        if(!hot->count || hot->address != address) {
+            hot->address = address;
+            cpumask_clear(&hot->kernels);
+        }
+        hot->count++;
+        cpumask_set_cpu(cpu,&hot->kernels);
+        spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
+        page_lock_stats_put(stats);
     }
-    
-    request->thread_es = task->thread.es;
-    savesegment(es, es);          
-    if ((current == task) && (es != request->thread_es))
-      PSPRINTK("%s: DAVEK: es %x thread %x\n", __func__, es, request->thread_es);
-    request->thread_ds = task->thread.ds;
-    savesegment(ds, ds);
-    if (ds != request->thread_ds)
-      PSPRINTK("%s: DAVEK: ds %x thread %x\n", __func__, ds, request->thread_ds);
-    
-    // fs register (TLS in user space)    
-    request->thread_fsindex = task->thread.fsindex;
-    savesegment(fs, fsindex);
-    if (fsindex != request->thread_fsindex)
-        //printk(KERN_ALERT"%s: fsindex %x (TLS_SEL:%x) thread %x\n", __func__, fsindex, FS_TLS_SEL, request->thread_fsindex);
-    request->thread_fs = task->thread.fs;
-    rdmsrl(MSR_FS_BASE, fs);
-    if (fs != request->thread_fs) {
-        request->thread_fs = fs;
-        PSPRINTK("%s: DAVEK: fs %lx thread %lx\n", __func__, fs, request->thread_fs);
+}
+
+/**
+ * @brief Drop the statistics of a thread group that has exited.
+ */
+static void page_lock_stats_destroy(int tgroup_home_cpu, int tgroup_home_id) {
+    page_lock_stats_t* stats;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+    stats = find_page_lock_stats(tgroup_home_cpu,tgroup_home_id);
+    if(stats)
+        remove_data_entry_from(stats,&_page_lock_stats_head);
+    spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
+
+    page_lock_stats_put(stats);
+}
+
+static int page_lock_stats_proc_read(char* page, char** start, off_t off,
+                                     int count, int* eof, void* d) {
+    char* p = page;
+    char* end = page + PAGE_SIZE;
+    char kernels[64];
+    page_lock_stats_t* stats;
+    page_lock_hot_page_t* order[PAGE_LOCK_HOT_PAGES];
+    page_lock_hot_page_t* tmp;
+    data_header_t* curr;
+    unsigned long lockflags;
+    int i,j,n;
+
+    spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+    for(curr = _page_lock_stats_head; curr; curr = curr->next) {
+        stats = (page_lock_stats_t*)curr;
+        p += scnprintf(p,end - p,"tgroup{%d,%d}\n",
+                       stats->tgroup_home_cpu,stats->tgroup_home_id);
+        for(i = 0; i < PS_LOCK_SITE_MAX; i++) {
+            if(!atomic_read(&stats->wait[i].count)) continue;
+            p = latency_hist_print("wait ",&stats->wait[i],1,p,end);
+            p = latency_hist_print("hold ",&stats->hold[i],1,p,end);
+        }
+        p += scnprintf(p,end - p,"contended");
+        for(i = 0; i < PS_LOCK_SITE_MAX; i++)
+            p += scnprintf(p,end - p," %s{%lu}",
+                           _lock_site_names[i],
+                           atomic_long_read(&stats->contended[i]));
+        p += scnprintf(p,end - p,"\n");
+
+        // Hottest first
+        n = 0;
+        for(i = 0; i < PAGE_LOCK_HOT_PAGES; i++) {
+            if(!stats->hot[i].count) continue;
+            order[n] = &stats->hot[i];
+            for(j = n++; j > 0 && order[j-1]->count < order[j]->count; j--) {
+                tmp = order[j-1];
+                order[j-1] = order[j];
+                order[j] = tmp;
+            }
+        }
+        for(i = 0; i < n; i++) {
+            cpulist_scnprintf(kernels,sizeof(kernels),&order[i]->kernels);
+            p += scnprintf(p,end - p,"hot addr{%lx} count{%lu} kernels{%s}\n",
+                           order[i]->address,order[i]->count,kernels);
+        }
     }
-    
-    // gs register (percpu in kernel space)
-    request->thread_gsindex = task->thread.gsindex;
-    savesegment(gs, gsindex);
-    if (gsindex != request->thread_gsindex)
-        printk(KERN_WARNING"%s: gsindex %x (TLS_SEL:%x) thread %x\n", __func__, gsindex, GS_TLS_SEL, request->thread_gsindex);
-    request->thread_gs = task->thread.gs;
-    rdmsrl(MSR_KERNEL_GS_BASE, gs); //NOTE there are two gs base registers in Kernel the used one is MSR_GS_BASE, so MSR_KERNEL_GS_BASE is user space in kernel
-    if (gs != request->thread_gs) {
-        request->thread_gs = gs;
-        PSPRINTK("%s: DAVEK: gs %lx thread %lx\n", __func__, fs, request->thread_gs);
+    spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
+
+    *eof = 1;
+    return p - page;
+}
+
+static int page_lock_stats_proc_write(struct file* file, const char* buffer,
+                                      unsigned long count, void* data) {
+    data_header_t* curr;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_page_lock_stats_head_lock,lockflags);
+    curr = _page_lock_stats_head;
+    _page_lock_stats_head = NULL;
+    spin_unlock_irqrestore(&_page_lock_stats_head_lock,lockflags);
+
+    while(curr) {
+        data_header_t* next = curr->next;
+        page_lock_stats_put((page_lock_stats_t*)curr);
+        curr = next;
     }
+    return count;
+}
 
-#ifdef FPU_   
- //FPU migration code --- initiator
-PSPRINTK(KERN_ERR"%s: task flags %x fpu_counter %x has_fpu %x [%d:%d] %d:%d %x\n",
-		        __func__, task->flags, (int)task->fpu_counter, (int)task->thread.has_fpu,
-		         (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu),
-		         (int)use_xsave(), (int)use_fxsr(), (int) PF_USED_MATH);
-     request->task_flags = task->flags;
-     request->task_fpu_counter = task->fpu_counter;
-    request->thread_has_fpu = task->thread.has_fpu;
-     if (!fpu_allocated(&task->thread.fpu)) {  
-	         printk("%s: !fpu_allocated\n", __func__);
-	         request->thread_has_fpu &= (unsigned char)~HAS_FPU_MASK;
-	     }
-	     else {
-		         struct fpu temp; temp.state = &request->fpu_state;      
-		         fpu_save_init(&task->thread.fpu);
-		         fpu_copy(&temp, &task->thread.fpu);
-		         request->thread_has_fpu |= HAS_FPU_MASK;
-		     }
-		 printk(KERN_ALERT"%s: flags %x fpu_counter %x has_fpu %x [%d:%d]\n",
-				         __func__, request->task_flags, (int)request->task_fpu_counter,
-				         (int)request->thread_has_fpu, (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu));
-#endif
-    
-	// ptrace, debug, dr7: struct perf_event *ptrace_bps[HBP_NUM]; unsigned long debugreg6; unsigned long ptrace_dr7;
-    // Fault info: unsigned long cr2; unsigned long trap_no; unsigned long error_code;
-    // floating point: struct fpu fpu; THIS IS NEEDED
-    // IO permissions: unsigned long *io_bitmap_ptr; unsigned long iopl; unsigned io_bitmap_max;
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+/**
+ * Home based page locks.  Every page lock of a thread group is
+ * arbitrated by the home kernel of the group, which keeps the requests
+ * in a FIFO.  Taking a lock is one request and one grant, and giving
+ * it up one release, instead of a round of messages to every kernel
+ * for each step.  Requests from the home kernel itself send nothing.
+ */
+
+/**
+ * @brief Finds the page lock queue of a thread group at this kernel.
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static page_lock_home_group_t* find_page_lock_home_group(int tgroup_home_cpu,
+                                                         int tgroup_home_id) {
+    data_header_t* curr = _page_lock_home_head;
+    page_lock_home_group_t* group = NULL;
+
+    while(curr) {
+        group = (page_lock_home_group_t*)curr;
+        if(group->tgroup_home_cpu == tgroup_home_cpu &&
+           group->tgroup_home_id  == tgroup_home_id) {
+            return group;
+        }
+        curr = curr->next;
     }
 
-    // Remember that now, that cpu has a mm for this tgroup
-    //set_cpu_has_known_tgroup_mm(dst_cpu);
+    return NULL;
+}
 
-    // Send request
-    DO_UNTIL_SUCCESS(pcn_kmsg_send_long(dst_cpu, 
-                        (struct pcn_kmsg_long_message*)request, 
-                        sizeof(clone_request_t) - sizeof(request->header)));
+/**
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static void page_lock_tree_insert(page_lock_home_group_t* group,
+                                  page_lock_home_entry_t* entry) {
+    struct prio_tree_node* node;
 
-    kfree(request);
+    INIT_LIST_HEAD(&entry->same);
+    INIT_PRIO_TREE_NODE(&entry->node);
+    entry->node.start = entry->address >> PAGE_SHIFT;
+    entry->node.last  = (entry->address + entry->sz - 1) >> PAGE_SHIFT;
 
-    printk(KERN_ALERT"Migration done\n");
-    //dump_task(task,regs,request->stack_ptr);
-    
-    PERF_MEASURE_STOP(&perf_process_server_do_migration,"migration to new cpu",perf);
+    node = prio_tree_insert(&group->tree,&entry->node);
+    if(node != &entry->node) {
+        page_lock_home_entry_t* owner =
+            prio_tree_entry(node,page_lock_home_entry_t,node);
+        list_add_tail(&entry->same,&owner->same);
+        entry->in_tree = 0;
+    } else {
+        entry->in_tree = 1;
+    }
+}
 
-    
-    __set_task_state(task,TASK_UNINTERRUPTIBLE);
-    return PROCESS_SERVER_CLONE_SUCCESS;
+/**
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static void page_lock_tree_remove(page_lock_home_group_t* group,
+                                  page_lock_home_entry_t* entry) {
+    page_lock_home_entry_t* next;
 
+    if(!entry->in_tree) {
+        list_del(&entry->same);
+    } else if(list_empty(&entry->same)) {
+        prio_tree_remove(&group->tree,&entry->node);
+    } else {
+        // Hand the tree node over to the next request on the range.
+        next = list_first_entry(&entry->same,page_lock_home_entry_t,same);
+        list_del_init(&entry->same);
+        prio_tree_replace(&group->tree,&entry->node,&next->node);
+        next->in_tree = 1;
+    }
 }
 
 /**
- * @brief Migrate the specified task to a CPU on which it has previously
- * executed.
- *
- * <MEASURE perf_process_server_do_migration>
+ * @brief Sequence number of the oldest heavy request of a group.
+ * @prerequisite Requires user to hold _page_lock_home_lock
  */
-int do_migration_back_to_previous_cpu(struct task_struct* task, int cpu) {
-    back_migration_t *mig =NULL;
-    struct pt_regs* regs = task_pt_regs(task);
+static unsigned long page_lock_first_heavy_seq(page_lock_home_group_t* group) {
+    page_lock_home_entry_t* entry;
 
-    unsigned long _usersp;
-    int perf = -1;
+    if(group->nr_heavy) {
+        list_for_each_entry(entry,&group->queue,queue) {
+            if(entry->is_heavy)
+                return entry->seq;
+        }
+    }
+    return ULONG_MAX;
+}
 
-    perf = PERF_MEASURE_START(&perf_process_server_do_migration);
+/**
+ * @brief Whether earlier request <e> keeps <entry> from being granted.
+ */
+static inline int page_lock_home_blocks(page_lock_home_entry_t* e,
+                                        page_lock_home_entry_t* entry) {
+    return e->seq < entry->seq && !(e->shared && entry->shared);
+}
 
-    mig = kmalloc(sizeof(back_migration_t), GFP_ATOMIC);
-    if (!mig) {
-         printk("%s: ERROR kmalloc ret %p\n", __func__, mig);
-         return -1;
-     }
-    // Set up response header
+/**
+ * @brief Whether <entry> can be granted, that is no earlier request
+ * that conflicts with it is queued.  Costs a tree lookup over its
+ * range, however many pages that is.  A shared request still waits
+ * behind an earlier exclusive one, so that writers are not starved.
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static int page_lock_home_grantable(page_lock_home_group_t* group,
+                                    page_lock_home_entry_t* entry) {
+    struct prio_tree_iter iter;
+    struct prio_tree_node* node;
+    page_lock_home_entry_t* owner;
+    page_lock_home_entry_t* e;
 
-    mig->header.type = PCN_KMSG_TYPE_PROC_SRV_BACK_MIGRATION;
-    mig->header.prio = PCN_KMSG_PRIO_NORMAL;
+    if(entry->is_heavy)
+        return group->queue.next == &entry->queue;
 
-    // Make mark on the list of previous cpus
-    set_bit(smp_processor_id(),&task->previous_cpus);
+    if(page_lock_first_heavy_seq(group) < entry->seq)
+        return 0;
 
-    // Knock this task out.
-    __set_task_state(task,TASK_UNINTERRUPTIBLE);
-    
-    // Update local state
-    task->executing_for_remote = 0;
-    task->represents_remote = 1;
-    task->t_distributed = 1; // This should already be the case
-    
-    // Build message
-    mig->tgroup_home_cpu = task->tgroup_home_cpu;
-    mig->tgroup_home_id  = task->tgroup_home_id;
-    mig->t_home_cpu      = task->t_home_cpu;
-    mig->t_home_id       = task->t_home_id;
-    mig->previous_cpus   = task->previous_cpus;
-    mig->thread_fs       = task->thread.fs;
-    mig->thread_gs       = task->thread.gs;
+    prio_tree_iter_init(&iter,&group->tree,entry->node.start,entry->node.last);
+    while((node = prio_tree_next(&iter))) {
+        owner = prio_tree_entry(node,page_lock_home_entry_t,node);
+        if(page_lock_home_blocks(owner,entry))
+            return 0;
+        list_for_each_entry(e,&owner->same,same) {
+            if(page_lock_home_blocks(e,entry))
+                return 0;
+        }
+    }
+    return 1;
+}
 
-    _usersp = get_percpu_old_rsp();
-if (task->thread.usersp != _usersp) { 
-  printk("%s: USERSP %lx %lx\n",
-    __func__, task->thread.usersp, _usersp);
-  mig->thread_usersp = _usersp;
-}else
-  mig->thread_usersp = task->thread.usersp;
+/**
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static void page_lock_home_try_grant(page_lock_home_group_t* group,
+                                     page_lock_home_entry_t* entry) {
+    if(entry->granted || !page_lock_home_grantable(group,entry))
+        return;
+    entry->granted = 1;
+    list_add_tail(&entry->notify,&_page_lock_home_notify);
+}
 
+/**
+ * @brief Grant what the release of a request on pages [start,last]
+ * may have unblocked.  Only requests overlapping it, and a heavy
+ * request now at the head, can have waited on a light request.
+ * Everything up to the next heavy request can have waited on a heavy
+ * one.
+ * @prerequisite Requires user to hold _page_lock_home_lock
+ */
+static void page_lock_home_schedule(page_lock_home_group_t* group,
+                                    int is_heavy,
+                                    unsigned long start,
+                                    unsigned long last) {
+    struct prio_tree_iter iter;
+    struct prio_tree_node* node;
+    page_lock_home_entry_t* owner;
+    page_lock_home_entry_t* e;
 
-    mig->thread_es       = task->thread.es;
-    mig->thread_ds       = task->thread.ds;
-    mig->thread_fsindex  = task->thread.fsindex;
-    mig->thread_gsindex  = task->thread.gsindex;
+    if(is_heavy) {
+        list_for_each_entry(e,&group->queue,queue) {
+            page_lock_home_try_grant(group,e);
+            if(e->is_heavy)
+                break;
+        }
+        return;
+    }
 
-    //FPU support --- initiator (back migration?)
+    prio_tree_iter_init(&iter,&group->tree,start,last);
+    while((node = prio_tree_next(&iter))) {
+        owner = prio_tree_entry(node,page_lock_home_entry_t,node);
+        page_lock_home_try_grant(group,owner);
+        list_for_each_entry(e,&owner->same,same) {
+            page_lock_home_try_grant(group,e);
+        }
+    }
 
-#ifdef FPU_   
-  mig->task_flags      = task->flags;
-       mig->task_fpu_counter = task->fpu_counter;
-       mig->thread_has_fpu   = task->thread.has_fpu;
-       if (!fpu_allocated(&task->thread.fpu)) {  
-	           printk("%s: !fpu_allocated\n", __func__);
-	           mig->thread_has_fpu &= (unsigned char)~HAS_FPU_MASK;
-	       }
-	       else {
-	           struct fpu temp; temp.state = &mig->fpu_state;      
-		          fpu_save_init(&task->thread.fpu);
-		         fpu_copy(&temp, &task->thread.fpu);
-		          mig->thread_has_fpu |= HAS_FPU_MASK;
-		      }
-		   printk(KERN_ALERT"%s: flags %x fpu_counter %x has_fpu %x [%d:%d]\n",
-				           __func__, mig->task_flags, (int)mig->task_fpu_counter,
-				           (int)mig->thread_has_fpu, (int)__thread_has_fpu(task), (int)fpu_allocated(&task->thread.fpu));
+    if(!list_empty(&group->queue)) {
+        e = list_first_entry(&group->queue,page_lock_home_entry_t,queue);
+        if(e->is_heavy)
+            page_lock_home_try_grant(group,e);
+    }
+}
+
+/**
+ * @brief A grant for lock request <token> of this kernel came in.
+ * <contended> tells whether it had to queue at the home kernel, and
+ * <retry> that the home kernel could not queue it, and it is to be
+ * sent again.
+ */
+static void page_lock_granted(unsigned long token, int contended,
+                              int retry) {
+    data_header_t* curr;
+    unsigned long lockflags;
+
+    spin_lock_irqsave(&_page_lock_data_head_lock,lockflags);
+    for(curr = _page_lock_data_head; curr; curr = curr->next) {
+        page_lock_data_t* data = (page_lock_data_t*)curr;
+        if(data->token == token) {
+            if(retry) {
+                data->retry = 1;
+            } else {
+                data->contended = contended;
+                data->granted = 1;
+            }
+            wake_up(&data->wait_queue);
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&_page_lock_data_head_lock,lockflags);
+}
 
-#endif
+/**
+ * @brief Tell the requesters of newly granted requests.  Messages are
+ * not sent under _page_lock_home_lock.
+ */
+static void page_lock_home_notify(void) {
+    page_lock_grant_t grant;
+    page_lock_home_entry_t* entry;
+    unsigned long lockflags;
+    int cpu;
 
-    memcpy(&mig->regs, regs, sizeof(struct pt_regs));
+    grant.header.type = PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_GRANT;
+    grant.header.prio = PCN_KMSG_PRIO_NORMAL;
+    grant.retry = 0;
 
-    // Send migration request to destination.
-    pcn_kmsg_send_long(cpu,
-                       (struct pcn_kmsg_long_message*)mig,
-                       sizeof(back_migration_t) - sizeof(struct pcn_kmsg_hdr));
+    for(;;) {
+        spin_lock_irqsave(&_page_lock_home_lock,lockflags);
+        if(list_empty(&_page_lock_home_notify)) {
+            spin_unlock_irqrestore(&_page_lock_home_lock,lockflags);
+            break;
+        }
+        entry = list_first_entry(&_page_lock_home_notify,
+                                 page_lock_home_entry_t,notify);
+        list_del_init(&entry->notify);
+        cpu = entry->cpu;
+        grant.token = entry->token;
+        grant.contended = entry->contended;
+        spin_unlock_irqrestore(&_page_lock_home_lock,lockflags);
+
+        // The entry stays queued until the requester releases it, and
+        // that cannot happen before this grant reaches it.
+        if(cpu == _cpu)
+            page_lock_granted(grant.token,grant.contended,0);
+        else
+            DO_UNTIL_SUCCESS(pcn_kmsg_send(cpu,(struct pcn_kmsg_message*)&grant));
+    }
+}
+
+/**
+ * @brief Queue a lock request from kernel <cpu> at this, its home,
+ * kernel, and grant it if nothing it conflicts with is ahead of it.
+ * Requests from message handlers allocate with GFP_ATOMIC, and may
+ * find the reserve drained by a burst of requests.
+ * @return 0, or -ENOMEM if the request could not be queued.
+ */
+static int page_lock_home_enqueue(int cpu,
+                                  int tgroup_home_cpu,
+                                  int tgroup_home_id,
+                                  unsigned long address,
+                                  size_t sz,
+                                  int is_heavy,
+                                  int shared,
+                                  unsigned long token,
+                                  gfp_t gfp) {
+    page_lock_home_entry_t* entry;
+    page_lock_home_group_t* group;
+    page_lock_home_group_t* new_group;
+    unsigned long lockflags;
+    int contended;
 
-    pcn_kmsg_free_msg(mig);
-    PERF_MEASURE_STOP(&perf_process_server_do_migration,"back migration",perf);
- 
+    entry = ps_cache_alloc(PS_CACHE_PAGE_LOCK_HOME,gfp);
+    new_group = ps_cache_alloc(PS_CACHE_PAGE_LOCK_HOME_GROUP,gfp);
+    if(!entry) {
+        if(new_group) ps_cache_free(PS_CACHE_PAGE_LOCK_HOME_GROUP,new_group);
+        return -ENOMEM;
+    }
+    entry->header.data_type = PROCESS_SERVER_PAGE_LOCK_HOME_DATA_TYPE;
+    entry->address = address;
+    entry->sz = sz;
+    entry->is_heavy = is_heavy;
+    entry->shared = shared && !is_heavy;
+    entry->cpu = cpu;
+    entry->token = token;
+    entry->granted = 0;
+    entry->contended = 0;
+    INIT_LIST_HEAD(&entry->notify);
+
+    spin_lock_irqsave(&_page_lock_home_lock,lockflags);
+    group = find_page_lock_home_group(tgroup_home_cpu,tgroup_home_id);
+    if(!group && !new_group) {
+        spin_unlock_irqrestore(&_page_lock_home_lock,lockflags);
+        ps_cache_free(PS_CACHE_PAGE_LOCK_HOME,entry);
+        return -ENOMEM;
+    }
+    if(!group) {
+        group = new_group;
+        new_group = NULL;
+        group->header.data_type = PROCESS_SERVER_PAGE_LOCK_HOME_GROUP_DATA_TYPE;
+        group->tgroup_home_cpu = tgroup_home_cpu;
+        group->tgroup_home_id  = tgroup_home_id;
+        INIT_LIST_HEAD(&group->queue);
+        INIT_PRIO_TREE_ROOT(&group->tree);
+        group->next_seq = 0;
+        group->nr_heavy = 0;
+        add_data_entry_to(group,NULL,&_page_lock_home_head);
+    }
+
+    entry->seq = group->next_seq++;
+    list_add_tail(&entry->queue,&group->queue);
+    if(is_heavy)
+        group->nr_heavy++;
+    else
+        page_lock_tree_insert(group,entry);
 
-    return PROCESS_SERVER_CLONE_SUCCESS;
+    page_lock_home_try_grant(group,entry);
+    contended = entry->contended = !entry->granted;
+    spin_unlock_irqrestore(&_page_lock_home_lock,lockflags);
+
+    if(new_group) ps_cache_free(PS_CACHE_PAGE_LOCK_HOME_GROUP,new_group);
+
+    if(contended && !is_heavy && sz == PAGE_SIZE)
+        page_lock_stats_hot(tgroup_home_cpu,tgroup_home_id,address,cpu);
+
+    page_lock_home_notify();
+
+    return 0;
 }
 
 /**
- * @brief Migrate the specified task <task> to cpu <cpu>
- * This function will put the specified task to 
- * sleep, and push its info over to the remote cpu.  The
- * remote cpu will then create a new process and import that
- * info into its new context.  
- *
- * Note: There are now two different migration implementations.
- *       One is for the case where we are migrating to a cpu that
- *       has never before hosted this thread.  The other is where
- *       we are migrating to a cpu that has hosted this thread
- *       before.  There's a lot of stuff that we do not need
- *       to do when the thread has been there before, and the
- *       messaging data requirements are much less for that case.
- *
- */
-int process_server_do_migration(struct task_struct* task, int cpu) {
-   
-    int ret = 0;
+ * @brief Kernel <cpu> gave up its lock <token>.  Pass the lock on.  A
+ * granted heavy request is always at the head of the queue, and a
+ * light one is found through the tree.
+ */
+static void page_lock_home_dequeue(int cpu,
+                                   int tgroup_home_cpu,
+                                   int tgroup_home_id,
+                                   unsigned long address,
+                                   size_t sz,
+                                   int is_heavy,
+                                   unsigned long token) {
+    page_lock_home_entry_t* entry = NULL;
+    page_lock_home_entry_t* owner;
+    page_lock_home_entry_t* e;
+    page_lock_home_group_t* group;
+    struct prio_tree_iter iter;
+    struct prio_tree_node* node;
+    unsigned long lockflags;
 
-#ifndef SUPPORT_FOR_CLUSTERING
-    printk(KERN_ALERT"%s: normal migration {%d}\n",__func__,cpu);
-    if(test_bit(cpu,&task->previous_cpus)) {
-        ret = do_migration_back_to_previous_cpu(task,cpu);
-    } else {
-        ret = do_migration_to_new_cpu(task,cpu);
+    spin_lock_irqsave(&_page_lock_home_lock,lockflags);
+    group = find_page_lock_home_group(tgroup_home_cpu,tgroup_home_id);
+    if(group && is_heavy && !list_empty(&group->queue)) {
+        e = list_first_entry(&group->queue,page_lock_home_entry_t,queue);
+        if(e->cpu == cpu && e->token == token)
+            entry = e;
+    } else if(group && !is_heavy) {
+        prio_tree_iter_init(&iter,&group->tree,address >> PAGE_SHIFT,
+                            (address + sz - 1) >> PAGE_SHIFT);
+        while(!entry && (node = prio_tree_next(&iter))) {
+            owner = prio_tree_entry(node,page_lock_home_entry_t,node);
+            if(owner->cpu == cpu && owner->token == token) {
+                entry = owner;
+                break;
+            }
+            list_for_each_entry(e,&owner->same,same) {
+                if(e->cpu == cpu && e->token == token) {
+                    entry = e;
+                    break;
+                }
+            }
+        }
     }
-#else
-    if (cpumask_test_cpu(cpu, cpu_present_mask)) {
-        printk(KERN_ERR"%s: called but task %p does not require inter-kernel migration"
-		       "(cpu: %d present_mask)\n", __func__, task, cpu);
-        return -EBUSY;
+
+    if(entry) {
+        list_del(&entry->queue);
+        if(entry->is_heavy) {
+            group->nr_heavy--;
+        } else {
+            page_lock_tree_remove(group,entry);
+        }
+        page_lock_home_schedule(group,entry->is_heavy,
+                                address >> PAGE_SHIFT,
+                                (address + sz - 1) >> PAGE_SHIFT);
+        if(list_empty(&group->queue))
+            remove_data_entry_from(group,&_page_lock_home_head);
+        else
+            group = NULL;
     }
-    //printk(KERN_ALERT"%s: clustering activated\n",__func__);
-    // TODO seems like that David is using previous_cpus as a bitmask.. 
-    // TODO well this must be upgraded to a cpumask, declared as usigned long in task_struct
-    struct list_head *iter;
-    _remote_cpu_info_list_t *objPtr;
-    struct cpumask *pcpum =0;
-    int cpuid=-1;
-extern struct list_head rlist_head;
-    list_for_each(iter, &rlist_head) {
-        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
-        cpuid = objPtr->_data._processor;
-        pcpum = &(objPtr->_data._cpumask);
-	if (cpumask_test_cpu(cpu, pcpum)) {
-		if ( bitmap_intersects(cpumask_bits(pcpum),
-				       &(task->previous_cpus),
-				       (sizeof(unsigned long)*8)) )
-	            ret = do_migration_back_to_previous_cpu(task,cpuid);
-		else
-		    ret = do_migration_to_new_cpu(task,cpuid);
-	}
+    spin_unlock_irqrestore(&_page_lock_home_lock,lockflags);
+
+    if(!entry) {
+        printk(KERN_ALERT"%s: unknown lock cpu{%d} token{%lx}\n",
+                __func__,cpu,token);
+        return;
     }
-#endif
-    return ret;
+    ps_cache_free(PS_CACHE_PAGE_LOCK_HOME,entry);
+    if(group) ps_cache_free(PS_CACHE_PAGE_LOCK_HOME_GROUP,group);
+
+    page_lock_home_notify();
+}
+
+static int handle_page_lock_request(struct pcn_kmsg_message* inc_msg) {
+    page_lock_request_t* msg = (page_lock_request_t*)inc_msg;
+    page_lock_grant_t grant;
+
+    if(page_lock_home_enqueue(msg->header.from_cpu,
+                              msg->tgroup_home_cpu,
+                              msg->tgroup_home_id,
+                              msg->address,
+                              msg->sz,
+                              msg->is_heavy,
+                              msg->shared,
+                              msg->token,
+                              GFP_ATOMIC)) {
+        // Out of memory, the requester asks again.
+        grant.header.type = PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_GRANT;
+        grant.header.prio = PCN_KMSG_PRIO_NORMAL;
+        grant.tgroup_home_cpu = msg->tgroup_home_cpu;
+        grant.tgroup_home_id  = msg->tgroup_home_id;
+        grant.token = msg->token;
+        grant.contended = 1;
+        grant.retry = 1;
+        DO_UNTIL_SUCCESS(pcn_kmsg_send(msg->header.from_cpu,
+                                       (struct pcn_kmsg_message*)&grant));
+    }
+
+    pcn_kmsg_free_msg(inc_msg);
+
+    return 0;
+}
+
+static int handle_page_lock_grant(struct pcn_kmsg_message* inc_msg) {
+    page_lock_grant_t* msg = (page_lock_grant_t*)inc_msg;
+
+    page_lock_granted(msg->token,msg->contended,msg->retry);
+
+    pcn_kmsg_free_msg(inc_msg);
+
+    return 0;
+}
+
+static int handle_page_lock_release(struct pcn_kmsg_message* inc_msg) {
+    page_lock_release_t* msg = (page_lock_release_t*)inc_msg;
+
+    page_lock_home_dequeue(msg->header.from_cpu,
+                           msg->tgroup_home_cpu,
+                           msg->tgroup_home_id,
+                           msg->address,
+                           msg->sz,
+                           msg->is_heavy,
+                           msg->token);
+
+    pcn_kmsg_free_msg(inc_msg);
+
+    return 0;
 }
 
 /**
- * @brief Handles a task's return disposition.  When a task is re-awoken
- * when it either migrates back to this CPU, or exits, this function
- * implements the actions that must be made immediately after
- * the newly awoken task resumes execution.
+ * @brief Take a page lock, or the heavy lock, from the home kernel of
+ * the current thread group.  Blocks until it is granted.  A <shared>
+ * page lock is held alongside other shared locks on the same pages.
+ * @return The lock, owned by the current thread.
  */
-void process_server_do_return_disposition(void) {
+static page_lock_data_t* page_lock_acquire(unsigned long address, size_t sz,
+                                           int is_heavy, int shared,
+                                           int site) {
+    page_lock_data_t* data;
+    page_lock_request_t request;
+    int home = current->tgroup_home_cpu;
+    unsigned long long wait_start;
 
-    int return_disposition = current->return_disposition;
+    data = ps_cache_alloc(PS_CACHE_PAGE_LOCK_DATA,GFP_KERNEL);
+    BUG_ON(!data);
+    data->header.data_type = PROCESS_SERVER_PAGE_LOCK_DATA_TYPE;
+    data->tgroup_home_cpu = current->tgroup_home_cpu;
+    data->tgroup_home_id  = current->tgroup_home_id;
+    data->address = address;
+    data->sz = sz;
+    data->is_heavy = is_heavy;
+    data->shared = shared;
+    data->pid = current->pid;
+    data->token = (unsigned long)atomic_inc_return(&_page_lock_token);
+    data->granted = 0;
+    data->retry = 0;
+    data->contended = 0;
+    data->site = site;
+    data->stats = page_lock_stats_get(data->tgroup_home_cpu,
+                                      data->tgroup_home_id,GFP_KERNEL);
+    data->requested = native_read_tsc();
+    init_waitqueue_head(&data->wait_queue);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    bitmap_zero(data->words,PS_SHARED_PAGE_LOCKS);
+#endif
+    add_data_entry_to(data,&_page_lock_data_head_lock,&_page_lock_data_head);
 
-    //printk("%s disp{%d} \n",__func__,return_disposition);
-    // Reset the return disposition
-    current->return_disposition = RETURN_DISPOSITION_NONE;
+    PSPRINTK("%s: addr{%lx},sz{%lx},is_heavy{%d},shared{%d},token{%lx}\n",
+            __func__,address,(unsigned long)sz,is_heavy,shared,data->token);
 
-    switch(return_disposition) {
-    case RETURN_DISPOSITION_NONE:
-        printk("%s: ERROR, return disposition is none!\n",__func__);
-        break;   
-    case RETURN_DISPOSITION_MIGRATE:
-        // Nothing to do, already back-imported the
-        // state in process_back_migration.  This will
-        // remain a stub until something needs to occur
-        // here.
-        PSPRINTK("%s: return disposition migrate\n",__func__);
-        break;
-    case RETURN_DISPOSITION_EXIT:
-        PSPRINTK("%s: return disposition exit\n",__func__);
-    default:
-        do_exit(0);
-        break;
+    request.header.type = PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_REQUEST;
+    request.header.prio = PCN_KMSG_PRIO_NORMAL;
+    request.tgroup_home_cpu = data->tgroup_home_cpu;
+    request.tgroup_home_id  = data->tgroup_home_id;
+    request.address = address;
+    request.sz = sz;
+    request.is_heavy = is_heavy;
+    request.shared = shared;
+    request.token = data->token;
+
+    wait_start = native_read_tsc();
+    for(;;) {
+        if(home == _cpu) {
+            if(!page_lock_home_enqueue(_cpu,data->tgroup_home_cpu,
+                                       data->tgroup_home_id,address,sz,
+                                       is_heavy,shared,data->token,
+                                       GFP_KERNEL))
+                break;
+        } else {
+            DO_UNTIL_SUCCESS(pcn_kmsg_send(home,(struct pcn_kmsg_message*)&request));
+            wait_event(data->wait_queue, data->granted || data->retry);
+            if(!data->retry)
+                break;
+            data->retry = 0;
+        }
+        // The home kernel had no memory to queue the request.
+        msleep(1);
     }
+    wait_event(data->wait_queue, data->granted);
+    process_server_track_wait(PS_WAIT_PAGE_LOCK,wait_start);
+    data->acquired = native_read_tsc();
 
-    return;
+    return data;
 }
 
 /**
- *
+ * @brief Take a lock taken with page_lock_acquire from the current
+ * thread, to be given up with page_lock_put.
+ * @return NULL if the thread does not hold it.
  */
-void wait_for_all_lamport_lock_acquisition(lamport_barrier_queue_t* queue,
-                                           lamport_barrier_entry_t* entry) {
-    data_header_t* curr = NULL;
-    lamport_barrier_queue_t* queue_curr = NULL;
-    int done = 0;
-    PSPRINTK("%s: ts{%lx}\n",__func__,entry->timestamp);
-    PSPRINTK("%s: Starting queues-\n",__func__);
-    dump_all_lamport_queues();
-    while(!done) {
-        done = 1;
-        PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
-        // look through every queue for this thread group
-        curr = (data_header_t*)_lamport_barrier_queue_head;
-        while(curr) {
-            queue_curr = (lamport_barrier_queue_t*) curr;
-            if(queue_curr->tgroup_home_cpu == queue->tgroup_home_cpu &&
-               queue_curr->tgroup_home_id  == queue->tgroup_home_id) {
-                
-                // if we don't have the lock, spin again.
-                if(queue_curr->queue) {
-                    if(queue_curr->queue->timestamp != entry->timestamp) {
-                        done = 0;
-                        break;
-                    }
-                }
+static page_lock_data_t* page_lock_detach(unsigned long address, size_t sz,
+                                          int is_heavy, int shared) {
+    page_lock_data_t* data = NULL;
+    data_header_t* curr;
+    unsigned long lockflags;
 
-            }
-            curr = curr->next;
+    spin_lock_irqsave(&_page_lock_data_head_lock,lockflags);
+    for(curr = _page_lock_data_head; curr; curr = curr->next) {
+        page_lock_data_t* d = (page_lock_data_t*)curr;
+        if(d->pid == current->pid &&
+           d->tgroup_home_cpu == current->tgroup_home_cpu &&
+           d->tgroup_home_id  == current->tgroup_home_id &&
+           d->address == address &&
+           d->sz == sz &&
+           d->is_heavy == is_heavy &&
+           d->shared == shared &&
+           d->granted) {
+            data = d;
+            break;
         }
-
-        PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
-        if(!done)
-            schedule();
     }
-    PSPRINTK("%s: Ending queues-\n",__func__);
-    dump_all_lamport_queues();
-    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
+    if(data)
+        remove_data_entry_from(data,&_page_lock_data_head);
+    spin_unlock_irqrestore(&_page_lock_data_head_lock,lockflags);
+
+    return data;
 }
 
 /**
- * _lamport_barrier_queue_lock must NOT already be held.
+ * @brief Give up a detached lock.  Need not run in the thread that
+ * took it.
  */
-void wait_for_lamport_lock_acquisition(lamport_barrier_queue_t* queue,
-                                       lamport_barrier_entry_t* entry) {
-    // Wait until "entry" is at the front of the queue
-    PSPRINTK("%s: ts{%llx}\n",__func__,entry->timestamp);
-    while(1) {
-        PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
-        if(entry == queue->queue) {
-            queue->active_timestamp = entry->timestamp;
-            PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
-            goto lock_acquired;
-        }
-        PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
-        schedule();
-    } 
-lock_acquired:
+static void page_lock_put(page_lock_data_t* data) {
+    page_lock_release_t release;
+    int home = data->tgroup_home_cpu;
 
-    if(queue->is_heavy) {
-        wait_for_all_lamport_lock_acquisition(queue,entry);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    page_lock_words_release(data->words);
+#endif
+
+    page_lock_stats_account(data->stats,
+                            data->site,data->acquired - data->requested,
+                            native_read_tsc() - data->acquired,
+                            data->contended);
+    page_lock_stats_put(data->stats);
+
+    if(home == _cpu) {
+        page_lock_home_dequeue(_cpu,data->tgroup_home_cpu,data->tgroup_home_id,
+                               data->address,data->sz,data->is_heavy,
+                               data->token);
+    } else {
+        release.header.type = PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_RELEASE;
+        release.header.prio = PCN_KMSG_PRIO_NORMAL;
+        release.tgroup_home_cpu = data->tgroup_home_cpu;
+        release.tgroup_home_id  = data->tgroup_home_id;
+        release.address = data->address;
+        release.sz = data->sz;
+        release.is_heavy = data->is_heavy;
+        release.token = data->token;
+        DO_UNTIL_SUCCESS(pcn_kmsg_send(home,(struct pcn_kmsg_message*)&release));
     }
 
-    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
-    return;
+    ps_cache_free(PS_CACHE_PAGE_LOCK_DATA,data);
 }
 
 /**
- * _lamport_barrier_queue_lock must NOT already be held.
+ * @brief Give up a lock taken with page_lock_acquire.
  */
-void wait_for_all_lamport_request_responses(lamport_barrier_entry_t* entry) {
-    PSPRINTK("%s: ts{%llx}\n",__func__,entry->timestamp);
-    while(1) {
-        PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
-        if(entry->expected_responses == entry->responses) {
-            PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
-            goto responses_acquired;
-        }
-        PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
-        schedule();
+static void page_lock_release(unsigned long address, size_t sz,
+                              int is_heavy, int shared) {
+    page_lock_data_t* data = page_lock_detach(address,sz,is_heavy,shared);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    page_lock_data_t* outer;
+#endif
+
+    if(!data) {
+        printk(KERN_ALERT"%s: lock not held addr{%lx},sz{%lx},is_heavy{%d}\n",
+                __func__,address,(unsigned long)sz,is_heavy);
+        return;
     }
-responses_acquired:
-    PSPRINTK("%s: exiting ts{%llx}\n",__func__,entry->timestamp);
-    return;
+
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    // Words taken together with those of a lock the thread still
+    // holds stay with that lock, see page_lock_take_words.
+    outer = page_lock_other_held(current->pid,NULL);
+    if(outer) {
+        bitmap_or(outer->words,outer->words,data->words,PS_SHARED_PAGE_LOCKS);
+        bitmap_zero(data->words,PS_SHARED_PAGE_LOCKS);
+    }
+#endif
+
+    page_lock_put(data);
 }
 
+#ifdef MPROTECT_BATCH_HOLDS_RANGE_LOCK
 /**
- * 
+ * @brief Hand the current thread's range lock on [address,address+sz)
+ * over to the queued protection changes of its thread group that
+ * overlap it, see mprotect_batch_data_t.
+ * @return 0 if no queued change overlaps the range, and the lock is
+ * still the thread's.
  */
-void add_entry_to_lamport_queue_light(unsigned long address, 
-                                      unsigned long long ts,
-                                      lamport_barrier_entry_t** entry,
-                                      lamport_barrier_queue_t** queue) {
-    lamport_barrier_queue_t* heavy_queue = NULL;
+static int mprotect_batch_hold(unsigned long address, size_t sz) {
+    mprotect_batch_data_t* data = NULL;
+    page_lock_data_t* lock = NULL;
+    unsigned long lockflags;
+    int i;
 
-    PSPRINTK("%s: addr{%lx},ts{%llx}\n",__func__,address,ts);
+    spin_lock_irqsave(&_mprotect_batch_data_head_lock,lockflags);
+    data = find_mprotect_batch_data(current->tgroup_home_cpu,
+                                    current->tgroup_home_id);
+    for(i = 0; data && i < data->count && !lock; i++) {
+        mprotect_batch_range_t* r = &data->ranges[i];
+        if(r->start < address + sz && address < r->start + r->len)
+            lock = page_lock_detach(address,sz,0,0);
+    }
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    // Its words may be shared with another lock of the thread.
+    if(lock && page_lock_other_held(current->pid,NULL)) {
+        add_data_entry_to(lock,&_page_lock_data_head_lock,
+                          &_page_lock_data_head);
+        lock = NULL;
+    }
+#endif
+    if(lock) {
+        lock->header.next = data->held;
+        lock->header.prev = NULL;
+        data->held = &lock->header;
+    }
+    spin_unlock_irqrestore(&_mprotect_batch_data_head_lock,lockflags);
 
-    *entry = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+    return lock != NULL;
+}
+#endif
 
-    // form record and place in queue
-    (*entry)->timestamp = ts;
-    (*entry)->responses = 0;
-    (*entry)->expected_responses = 0;
-    (*entry)->allow_responses = 0;
-    (*entry)->is_heavy = 0;
-    (*entry)->cpu = _cpu;
+/**
+ * @brief Push out this kernel's queued protection changes of the
+ * current thread group that overlap [address,address+sz), or all of
+ * them when <sz> is 0, before taking a lock.  They may hold a
+ * conflicting range lock until flushed, see mprotect_batch_data_t.
+ */
+static void mprotect_batch_flush_range(unsigned long address, size_t sz) {
+    if(mprotect_batch_pending(current->tgroup_home_cpu,current->tgroup_home_id,
+                              address,sz))
+        mprotect_batch_flush(current->tgroup_home_cpu,current->tgroup_home_id);
+}
+#endif
 
-    // find queue if it exists
-    *queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
-                                     current->tgroup_home_id,
-                                     address,
-                                     0);
-    // If no queue exists, create one
-    if(!*queue) {
-        *queue = kmalloc(sizeof(lamport_barrier_queue_t),GFP_ATOMIC);
-        (*queue)->tgroup_home_cpu = current->tgroup_home_cpu;
-        (*queue)->tgroup_home_id  = current->tgroup_home_id;
-        (*queue)->address = address;
-        (*queue)->is_heavy = 0;
-        PSPRINTK("%s: Setting active_timestamp to 0\n",__func__);
-        (*queue)->active_timestamp = 0;
-        (*queue)->queue = NULL;
-        add_data_entry_to(*queue,NULL,&_lamport_barrier_queue_head);
+/**
+ * @brief Count of the threads of a distributed thread group, on any
+ * kernel, that wait on a private futex through the server.  It is one
+ * count for all futexes of the group, not one per futex, and thread
+ * groups may share it.  Threads that went to sleep before the group
+ * was distributed are not in it, see futex_wake.
+ * @return NULL before the shared page is set up.
+ */
+atomic_t* process_server_futex_waiters(struct task_struct* task) {
+    if(!_shared_page)
+        return NULL;
 
-        // Add all heavy entries to this queue
-        heavy_queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
-                                                 current->tgroup_home_id,
-                                                 0,
-                                                 1);
-        if(heavy_queue) {
-            lamport_barrier_entry_t* curr = heavy_queue->queue;
-            PSPRINTK("%s: found heavy queue\n",__func__);
-            while(curr) {
-                lamport_barrier_entry_t* e = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
-                PSPRINTK("%s: adding entry from heavy queue to queue(addr{%lx}) ts{%llx}\n",
-                        __func__,address,curr->timestamp);
-                e->timestamp = curr->timestamp;
-                e->responses = 0;
-                e->expected_responses = 0;
-                e->allow_responses = 0;
-                e->is_heavy = 1;
-                e->cpu = curr->cpu;
-                
-                add_fault_entry_to_queue(e,*queue);
+    return &_shared_page->futex_waiters[jhash_2words(task->tgroup_home_cpu,
+                                                     task->tgroup_home_id,0)
+                                        % PS_SHARED_FUTEX_WAITERS];
+}
 
-                if((*queue)->queue == e) {
-                    PSPRINTK("%s: new entry is not at the front of the queue\n",
-                            __func__);
-                    PSPRINTK("%s: setting active timestamp to %llx\n",
-                            __func__,e->timestamp);
-                    (*queue)->active_timestamp = e->timestamp;
-                }
-               
+/**
+ * @brief Whether <task> runs on the home kernel of its thread group.
+ */
+int process_server_on_tgroup_home(struct task_struct* task) {
+    int home_kernel =
+#ifndef SUPPORT_FOR_CLUSTERING
+    _cpu;
+#else
+    cpumask_first(cpu_present_mask);
+#endif
 
-                curr = (lamport_barrier_entry_t*)curr->header.next;
-            }
-        }
-    } 
+    return task->tgroup_home_cpu == home_kernel;
+}
 
-    // Add entry to queue
-    add_fault_entry_to_queue(*entry,*queue);
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+/**
+ * @brief Lock word of a thread group.
+ */
+static ps_shared_lock_t* ps_shared_tgroup_lock(int tgroup_home_cpu,
+                                               int tgroup_home_id) {
+    u32 hash = jhash_2words(tgroup_home_cpu,tgroup_home_id,0);
+    return &_shared_page->tgroup_locks[hash % PS_SHARED_TGROUP_LOCKS];
+}
 
-    dump_lamport_queue(*queue);
+/**
+ * @brief Index of the lock word of a page of a thread group.  Distinct
+ * pages may share a word.
+ */
+static int ps_shared_page_lock_index(int tgroup_home_cpu,
+                                     int tgroup_home_id,
+                                     unsigned long address) {
+    u32 hash = jhash_3words(tgroup_home_cpu,tgroup_home_id,
+                            address >> PAGE_SHIFT,0);
+    return hash % PS_SHARED_PAGE_LOCKS;
+}
 
+/**
+ * @brief Lock word of a page of a thread group.
+ */
+static ps_shared_lock_t* ps_shared_page_lock(int tgroup_home_cpu,
+                                             int tgroup_home_id,
+                                             unsigned long address) {
+    return &_shared_page->page_locks[
+            ps_shared_page_lock_index(tgroup_home_cpu,tgroup_home_id,address)];
 }
 
-static void add_entry_to_lamport_queue_heavy(unsigned long long ts,
-                                      lamport_barrier_entry_t** entry,
-                                      lamport_barrier_queue_t** queue) {
+/**
+ * @brief Take a shared lock word.  Spins for a short while, since a
+ * word is typically held for a short time, then sleeps until the
+ * holder sends a wake message.
+ * @return Whether the word was held by someone else.
+ */
+static int ps_shared_lock_acquire(ps_shared_lock_t* lock) {
+    int ticket = atomic_add_return(1,&lock->next) - 1;
+    int spins = PS_SHARED_LOCK_SPINS;
+    int contended = atomic_read(&lock->owner) != ticket;
+    unsigned long long wait_start;
 
-    data_header_t* curr = NULL;
-    lamport_barrier_queue_t* queue_curr = NULL;
+    while(atomic_read(&lock->owner) != ticket) {
+        if(spins-- > 0) {
+            cpu_relax();
+            continue;
+        }
 
-    PSPRINTK("%s: ts{%llx}\n",__func__,ts);
+        wait_start = native_read_tsc();
+        for(;;) {
+            // set_bit is a locked instruction, so either the check
+            // sees the release, or the releaser sees the bit.
+            set_bit(_cpu,lock->sleepers);
+            if(atomic_read(&lock->owner) == ticket)
+                break;
+            // A release clears the bit whether or not it is our turn,
+            // and then the bit has to be set again.
+            wait_event(_shared_lock_wq,
+                       atomic_read(&lock->owner) == ticket ||
+                       !test_bit(_cpu,lock->sleepers));
+        }
+        process_server_track_wait(PS_WAIT_SHARED_LOCK,wait_start);
+        break;
+    }
 
-    *entry = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
+    return contended;
+}
 
-    // form record and place in queue
-    (*entry)->timestamp = ts;
-    (*entry)->responses = 0;
-    (*entry)->expected_responses = 0;
-    (*entry)->allow_responses = 0;
-    (*entry)->is_heavy = 1;
-    (*entry)->cpu = _cpu;
+/**
+ * @brief Give up a shared lock word, and wake up the kernels that
+ * sleep on it.
+ */
+static void ps_shared_lock_release(ps_shared_lock_t* lock) {
+    shared_lock_wake_t wake;
+    int cpu;
 
-    // find queue if it exists
-    *queue = find_lamport_barrier_queue(current->tgroup_home_cpu,
-                                        current->tgroup_home_id,
-                                        0,
-                                        1);
-    // If no queue exists, create one
-    if(!*queue) {
-        PSPRINTK("%s: adding heavy queue\n",__func__);
-        *queue = kmalloc(sizeof(lamport_barrier_queue_t),GFP_ATOMIC);
-        (*queue)->tgroup_home_cpu = current->tgroup_home_cpu;
-        (*queue)->tgroup_home_id  = current->tgroup_home_id;
-        (*queue)->address = 0;
-        (*queue)->is_heavy = 1;
-        PSPRINTK("%s: Setting active_timestamp to 0\n",__func__);
-        (*queue)->active_timestamp = 0;
-        (*queue)->queue = NULL;
-        add_data_entry_to(*queue,NULL,&_lamport_barrier_queue_head);
-    } 
+    atomic_inc(&lock->owner);
 
-    // Add entry to queue
-    add_fault_entry_to_queue(*entry,*queue);
+    wake.header.type = PCN_KMSG_TYPE_PROC_SRV_SHARED_LOCK_WAKE;
+    wake.header.prio = PCN_KMSG_PRIO_NORMAL;
+    for_each_set_bit(cpu,lock->sleepers,NR_CPUS) {
+        if(!test_and_clear_bit(cpu,lock->sleepers))
+            continue;
+        if(cpu == _cpu)
+            wake_up(&_shared_lock_wq);
+        else
+            DO_UNTIL_SUCCESS(pcn_kmsg_send(cpu,(struct pcn_kmsg_message*)&wake));
+    }
+}
 
-    // Add entry to all existing non-heavy queues for this thread group
-    curr = (data_header_t*)_lamport_barrier_queue_head; 
-    while(curr) {
-        queue_curr = (lamport_barrier_queue_t*) curr;
-        if(queue_curr->tgroup_home_cpu == current->tgroup_home_cpu &&
-           queue_curr->tgroup_home_id  == current->tgroup_home_id) {
+static int handle_shared_lock_wake(struct pcn_kmsg_message* inc_msg) {
+    wake_up(&_shared_lock_wq);
+    pcn_kmsg_free_msg(inc_msg);
+    return 0;
+}
 
-            if(!queue_curr->is_heavy) {
-                lamport_barrier_entry_t* e = kmalloc(sizeof(lamport_barrier_entry_t),GFP_ATOMIC);
-                PSPRINTK("%s: adding entry to non heavy queue addr{%lx}\n",
-                        __func__,queue_curr->address);
-                e->timestamp = ts;
-                e->responses = 0;
-                e->expected_responses = 0;
-                e->allow_responses = 0;
-                e->is_heavy = 1;
-                e->cpu = _cpu;
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+/**
+ * @brief Give up the page lock words set in <words>, and clear them.
+ */
+static void page_lock_words_release(unsigned long* words) {
+    int i;
 
-                add_fault_entry_to_queue(e,queue_curr);
+    for_each_set_bit(i,words,PS_SHARED_PAGE_LOCKS)
+        ps_shared_lock_release(&_shared_page->page_locks[i]);
+    bitmap_zero(words,PS_SHARED_PAGE_LOCKS);
+}
 
-                if(queue_curr->queue == e) {
-                    PSPRINTK("%s: new entry is not at the front of the queue\n",
-                            __func__);
-                    PSPRINTK("%s: setting active timestamp to %llx\n",
-                            __func__,e->timestamp);
-                    queue_curr->active_timestamp = e->timestamp;
-                }
+/**
+ * @brief A lock other than <data> that thread <pid> holds on this
+ * kernel.
+ * @return NULL if there is none.
+ */
+static page_lock_data_t* page_lock_other_held(pid_t pid,
+                                              page_lock_data_t* data) {
+    page_lock_data_t* other = NULL;
+    data_header_t* curr;
+    unsigned long lockflags;
 
-                PSPRINTK("Modified non heavy queue-\n");
-                dump_lamport_queue(queue_curr);
-            }
-            
+    spin_lock_irqsave(&_page_lock_data_head_lock,lockflags);
+    for(curr = _page_lock_data_head; curr; curr = curr->next) {
+        page_lock_data_t* d = (page_lock_data_t*)curr;
+        if(d != data && d->pid == pid && d->granted) {
+            other = d;
+            break;
         }
-        curr = curr->next;
     }
-    PSPRINTK("%s: exiting\n",__func__);
+    spin_unlock_irqrestore(&_page_lock_data_head_lock,lockflags);
+
+    return other;
 }
 
 /**
- * _lamport_barrier_queue_lock must already be held.
+ * @brief Shut faults out of the range of <data>, just granted by the
+ * home kernel, by also taking the lock words of its pages.  Words are
+ * only ever taken in index order.  A thread that holds an outer range
+ * lock, as mremap does, lets go of its words and takes them again
+ * together with the new ones, so nothing may have been changed under
+ * the outer lock yet.
  */
-static void add_entry_to_lamport_queue(unsigned long address, 
-                                unsigned long long ts,
-                                lamport_barrier_entry_t** entry,
-                                lamport_barrier_queue_t** queue,
-                                int is_heavy) {
-    if(is_heavy) {
-        add_entry_to_lamport_queue_heavy(ts,entry,queue);
+static void page_lock_take_words(page_lock_data_t* data) {
+    page_lock_data_t* outer;
+    unsigned long addr;
+    int i;
+
+    if(!_shared_page)
+        return;
+
+    if(data->is_heavy || data->sz >= PS_SHARED_PAGE_LOCKS * PAGE_SIZE) {
+        bitmap_fill(data->words,PS_SHARED_PAGE_LOCKS);
     } else {
-        add_entry_to_lamport_queue_light(address,ts,entry,queue);
+        for(addr = data->address; addr < data->address + data->sz;
+            addr += PAGE_SIZE) {
+            set_bit(ps_shared_page_lock_index(data->tgroup_home_cpu,
+                                              data->tgroup_home_id,addr),
+                    data->words);
+        }
     }
+
+    outer = page_lock_other_held(data->pid,data);
+    if(outer) {
+        bitmap_or(data->words,data->words,outer->words,PS_SHARED_PAGE_LOCKS);
+        page_lock_words_release(outer->words);
+    }
+
+    for_each_set_bit(i,data->words,PS_SHARED_PAGE_LOCKS)
+        ps_shared_lock_acquire(&_shared_page->page_locks[i]);
+}
+
+/**
+ * @brief Take the page lock of a fault.  It is only the lock word of
+ * the page, which range and heavy locks hold as well, so no message
+ * is needed unless the word is taken.  Contended pages are accounted
+ * as hot here rather than at the home kernel.
+ */
+static void page_lock_fault_acquire(unsigned long address) {
+    address &= PAGE_MASK;
+    mprotect_batch_flush_range(address,PAGE_SIZE);
+    if(ps_shared_lock_acquire(ps_shared_page_lock(current->tgroup_home_cpu,
+                                                  current->tgroup_home_id,
+                                                  address)))
+        page_lock_stats_hot(current->tgroup_home_cpu,current->tgroup_home_id,
+                            address,_cpu);
 }
 
+/**
+ * @brief Give up the page lock of a fault.
+ */
+static void page_lock_fault_release(unsigned long address) {
+    ps_shared_lock_release(ps_shared_page_lock(current->tgroup_home_cpu,
+                                               current->tgroup_home_id,
+                                               address));
+}
+#endif
+#endif
 
 /**
  *
  */
-static int process_server_acquire_page_lock_range_maybeheavy(unsigned long address,size_t sz, int is_heavy) {
+static int process_server_acquire_page_lock_range_maybeheavy(unsigned long address,size_t sz, int is_heavy, int site) {
     lamport_barrier_request_range_t* request = NULL;
     lamport_barrier_entry_t** entry_list = NULL;
     lamport_barrier_queue_t** queue_list = NULL;
@@ -8804,9 +14279,24 @@ static int process_server_acquire_page_lock_range_maybeheavy(unsigned long addre
 
     BUG_ON(is_heavy && (sz > PAGE_SIZE));
 
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    // The home kernel orders the heavy lock against page locks.  The
+    // lamport barrier is still taken for it, so that every kernel
+    // applies its queued protection changes first.
+    mprotect_batch_flush_range(address & PAGE_MASK,is_heavy? 0 : sz);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    page_lock_take_words(page_lock_acquire(address & PAGE_MASK,sz,is_heavy,
+                                           0,site));
+#else
+    page_lock_acquire(address & PAGE_MASK,sz,is_heavy,0,site);
+#endif
+    if(!is_heavy)
+        return 0;
+#endif
+
     entry_list = kmalloc(sizeof(lamport_barrier_entry_t*)*page_count,GFP_KERNEL);
     queue_list = kmalloc(sizeof(lamport_barrier_queue_t*)*page_count,GFP_KERNEL);
-    request = kmalloc(sizeof(lamport_barrier_request_range_t), GFP_KERNEL);
+    request = ps_cache_alloc(PS_CACHE_LAMPORT_REQUEST_RANGE,GFP_KERNEL);
   
     BUG_ON(!request);
     BUG_ON(!entry_list);
@@ -8850,6 +14340,8 @@ static int process_server_acquire_page_lock_range_maybeheavy(unsigned long addre
     // Send out request to everybody
     for(i = 0; i < NR_CPUS; i++) {
         if(i == _cpu) continue;
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i))
+            continue;
         s = pcn_kmsg_send(i,(struct pcn_kmsg_message*)request);
         if(!s) {
             for(index = 0; index < page_count; index++) 
@@ -8859,7 +14351,7 @@ static int process_server_acquire_page_lock_range_maybeheavy(unsigned long addre
 
     mb();
 
-    kfree(request);
+    ps_cache_free(PS_CACHE_LAMPORT_REQUEST_RANGE,request);
 
     for(index = 0; index < page_count; index++)
         wait_for_all_lamport_request_responses(entry_list[index]);
@@ -8884,29 +14376,94 @@ static int process_server_acquire_page_lock_range_maybeheavy(unsigned long addre
 }
 
 
-int process_server_acquire_page_lock_range(unsigned long address,size_t sz) {
-    return process_server_acquire_page_lock_range_maybeheavy(address,sz,0);
+int process_server_acquire_page_lock_range(unsigned long address,size_t sz,
+                                           int site) {
+    return process_server_acquire_page_lock_range_maybeheavy(address,sz,0,site);
 }
 
 /**
  *
  */
 int process_server_acquire_page_lock(unsigned long address) {
-    return process_server_acquire_page_lock_range(address,PAGE_SIZE);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    if(!current->tgroup_distributed) return 0;
+    if(_shared_page) {
+        page_lock_fault_acquire(address);
+        return 0;
+    }
+#endif
+    return process_server_acquire_page_lock_range(address,PAGE_SIZE,
+                                                  PS_LOCK_SITE_FAULT);
+}
+
+/**
+ * @brief Take the page lock in shared mode, for faults that do not
+ * write to the page.  Shared holders on different kernels proceed
+ * together, and are excluded only by an exclusive page lock or the
+ * heavy lock.  Without the home page lock, or with lock words, this is
+ * the exclusive lock.
+ */
+int process_server_acquire_page_lock_shared(unsigned long address) {
+    if(!current->tgroup_distributed) return 0;
+
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    // A lock word has no shared mode.
+    if(_shared_page)
+        return process_server_acquire_page_lock(address);
+#endif
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    mprotect_batch_flush_range(address & PAGE_MASK,PAGE_SIZE);
+    page_lock_acquire(address & PAGE_MASK,PAGE_SIZE,0,1,PS_LOCK_SITE_FAULT);
+    return 0;
+#else
+    return process_server_acquire_page_lock(address);
+#endif
 }
 
 /**
  *
  */
-int process_server_acquire_heavy_lock() {
-    return process_server_acquire_page_lock_range_maybeheavy(0,PAGE_SIZE,1);
+int process_server_acquire_heavy_lock(int site) {
+    return process_server_acquire_page_lock_range_maybeheavy(0,PAGE_SIZE,1,site);
 }
 
 /**
  *
  */
-int process_server_acquire_distributed_mm_lock() {
-    return process_server_acquire_page_lock_range(0,PAGE_SIZE);
+int process_server_acquire_distributed_mm_lock(int site) {
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+    int i;
+
+    if(!current->tgroup_distributed) return 0;
+
+    // The group's word orders vma changes, and taking every page word
+    // in index order shuts out the faults.
+    ps_shared_lock_acquire(ps_shared_tgroup_lock(current->tgroup_home_cpu,
+                                                 current->tgroup_home_id));
+    for(i = 0; i < PS_SHARED_PAGE_LOCKS; i++)
+        ps_shared_lock_acquire(&_shared_page->page_locks[i]);
+    return 0;
+#else
+    return process_server_acquire_page_lock_range(0,PAGE_SIZE,site);
+#endif
+}
+
+/**
+ * @brief The distributed mm lock as taken by a fault on <address>.
+ * With shared lock words only faults on pages with the same word
+ * exclude each other, otherwise this is the whole mm lock.
+ */
+int process_server_acquire_distributed_mm_page_lock(unsigned long address) {
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+    if(!current->tgroup_distributed) return 0;
+
+    ps_shared_lock_acquire(ps_shared_page_lock(current->tgroup_home_cpu,
+                                               current->tgroup_home_id,
+                                               address));
+    return 0;
+#else
+    return process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_FAULT);
+#endif
 }
 
 /**
@@ -8945,12 +14502,12 @@ static void release_local_lamport_lock_light(unsigned long address,
         // remove entry from queue
         remove_data_entry_from((data_header_t*)entry,(data_header_t**)&queue->queue);
 
-        kfree(entry); // this is OK, because kfree never sleeps
+        ps_cache_free(PS_CACHE_LAMPORT_ENTRY,entry); // never sleeps
 
         // garbage collect the queue if necessary
         if(!queue->queue) {
             remove_data_entry_from(queue,&_lamport_barrier_queue_head);
-            kfree(queue);
+            ps_cache_free(PS_CACHE_LAMPORT_QUEUE,queue);
         }
     
     }
@@ -9005,13 +14562,13 @@ static void release_local_lamport_lock_heavy(unsigned long long* timestamp) {
         // remove entry from queue
         remove_data_entry_from((data_header_t*)entry,(data_header_t**)&queue->queue);
 
-        kfree(entry); // this is OK, because kfree never sleeps
+        ps_cache_free(PS_CACHE_LAMPORT_ENTRY,entry); // never sleeps
 
         // garbage collect the queue if necessary
         if(!queue->queue) {
             PSPRINTK("%s: Removing queue is_heavy{%d}\n",__func__,queue->is_heavy);
             remove_data_entry_from(queue,&_lamport_barrier_queue_head);
-            kfree(queue);
+            ps_cache_free(PS_CACHE_LAMPORT_QUEUE,queue);
         }
         
         curr = next;
@@ -9050,8 +14607,16 @@ void process_server_release_page_lock_range_maybeheavy(unsigned long address,siz
     PSPRINTK("%s: addr{%lx},sz{%d},is_heavy{%d}\n",__func__,address,sz,is_heavy);
 
     address &= PAGE_MASK;
-    release = kmalloc(sizeof(lamport_barrier_release_range_t),
-                        GFP_KERNEL);
+
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    if(!is_heavy) {
+        page_lock_release(address,sz,0,0);
+        return;
+    }
+#endif
+
+    release = ps_cache_alloc(PS_CACHE_LAMPORT_RELEASE_RANGE,GFP_KERNEL);
+    BUG_ON(!release);
 
     PS_SPIN_LOCK(&_lamport_barrier_queue_lock);
     
@@ -9068,6 +14633,7 @@ void process_server_release_page_lock_range_maybeheavy(unsigned long address,siz
     }
 
     PS_SPIN_UNLOCK(&_lamport_barrier_queue_lock);
+    wake_up(&_lamport_barrier_wq);
 
     // Send release
     release->header.type = PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_RELEASE_RANGE;
@@ -9080,18 +14646,36 @@ void process_server_release_page_lock_range_maybeheavy(unsigned long address,siz
     release->sz = sz;
     for(i = 0; i < NR_CPUS; i++) {
         if(i == _cpu) continue;
+        if(!kernel_has_known_tgroup_mm(current->known_cpu_with_tgroup_mm,i))
+            continue;
         pcn_kmsg_send(i,(struct pcn_kmsg_message*)release);
     }
 
-    kfree(release);
+    ps_cache_free(PS_CACHE_LAMPORT_RELEASE_RANGE,release);
+
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    page_lock_release(address,sz,1,0);
+#endif
 
     PSPRINTK("%s: exiting\n",__func__);
 }
 
 /**
- *
+ * @brief Give up the range lock of a vma change.  Protection changes
+ * to the range that are still queued must land before the next change
+ * of the range, which may come from another kernel, so the lock is
+ * handed over to them, or they go out first.
  */
 void process_server_release_page_lock_range(unsigned long address,size_t sz) {
+    if(current->tgroup_distributed &&
+       mprotect_batch_pending(current->tgroup_home_cpu,current->tgroup_home_id,
+                              address & PAGE_MASK,sz)) {
+#ifdef MPROTECT_BATCH_HOLDS_RANGE_LOCK
+        if(mprotect_batch_hold(address & PAGE_MASK,sz))
+            return;
+#endif
+        mprotect_batch_flush(current->tgroup_home_cpu,current->tgroup_home_id);
+    }
     process_server_release_page_lock_range_maybeheavy(address,sz,0);
 }
 
@@ -9099,7 +14683,87 @@ void process_server_release_page_lock_range(unsigned long address,size_t sz) {
  *
  */
 void process_server_release_page_lock(unsigned long address) {
-    process_server_release_page_lock_range(address,PAGE_SIZE);
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    if(!current->tgroup_distributed) return;
+    if(_shared_page) {
+        page_lock_fault_release(address);
+        return;
+    }
+#endif
+    process_server_release_page_lock_range_maybeheavy(address,PAGE_SIZE,0);
+}
+
+/**
+ * @brief Give up a page lock taken with
+ * process_server_acquire_page_lock_shared.
+ */
+void process_server_release_page_lock_shared(unsigned long address) {
+    if(!current->tgroup_distributed) return;
+
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    if(_shared_page) {
+        process_server_release_page_lock(address);
+        return;
+    }
+#endif
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    page_lock_release(address & PAGE_MASK,PAGE_SIZE,0,1);
+#else
+    process_server_release_page_lock(address);
+#endif
+}
+
+/**
+ * @brief Fault at <address> on the optimistic path, see
+ * process_server_fault_path.  If no kernel has the page, its first
+ * touch must not race with one on another kernel, so it is made with
+ * the page lock held.  Every first touch takes the lock word of its
+ * page.  If the word was free before the page was asked for, and no
+ * one took it before this thread, no kernel can have touched the page
+ * since, and it is not asked for again under the lock.
+ * @return PS_FAULT_OPTIMISTIC_HANDLED if the page was pulled in,
+ * PS_FAULT_OPTIMISTIC_MISS if no kernel has it and the page lock is
+ * now held, to be given up with process_server_release_page_lock, or
+ * PS_FAULT_OPTIMISTIC_RETRY if it is to be asked for again under the
+ * page lock, which is not held.
+ */
+int process_server_fault_optimistic(struct mm_struct *mm,
+                                    struct vm_area_struct *vma,
+                                    unsigned long address,
+                                    unsigned int flags,
+                                    struct vm_area_struct **vma_out,
+                                    unsigned long error_code) {
+    int no_page = 0;
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    ps_shared_lock_t* lock = NULL;
+    int stamp = 0;
+    int word_free = 0;
+
+    if(_shared_page) {
+        lock = ps_shared_page_lock(current->tgroup_home_cpu,
+                                   current->tgroup_home_id,
+                                   address & PAGE_MASK);
+        stamp = atomic_read(&lock->next);
+        smp_rmb();
+        word_free = atomic_read(&lock->owner) == stamp;
+    }
+#endif
+
+    if(pull_remote_mappings(mm,vma,address,flags,vma_out,error_code,&no_page))
+        return PS_FAULT_OPTIMISTIC_HANDLED;
+
+#ifdef PAGE_LOCK_USES_LOCK_WORDS
+    if(lock && word_free && no_page) {
+        page_lock_fault_acquire(address);
+        // Tickets are handed out in order, so the word was not taken
+        // in between if this thread holds the ticket it saw as next.
+        if(atomic_read(&lock->owner) == stamp)
+            return PS_FAULT_OPTIMISTIC_MISS;
+        page_lock_fault_release(address);
+    }
+#endif
+
+    return PS_FAULT_OPTIMISTIC_RETRY;
 }
 
 /**
@@ -9113,7 +14777,34 @@ void process_server_release_heavy_lock() {
  *  
  */
 void process_server_release_distributed_mm_lock() {
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+    int i;
+
+    if(!current->tgroup_distributed) return;
+
+    for(i = PS_SHARED_PAGE_LOCKS - 1; i >= 0; i--)
+        ps_shared_lock_release(&_shared_page->page_locks[i]);
+    ps_shared_lock_release(ps_shared_tgroup_lock(current->tgroup_home_cpu,
+                                                 current->tgroup_home_id));
+#else
     process_server_release_page_lock_range(0,PAGE_SIZE);
+#endif
+}
+
+/**
+ * @brief Give up a lock taken with
+ * process_server_acquire_distributed_mm_page_lock.
+ */
+void process_server_release_distributed_mm_page_lock(unsigned long address) {
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+    if(!current->tgroup_distributed) return;
+
+    ps_shared_lock_release(ps_shared_page_lock(current->tgroup_home_cpu,
+                                               current->tgroup_home_id,
+                                               address));
+#else
+    process_server_release_distributed_mm_lock();
+#endif
 }
 
 #ifdef PROCESS_SERVER_HOST_PROC_ENTRY
@@ -9140,6 +14831,7 @@ static int proc_read(char* buf, char**start, off_t off, int count,
     int i,j,s;
     stats_query_t query;
     stats_query_data_t data;
+    unsigned long long wait_start;
 
     sprintf(buf,"See dmesg\n");
 
@@ -9173,9 +14865,9 @@ static int proc_read(char* buf, char**start, off_t off, int count,
         }
     }
 
-    while(data.expected_responses != data.responses) {
-        schedule();
-    }
+    wait_start = native_read_tsc();
+    wait_event(_stats_query_wq, data.expected_responses == data.responses);
+    process_server_track_wait(PS_WAIT_STATS_QUERY,wait_start);
 
     spin_lock(&_data_head_lock);
     remove_data_entry(&data);
@@ -9405,31 +15097,40 @@ static int handle_stats_response(struct pcn_kmsg_message* inc_msg) {
         }
 
         data->responses++;
+        wake_up(&_stats_query_wq);
     }
     pcn_kmsg_free_msg(inc_msg);
     return 0;
 }
 #endif
 
-/* From Wikipedia page "Fetch and add", modified to work for u64 */
 /**
- *
+ * @brief Timestamp for a lamport barrier request.  Each kernel keeps
+ * its own lamport clock, which lamport_clock_observe moves past every
+ * timestamp that comes in.  The clock is scaled by NR_CPUS and the
+ * kernel's cpu added in, so timestamps are unique and totally ordered
+ * with ties broken by kernel, without any counter shared by kernels.
  */
-static inline unsigned long fetch_and_add(volatile unsigned long * variable, 
-                      unsigned long value) {
-    asm volatile( 
-             "lock; xaddq %%rax, %2;"
-             :"=a" (value)                   //Output
-             : "a" (value), "m" (*variable)  //Input
-             :"memory" );
-    return value;
+static unsigned long long get_next_ts_value() {
+    return (unsigned long long)atomic64_inc_return(&_lamport_clock) * NR_CPUS
+        + _cpu;
 }
 
 /**
- *
+ * @brief Advance the local lamport clock past <timestamp>, received
+ * from another kernel.
  */
-static unsigned long get_next_ts_value() {
-    return fetch_and_add(ts_counter,1);
+static void lamport_clock_observe(unsigned long long timestamp) {
+    long clock = timestamp / NR_CPUS;
+    long curr = atomic64_read(&_lamport_clock);
+    long old;
+
+    while(curr < clock) {
+        old = atomic64_cmpxchg(&_lamport_clock,curr,clock);
+        if(old == curr)
+            break;
+        curr = old;
+    }
 }
 
 /**
@@ -9437,6 +15138,7 @@ static unsigned long get_next_ts_value() {
  */
 static unsigned long long* get_master_ts_counter_address() {
     get_counter_phys_request_t request;
+    unsigned long long wait_start;
     request.header.type = PCN_KMSG_TYPE_PROC_SRV_GET_COUNTER_PHYS_REQUEST;
     request.header.prio = PCN_KMSG_PRIO_NORMAL;
 
@@ -9446,11 +15148,12 @@ static unsigned long long* get_master_ts_counter_address() {
     get_counter_phys_data->resp = 0;
     get_counter_phys_data->response_received = 0;
 
+    wait_start = native_read_tsc();
     pcn_kmsg_send(0,(struct pcn_kmsg_message*)&request);
 
-    while(!get_counter_phys_data->response_received)
-        schedule();
-     
+    wait_event(_get_counter_phys_wq, get_counter_phys_data->response_received);
+    process_server_track_wait(PS_WAIT_COUNTER_PHYS,wait_start);
+
     return (unsigned long long*)get_counter_phys_data->resp;
 }
 
@@ -9458,22 +15161,17 @@ static unsigned long long* get_master_ts_counter_address() {
  *
  */
 static void init_shared_counter(void) {
+    BUILD_BUG_ON(sizeof(ps_shared_page_t) > PAGE_SIZE);
+
     if(!_cpu) {
-        // Master allocs space, then shares it
-        void* pg = kmalloc(PAGE_SIZE,GFP_KERNEL);
-        ts_counter = pg;
-        *ts_counter = 0;
-        get_next_ts_value();
-        printk("%s: ts_counter{%lx},*ts_counter{%lx}\n",__func__,
-                ts_counter,
-                get_next_ts_value());
+        // Master allocs space, then shares it.  Zeroed, so that all
+        // the shared lock words start out free.
+        _shared_page = kzalloc(PAGE_SIZE,GFP_KERNEL);
     } else {
-        // ask for physical address of master's ts_counter
-        ts_counter = ioremap_cache(get_master_ts_counter_address(), PAGE_SIZE);
-        printk("%s: ts_counter{%lx},*ts_counter{%lx}\n",__func__,
-                ts_counter,
-                get_next_ts_value());
+        // ask for physical address of master's shared page
+        _shared_page = ioremap_cache(get_master_ts_counter_address(), PAGE_SIZE);
     }
+    printk("%s: _shared_page{%lx}\n",__func__,(unsigned long)_shared_page);
 }
 
 
@@ -9481,6 +15179,7 @@ static void init_shared_counter(void) {
  * @brief Initialize this module
  */
 static int __init process_server_init(void) {
+    struct proc_dir_entry* stats_entry;
 
     /*
      * Cache some local information.
@@ -9498,6 +15197,14 @@ static int __init process_server_init(void) {
      */
     init_rwsem(&_import_sem);
 
+    ps_cache_init();
+
+    // A gang and a full mprotect batch have to fit in one long message.
+    BUILD_BUG_ON(sizeof(gang_migration_t) - sizeof(struct pcn_kmsg_hdr) >
+                 PCN_KMSG_LONG_PAYLOAD_SIZE);
+    BUILD_BUG_ON(sizeof(mprotect_batch_t) - sizeof(struct pcn_kmsg_hdr) >
+                 PCN_KMSG_LONG_PAYLOAD_SIZE);
+
     /*
      * Create work queues so that we can do bottom side
      * processing on data that was brought in by the
@@ -9506,11 +15213,38 @@ static int __init process_server_init(void) {
     clone_wq   = create_workqueue("clone_wq");
     exit_wq    = create_workqueue("exit_wq");
     mapping_wq = create_workqueue("mapping_wq");
+    mprotect_batch_wq = create_workqueue("mprotect_batch_wq");
+    tgroup_mm_join_wq = create_workqueue("tgroup_mm_join_wq");
 
     /*
      * Proc entry to publish information
      */
     PS_PROC_DATA_INIT();
+    stats_entry = create_proc_entry("procsrv_wait",0644,NULL);
+    if(stats_entry) {
+        stats_entry->read_proc = wait_stats_proc_read;
+        stats_entry->write_proc = wait_stats_proc_write;
+    }
+    stats_entry = create_proc_entry("procsrv_migration",0644,NULL);
+    if(stats_entry) {
+        stats_entry->read_proc = migration_stats_proc_read;
+        stats_entry->write_proc = migration_stats_proc_write;
+    }
+    stats_entry = create_proc_entry("procsrv_fault",0644,NULL);
+    if(stats_entry) {
+        stats_entry->read_proc = fault_stats_proc_read;
+        stats_entry->write_proc = fault_stats_proc_write;
+    }
+    stats_entry = create_proc_entry("procsrv_cache",0644,NULL);
+    if(stats_entry) {
+        stats_entry->read_proc = cache_stats_proc_read;
+        stats_entry->write_proc = cache_stats_proc_write;
+    }
+    stats_entry = create_proc_entry("procsrv_page_lock",0644,NULL);
+    if(stats_entry) {
+        stats_entry->read_proc = page_lock_stats_proc_read;
+        stats_entry->write_proc = page_lock_stats_proc_write;
+    }
 
     /*
      * Register to receive relevant incomming messages.
@@ -9535,6 +15269,18 @@ static int __init process_server_init(void) {
             handle_nonpresent_mapping_response);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_MUNMAP_REQUEST,
             handle_munmap_request);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE,
+            handle_vma_update);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_VMA_UPDATE_RESPONSE,
+            handle_vma_update_response);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH,
+            handle_mprotect_batch);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_MPROTECT_BATCH_RESPONSE,
+            handle_mprotect_batch_response);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN,
+            handle_tgroup_mm_join);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_TGROUP_MM_JOIN_RESPONSE,
+            handle_tgroup_mm_join_response);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_MUNMAP_RESPONSE,
             handle_munmap_response);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_THREAD_COUNT_REQUEST,
@@ -9549,6 +15295,8 @@ static int __init process_server_init(void) {
             handle_mprotect_response);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_BACK_MIGRATION,
             handle_back_migration);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_GANG_MIGRATION,
+            handle_gang_migration);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_REQUEST,
             handle_lamport_barrier_request);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_RESPONSE,
@@ -9561,6 +15309,18 @@ static int __init process_server_init(void) {
             handle_lamport_barrier_response_range);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_LAMPORT_BARRIER_RELEASE_RANGE,
             handle_lamport_barrier_release_range);
+#ifdef PROCESS_SERVER_USE_HOME_PAGE_LOCK
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_REQUEST,
+            handle_page_lock_request);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_GRANT,
+            handle_page_lock_grant);
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_PAGE_LOCK_RELEASE,
+            handle_page_lock_release);
+#endif
+#ifdef PROCESS_SERVER_USE_SHARED_LOCK_WORDS
+    pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_SHARED_LOCK_WAKE,
+            handle_shared_lock_wake);
+#endif
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_GET_COUNTER_PHYS_REQUEST,
             handle_get_counter_phys_request);
     pcn_kmsg_register_callback(PCN_KMSG_TYPE_PROC_SRV_GET_COUNTER_PHYS_RESPONSE,
@@ -5568,16 +5568,17 @@ out_unlock:
 
 int shadow_return_check(struct task_struct *tsk)
 {
-int spin =0;
+unsigned long long wait_start;
  if(current->pid == tsk->pid && (tsk->migration_state == 1 || tsk->represents_remote==1)){
+                wait_start = native_read_tsc();
+                // The state is set before return_disposition is checked,
+                // so a wake up from the process server is never lost.
                 do {
-                     spin = 0;
                      schedule(); // this will save us from death
-                     if(current->return_disposition == RETURN_DISPOSITION_NONE) {
-                          __set_task_state(current,TASK_UNINTERRUPTIBLE);
-                           spin = 1;
-                       }
-                  } while (spin);
+                     set_current_state(TASK_UNINTERRUPTIBLE);
+                  } while (current->return_disposition == RETURN_DISPOSITION_NONE);
+                __set_current_state(TASK_RUNNING);
+                process_server_track_wait(PS_WAIT_SHADOW_RETURN, wait_start);
             // We are here because of either the task is exiting,
             // or because the task is migrating back.  Let's handle
             // that now.  If we're migrating back, this function
@@ -5595,7 +5596,6 @@ long sched_setaffinity(pid_t pid, const struct cpumask *in_mask)
 	cpumask_var_t cpus_allowed, new_mask;
 	struct task_struct *p;
 	int retval;
-    int current_cpu = smp_processor_id();
     int i,ret;
     int spin = 0;
 
@@ -5612,16 +5612,13 @@ long sched_setaffinity(pid_t pid, const struct cpumask *in_mask)
         spin_unlock_irq(&(p->mig_lock));
 	smp_mb();
 	pid = current->pid;
-if(current->tgroup_distributed == 1 || strcmp(current->comm,"is-gomp") == 0)
-   {	dump_stack();
-printk(KERN_ALERT"inside sched affinity pid{%d} c{%s} p{%d} state{%d}\n",current->pid,current->comm,p->pid,p->futex_state);
-
-}// TODO migration must be removed from here
     /*
      * Multikernel
      */
-    // For now, migrate to the first cpu in the mask that
-    // is not the current cpu
+    // Kept for existing runtimes, new code should use sys_popcorn_migrate
+    // which does not block the caller.
+    // If the mask has no cpu of this kernel, migrate to the cpu of
+    // another kernel picked by the process server placement policy.
 // FIX: in order to work in clusters (but not in multicluster)
 //      if the current process mask to not have any intersection with the
 //      current cpu cluster migrate to another (by cpu_present_mask)i
@@ -5636,29 +5633,14 @@ if ( !cpumask_intersects(in_mask, cpu_present_mask) ) {
 	        __func__, buf_in, buf_present);
 #endif
 
-#ifndef SUPPORT_FOR_CLUSTERING
-    for(i = 0; i < NR_CPUS; i++) {
-        if( (cpu_isset(i,*in_mask) ) && (current_cpu != i) ) {
-#else
-    struct list_head *iter;
-    _remote_cpu_info_list_t *objPtr;
-    struct cpumask *pcpum;
-extern struct list_head rlist_head;
-    list_for_each(iter, &rlist_head) {
-        objPtr = list_entry(iter, _remote_cpu_info_list_t, cpu_list_member);
-        i = objPtr->_data._processor;
-        pcpum = &(objPtr->_data._cpumask);
-        if ( cpumask_intersects(in_mask, pcpum) ) {
-#endif
-        // TODO ask the global scheduler if there are multiple affinities    
+    i = process_server_select_migration_cpu(p, in_mask);
+    if (i != -1) {
 	// do the migration
             get_task_struct(p);
             rcu_read_unlock();
-printk(KERN_ALERT"before proce server {%d} i{%d} cpu{%d}\n",p->pid,i,current_cpu);
             ret =process_server_do_migration(p,i);
             put_task_struct(p);
             put_online_cpus();
-            printk(KERN_ALERT"sched_setaffinity tsk{%d} state{%d} on run q{%d} RET{%d} current{%s} \n",p->pid,p->state,p->on_rq,ret,current->comm);
 	    spin_lock_irq(&(p->mig_lock));
 	        p->migration_state=0;
             spin_unlock_irq(&(p->mig_lock));
@@ -5671,9 +5653,6 @@ printk(KERN_ALERT"before proce server {%d} i{%d} cpu{%d}\n",p->pid,i,current_cpu
 	      }
 	    else
 		return 0;
-	    
-	  
-        }
     }
 }
 
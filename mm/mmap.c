@@ -996,11 +996,11 @@ unsigned long do_mmap_pgoff(struct file *file, unsigned long addr,
 #ifdef PROCESS_SERVER_ENFORCE_VMA_MOD_ATOMICITY
             up_write(&mm->mmap_sem);
 #ifdef PROCESS_SERVER_USE_HEAVY_LOCK
-            process_server_acquire_heavy_lock();
+            process_server_acquire_heavy_lock(PS_LOCK_SITE_MMAP);
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-            process_server_acquire_distributed_mm_lock();
+            process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_MMAP);
 #else
-            process_server_acquire_page_lock_range(addr,len);
+            process_server_acquire_page_lock_range(addr,len,PS_LOCK_SITE_MMAP);
 #endif
             down_write(&mm->mmap_sem);
 #endif
@@ -1047,11 +1047,11 @@ unsigned long do_mmap_pgoff(struct file *file, unsigned long addr,
     if(current->enable_do_mmap_pgoff_hook && !range_locked) {
         up_write(&mm->mmap_sem);
 #ifdef PROCESS_SERVER_USE_HEAVY_LOCK
-        process_server_acquire_heavy_lock();
+        process_server_acquire_heavy_lock(PS_LOCK_SITE_MMAP);
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-        process_server_acquire_distributed_mm_lock();
+        process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_MMAP);
 #else
-        process_server_acquire_page_lock_range(addr,len);
+        process_server_acquire_page_lock_range(addr,len,PS_LOCK_SITE_MMAP);
 #endif
         down_write(&mm->mmap_sem);
     }
@@ -1245,6 +1245,10 @@ SYSCALL_DEFINE6(mmap_pgoff, unsigned long, addr, unsigned long, len,
 	retval = do_mmap_pgoff(file, addr, len, prot, flags, pgoff);
 	up_write(&current->mm->mmap_sem);
 
+	/* Multikernel - announce the new vma to the other kernels */
+	if (!IS_ERR_VALUE(retval))
+		process_server_notify_mmap(retval, len);
+
 	if (file)
 		fput(file);
 out:
@@ -1463,9 +1467,6 @@ out:
 	} else if ((flags & MAP_POPULATE) && !(flags & MAP_NONBLOCK))
 		make_pages_present(addr, addr + len);
 
-    // Success - notify other cpus if necessary
-    //process_server_notify_mmap(file, addr, len, flags, vm_flags, pgoff);
-
 	return addr;
 
 unmap_and_free_vma:
@@ -2171,15 +2172,20 @@ int do_munmap(struct mm_struct *mm, unsigned long start, size_t len)
     if(current->enable_distributed_munmap) {
         up_write(&mm->mmap_sem);
 #ifdef PROCESS_SERVER_USE_HEAVY_LOCK
-        process_server_acquire_heavy_lock();
+        process_server_acquire_heavy_lock(PS_LOCK_SITE_MUNMAP);
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-        process_server_acquire_distributed_mm_lock();
+        process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_MUNMAP);
 #else
-        process_server_acquire_page_lock_range(start,len);
+        process_server_acquire_page_lock_range(start,len,PS_LOCK_SITE_MUNMAP);
 #endif
         down_write(&mm->mmap_sem);
     }
 #endif
+    // Multikernel - only a distributed mm has pages pulled in from other
+    // kernels.  Changes on behalf of another kernel run in a worker.
+    if(current->tgroup_distributed || current->mm != mm) {
+        process_server_mapping_changed(mm,start,len);
+    }
 
 	/* Find the first overlapping VMA */
 	vma = find_vma(mm, start);
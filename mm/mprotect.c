@@ -264,11 +264,11 @@ int do_mprotect(struct task_struct* task, struct mm_struct* mm, unsigned long st
     if(do_remote) {
         //printk("%s: doing lock\n",__func__);
 #ifdef PROCESS_SERVER_USE_HEAVY_LOCK
-        process_server_acquire_heavy_lock();
+        process_server_acquire_heavy_lock(PS_LOCK_SITE_MPROTECT);
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-        process_server_acquire_distributed_mm_lock();
+        process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_MPROTECT);
 #else
-        process_server_acquire_page_lock_range(start,len);
+        process_server_acquire_page_lock_range(start,len,PS_LOCK_SITE_MPROTECT);
 #endif
     }
 #endif
@@ -283,6 +283,11 @@ int do_mprotect(struct task_struct* task, struct mm_struct* mm, unsigned long st
 	vm_flags = calc_vm_prot_bits(prot);
 
 	down_write(&task_mm->mmap_sem);
+    // Multikernel - only a distributed mm has pages pulled in from other
+    // kernels.  Changes on behalf of another kernel run in a worker.
+    if(current->tgroup_distributed || current->mm != task_mm) {
+        process_server_mapping_changed(task_mm,start,len);
+    }
 
 	vma = find_vma_prev(task_mm, start, &prev);
 	error = -ENOMEM;
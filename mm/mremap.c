@@ -434,6 +434,16 @@ unsigned long do_mremap(unsigned long addr,
 	unsigned long charged = 0;
     int original_enable_distributed_munmap = current->enable_distributed_munmap;
     unsigned long a;
+#if defined(PROCESS_SERVER_ENFORCE_VMA_MOD_ATOMICITY) && \
+    !defined(PROCESS_SERVER_USE_HEAVY_LOCK) && \
+    !defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
+    // What was locked, since the lengths and new_addr change below.
+    unsigned long lock_new_addr = new_addr;
+    unsigned long lock_old_len = PAGE_ALIGN(old_len);
+    unsigned long lock_new_len = PAGE_ALIGN(new_len);
+    int lock_heavy = 0;
+    int lock_old_only = 0;
+#endif
     current->enable_distributed_munmap = 0;
 
     // This is kind of tricky.  We have to lock the old range
@@ -445,22 +455,37 @@ unsigned long do_mremap(unsigned long addr,
 #ifdef PROCESS_SERVER_ENFORCE_VMA_MOD_ATOMICITY
     up_write(&mm->mmap_sem);
 #ifdef PROCESS_SERVER_USE_HEAVY_LOCK
-    process_server_acquire_heavy_lock();
+    process_server_acquire_heavy_lock(PS_LOCK_SITE_MREMAP);
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
-    process_server_acquire_distributed_mm_lock();
+    process_server_acquire_distributed_mm_lock(PS_LOCK_SITE_MREMAP);
 #else 
-    {
+    if(!(flags & MREMAP_FIXED) && PAGE_ALIGN(new_len) > PAGE_ALIGN(old_len)) {
+        // The range a growing remap ends up in is only known once
+        // it is chosen under mmap_sem, be it in place or wherever
+        // get_unmapped_area puts it, so it takes the heavy lock.
+        lock_heavy = 1;
+        process_server_acquire_heavy_lock(PS_LOCK_SITE_MREMAP);
+    } else {
     unsigned long old_start = addr;
-    unsigned long old_end   = addr + old_len;
+    unsigned long old_end   = addr + lock_old_len;
     unsigned long new_start = new_addr;
-    unsigned long new_end   = new_addr + new_len;
-    if(old_end <= new_start || new_end <= old_start) {
-        process_server_acquire_page_lock_range(old_start,old_len);
-        process_server_acquire_page_lock_range(new_start,new_len);
+    unsigned long new_end   = new_addr + lock_new_len;
+    if(!(flags & MREMAP_FIXED)) {
+        // Shrinking in place, only the old range changes.
+        lock_old_only = 1;
+        process_server_acquire_page_lock_range(old_start,lock_old_len,PS_LOCK_SITE_MREMAP);
+    } else if(old_end <= new_start) {
+        // Lowest range first, so that two remaps between the same
+        // ranges on different kernels cannot deadlock.
+        process_server_acquire_page_lock_range(old_start,lock_old_len,PS_LOCK_SITE_MREMAP);
+        process_server_acquire_page_lock_range(new_start,lock_new_len,PS_LOCK_SITE_MREMAP);
+    } else if(new_end <= old_start) {
+        process_server_acquire_page_lock_range(new_start,lock_new_len,PS_LOCK_SITE_MREMAP);
+        process_server_acquire_page_lock_range(old_start,lock_old_len,PS_LOCK_SITE_MREMAP);
     } else {
         unsigned long min_start = old_start < new_start? old_start : new_start;
         unsigned long max_end   = old_end > new_end? old_end : new_end;
-        process_server_acquire_page_lock_range(min_start,max_end - min_start);
+        process_server_acquire_page_lock_range(min_start,max_end - min_start,PS_LOCK_SITE_MREMAP);
     }
     }
 #endif
@@ -594,20 +619,23 @@ out:
 #elif defined(PROCESS_SERVER_USE_DISTRIBUTED_MM_LOCK)
     process_server_release_distributed_mm_lock();
 #else
-    {
+    if(lock_heavy) {
+        process_server_release_heavy_lock();
+    } else {
     unsigned long old_start = addr;
-    unsigned long old_end   = addr + old_len;
-    unsigned long new_start = new_addr;
-    unsigned long new_end   = new_addr + new_len;
-    if(old_end <= new_start || new_end <= old_start) {
-        process_server_release_page_lock_range(old_start,old_len);
-        process_server_release_page_lock_range(new_start,new_len);
+    unsigned long old_end   = addr + lock_old_len;
+    unsigned long new_start = lock_new_addr;
+    unsigned long new_end   = lock_new_addr + lock_new_len;
+    if(lock_old_only) {
+        process_server_release_page_lock_range(old_start,lock_old_len);
+    } else if(old_end <= new_start || new_end <= old_start) {
+        process_server_release_page_lock_range(old_start,lock_old_len);
+        process_server_release_page_lock_range(new_start,lock_new_len);
     } else {
         unsigned long min_start = old_start < new_start? old_start : new_start;
         unsigned long max_end   = old_end > new_end? old_end : new_end;
         process_server_release_page_lock_range(min_start,max_end - min_start);
     }
-
     }
 #endif
 #endif